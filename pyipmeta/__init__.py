@@ -1 +1,2 @@
 from .pyipmeta import *
+from .history import IpMetaHistory
@@ -0,0 +1,179 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Streaming aggregation of events into InfluxDB line protocol.
+
+Events are (timestamp, address, weight) tuples, e.g., packets seen by a
+telescope with their sizes. They are looked up and counted per interval by
+the _pyipmeta.Aggregator engine, grouped by the chosen record fields (e.g.,
+country_code and asns), without creating any Python objects per event. When
+an interval closes, its points are handed to a transport as a single block of
+newline-separated line protocol.
+
+Transports only need send(data) and close() methods, so Kafka can be replaced
+by a file or pipe (see open_transport).
+"""
+
+import logging
+import os
+import sys
+import _pyipmeta
+
+logger = logging.getLogger(__name__)
+logger.setLevel(os.getenv('PYIPMETA_LOGLEVEL', 'INFO'))
+
+
+class FileTransport:
+    """Write line protocol to a file, FIFO or file object (e.g., stdout)."""
+
+    def __init__(self, path):
+        if hasattr(path, "write"):
+            self.fh = path
+            self._close = False
+        else:
+            self.fh = open(path, "ab")
+            self._close = True
+
+    def send(self, data):
+        self.fh.write(data)
+        self.fh.flush()
+
+    def close(self):
+        if self._close:
+            self.fh.close()
+
+
+class KafkaTransport:
+    """Produce line protocol to a Kafka topic (e.g., for hicube).
+
+    Points are batched into messages of at most max_message_bytes, split on
+    line boundaries.
+    """
+
+    def __init__(self, brokers, topic, max_message_bytes=1000000, config=None):
+        import confluent_kafka
+        conf = {"bootstrap.servers": brokers}
+        conf.update(config or {})
+        self.producer = confluent_kafka.Producer(conf)
+        self.topic = topic
+        self.max_message_bytes = max_message_bytes
+
+    def send(self, data):
+        start = 0
+        while start < len(data):
+            end = len(data)
+            if end - start > self.max_message_bytes:
+                end = data.rfind(b"\n", start, start + self.max_message_bytes) + 1
+                if end <= start:
+                    # a single line that is too long; let Kafka complain
+                    end = data.find(b"\n", start) + 1 or len(data)
+            self.producer.produce(self.topic, data[start:end])
+            start = end
+        self.producer.poll(0)
+
+    def close(self, timeout=10):
+        self.producer.flush(timeout)
+
+
+def open_transport(url):
+    """Open a transport given as kafka://BROKERS/TOPIC, file:PATH, a plain
+    path, or "-" for stdout."""
+    if url == "-":
+        return FileTransport(sys.stdout.buffer)
+    if url.startswith("kafka://"):
+        brokers, _, topic = url[len("kafka://"):].partition("/")
+        if not brokers or not topic:
+            raise ValueError("Expected kafka://BROKERS/TOPIC, got %r" % url)
+        return KafkaTransport(brokers, topic)
+    if url.startswith("file:"):
+        url = url[len("file:"):]
+    return FileTransport(url)
+
+
+class Aggregator:
+    """Aggregate events looked up in an IpMeta into a transport.
+
+    ipm is a pyipmeta.IpMeta; the aggregator follows it when it reloads. The
+    other arguments are those of _pyipmeta.Aggregator: fields to group by,
+    the interval in seconds, the measurement name, fixed tags, the names of
+    the count and weight fields (weight_field=None leaves weights out), and
+    the tag value for fields that have no value (unknown=None leaves the tag
+    out).
+    """
+
+    def __init__(self, ipm, transport, fields=("country_code",), interval=60,
+                 measurement="ipmeta", provmask=0, **kwargs):
+        ipm.check_native(provmask)
+        self.ipm = ipm
+        self.transport = transport
+        self._current = ipm.ipm
+        self.agg = _pyipmeta.Aggregator(self._current, list(fields), interval,
+                                        measurement, provmask, **kwargs)
+
+    def _check_reload(self):
+        if self.ipm.ipm is not self._current:
+            logger.info("switching aggregator to reloaded database")
+            self._current = self.ipm.ipm
+            self.agg.set_ipm(self._current)
+
+    def _send(self):
+        data = self.agg.take()
+        if data:
+            self.transport.send(data)
+
+    def add(self, timestamps, addrs, weights=None):
+        """Count IPv4 events given as buffers (e.g., array.array or numpy
+        arrays) of unix timestamps, host byte order addresses, and optional
+        weights. Points for any intervals this closes are sent."""
+        self._check_reload()
+        if self.agg.add(timestamps, addrs, weights):
+            self._send()
+
+    def add6(self, timestamps, addrs, weights=None):
+        """Count IPv6 events; addrs is a buffer of packed 16-byte
+        addresses."""
+        self._check_reload()
+        if self.agg.add6(timestamps, addrs, weights):
+            self._send()
+
+    def flush(self):
+        """Close the open interval and send its points."""
+        self.agg.flush()
+        self._send()
+
+    def stats(self):
+        return self.agg.stats()
+
+    def close(self):
+        self.flush()
+        self.transport.close()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
@@ -0,0 +1,158 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Parallel streaming annotation of files of addresses/prefixes.
+
+The input is read in chunks of whole lines. Each chunk is looked up by
+IpMeta.annotate() on one of a pool of threads; since that runs entirely in C
+without the GIL, the threads all share one loaded database and run in
+parallel. Results are written in input order, and only a fixed number of
+chunks are ever in flight, so memory use does not depend on the input size.
+"""
+
+import bz2
+import collections
+import concurrent.futures
+import gzip
+import logging
+import os
+import sys
+import time
+
+logger = logging.getLogger(__name__)
+logger.setLevel(os.getenv('PYIPMETA_LOGLEVEL', 'INFO'))
+
+FORMATS = ("ndjson", "csv")
+
+
+def open_input(path):
+    """Open a possibly compressed input file for reading in binary mode."""
+    if path == "-":
+        return sys.stdin.buffer
+    if path.endswith(".gz"):
+        return gzip.open(path, "rb")
+    if path.endswith(".bz2"):
+        return bz2.open(path, "rb")
+    if path.endswith(".zst") or path.endswith(".zstd"):
+        try:
+            from compression import zstd
+            return zstd.open(path, "rb")
+        except ImportError:
+            pass
+        try:
+            import zstandard
+        except ImportError:
+            raise RuntimeError("Reading %s requires the zstandard module" % path)
+        return zstandard.ZstdDecompressor().stream_reader(open(path, "rb"),
+                closefd=True)
+    return open(path, "rb")
+
+
+def read_chunks(fh, chunk_size):
+    """Yield chunks of about chunk_size bytes that end on a line boundary."""
+    rest = b""
+    while True:
+        data = fh.read(chunk_size)
+        if not data:
+            break
+        data = rest + data
+        end = data.rfind(b"\n")
+        if end < 0:
+            rest = data
+            continue
+        rest = data[end + 1:]
+        yield data[:end + 1]
+    if rest:
+        yield rest
+
+
+class Annotator:
+
+    def __init__(self, ipm, jobs=None, format="ndjson", fields=None,
+                 provmask=0, chunk_size=1 << 20):
+        if format not in FORMATS:
+            raise ValueError("Invalid format '%s'" % format)
+        ipm.check_native(provmask)
+        self.ipm = ipm
+        self.jobs = jobs or os.cpu_count() or 1
+        self.format = format
+        self.fields = fields
+        self.provmask = provmask
+        self.chunk_size = chunk_size
+        # at most this many chunks are read but not yet written
+        self.max_inflight = 2 * self.jobs
+
+    def run(self, infh, outfh):
+        """Annotate the lines of infh, writing the results to outfh.
+
+        Returns a dict of counters for the run.
+        """
+        stats = {"lines": 0, "errors": 0, "records": 0, "bytes_in": 0,
+                 "bytes_out": 0}
+        # hold on to one database for the whole run, even if ipm reloads
+        db = self.ipm.ipm
+        start = time.time()
+
+        def write(future):
+            out, lines, errors, records = future.result()
+            outfh.write(out)
+            stats["lines"] += lines
+            stats["errors"] += errors
+            stats["records"] += records
+            stats["bytes_out"] += len(out)
+
+        inflight = collections.deque()
+        with concurrent.futures.ThreadPoolExecutor(self.jobs) as pool:
+            header = self.format == "csv"
+            for chunk in read_chunks(infh, self.chunk_size):
+                stats["bytes_in"] += len(chunk)
+                if len(inflight) >= self.max_inflight:
+                    write(inflight.popleft())
+                inflight.append(pool.submit(db.annotate, chunk, self.provmask,
+                                            self.format, self.fields, header))
+                header = False
+            if header:
+                # empty input still gets a CSV header
+                inflight.append(pool.submit(db.annotate, b"", self.provmask,
+                                            self.format, self.fields, header))
+            while inflight:
+                write(inflight.popleft())
+        outfh.flush()
+
+        stats["seconds"] = time.time() - start
+        return stats
+
+    @staticmethod
+    def report(stats):
+        """Log a throughput summary for the stats returned by run()."""
+        secs = max(stats["seconds"], 1e-9)
+        logger.info("annotated %d lines (%d invalid, %d records) from %.1f MiB "
+                    "in %.2fs: %.0f lines/s, %.1f MiB/s in, %.1f MiB/s out",
+                    stats["lines"], stats["errors"], stats["records"],
+                    stats["bytes_in"] / 2**20, stats["seconds"],
+                    stats["lines"] / secs, stats["bytes_in"] / 2**20 / secs,
+                    stats["bytes_out"] / 2**20 / secs)
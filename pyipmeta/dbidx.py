@@ -43,6 +43,25 @@ def _build_cmd(db, cmd):
     return " ".join([subcmd[0] % db[subcmd[1]]
         for subcmd in cmd if subcmd[1] in db])
 
+def _swift_options():
+    return {
+        # Apparently SwiftService by default checks only ST_AUTH_VERSION.
+        # We emulate the swift CLI, and check three different variables.
+        "auth_version": os.environ.get('ST_AUTH_VERSION',
+            os.environ.get('OS_AUTH_VERSION',
+            os.environ.get('OS_IDENTITY_API_VERSION', '1.0'))),
+        }
+
+def download(url, out_file):
+    """Download a "swift://<container>/<object>" DB file (as named in
+    DbIdx.dbs) to out_file."""
+    container, obj = url[len("swift://"):].split("/", 1)
+    with SwiftService(options=_swift_options()) as swift:
+        for res in swift.download(container=container, objects=[obj],
+                options={"out_file": out_file}):
+            if not res["success"]:
+                raise res["error"]
+
 class DbIdx:
     cfgs = {
 #        # configuration format
@@ -121,14 +140,7 @@ class DbIdx:
         return DbIdx.cfgs[provider]
 
     def _load_index(self):
-        swift_opts = {
-            # Apparently SwiftService by default checks only ST_AUTH_VERSION.
-            # We emulate the swift CLI, and check three different variables.
-            "auth_version": os.environ.get('ST_AUTH_VERSION',
-                os.environ.get('OS_AUTH_VERSION',
-                os.environ.get('OS_IDENTITY_API_VERSION', '1.0'))),
-            }
-        with SwiftService(options=swift_opts) as swift:
+        with SwiftService(options=_swift_options()) as swift:
             for cfg in self.prov_cfg:
                 try:
                     list_parts_gen = swift.list(container=cfg["container"])
@@ -154,14 +166,28 @@ class DbIdx:
     def all_providers():
         return DbIdx.cfgs.keys()
 
+    def _complete(self, t):
+        """Are all the required files available for time t?"""
+        cfg = self.dbcfgs[t]
+        return all([subcmd[1] in self.dbs[t] for subcmd in cfg["cmd"] if subcmd[2]])
+
+    def db_times(self, start=None, end=None):
+        """Get the sorted times of the complete DBs in effect between start
+        and end (i.e., the best DB at start, and all later ones up to end)."""
+        times = sorted(t for t in self.dbs if self._complete(t)
+                and (end is None or t <= end))
+        if start is not None:
+            first = [t for t in times if t <= start][-1:]
+            times = first + [t for t in times if t > start]
+        return times
+
     def best_db(self, time=None, build_cmd=False):
         if time is None:
             time = self.latest_time
         best_time = None
         for t in self.dbs:
             # are all the required files available?
-            cfg = self.dbcfgs[t]
-            if not all([subcmd[1] in self.dbs[t] for subcmd in cfg["cmd"] if subcmd[2]]):
+            if not self._complete(t):
                 continue
             # is this the best time we've seen so far?
             if t <= time and (not best_time or best_time < t):
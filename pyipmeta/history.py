@@ -0,0 +1,129 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Time-travel lookups across dated database snapshots.
+
+Each snapshot is loaded into a temporary IpMeta and copied into a
+_pyipmeta.History, which stores the range tables in blocks and shares every
+block (and record) that did not change since the previous snapshot. Loading
+months of daily pfx2as data therefore costs memory in proportion to the
+changes between days, and lookups pick the snapshot in effect at the
+requested time.
+"""
+
+import calendar
+import datetime
+import logging
+import os
+import time as _time
+import _pyipmeta
+import dateutil.parser
+from . import dbidx
+
+logger = logging.getLogger(__name__)
+logger.setLevel(os.getenv('PYIPMETA_LOGLEVEL', 'INFO'))
+
+
+def _to_epoch(t):
+    """Convert a time string, datetime (naive means UTC) or number of
+    seconds since the epoch to seconds since the epoch."""
+    if isinstance(t, str):
+        t = dateutil.parser.parse(t, ignoretz=True)
+    if isinstance(t, datetime.datetime):
+        return calendar.timegm(t.utctimetuple())
+    return int(t)
+
+
+class IpMetaHistory:
+    """Lookups against the database snapshots in effect at different times.
+
+    If start and end are given, every snapshot of the given providers (by
+    name, as found by DbIdx) in effect between them is loaded. Snapshots can
+    also be added explicitly with add_snapshot().
+    """
+
+    def __init__(self, providers=None, start=None, end=None, **kwargs):
+        self.ipm_args = kwargs
+        self.history = _pyipmeta.History()
+        if start is None and end is None:
+            return
+        if providers is None:
+            providers = dbidx.DbIdx.all_providers()
+        start = dateutil.parser.parse(start, ignoretz=True) \
+            if isinstance(start, str) else start
+        end = dateutil.parser.parse(end, ignoretz=True) \
+            if isinstance(end, str) else end
+
+        idxs = {}
+        for name in providers:
+            if len(name.split()) > 1:
+                raise ValueError("Provider configs cannot be combined with "
+                        "start/end; use add_snapshot() instead")
+            idxs[name] = dbidx.DbIdx(name)
+        times = sorted(set(t for idx in idxs.values()
+                for t in idx.db_times(start, end)))
+        for t in times:
+            try:
+                cmds = ["%s %s" % (name, idx.best_db(t, build_cmd=True))
+                        for name, idx in idxs.items()]
+            except RuntimeError:
+                # not every provider has data this early
+                continue
+            self.add_snapshot(t, cmds)
+
+    def add_snapshot(self, time, providers):
+        """Load the given providers ("<name> <config>" strings) as the
+        snapshot in effect from the given time on. Snapshots must be added in
+        order of time."""
+        start = _time.time()
+        ipm = _pyipmeta.IpMeta(**self.ipm_args)
+        for arg in providers:
+            name, cmd = arg.strip().split(None, 1)
+            prov = ipm.get_provider_by_name(name)
+            if not prov:
+                raise ValueError("Invalid provider specified: '%s'" % name)
+            logger.debug('enable_provider("%s", "%s")' % (name, cmd))
+            if not ipm.enable_provider(prov, cmd):
+                raise RuntimeError("Could not enable provider (check stderr)")
+        self.history.add_snapshot(_to_epoch(time), ipm)
+        logger.info("added snapshot for %s in %.1fs", time,
+                _time.time() - start)
+
+    def lookup(self, ipaddr, time, provmask=0):
+        """Look up an IP address as it was at the given time (a string,
+        datetime or seconds since the epoch)."""
+        return self.history.lookup(ipaddr, _to_epoch(time), provmask)
+
+    def snapshot_times(self):
+        return [datetime.datetime.fromtimestamp(t, datetime.timezone.utc)
+                .replace(tzinfo=None)
+                for t in self.history.snapshot_times()]
+
+    def stats(self):
+        """Get the number of snapshots, and of the distinct records, range
+        blocks and bytes stored for them."""
+        return self.history.stats()
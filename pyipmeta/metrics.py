@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Export IpMeta.stats() in the Prometheus text format.
+
+The output can be served as-is from a /metrics endpoint, e.g.:
+
+    body = pyipmeta.metrics.prometheus_text(ipm.stats()).encode()
+"""
+
+import math
+
+
+def _fmt(value):
+    if value is None:
+        return "NaN"
+    if isinstance(value, float):
+        if math.isinf(value):
+            return "+Inf"
+        return repr(value)
+    return str(value)
+
+
+def _labels(labels):
+    if not labels:
+        return ""
+    return "{%s}" % ",".join('%s="%s"' % (k, str(v).replace("\\", "\\\\")
+                                          .replace('"', '\\"'))
+                             for k, v in labels)
+
+
+class _Writer:
+
+    def __init__(self, namespace):
+        self.namespace = namespace
+        self.lines = []
+
+    def family(self, name, mtype, help):
+        name = "%s_%s" % (self.namespace, name)
+        self.lines.append("# HELP %s %s" % (name, help))
+        self.lines.append("# TYPE %s %s" % (name, mtype))
+        return name
+
+    def sample(self, name, value, labels=()):
+        self.lines.append("%s%s %s" % (name, _labels(labels), _fmt(value)))
+
+    def metric(self, name, mtype, help, value, labels=()):
+        self.sample(self.family(name, mtype, help), value, labels)
+
+
+def prometheus_text(stats, namespace="pyipmeta"):
+    """Format the dict returned by IpMeta.stats() as Prometheus metrics."""
+    w = _Writer(namespace)
+
+    w.metric("lookups_total", "counter",
+             "Addresses/prefixes looked up one at a time", stats["lookups"])
+    name = w.family("lookup_errors_total", "counter", "Lookups that failed")
+    w.sample(name, stats["errors_input"], [("reason", "input")])
+    w.sample(name, stats["errors_internal"], [("reason", "internal")])
+    w.metric("lookup_misses_total", "counter",
+             "Lookups that matched no records", stats["misses"])
+    w.metric("lookups_filtered_total", "counter",
+             "Lookups answered as misses by the presence filter",
+             stats["filtered"])
+    w.metric("presence_failures_total", "counter",
+             "Presence filters that could not be built",
+             stats["presence_failures"])
+    w.metric("batch_lookups_total", "counter",
+             "Addresses looked up with lookup_batch/lookup_batch6",
+             stats["batch_lookups"])
+    name = w.family("records_total", "counter",
+                    "Records returned by lookups, by provider")
+    for prov, cnt in sorted(stats["records"].items()):
+        w.sample(name, cnt, [("provider", prov)])
+
+    if stats["timing"]:
+        name = w.family("lookup_duration_seconds", "histogram",
+                        "Time spent in each stage of a lookup")
+        for stage, hist in sorted(stats["latency"].items()):
+            cumulative = 0
+            for le, cnt in hist["buckets"]:
+                cumulative += cnt
+                w.sample(name + "_bucket", cumulative,
+                         [("stage", stage), ("le", _fmt(float(le)))])
+            w.sample(name + "_sum", hist["sum_seconds"], [("stage", stage)])
+            w.sample(name + "_count", hist["count"], [("stage", stage)])
+
+    reload = stats.get("reload")
+    if reload is not None:
+        w.metric("reload_checks_total", "counter",
+                 "Checks for new databases", reload["checks"])
+        w.metric("loads_total", "counter",
+                 "Databases loaded (including the initial load)",
+                 reload["loads"])
+        w.metric("load_failures_total", "counter",
+                 "Database loads that failed", reload["load_failures"])
+        w.metric("load_seconds_total", "counter",
+                 "Time spent loading databases", reload["load_seconds_total"])
+        w.metric("last_load_duration_seconds", "gauge",
+                 "Time taken by the most recent database load",
+                 reload["last_load_seconds"])
+        w.metric("last_load_timestamp_seconds", "gauge",
+                 "When the most recent database load finished",
+                 reload["last_load_time"])
+        w.metric("delta_loads_total", "counter",
+                 "pfx2as updates applied as differences (reload_mode=delta)",
+                 reload["delta_loads"])
+        w.metric("delta_seconds_total", "counter",
+                 "Time spent applying pfx2as differences",
+                 reload["delta_seconds_total"])
+
+    return "\n".join(w.lines) + "\n"
@@ -23,13 +23,18 @@
 # OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 import os
+import sys
 import argparse
+import asyncio
 import dateutil.parser
+from . import annotate
 from . import dbidx
 import json
 import _pyipmeta
 import logging
+import tempfile
 import threading
+import time
 import weakref
 
 logger = logging.getLogger(__name__)
@@ -41,12 +46,30 @@ class IpMeta:
     def __init__(self,
                  providers=None,
                  time=None,
+                 reload_mode="full",
                  **kwargs
                  ):
         self.ipm_args = kwargs
         self.target_time = self._parse_timestr(time)
         self.reload_period = 10*60 # 10 minutes
         self.reloader_stop = None
+        if reload_mode not in ("full", "delta"):
+            raise ValueError("reload_mode must be 'full' or 'delta'")
+        self.async_workers = None  # default: one per CPU
+        self._async = None
+        self._async_lock = threading.Lock()
+        self._reload_stats = {
+            "checks": 0,            # _reload() calls
+            "last_check_time": None,
+            "loads": 0,             # databases loaded
+            "load_failures": 0,
+            "last_load_time": None, # when the last load finished (epoch)
+            "last_load_seconds": None,
+            "load_seconds_total": 0.0,
+            "delta_loads": 0,       # pfx2as differences applied
+            "delta_seconds_total": 0.0,
+            "last_delta": None,     # counters from the last one
+        }
 
         logger.debug('IpMeta.__init__(%r, %r)', providers, time)
 
@@ -69,6 +92,13 @@ class IpMeta:
                 # "<name>"
                 # let _reload() figure out the config
                 self.prov_dict[args[0]] = { "auto": True, "cmd": None }
+
+        # In delta mode, pfx2as data is kept in a table that is reloaded by
+        # applying only the prefixes that changed, rather than by libipmeta
+        self.pfx2as = None
+        self._other_mask = 0  # providers looked up in ipm
+        if reload_mode == "delta" and "pfx2as" in self.prov_dict:
+            self.pfx2as = _pyipmeta.Pfx2asTable()
         self._reload(force_load=True)
 
         if self.target_time is None and self.reload_period is not None:
@@ -97,7 +127,11 @@ class IpMeta:
             if ipm is None:
                 break
             logger.debug("_periodic_reload reloading")
-            ipm._reload()
+            try:
+                ipm._reload()
+            except Exception:
+                # keep serving the current data and try again next time
+                logger.exception("reload failed")
             reload_period = ipm.reload_period
             ipm = None  # release the strong reference
         logger.debug("_periodic_reload stopped")
@@ -109,16 +143,70 @@ class IpMeta:
         atomically replaces the old, so this is safe to call in a thread while
         other threads read from ipm.
         """
-        new_ipm = _pyipmeta.IpMeta(**self.ipm_args)
-        for prov_name, prov_info in self.prov_dict.items():
-            # configure the provider
-            prov = new_ipm.get_provider_by_name(prov_name)
-            if not prov:
-                raise ValueError("Invalid provider specified: '%s'" % prov_name)
-            logger.debug('enable_provider("%s", "%s")' % (prov_name, prov_info["cmd"]))
-            if not new_ipm.enable_provider(prov, prov_info["cmd"]):
-                raise RuntimeError("Could not enable provider (check stderr)")
+        start = time.time()
+        try:
+            # carry the lookup metrics over from the instance being replaced
+            new_ipm = _pyipmeta.IpMeta(share_metrics=getattr(self, "ipm", None),
+                                       **self.ipm_args)
+            other_mask = 0
+            for prov_name, prov_info in self.prov_dict.items():
+                if prov_name == "pfx2as" and self.pfx2as is not None:
+                    continue
+                # configure the provider
+                prov = new_ipm.get_provider_by_name(prov_name)
+                if not prov:
+                    raise ValueError("Invalid provider specified: '%s'" % prov_name)
+                other_mask |= prov.mask
+                logger.debug('enable_provider("%s", "%s")' % (prov_name, prov_info["cmd"]))
+                if not new_ipm.enable_provider(prov, prov_info["cmd"]):
+                    raise RuntimeError("Could not enable provider (check stderr)")
+        except Exception:
+            self._reload_stats["load_failures"] += 1
+            raise
         self.ipm = new_ipm
+        self._other_mask = other_mask
+        end = time.time()
+        self._reload_stats["loads"] += 1
+        self._reload_stats["last_load_time"] = end
+        self._reload_stats["last_load_seconds"] = end - start
+        self._reload_stats["load_seconds_total"] += end - start
+        logger.debug("loaded in %.3fs", end - start)
+
+    def _read_pfx2as(self):
+        """Read the (decompressed) pfx2as file from the provider config."""
+        args = self.prov_dict["pfx2as"]["cmd"].split()
+        if len(args) != 2 or args[0] != "-f":
+            raise ValueError("reload_mode='delta' needs a pfx2as config of "
+                             "the form '-f <file>'")
+        path = args[1]
+        if path.startswith("swift://"):
+            with tempfile.NamedTemporaryFile(
+                    suffix=os.path.basename(path)) as tmp:
+                dbidx.download(path, tmp.name)
+                with annotate.open_input(tmp.name) as fh:
+                    return fh.read()
+        with annotate.open_input(path) as fh:
+            return fh.read()
+
+    def _load_pfx2as(self):
+        """Apply the differences between the pfx2as file and the pfx2as
+        table.
+
+        Lookups keep using the previous contents of the table until all
+        the changes have been made, and are never blocked.
+        """
+        start = time.time()
+        try:
+            counts = self.pfx2as.update(self._read_pfx2as())
+        except Exception:
+            self._reload_stats["load_failures"] += 1
+            raise
+        end = time.time()
+        self._reload_stats["delta_loads"] += 1
+        self._reload_stats["delta_seconds_total"] += end - start
+        self._reload_stats["last_delta"] = counts
+        logger.debug("applied pfx2as differences in %.3fs: %r",
+                     end - start, counts)
 
     def _reload(self, force_load=False):
         """Reload ipm if new db files are available.
@@ -126,6 +214,9 @@ class IpMeta:
         If new db files are available for target_time for any providers marked
         "auto", load a new ipm object to replace the existing one.
         """
+        self._reload_stats["checks"] += 1
+        self._reload_stats["last_check_time"] = time.time()
+        changed = set(self.prov_dict) if force_load else set()
         for prov_name, prov_info in self.prov_dict.items():
             if prov_info["auto"]:
                 idx = dbidx.DbIdx(prov_name)
@@ -134,8 +225,13 @@ class IpMeta:
                     logger.info("need reload for %s: %r", prov_name, cmd)
                     logger.debug("  (was: %r)", prov_info["cmd"])
                     prov_info["cmd"] = cmd
-                    force_load = True
-        if force_load:
+                    changed.add(prov_name)
+        if self.pfx2as is not None and "pfx2as" in changed:
+            self._load_pfx2as()
+            changed.discard("pfx2as")
+            if not force_load and not changed:
+                return
+        if changed or force_load:
             self._load()
         else:
             logger.debug("no reload needed")
@@ -146,6 +242,24 @@ class IpMeta:
             return None
         return dateutil.parser.parse(timestr, ignoretz=True)
 
+    def stats(self):
+        """Get lookup and reload metrics.
+
+        Lookup counters (and, if enabled with set_timing(), latency
+        histograms) are collected natively, per thread, and carried across
+        reloads; see metrics.prometheus_text() to export them.
+        """
+        stats = self.ipm.stats()
+        stats["reload"] = dict(self._reload_stats)
+        dir24 = self.ipm.dir24_stats()
+        if dir24["enabled"]:
+            stats["dir24"] = dir24
+        return stats
+
+    def set_timing(self, enabled):
+        """Turn lookup latency histograms on or off (default: off)."""
+        self.ipm.set_timing(enabled)
+
     def provmask(self, names, must_be_enabled=False):
         """Convert list of provider names to a provider mask."""
         mask = 0
@@ -153,13 +267,261 @@ class IpMeta:
             prov = self.ipm.get_provider_by_name(name)
             if prov is None:
                 raise ValueError("Invalid provider '%s'" % name)
-            if must_be_enabled and not prov.enabled:
+            if must_be_enabled and not prov.enabled and \
+                    not (name == "pfx2as" and self.pfx2as is not None):
                 raise ValueError("Provider '%s' is not enabled" % name)
             mask = mask | prov.mask
         return mask
 
     def lookup(self, ipaddr, provmask=0):
-        return self.ipm.lookup(ipaddr, provmask)
+        """Look up an IP address or prefix, returning a list of records
+        (or an empty tuple if there are none).
+
+        With reload_mode="delta", pfx2as records come from the pfx2as table,
+        which only this method reads: the other lookup methods (and the
+        annotator, server and aggregator) raise ValueError unless they are
+        given a provmask without pfx2as.
+        """
+        if self.pfx2as is None:
+            return self.ipm.lookup(ipaddr, provmask)
+        pfx2as_mask = self.ipm.get_provider_by_name("pfx2as").mask
+        other_mask = (provmask or self._other_mask) & ~pfx2as_mask
+        res = list(self.ipm.lookup(ipaddr, other_mask)) if other_mask else []
+        if provmask == 0 or provmask & pfx2as_mask:
+            res += self.pfx2as.lookup(ipaddr)
+        return res or ()
+
+    def lookup_fused(self, ipaddr, provmask=0, order=None, sources=None):
+        """Look up an IP address or prefix in all providers at once.
+
+        Returns one dict per range of addresses over which the records of
+        the providers do not change (a prefix query is split at the union of
+        their boundaries), with "start", "end", "matched_ip_count",
+        "record_ids" ({provider name: record id}) and the record fields
+        joined from the providers: each field comes from the first provider
+        in order (a list of provider names; by default, the order they were
+        given to IpMeta) that has a value for it, unless sources (a dict of
+        {field name: provider name}) says where to take it from. E.g.,
+        order=["netacq-edge", "maxmind", "pfx2as"] takes the country from
+        netacq-edge and the ASNs from pfx2as.
+
+        Like lookup_batch, this uses the range index, so IPv6 is resolved to
+        /64s.
+        """
+        if order is None:
+            order = list(self.prov_dict)
+        order = [self._provider_id(name) for name in order]
+        if sources is not None:
+            sources = {field: self._provider_id(name)
+                       for field, name in sources.items()}
+        self.check_native(provmask)
+        return self.ipm.lookup_fused(ipaddr, provmask, order, sources)
+
+    def lookup_bbox(self, min_lat, min_lon, max_lat, max_lon, provmask=0):
+        """Find the geolocation records located within a bounding box.
+
+        Returns one dict per record (ordered by provider and id): the record
+        fields, plus "prefixes" (the IPv4 and IPv6 prefixes located there),
+        "matched_ip_count" (IPv4 addresses) and "matched_ip6_count" (IPv6
+        /64s). A box with min_lon > max_lon crosses the antimeridian.
+        Records located at 0,0 are taken to have no location.
+        """
+        return self.ipm.lookup_bbox(min_lat, min_lon, max_lat, max_lon,
+                                    provmask)
+
+    def lookup_radius(self, lat, lon, radius_km, provmask=0):
+        """Find the geolocation records located within radius_km of a point.
+
+        Returns the same dicts as lookup_bbox.
+        """
+        return self.ipm.lookup_radius(lat, lon, radius_km, provmask)
+
+    def lookup_polygon(self, polygon_id, provmask=0):
+        """Find the geolocation records that have the given polygon id.
+
+        Returns the same dicts as lookup_bbox.
+        """
+        return self.ipm.lookup_polygon(polygon_id, provmask)
+
+    def _provider_id(self, name):
+        prov = self.ipm.get_provider_by_name(name)
+        if prov is None:
+            raise ValueError("Invalid provider '%s'" % name)
+        return prov.id
+
+    def check_native(self, provmask):
+        """Raise ValueError if provmask asks for pfx2as records that only
+        lookup() can return (i.e., with reload_mode="delta")."""
+        if self.pfx2as is None:
+            return
+        if provmask == 0 or \
+                provmask & self.ipm.get_provider_by_name("pfx2as").mask:
+            raise ValueError("With reload_mode='delta', pfx2as records are "
+                             "only returned by lookup(); pass a provmask "
+                             "without pfx2as")
+
+    def lookup_json(self, queries, provmask=0, out=None):
+        """Look up one or more addresses/prefixes, returning JSON bytes.
+
+        A single query gives a {"query": ..., "result": [...]} object in the
+        same format that pyipmeta-lookup prints; a sequence of queries gives
+        one such object per line (NDJSON). Invalid queries give a
+        {"query": ..., "error": ...} object instead of raising. The JSON is
+        encoded natively; if out is a bytearray, it is filled and returned
+        instead of allocating a new bytes object.
+        """
+        self.check_native(provmask)
+        return self.ipm.lookup_json(queries, provmask, out)
+
+    def lookup_batch(self, addrs, provmask=0, out=None):
+        """Look up many IPv4 addresses at once.
+
+        addrs must support the buffer protocol and contain 32-bit unsigned
+        integers in host byte order (e.g., array.array('I') or a numpy uint32
+        array).  Returns a BatchResult.
+        """
+        return self._lookup_batch("lookup_batch", addrs, provmask, out)
+
+    def lookup_batch6(self, addrs, provmask=0, out=None):
+        """Look up many IPv6 addresses at once.
+
+        addrs must support the buffer protocol and contain packed 16-byte
+        addresses in network byte order (e.g., b"".join of
+        socket.inet_pton(AF_INET6, ...) results).  Returns a BatchResult.
+        """
+        return self._lookup_batch("lookup_batch6", addrs, provmask, out)
+
+    def lookup_arrow(self, addrs, provmask=0):
+        """Look up a column of addresses, returning Arrow columns.
+
+        addrs is an Arrow array of uint32 (IPv4, host byte order) or
+        fixed_size_binary(16) (IPv6) addresses, or a buffer in the format
+        taken by lookup_batch or lookup_batch6.  Returns an ArrowBatch,
+        which exports a record batch through the Arrow PyCapsule interface
+        (e.g., pyarrow.record_batch(res) or polars.from_arrow(res)), with
+        one row per address and matching provider: "index" (position of
+        the address in addrs), "source", "id", the dictionary-encoded
+        "country_code", "continent_code", "region" and "city",
+        "latitude", "longitude", the "asns" and "polygon_ids" lists and
+        "matched_ip_count".
+
+        Like lookup_batch, this uses the range index, so IPv6 is resolved
+        to /64s.
+        """
+        self.check_native(provmask)
+        return self.ipm.lookup_arrow(addrs, provmask)
+
+    async def lookup_async(self, ipaddr, provmask=0):
+        """Look up an IP address or prefix without blocking the event loop.
+
+        The lookup runs in a native worker thread (without the GIL) and the
+        result is delivered to the running asyncio loop.
+        """
+        self.check_native(provmask)
+        return await self._async_dispatcher().submit(ipaddr, provmask)
+
+    async def lookup_batch_async(self, ipaddrs, provmask=0):
+        """Look up a list of IP addresses/prefixes without blocking the
+        event loop.  Returns a list with one lookup result per query."""
+        self.check_native(provmask)
+        return await self._async_dispatcher().submit(list(ipaddrs), provmask)
+
+    def _async_dispatcher(self):
+        with self._async_lock:
+            disp = self._async
+            if disp is None or disp.ipm is not self.ipm:
+                # ipm was reloaded: the old dispatcher finishes its pending
+                # lookups on its own
+                disp = self._async = _AsyncDispatcher(self.ipm,
+                                                      self.async_workers or 0)
+            return disp
+
+    def _lookup_batch(self, method, addrs, provmask, out):
+        self.check_native(provmask)
+        ipm = self.ipm  # keep using this instance even if a reload happens
+        buf = getattr(ipm, method)(addrs, provmask, out)
+        provs = [p for p in ipm.get_all_providers()
+                 if p.enabled and (provmask == 0 or p.mask & provmask)]
+        return BatchResult(ipm, buf, provs)
+
+
+class _AsyncDispatcher:
+    """Completes asyncio futures for lookups run by the worker pool of a
+    _pyipmeta.IpMeta instance.
+
+    The workers signal all completions on one file descriptor, which every
+    event loop with pending lookups watches. Whichever loop wakes up first
+    collects all the results, and each future is completed on its own loop.
+    """
+
+    def __init__(self, ipm, workers):
+        self.ipm = ipm
+        self.lock = threading.Lock()
+        self.futures = {}  # job id -> future
+        self.pending = {}  # loop -> number of its futures not yet completed
+        self.fd = ipm.async_start(workers)
+
+    def submit(self, queries, provmask):
+        loop = asyncio.get_running_loop()
+        fut = loop.create_future()
+        with self.lock:
+            # the job cannot be collected before its future is known
+            job_id = self.ipm.async_submit(queries, provmask)
+            self.futures[job_id] = fut
+            if loop not in self.pending:
+                self.pending[loop] = 0
+                loop.add_reader(self.fd, self._collect)
+            self.pending[loop] += 1
+        return fut
+
+    def _collect(self):
+        with self.lock:
+            done = [(self.futures.pop(job_id), result)
+                    for job_id, result in self.ipm.async_collect()]
+        for fut, result in done:
+            try:
+                fut.get_loop().call_soon_threadsafe(self._complete, fut,
+                                                    result)
+            except RuntimeError:
+                pass  # the loop has been closed
+
+    def _complete(self, fut, result):
+        # runs on the loop of the future
+        loop = fut.get_loop()
+        if not fut.cancelled():
+            if isinstance(result, BaseException):
+                fut.set_exception(result)
+            else:
+                fut.set_result(result)
+        with self.lock:
+            self.pending[loop] -= 1
+            if self.pending[loop] == 0:
+                del self.pending[loop]
+                loop.remove_reader(self.fd)
+
+
+class BatchResult:
+    """Record indices returned by IpMeta.lookup_batch.
+
+    indices[i * len(providers) + j] is the record index for the i'th address
+    and the j'th provider, or _pyipmeta.INDEX_NONE if there is no match.
+    """
+
+    def __init__(self, ipm, buf, providers):
+        self.ipm = ipm
+        self.providers = providers
+        self.indices = memoryview(buf).cast('I')
+
+    def __len__(self):
+        if not self.providers:
+            return 0
+        return len(self.indices) // len(self.providers)
+
+    def records(self, i):
+        """Get the records for the i'th address, one per provider (or None)"""
+        n = len(self.providers)
+        return [self.ipm.get_record(idx)
+                for idx in self.indices[i * n:(i + 1) * n]]
 
 
 def main():
@@ -180,7 +542,19 @@ def main():
         required=False,
         help="Logging level")
     parser.add_argument('-f', '--file',
-        help="File with list of addresses/prefixes to look up")
+        help="File with list of addresses/prefixes to look up (may be "
+            "compressed with gzip, bzip2 or zstd; '-' for stdin)")
+    parser.add_argument('-o', '--output',
+        help="Write file results here instead of stdout")
+    parser.add_argument('-F', '--format',
+        choices=annotate.FORMATS, default="ndjson",
+        help="Output format for file results (default: ndjson)")
+    parser.add_argument('--fields',
+        help="Comma-separated list of record fields to output for file "
+            "results (default: all)")
+    parser.add_argument('-j', '--jobs',
+        type=int, default=None,
+        help="Number of lookup threads for file results (default: one per CPU)")
     parser.add_argument('prefix', nargs='*', help='IP address or prefix to look up', default=[])
 
     opts = vars(parser.parse_args())
@@ -191,10 +565,20 @@ def main():
     ipm = IpMeta(providers=opts["provider"], time=opts["date"])
 
     if opts["file"] is not None:
-        with open(opts["file"], "r") as fh:
-            for line in fh:
-                line = line.strip()
-                do_lookup(ipm, line)
+        fields = opts["fields"].split(",") if opts["fields"] else None
+        annotator = annotate.Annotator(ipm, jobs=opts["jobs"],
+                format=opts["format"], fields=fields)
+        infh = annotate.open_input(opts["file"])
+        outfh = (open(opts["output"], "wb") if opts["output"]
+                 else sys.stdout.buffer)
+        try:
+            stats = annotator.run(infh, outfh)
+        finally:
+            if infh is not sys.stdin.buffer:
+                infh.close()
+            if outfh is not sys.stdout.buffer:
+                outfh.close()
+        annotator.report(stats)
 
     for prefix in opts["prefix"]:
         do_lookup(ipm, prefix)
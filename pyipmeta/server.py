@@ -0,0 +1,136 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""Native lookup server.
+
+Queries are answered by the _pyipmeta.Server engine: a pool of threads, each
+with its own epoll loop, that run lookups and encode JSON without touching
+Python. This module only handles configuration and switches the server over
+to new databases when IpMeta reloads them.
+"""
+
+import argparse
+import logging
+import os
+import signal
+import threading
+import _pyipmeta
+from . import dbidx
+from .pyipmeta import IpMeta
+
+logger = logging.getLogger(__name__)
+logger.setLevel(os.getenv('PYIPMETA_LOGLEVEL', 'INFO'))
+
+
+class Server:
+
+    def __init__(self, ipm, provmask=0):
+        ipm.check_native(provmask)
+        self.ipm = ipm
+        self._current = ipm.ipm
+        self.server = _pyipmeta.Server(self._current, provmask)
+
+    def listen(self, host, port, protocol="http"):
+        port = self.server.listen(host, str(port), protocol)
+        logger.info("listening for %s on %s:%s", protocol, host or "*", port)
+        return port
+
+    def start(self, threads=0):
+        self.server.start(threads)
+
+    def stop(self):
+        self.server.stop()
+
+    def check_reload(self):
+        """Start answering from ipm's current database if it has changed."""
+        if self.ipm.ipm is not self._current:
+            logger.info("switching server to reloaded database")
+            self._current = self.ipm.ipm
+            self.server.set_ipm(self._current)
+
+    def serve_forever(self, stop_event, poll_period=10):
+        while not stop_event.wait(poll_period):
+            self.check_reload()
+
+
+def main():
+    logging.basicConfig(datefmt='%H:%M:%S',
+            format='[%(asctime)s.%(msecs)03d] %(levelname)s: %(message)s')
+
+    parser = argparse.ArgumentParser(description="""
+    Native HTTP and line-protocol server for IP/Prefix metadata lookups
+    """)
+    parser.add_argument('-l', '--listen-ip',
+        default=None,
+        help="IP/Hostname to listen on (default: all)")
+    parser.add_argument('-P', '--listen-port',
+        type=int, default=None,
+        help="Port to serve HTTP on")
+    parser.add_argument('-L', '--line-port',
+        type=int, default=None,
+        help="Port to serve the line protocol on (one query per line, "
+            "one JSON object per line in response)")
+    parser.add_argument('-t', '--threads',
+        type=int, default=0,
+        help="Number of server threads (default: one per CPU)")
+    parser.add_argument('-p', '--provider',
+        required=False, action='append',
+        help="Metadata provider name and configuration (repeatable).  Available providers: "
+            + ", ".join(name for name in dbidx.DbIdx.all_providers()))
+    parser.add_argument('-d', '--date',
+        required=False,
+        help="Date to use for automatic DB selection (default: latest DB)")
+    parser.add_argument('--loglevel',
+        required=False,
+        help="Logging level")
+
+    opts = vars(parser.parse_args())
+
+    if opts["loglevel"] is not None:
+        logger.setLevel(opts["loglevel"])
+    if opts["listen_port"] is None and opts["line_port"] is None:
+        parser.error("at least one of --listen-port and --line-port is required")
+
+    ipm = IpMeta(providers=opts["provider"], time=opts["date"])
+    server = Server(ipm)
+    if opts["listen_port"] is not None:
+        server.listen(opts["listen_ip"], opts["listen_port"], "http")
+    if opts["line_port"] is not None:
+        server.listen(opts["listen_ip"], opts["line_port"], "line")
+
+    stop_event = threading.Event()
+    signal.signal(signal.SIGTERM, lambda signum, frame: stop_event.set())
+    signal.signal(signal.SIGINT, lambda signum, frame: stop_event.set())
+
+    server.start(opts["threads"])
+    logger.info("Ready to accept queries")
+    server.serve_forever(stop_event)
+    server.stop()
+
+
+if __name__ == "__main__":
+    main()
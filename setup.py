@@ -4,6 +4,21 @@ _pyipmeta_module = Extension("_pyipmeta",
                              libraries=["ipmeta"],
                              sources=["src/_pyipmeta_module.c",
                                       "src/_pyipmeta_ipmeta.c",
+                                      "src/_pyipmeta_index.c",
+                                      "src/_pyipmeta_dir24.c",
+                                      "src/_pyipmeta_presence.c",
+                                      "src/_pyipmeta_spatial.c",
+                                      "src/_pyipmeta_fused.c",
+                                      "src/_pyipmeta_arrow.c",
+                                      "src/_pyipmeta_pool.c",
+                                      "src/_pyipmeta_json.c",
+                                      "src/_pyipmeta_metrics.c",
+                                      "src/_pyipmeta_guard.c",
+                                      "src/_pyipmeta_annotate.c",
+                                      "src/_pyipmeta_server.c",
+                                      "src/_pyipmeta_aggregator.c",
+                                      "src/_pyipmeta_history.c",
+                                      "src/_pyipmeta_pfx2as.c",
                                       "src/_pyipmeta_provider.c",
                                       "src/_pyipmeta_record.c"])
 
@@ -25,10 +40,12 @@ setup(name="pyipmeta",
           'Operating System :: POSIX',
       ],
       keywords='_pyipmeta pyipmeta geolocation pfx2as',
+      python_requires=">=3.11",
       ext_modules=[_pyipmeta_module],
       packages=find_packages(),
       entry_points={'console_scripts': [
-          'pyipmeta-lookup=pyipmeta.pyipmeta:main'
+          'pyipmeta-lookup=pyipmeta.pyipmeta:main',
+          'pyipmeta-server=pyipmeta.server:main'
       ]},
       install_requires=[
           "python-dateutil",
@@ -0,0 +1,1111 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_aggregator.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_ipmeta.h"
+#include "_pyipmeta_module.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_util.h"
+#include "pyutils.h"
+#include <arpa/inet.h>
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Python.h>
+
+#define AggregatorDocstring                                                 \
+  "Native aggregator of lookups into InfluxDB line protocol"
+
+#define AggregatorTypeName "_pyipmeta.Aggregator"
+
+/* Addresses are looked up this many at a time, one provider after another */
+#define CHUNK 256
+
+/* Characters that must be escaped in line protocol names and values */
+#define ESC_MEASUREMENT ", "
+#define ESC_KEY ",= "
+
+/* A tag written on every line */
+typedef struct agg_tag {
+  /* escaped tag key */
+  char *key;
+  /* field the value is taken from, or -1 for a fixed value */
+  int field;
+  /* escaped fixed value */
+  char *value;
+} agg_tag_t;
+
+/* Counts per distinct combination of records, one record (or NULL) per
+ * provider. A slot is empty if its count is zero. */
+typedef struct rec_table {
+  ipmeta_record_t **keys;
+  uint64_t *counts;
+  uint64_t *weights;
+  /* number of slots (a power of two) */
+  size_t size;
+  size_t cnt;
+} rec_table_t;
+
+/* Counts per distinct tag set, which is what ends up in the output. Several
+ * record combinations can have the same tags (e.g., two prefixes of the same
+ * AS). */
+typedef struct tag_entry {
+  uint64_t hash;
+  size_t off;
+  size_t len;
+  uint64_t count;
+  uint64_t weight;
+} tag_entry_t;
+
+typedef struct tag_table {
+  tag_entry_t *ents;
+  size_t size;
+  size_t cnt;
+  /* rendered tag sets, referenced by off/len */
+  pyipmeta_buf_t strs;
+} tag_table_t;
+
+typedef struct {
+  PyObject_HEAD
+
+  /* IpMeta object the events are looked up in */
+  IpMetaObject *pyipm;
+  uint32_t provmask;
+
+  /* sorted by key, as InfluxDB prefers */
+  agg_tag_t *tags;
+  int tags_cnt;
+
+  /* escaped measurement and field names (weight_field may be NULL) */
+  char *measurement;
+  char *count_field;
+  char *weight_field;
+  /* escaped value for tags with no value, or NULL to leave them out */
+  char *unknown;
+
+  /* interval length in seconds */
+  uint64_t interval;
+  /* start of the open interval, if any */
+  int open;
+  uint64_t start;
+
+  /* providers (ids) that the keys of recs refer to */
+  int provs[IPMETA_PROVIDER_MAX];
+  int provs_cnt;
+
+  rec_table_t recs;
+  tag_table_t tagsets;
+
+  /* lines of closed intervals waiting to be taken */
+  pyipmeta_buf_t out;
+  pyipmeta_buf_t scratch;
+
+  /* set while a thread is using the aggregator (add() runs without the
+   * GIL, and there may be no GIL at all) */
+  int busy;
+
+  uint64_t events;
+  uint64_t misses;
+  uint64_t late;
+  uint64_t intervals;
+  uint64_t lines;
+
+} AggregatorObject;
+
+/* ========== LINE PROTOCOL ========== */
+
+/* Append a name or tag value, escaping the given characters. Line breaks
+ * cannot be escaped, so they become (escaped) spaces. */
+static int lp_escape(pyipmeta_buf_t *buf, const char *str, size_t len,
+                     const char *special)
+{
+  size_t i;
+  char c;
+
+  if (_pyipmeta_buf_reserve(buf, len * 2) != 0) {
+    return -1;
+  }
+  for (i = 0; i < len; i++) {
+    c = (str[i] == '\n' || str[i] == '\r') ? ' ' : str[i];
+    if (strchr(special, c) != NULL) {
+      buf->data[buf->len++] = '\\';
+    }
+    buf->data[buf->len++] = c;
+  }
+  return 0;
+}
+
+/* Get a NUL-terminated escaped copy of a string */
+static char *lp_escape_dup(const char *str, const char *special)
+{
+  pyipmeta_buf_t buf = {NULL, 0, 0};
+
+  if (lp_escape(&buf, str, strlen(str), special) != 0 ||
+      _pyipmeta_buf_append(&buf, "", 1) != 0) {
+    _pyipmeta_buf_free(&buf);
+    return NULL;
+  }
+  return buf.data;
+}
+
+static int lp_cstring(pyipmeta_buf_t *buf, const char *str)
+{
+  size_t len = strlen(str);
+  if (len == 0) {
+    return 0;
+  }
+  return lp_escape(buf, str, len, ESC_KEY) == 0 ? 1 : -1;
+}
+
+static int lp_u64(pyipmeta_buf_t *buf, uint64_t val)
+{
+  if (val == 0) {
+    return 0;
+  }
+  return _pyipmeta_buf_u64(buf, val) == 0 ? 1 : -1;
+}
+
+/* Lists are joined with underscores, e.g., asn=15169_36040 */
+static int lp_u32_list(pyipmeta_buf_t *buf, const uint32_t *vals, int cnt)
+{
+  int i;
+  for (i = 0; i < cnt; i++) {
+    if ((i > 0 && _pyipmeta_buf_append(buf, "_", 1) != 0) ||
+        _pyipmeta_buf_u64(buf, vals[i]) != 0) {
+      return -1;
+    }
+  }
+  return cnt > 0;
+}
+
+/* Append the value of a field as a tag value
+ *
+ * @return 1 if a value was written, 0 if the record has no value for the
+ * field, -1 if out of memory
+ */
+static int lp_field(pyipmeta_buf_t *buf, ipmeta_record_t *rec,
+                    pyipmeta_field_t field)
+{
+  switch (field) {
+  case PYIPMETA_FIELD_SOURCE:
+    return lp_u64(buf, rec->source);
+  case PYIPMETA_FIELD_ID:
+    return lp_u64(buf, rec->id);
+  case PYIPMETA_FIELD_COUNTRY_CODE:
+    return lp_cstring(buf, STR_SAFE(rec->country_code));
+  case PYIPMETA_FIELD_CONTINENT_CODE:
+    return lp_cstring(buf, STR_SAFE(rec->continent_code));
+  case PYIPMETA_FIELD_REGION:
+    return lp_cstring(buf, STR_SAFE(rec->region));
+  case PYIPMETA_FIELD_CITY:
+    return lp_cstring(buf, STR_SAFE(rec->city));
+  case PYIPMETA_FIELD_POST_CODE:
+    return lp_cstring(buf, STR_SAFE(rec->post_code));
+  case PYIPMETA_FIELD_METRO_CODE:
+    return lp_u64(buf, rec->metro_code);
+  case PYIPMETA_FIELD_AREA_CODE:
+    return lp_u64(buf, rec->area_code);
+  case PYIPMETA_FIELD_REGION_CODE:
+    return lp_u64(buf, rec->region_code);
+  case PYIPMETA_FIELD_CONNECTION_SPEED:
+    return lp_cstring(buf, STR_SAFE(rec->conn_speed));
+  case PYIPMETA_FIELD_ASNS:
+    return lp_u32_list(buf, rec->asn, rec->asn_cnt);
+  case PYIPMETA_FIELD_ASN_IP_COUNT:
+    return lp_u64(buf, rec->asn_ip_cnt);
+  case PYIPMETA_FIELD_POLYGON_IDS:
+    return lp_u32_list(buf, rec->polygon_ids, rec->polygon_ids_cnt);
+  default:
+    /* lat_long and matched_ip_count are rejected when the tags are set up */
+    return 0;
+  }
+}
+
+/* Append ",key=value" for each tag of a record combination. Each field is
+ * taken from the first provider whose record has a value for it. */
+static int render_tags(AggregatorObject *self, ipmeta_record_t **row,
+                       pyipmeta_buf_t *buf)
+{
+  agg_tag_t *tag;
+  size_t mark;
+  int i, j, rc;
+
+  for (i = 0; i < self->tags_cnt; i++) {
+    tag = &self->tags[i];
+    mark = buf->len;
+    if (_pyipmeta_buf_append(buf, ",", 1) != 0 ||
+        _pyipmeta_buf_puts(buf, tag->key) != 0 ||
+        _pyipmeta_buf_append(buf, "=", 1) != 0) {
+      return -1;
+    }
+    if (tag->field < 0) {
+      rc = _pyipmeta_buf_puts(buf, tag->value) == 0 ? 1 : -1;
+    } else {
+      rc = 0;
+      for (j = 0; j < self->provs_cnt && rc == 0; j++) {
+        if (row[j] != NULL) {
+          rc = lp_field(buf, row[j], tag->field);
+        }
+      }
+      if (rc == 0 && self->unknown != NULL) {
+        rc = _pyipmeta_buf_puts(buf, self->unknown) == 0 ? 1 : -1;
+      }
+    }
+    if (rc < 0) {
+      return -1;
+    }
+    if (rc == 0) {
+      buf->len = mark;
+    }
+  }
+  return 0;
+}
+
+/* ========== HASH TABLES ========== */
+
+static uint64_t mix(uint64_t h)
+{
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static uint64_t hash_row(ipmeta_record_t **row, int cnt)
+{
+  uint64_t h = 0;
+  int i;
+  for (i = 0; i < cnt; i++) {
+    h = mix(h ^ (uint64_t)(uintptr_t)row[i]) + i;
+  }
+  return h;
+}
+
+static void rec_table_free(rec_table_t *t)
+{
+  free(t->keys);
+  free(t->counts);
+  free(t->weights);
+  memset(t, 0, sizeof(*t));
+}
+
+static void rec_table_clear(rec_table_t *t)
+{
+  if (t->cnt > 0) {
+    memset(t->counts, 0, t->size * sizeof(uint64_t));
+    t->cnt = 0;
+  }
+}
+
+/* Find the slot for a row, which is either empty or holds the row */
+static size_t rec_table_slot(rec_table_t *t, ipmeta_record_t **row, int width)
+{
+  size_t i = hash_row(row, width) & (t->size - 1);
+  while (t->counts[i] != 0 &&
+         memcmp(&t->keys[i * width], row, width * sizeof(*row)) != 0) {
+    i = (i + 1) & (t->size - 1);
+  }
+  return i;
+}
+
+static int rec_table_grow(rec_table_t *t, int width)
+{
+  rec_table_t n;
+  size_t i, j;
+
+  n.size = t->size ? t->size * 2 : 1024;
+  n.cnt = t->cnt;
+  n.keys = malloc(n.size * (width ? width : 1) * sizeof(*n.keys));
+  n.counts = calloc(n.size, sizeof(uint64_t));
+  n.weights = malloc(n.size * sizeof(uint64_t));
+  if (n.keys == NULL || n.counts == NULL || n.weights == NULL) {
+    rec_table_free(&n);
+    return -1;
+  }
+  for (i = 0; i < t->size; i++) {
+    if (t->counts[i] == 0) {
+      continue;
+    }
+    j = rec_table_slot(&n, &t->keys[i * width], width);
+    memcpy(&n.keys[j * width], &t->keys[i * width], width * sizeof(*n.keys));
+    n.counts[j] = t->counts[i];
+    n.weights[j] = t->weights[i];
+  }
+  rec_table_free(t);
+  *t = n;
+  return 0;
+}
+
+static int rec_table_add(rec_table_t *t, ipmeta_record_t **row, int width,
+                         uint64_t weight)
+{
+  size_t i;
+
+  if ((t->cnt + 1) * 4 > t->size * 3 && rec_table_grow(t, width) != 0) {
+    return -1;
+  }
+  i = rec_table_slot(t, row, width);
+  if (t->counts[i] == 0) {
+    memcpy(&t->keys[i * width], row, width * sizeof(*row));
+    t->weights[i] = 0;
+    t->cnt++;
+  }
+  t->counts[i]++;
+  t->weights[i] += weight;
+  return 0;
+}
+
+static void tag_table_free(tag_table_t *t)
+{
+  free(t->ents);
+  _pyipmeta_buf_free(&t->strs);
+  memset(t, 0, sizeof(*t));
+}
+
+static void tag_table_clear(tag_table_t *t)
+{
+  if (t->cnt > 0) {
+    memset(t->ents, 0, t->size * sizeof(tag_entry_t));
+    t->cnt = 0;
+  }
+  t->strs.len = 0;
+}
+
+static size_t tag_table_slot(tag_table_t *t, uint64_t hash, const char *str,
+                             size_t len)
+{
+  size_t i = hash & (t->size - 1);
+  tag_entry_t *e;
+  for (e = &t->ents[i]; e->count != 0; e = &t->ents[i]) {
+    if (e->hash == hash && e->len == len &&
+        memcmp(t->strs.data + e->off, str, len) == 0) {
+      break;
+    }
+    i = (i + 1) & (t->size - 1);
+  }
+  return i;
+}
+
+static int tag_table_grow(tag_table_t *t)
+{
+  tag_entry_t *ents, *e;
+  size_t size = t->size ? t->size * 2 : 256;
+  size_t i, j;
+
+  if ((ents = calloc(size, sizeof(*ents))) == NULL) {
+    return -1;
+  }
+  for (i = 0; i < t->size; i++) {
+    e = &t->ents[i];
+    if (e->count == 0) {
+      continue;
+    }
+    for (j = e->hash & (size - 1); ents[j].count != 0; j = (j + 1) & (size - 1))
+      ;
+    ents[j] = *e;
+  }
+  free(t->ents);
+  t->ents = ents;
+  t->size = size;
+  return 0;
+}
+
+/* Add counts to a tag set; str must not point into t->strs */
+static int tag_table_add(tag_table_t *t, const char *str, size_t len,
+                         uint64_t count, uint64_t weight)
+{
+  uint64_t hash = _pyipmeta_hash_str(str, len);
+  tag_entry_t *e;
+
+  if ((t->cnt + 1) * 4 > t->size * 3 && tag_table_grow(t) != 0) {
+    return -1;
+  }
+  e = &t->ents[tag_table_slot(t, hash, str, len)];
+  if (e->count == 0) {
+    e->hash = hash;
+    e->off = t->strs.len;
+    e->len = len;
+    if (_pyipmeta_buf_append(&t->strs, str, len) != 0) {
+      return -1;
+    }
+    t->cnt++;
+  }
+  e->count += count;
+  e->weight += weight;
+  return 0;
+}
+
+/* ========== AGGREGATION ========== */
+
+/* Move the counts per record combination into the counts per tag set, so
+ * that the records are no longer needed (e.g., before the providers change) */
+static int materialize(AggregatorObject *self)
+{
+  rec_table_t *t = &self->recs;
+  size_t i;
+
+  for (i = 0; i < t->size && t->cnt > 0; i++) {
+    if (t->counts[i] == 0) {
+      continue;
+    }
+    self->scratch.len = 0;
+    if (render_tags(self, &t->keys[i * self->provs_cnt], &self->scratch) !=
+          0 ||
+        tag_table_add(&self->tagsets, self->scratch.data, self->scratch.len,
+                      t->counts[i], t->weights[i]) != 0) {
+      return -1;
+    }
+  }
+  rec_table_clear(t);
+  return 0;
+}
+
+/* Write a line for each tag set of the open interval and close it */
+static int close_interval(AggregatorObject *self)
+{
+  tag_table_t *t = &self->tagsets;
+  tag_entry_t *e;
+  size_t i;
+
+  if (!self->open) {
+    return 0;
+  }
+  if (materialize(self) != 0) {
+    return -1;
+  }
+  for (i = 0; i < t->size; i++) {
+    e = &t->ents[i];
+    if (e->count == 0) {
+      continue;
+    }
+    if (_pyipmeta_buf_puts(&self->out, self->measurement) != 0 ||
+        _pyipmeta_buf_append(&self->out, t->strs.data + e->off, e->len) !=
+          0 ||
+        _pyipmeta_buf_append(&self->out, " ", 1) != 0 ||
+        _pyipmeta_buf_puts(&self->out, self->count_field) != 0 ||
+        _pyipmeta_buf_append(&self->out, "=", 1) != 0 ||
+        _pyipmeta_buf_u64(&self->out, e->count) != 0 ||
+        _pyipmeta_buf_append(&self->out, "i", 1) != 0) {
+      return -1;
+    }
+    if (self->weight_field != NULL &&
+        (_pyipmeta_buf_append(&self->out, ",", 1) != 0 ||
+         _pyipmeta_buf_puts(&self->out, self->weight_field) != 0 ||
+         _pyipmeta_buf_append(&self->out, "=", 1) != 0 ||
+         _pyipmeta_buf_u64(&self->out, e->weight) != 0 ||
+         _pyipmeta_buf_append(&self->out, "i", 1) != 0)) {
+      return -1;
+    }
+    /* points are stamped with the start of the interval, in ns */
+    if (_pyipmeta_buf_append(&self->out, " ", 1) != 0 ||
+        _pyipmeta_buf_u64(&self->out, self->start * 1000000000ULL) != 0 ||
+        _pyipmeta_buf_append(&self->out, "\n", 1) != 0) {
+      return -1;
+    }
+    self->lines++;
+  }
+  tag_table_clear(t);
+  self->intervals++;
+  self->open = 0;
+  return 0;
+}
+
+static uint64_t get_uint(const Py_buffer *view, size_t i)
+{
+  return (view->itemsize == 4) ? ((const uint32_t *)view->buf)[i]
+                               : ((const uint64_t *)view->buf)[i];
+}
+
+/* Look up and count a batch of events. This does not touch any Python
+ * objects, so it runs without the GIL.
+ *
+ * @return the number of intervals closed, or -1 if out of memory
+ */
+static int add_events(AggregatorObject *self, pyipmeta_index_t *idx,
+                      int family, const Py_buffer *ts, const Py_buffer *addrs,
+                      const Py_buffer *weights, size_t cnt)
+{
+  int provs[IPMETA_PROVIDER_MAX];
+  void *tbls[IPMETA_PROVIDER_MAX];
+  uint32_t vals[CHUNK * IPMETA_PROVIDER_MAX];
+  ipmeta_record_t *row[IPMETA_PROVIDER_MAX];
+  int provs_cnt = 0, closed = 0, hit, i;
+  size_t base, n, j;
+  uint64_t start;
+  uint32_t mask;
+
+  /* one key column per indexed provider, in provider id order */
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    mask = IPMETA_PROV_TO_MASK(i + 1);
+    if (idx->v4[i] != NULL &&
+        (self->provmask == 0 || (self->provmask & mask) != 0)) {
+      tbls[provs_cnt] = (family == AF_INET) ? (void *)idx->v4[i]
+                                            : (void *)idx->v6[i];
+      provs[provs_cnt++] = i + 1;
+    }
+  }
+  if (provs_cnt != self->provs_cnt ||
+      memcmp(provs, self->provs, provs_cnt * sizeof(int)) != 0) {
+    /* a provider was enabled since the last batch */
+    if (materialize(self) != 0) {
+      return -1;
+    }
+    memcpy(self->provs, provs, provs_cnt * sizeof(int));
+    self->provs_cnt = provs_cnt;
+    rec_table_free(&self->recs);
+  }
+
+  for (base = 0; base < cnt; base += CHUNK) {
+    n = (cnt - base < CHUNK) ? cnt - base : CHUNK;
+    for (i = 0; i < provs_cnt; i++) {
+      if (family == AF_INET) {
+        _pyipmeta_index_search4(tbls[i],
+                                (const uint32_t *)addrs->buf + base, n,
+                                vals + i, provs_cnt);
+      } else {
+        _pyipmeta_index_search6(tbls[i],
+                                (const uint8_t *)addrs->buf + base * 16, n,
+                                vals + i, provs_cnt);
+      }
+    }
+
+    for (j = 0; j < n; j++) {
+      start = get_uint(ts, base + j);
+      start -= start % self->interval;
+      if (self->open && start < self->start) {
+        /* the interval this event belongs to has been written already */
+        self->late++;
+        continue;
+      }
+      if (self->open && start > self->start) {
+        if (close_interval(self) != 0) {
+          return -1;
+        }
+        closed++;
+      }
+      if (!self->open) {
+        self->open = 1;
+        self->start = start;
+      }
+
+      hit = 0;
+      for (i = 0; i < provs_cnt; i++) {
+        if (vals[j * provs_cnt + i] == PYIPMETA_INDEX_NONE) {
+          row[i] = NULL;
+        } else {
+          row[i] = idx->recs[vals[j * provs_cnt + i]];
+          hit = 1;
+        }
+      }
+      self->events++;
+      if (!hit) {
+        self->misses++;
+      }
+      if (rec_table_add(&self->recs, row, provs_cnt,
+                        weights->buf ? get_uint(weights, base + j) : 1) !=
+          0) {
+        return -1;
+      }
+    }
+  }
+  return closed;
+}
+
+/* ========== PYTHON INTERFACE ========== */
+
+static void
+Aggregator_dealloc(AggregatorObject *self)
+{
+  int i;
+
+  for (i = 0; i < self->tags_cnt; i++) {
+    free(self->tags[i].key);
+    free(self->tags[i].value);
+  }
+  free(self->tags);
+  free(self->measurement);
+  free(self->count_field);
+  free(self->weight_field);
+  free(self->unknown);
+  rec_table_free(&self->recs);
+  tag_table_free(&self->tagsets);
+  _pyipmeta_buf_free(&self->out);
+  _pyipmeta_buf_free(&self->scratch);
+  Py_XDECREF(self->pyipm);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
+}
+
+static int tag_cmp(const void *a, const void *b)
+{
+  return strcmp(((const agg_tag_t *)a)->key, ((const agg_tag_t *)b)->key);
+}
+
+/* Add a tag, taking its (unescaped) key and value from Python strings */
+static int add_tag(AggregatorObject *self, PyObject *pykey, PyObject *pyval)
+{
+  agg_tag_t *tag = &self->tags[self->tags_cnt];
+  const char *key, *val;
+  int field = -1;
+
+  if ((key = PyUnicode_AsUTF8(pykey)) == NULL) {
+    return -1;
+  }
+  if (pyval == NULL) {
+    if ((field = _pyipmeta_field_by_name(key)) < 0 ||
+        field == PYIPMETA_FIELD_LAT_LONG ||
+        field == PYIPMETA_FIELD_MATCHED_IP_COUNT) {
+      PyErr_Format(PyExc_ValueError, "Cannot aggregate by field '%s'", key);
+      return -1;
+    }
+  } else if ((val = PyUnicode_AsUTF8(pyval)) == NULL) {
+    return -1;
+  } else if (*val == '\0') {
+    PyErr_Format(PyExc_ValueError, "Empty value for tag '%s'", key);
+    return -1;
+  }
+  tag->field = field;
+  if ((tag->key = lp_escape_dup(key, ESC_KEY)) == NULL ||
+      (pyval != NULL && (tag->value = lp_escape_dup(val, ESC_KEY)) == NULL)) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  self->tags_cnt++;
+  return 0;
+}
+
+static PyObject *
+Aggregator_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  AggregatorObject *self;
+  IpMetaObject *pyipm = NULL;
+  PyObject *pyfields = NULL, *pytags = Py_None, *seq = NULL;
+  PyObject *key, *val;
+  unsigned long long interval = 60;
+  const char *measurement = "ipmeta", *count_field = "count";
+  const char *weight_field = "weight", *unknown = "??";
+  int provmask = 0, i;
+  Py_ssize_t pos = 0, tags_cnt;
+  static char *kwlist[] = { "ipm", "fields", "interval", "measurement",
+                            "provmask", "tags", "count_field", "weight_field",
+                            "unknown", NULL };
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!O|KsiOszz", kwlist,
+                                   _pyipmeta_get_state(type)->IpMetaType,
+                                   &pyipm, &pyfields, &interval, &measurement,
+                                   &provmask, &pytags, &count_field,
+                                   &weight_field, &unknown)) {
+    return NULL;
+  }
+  if (interval == 0) {
+    PyErr_SetString(PyExc_ValueError, "interval must be positive");
+    return NULL;
+  }
+  if (*measurement == '\0' || *count_field == '\0' ||
+      (weight_field != NULL && *weight_field == '\0')) {
+    PyErr_SetString(PyExc_ValueError,
+                    "Measurement and field names must not be empty");
+    return NULL;
+  }
+  if (pytags != Py_None && !PyDict_Check(pytags)) {
+    PyErr_SetString(PyExc_TypeError, "tags must be a dict");
+    return NULL;
+  }
+  if ((seq = PySequence_Fast(pyfields, "fields must be a sequence")) ==
+      NULL) {
+    return NULL;
+  }
+
+  self = (AggregatorObject *)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    Py_DECREF(seq);
+    return NULL;
+  }
+  Py_INCREF(pyipm);
+  self->pyipm = pyipm;
+  self->provmask = provmask;
+  self->interval = interval;
+
+  tags_cnt = PySequence_Fast_GET_SIZE(seq) +
+             (pytags != Py_None ? PyDict_Size(pytags) : 0);
+  if ((self->tags = calloc(tags_cnt ? tags_cnt : 1, sizeof(agg_tag_t))) ==
+      NULL) {
+    PyErr_NoMemory();
+    goto err;
+  }
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    if (add_tag(self, PySequence_Fast_GET_ITEM(seq, i), NULL) != 0) {
+      goto err;
+    }
+  }
+  while (pytags != Py_None && PyDict_Next(pytags, &pos, &key, &val)) {
+    if (add_tag(self, key, val) != 0) {
+      goto err;
+    }
+  }
+  qsort(self->tags, self->tags_cnt, sizeof(agg_tag_t), tag_cmp);
+  for (i = 1; i < self->tags_cnt; i++) {
+    if (strcmp(self->tags[i - 1].key, self->tags[i].key) == 0) {
+      PyErr_Format(PyExc_ValueError, "Duplicate tag '%s'", self->tags[i].key);
+      goto err;
+    }
+  }
+
+  if ((self->measurement = lp_escape_dup(measurement, ESC_MEASUREMENT)) ==
+        NULL ||
+      (self->count_field = lp_escape_dup(count_field, ESC_KEY)) == NULL ||
+      (weight_field != NULL &&
+       (self->weight_field = lp_escape_dup(weight_field, ESC_KEY)) == NULL) ||
+      (unknown != NULL && *unknown != '\0' &&
+       (self->unknown = lp_escape_dup(unknown, ESC_KEY)) == NULL)) {
+    PyErr_NoMemory();
+    goto err;
+  }
+
+  Py_DECREF(seq);
+  return (PyObject *)self;
+
+ err:
+  Py_DECREF(seq);
+  Py_DECREF(self);
+  return NULL;
+}
+
+static int
+Aggregator_init(AggregatorObject *self, PyObject *args, PyObject *kwds)
+{
+  return 0;
+}
+
+/* Get a read-only buffer of 32- or 64-bit unsigned integers */
+static int
+get_uint_buffer(PyObject *obj, Py_buffer *view, const char *what)
+{
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return -1;
+  }
+  if ((view->itemsize != 4 && view->itemsize != 8) || view->format == NULL ||
+      strchr("ILNQ", view->format[strlen(view->format) - 1]) == NULL) {
+    PyErr_Format(PyExc_TypeError,
+                 "Expected %s as a buffer of 32- or 64-bit unsigned integers",
+                 what);
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+/* Claim the aggregator for the calling thread */
+static int
+claim(AggregatorObject *self)
+{
+  if (__atomic_exchange_n(&self->busy, 1, __ATOMIC_ACQUIRE)) {
+    PyErr_SetString(PyExc_RuntimeError, "Aggregator is already in use");
+    return -1;
+  }
+  return 0;
+}
+
+static void
+release(AggregatorObject *self)
+{
+  __atomic_store_n(&self->busy, 0, __ATOMIC_RELEASE);
+}
+
+/* Count a batch of events of the given address family */
+static PyObject *
+add(AggregatorObject *self, PyObject *args, PyObject *kwds, int family)
+{
+  PyObject *pyts = NULL, *pyaddrs = NULL, *pyweights = Py_None;
+  static char *kwlist[] = { "timestamps", "addrs", "weights", NULL };
+  Py_buffer ts, addrs, weights;
+  pyipmeta_index_t *idx;
+  IpMetaObject *pyipm;
+  size_t cnt;
+  int rc, shard;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "OO|O", kwlist,
+                                   &pyts, &pyaddrs, &pyweights)) {
+    return NULL;
+  }
+  if (claim(self) != 0) {
+    return NULL;
+  }
+  /* enable_provider cannot replace the index while we are searching */
+  pyipm = self->pyipm;
+  if ((shard = _pyipmeta_ipmeta_begin(pyipm)) < 0) {
+    goto err_claim;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(pyipm)) == NULL) {
+    goto err_ipm;
+  }
+
+  memset(&weights, 0, sizeof(weights));
+  if (get_uint_buffer(pyts, &ts, "timestamps") != 0) {
+    goto err_ipm;
+  }
+  if (family == AF_INET) {
+    if (get_uint_buffer(pyaddrs, &addrs, "addrs") != 0) {
+      goto err_ts;
+    }
+    if (addrs.itemsize != 4) {
+      PyErr_SetString(PyExc_TypeError,
+                      "Expected addrs as 32-bit unsigned integers");
+      goto err_addrs;
+    }
+    cnt = addrs.len / 4;
+  } else {
+    if (PyObject_GetBuffer(pyaddrs, &addrs, PyBUF_C_CONTIGUOUS) != 0) {
+      goto err_ts;
+    }
+    if (addrs.len % 16 != 0) {
+      PyErr_SetString(PyExc_TypeError,
+                      "Expected addrs as packed 16-byte IPv6 addresses");
+      goto err_addrs;
+    }
+    cnt = addrs.len / 16;
+  }
+  if (pyweights != Py_None &&
+      get_uint_buffer(pyweights, &weights, "weights") != 0) {
+    goto err_addrs;
+  }
+  if ((size_t)(ts.len / ts.itemsize) != cnt ||
+      (weights.buf != NULL && (size_t)(weights.len / weights.itemsize) !=
+                                cnt)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "timestamps, addrs and weights must have the same length");
+    goto err_weights;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  rc = add_events(self, idx, family, &ts, &addrs, &weights, cnt);
+  Py_END_ALLOW_THREADS
+  _pyipmeta_metrics_batch(pyipm->metrics, cnt);
+
+  if (weights.buf != NULL) {
+    PyBuffer_Release(&weights);
+  }
+  PyBuffer_Release(&addrs);
+  PyBuffer_Release(&ts);
+  _pyipmeta_ipmeta_end(pyipm, shard);
+  release(self);
+  if (rc < 0) {
+    return PyErr_NoMemory();
+  }
+  return Py_BuildValue("i", rc);
+
+ err_weights:
+  if (weights.buf != NULL) {
+    PyBuffer_Release(&weights);
+  }
+ err_addrs:
+  PyBuffer_Release(&addrs);
+ err_ts:
+  PyBuffer_Release(&ts);
+ err_ipm:
+  _pyipmeta_ipmeta_end(pyipm, shard);
+ err_claim:
+  release(self);
+  return NULL;
+}
+
+/* Count a batch of IPv4 events */
+static PyObject *
+Aggregator_add(AggregatorObject *self, PyObject *args, PyObject *kwds)
+{
+  return add(self, args, kwds, AF_INET);
+}
+
+/* Count a batch of IPv6 events */
+static PyObject *
+Aggregator_add6(AggregatorObject *self, PyObject *args, PyObject *kwds)
+{
+  return add(self, args, kwds, AF_INET6);
+}
+
+/* Close the open interval, even though more events could still arrive */
+static PyObject *
+Aggregator_flush(AggregatorObject *self)
+{
+  int closed, rc;
+
+  if (claim(self) != 0) {
+    return NULL;
+  }
+  closed = self->open;
+  rc = close_interval(self);
+  release(self);
+  if (rc != 0) {
+    return PyErr_NoMemory();
+  }
+  return Py_BuildValue("i", closed);
+}
+
+/* Return (and forget) the lines of the closed intervals */
+static PyObject *
+Aggregator_take(AggregatorObject *self)
+{
+  PyObject *res;
+
+  if (claim(self) != 0) {
+    return NULL;
+  }
+  if ((res = PyBytes_FromStringAndSize(self->out.data, self->out.len)) !=
+      NULL) {
+    self->out.len = 0;
+  }
+  release(self);
+  return res;
+}
+
+/* Look up events in a different IpMeta instance (e.g., after a reload) */
+static PyObject *
+Aggregator_set_ipm(AggregatorObject *self, PyObject *args)
+{
+  IpMetaObject *pyipm = NULL, *old;
+
+  if (!PyArg_ParseTuple(args, "O!",
+                        _pyipmeta_get_state(Py_TYPE(self))->IpMetaType,
+                        &pyipm)) {
+    return NULL;
+  }
+  if (claim(self) != 0) {
+    return NULL;
+  }
+  /* the counts so far refer to records of the old instance */
+  if (materialize(self) != 0) {
+    release(self);
+    return PyErr_NoMemory();
+  }
+  self->provs_cnt = 0;
+  rec_table_free(&self->recs);
+
+  Py_INCREF(pyipm);
+  old = self->pyipm;
+  self->pyipm = pyipm;
+  release(self);
+  Py_DECREF(old);
+
+  Py_RETURN_NONE;
+}
+
+/* Get the aggregator counters */
+static PyObject *
+Aggregator_stats(AggregatorObject *self)
+{
+  return Py_BuildValue(
+    "{s:K,s:K,s:K,s:K,s:K,s:n,s:n}",
+    "events", (unsigned long long)self->events,
+    "misses", (unsigned long long)self->misses,
+    "late", (unsigned long long)self->late,
+    "intervals", (unsigned long long)self->intervals,
+    "lines", (unsigned long long)self->lines,
+    "groups", (Py_ssize_t)(self->recs.cnt + self->tagsets.cnt),
+    "pending_bytes", (Py_ssize_t)self->out.len);
+}
+
+static PyMethodDef Aggregator_methods[] = {
+
+  {
+    "add",
+    (PyCFunction)Aggregator_add,
+    METH_VARARGS | METH_KEYWORDS,
+    "Count a batch of IPv4 events given as buffers of timestamps (seconds), "
+    "host byte order addresses and optional weights, returning the number "
+    "of intervals closed"
+  },
+
+  {
+    "add6",
+    (PyCFunction)Aggregator_add6,
+    METH_VARARGS | METH_KEYWORDS,
+    "Count a batch of IPv6 events given as buffers of timestamps (seconds), "
+    "packed 16-byte addresses and optional weights, returning the number "
+    "of intervals closed"
+  },
+
+  {
+    "flush",
+    (PyCFunction)Aggregator_flush,
+    METH_NOARGS,
+    "Close the open interval, returning the number of intervals closed"
+  },
+
+  {
+    "take",
+    (PyCFunction)Aggregator_take,
+    METH_NOARGS,
+    "Return the line protocol for the closed intervals as bytes, and clear "
+    "it"
+  },
+
+  {
+    "set_ipm",
+    (PyCFunction)Aggregator_set_ipm,
+    METH_VARARGS,
+    "Look up events in the given IpMeta object from now on"
+  },
+
+  {
+    "stats",
+    (PyCFunction)Aggregator_stats,
+    METH_NOARGS,
+    "Get a dict of aggregator counters"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Aggregator_slots[] = {
+  {Py_tp_dealloc, Aggregator_dealloc},
+  {Py_tp_doc, AggregatorDocstring},
+  {Py_tp_methods, Aggregator_methods},
+  {Py_tp_init, Aggregator_init},
+  {Py_tp_new, Aggregator_new},
+  {0, NULL},
+};
+
+static PyType_Spec Aggregator_spec = {
+  AggregatorTypeName,
+  sizeof(AggregatorObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE,
+  Aggregator_slots,
+};
+
+PyType_Spec *_pyipmeta_aggregator_get_AggregatorSpec()
+{
+  return &Aggregator_spec;
+}
@@ -0,0 +1,300 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_annotate.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_util.h"
+#include <libipmeta.h>
+#include <math.h>
+#include <string.h>
+
+/* Longer lines cannot be valid addresses or prefixes */
+#define MAX_QUERY_LEN 255
+
+#define IS_SPACE(c) ((c) == ' ' || (c) == '\t' || (c) == '\r' || (c) == '\n')
+
+/* ========== CSV ========== */
+
+/* Append a CSV field, quoting it if needed */
+static int csv_string(pyipmeta_buf_t *buf, const char *str, size_t len)
+{
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    if (str[i] == ',' || str[i] == '"' || str[i] == '\r' || str[i] == '\n') {
+      break;
+    }
+  }
+  if (i == len) {
+    return _pyipmeta_buf_append(buf, str, len);
+  }
+  if (_pyipmeta_buf_reserve(buf, len * 2 + 2) != 0) {
+    return -1;
+  }
+  buf->data[buf->len++] = '"';
+  for (i = 0; i < len; i++) {
+    if (str[i] == '"') {
+      buf->data[buf->len++] = '"';
+    }
+    buf->data[buf->len++] = str[i];
+  }
+  buf->data[buf->len++] = '"';
+  return 0;
+}
+
+static int csv_cstring(pyipmeta_buf_t *buf, const char *str)
+{
+  return csv_string(buf, str, strlen(str));
+}
+
+/* Non-finite values are written as empty fields */
+static int csv_double(pyipmeta_buf_t *buf, double val)
+{
+  return isfinite(val) ? _pyipmeta_buf_double(buf, val) : 0;
+}
+
+/* Lists are written space-separated in a single field */
+static int csv_u32_list(pyipmeta_buf_t *buf, const uint32_t *vals, int cnt)
+{
+  int i;
+  for (i = 0; i < cnt; i++) {
+    if ((i > 0 && _pyipmeta_buf_append(buf, " ", 1) != 0) ||
+        _pyipmeta_buf_u64(buf, vals[i]) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int csv_field(pyipmeta_buf_t *buf, ipmeta_record_t *rec,
+                     uint64_t num_ips, pyipmeta_field_t field)
+{
+  switch (field) {
+  case PYIPMETA_FIELD_SOURCE:
+    return _pyipmeta_buf_u64(buf, rec->source);
+  case PYIPMETA_FIELD_ID:
+    return _pyipmeta_buf_u64(buf, rec->id);
+  case PYIPMETA_FIELD_COUNTRY_CODE:
+    return csv_cstring(buf, STR_SAFE(rec->country_code));
+  case PYIPMETA_FIELD_CONTINENT_CODE:
+    return csv_cstring(buf, STR_SAFE(rec->continent_code));
+  case PYIPMETA_FIELD_REGION:
+    return csv_cstring(buf, STR_SAFE(rec->region));
+  case PYIPMETA_FIELD_CITY:
+    return csv_cstring(buf, STR_SAFE(rec->city));
+  case PYIPMETA_FIELD_POST_CODE:
+    return csv_cstring(buf, STR_SAFE(rec->post_code));
+  case PYIPMETA_FIELD_LAT_LONG:
+    /* written as separate latitude and longitude columns */
+    return (csv_double(buf, rec->latitude) ||
+            _pyipmeta_buf_append(buf, ",", 1) ||
+            csv_double(buf, rec->longitude));
+  case PYIPMETA_FIELD_METRO_CODE:
+    return _pyipmeta_buf_u64(buf, rec->metro_code);
+  case PYIPMETA_FIELD_AREA_CODE:
+    return _pyipmeta_buf_u64(buf, rec->area_code);
+  case PYIPMETA_FIELD_REGION_CODE:
+    return _pyipmeta_buf_u64(buf, rec->region_code);
+  case PYIPMETA_FIELD_CONNECTION_SPEED:
+    return csv_cstring(buf, STR_SAFE(rec->conn_speed));
+  case PYIPMETA_FIELD_ASNS:
+    return csv_u32_list(buf, rec->asn, rec->asn_cnt);
+  case PYIPMETA_FIELD_ASN_IP_COUNT:
+    return _pyipmeta_buf_u64(buf, rec->asn_ip_cnt);
+  case PYIPMETA_FIELD_POLYGON_IDS:
+    return csv_u32_list(buf, rec->polygon_ids, rec->polygon_ids_cnt);
+  case PYIPMETA_FIELD_MATCHED_IP_COUNT:
+    return _pyipmeta_buf_u64(buf, num_ips);
+  default:
+    return -1;
+  }
+}
+
+int _pyipmeta_csv_header(pyipmeta_buf_t *buf, const pyipmeta_field_t *fields,
+                         int fields_cnt)
+{
+  int i, rc;
+
+  if (fields == NULL) {
+    fields = _pyipmeta_all_fields;
+    fields_cnt = PYIPMETA_FIELD_CNT;
+  }
+  if (_pyipmeta_buf_puts(buf, "query") != 0) {
+    return -1;
+  }
+  for (i = 0; i < fields_cnt; i++) {
+    if (fields[i] == PYIPMETA_FIELD_LAT_LONG) {
+      rc = _pyipmeta_buf_puts(buf, ",latitude,longitude");
+    } else {
+      rc = (_pyipmeta_buf_append(buf, ",", 1) ||
+            _pyipmeta_buf_puts(buf, _pyipmeta_field_name(fields[i])));
+    }
+    if (rc != 0) {
+      return -1;
+    }
+  }
+  return _pyipmeta_buf_append(buf, "\n", 1);
+}
+
+static int csv_lookup(pyipmeta_buf_t *buf, const char *query,
+                      size_t query_len, int rc, ipmeta_record_set_t *set,
+                      const pyipmeta_field_t *fields, int fields_cnt,
+                      pyipmeta_annotate_stats_t *stats)
+{
+  ipmeta_record_t *rec;
+  uint64_t num_ips = 0;
+  int i, rows = 0;
+
+  if (rc >= 0) {
+    ipmeta_record_set_rewind(set);
+    while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+      if (csv_string(buf, query, query_len) != 0) {
+        return -1;
+      }
+      for (i = 0; i < fields_cnt; i++) {
+        if (_pyipmeta_buf_append(buf, ",", 1) != 0 ||
+            csv_field(buf, rec, num_ips, fields[i]) != 0) {
+          return -1;
+        }
+      }
+      if (_pyipmeta_buf_append(buf, "\n", 1) != 0) {
+        return -1;
+      }
+      rows++;
+    }
+  }
+  stats->records += rows;
+  if (rows > 0) {
+    return 0;
+  }
+
+  /* one row of empty fields so that every query appears in the output */
+  if (csv_string(buf, query, query_len) != 0) {
+    return -1;
+  }
+  for (i = 0; i < fields_cnt; i++) {
+    /* lat_long takes two columns */
+    if (_pyipmeta_buf_puts(buf,
+                           fields[i] == PYIPMETA_FIELD_LAT_LONG ? ",," : ",")
+        != 0) {
+      return -1;
+    }
+  }
+  return _pyipmeta_buf_append(buf, "\n", 1);
+}
+
+/* ========== ANNOTATION ========== */
+
+static uint64_t count_records(ipmeta_record_set_t *set)
+{
+  uint64_t cnt = 0, num_ips;
+
+  ipmeta_record_set_rewind(set);
+  while (ipmeta_record_set_next(set, &num_ips) != NULL) {
+    cnt++;
+  }
+  return cnt;
+}
+
+int _pyipmeta_annotate(ipmeta_t *ipm, uint32_t provmask,
+                       ipmeta_record_set_t *set, pyipmeta_metrics_t *metrics,
+                       pyipmeta_format_t format,
+                       const pyipmeta_field_t *fields, int fields_cnt,
+                       const char *in, size_t in_len, pyipmeta_buf_t *out,
+                       pyipmeta_annotate_stats_t *stats)
+{
+  char query[MAX_QUERY_LEN + 1];
+  const char *line, *eol, *end = in + in_len;
+  size_t len;
+  uint64_t start;
+  int rc;
+
+  if (format == PYIPMETA_FORMAT_CSV && fields == NULL) {
+    fields = _pyipmeta_all_fields;
+    fields_cnt = PYIPMETA_FIELD_CNT;
+  }
+
+  for (line = in; line < end; line = eol + 1) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL) {
+      eol = end;
+    }
+    /* strip surrounding whitespace */
+    len = eol - line;
+    while (len > 0 && IS_SPACE(*line)) {
+      line++;
+      len--;
+    }
+    while (len > 0 && IS_SPACE(line[len - 1])) {
+      len--;
+    }
+    if (len == 0) {
+      continue;
+    }
+
+    stats->lines++;
+    start = _pyipmeta_metrics_now(metrics);
+    if (len > MAX_QUERY_LEN) {
+      rc = IPMETA_ERR_INPUT;
+    } else {
+      /* ipmeta_lookup needs a NUL-terminated string */
+      memcpy(query, line, len);
+      query[len] = '\0';
+      rc = ipmeta_lookup(ipm, query, provmask, set);
+    }
+    start = _pyipmeta_metrics_lookup(metrics, rc, set, start);
+    if (rc < 0) {
+      if (rc != IPMETA_ERR_INPUT) {
+        return -1;
+      }
+      stats->errors++;
+    }
+
+    if (format == PYIPMETA_FORMAT_CSV) {
+      rc = csv_lookup(out, line, len, rc, set, fields, fields_cnt, stats);
+    } else {
+      if (rc >= 0) {
+        stats->records += count_records(set);
+      }
+      rc = (_pyipmeta_json_lookup(out, line, len, rc, set, fields,
+                                  fields_cnt) != 0 ||
+            _pyipmeta_buf_append(out, "\n", 1) != 0)
+             ? -1
+             : 0;
+    }
+    ipmeta_record_set_clear(set);
+    _pyipmeta_metrics_time(metrics, PYIPMETA_HIST_CONVERT, start);
+    if (rc != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_annotate_H
+#define ___pyipmeta_annotate_H
+
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include <libipmeta.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Output formats for annotated lookups */
+typedef enum pyipmeta_format {
+  PYIPMETA_FORMAT_NDJSON,
+  PYIPMETA_FORMAT_CSV,
+} pyipmeta_format_t;
+
+/** Counters for annotated lookups */
+typedef struct pyipmeta_annotate_stats {
+  /** Number of (non-blank) lines looked up */
+  uint64_t lines;
+  /** Number of lines that were not valid addresses or prefixes */
+  uint64_t errors;
+  /** Number of records written */
+  uint64_t records;
+} pyipmeta_annotate_stats_t;
+
+/** Append the CSV header line for the given fields (all if NULL) */
+int _pyipmeta_csv_header(pyipmeta_buf_t *buf, const pyipmeta_field_t *fields,
+                         int fields_cnt);
+
+/** Look up each line of a chunk of input and append the results to out
+ *
+ * Lines are stripped of surrounding whitespace and blank lines are skipped.
+ * NDJSON output has one {"query": ..., "result": [...]} object per line (see
+ * _pyipmeta_json_lookup). CSV output has one row per matched record, with the
+ * query in the first column; queries with no matches (or that are invalid)
+ * get a single row with empty fields.
+ *
+ * This does not touch any Python objects, so it can be called without the
+ * GIL as long as each thread uses its own record set. Lookups are counted
+ * in metrics unless it is NULL.
+ *
+ * @return 0 if successful, -1 if out of memory or the lookup failed
+ */
+int _pyipmeta_annotate(ipmeta_t *ipm, uint32_t provmask,
+                       ipmeta_record_set_t *set, pyipmeta_metrics_t *metrics,
+                       pyipmeta_format_t format,
+                       const pyipmeta_field_t *fields, int fields_cnt,
+                       const char *in, size_t in_len, pyipmeta_buf_t *out,
+                       pyipmeta_annotate_stats_t *stats);
+
+#endif /* ___pyipmeta_annotate_H */
@@ -0,0 +1,944 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "_pyipmeta_arrow.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_util.h"
+#include "pyutils.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Python.h>
+
+#define ArrowBatchDocstring                                                 \
+  "Lookup results as Arrow columns, exported through the Arrow PyCapsule "  \
+  "interface (e.g., pyarrow.record_batch(batch) or "                        \
+  "polars.from_arrow(batch))"
+
+#define ArrowBatchTypeName "_pyipmeta.ArrowBatch"
+
+/* Columns of a batch, in schema order */
+enum {
+  COL_INDEX,
+  COL_SOURCE,
+  COL_ID,
+  COL_COUNTRY_CODE,
+  COL_CONTINENT_CODE,
+  COL_REGION,
+  COL_CITY,
+  COL_LATITUDE,
+  COL_LONGITUDE,
+  COL_ASNS,
+  COL_POLYGON_IDS,
+  COL_MATCHED_IP_COUNT,
+  COL_CNT
+};
+
+/* The dictionary-encoded columns are COL_DICT to COL_DICT +
+   PYIPMETA_ARROW_DICT_CNT - 1, in the order of the dictionaries */
+#define COL_DICT COL_COUNTRY_CODE
+
+/* The list<uint32> columns are COL_LIST and COL_LIST + 1 */
+#define COL_LIST COL_ASNS
+#define LIST_CNT 2
+
+#define IS_DICT(c) ((c) >= COL_DICT && (c) < COL_DICT + PYIPMETA_ARROW_DICT_CNT)
+#define IS_LIST(c) ((c) >= COL_LIST && (c) < COL_LIST + LIST_CNT)
+
+/* Name, Arrow format and value size (offset size for lists, index size for
+   dictionaries) of each column */
+static const struct {
+  const char *name;
+  const char *format;
+  size_t size;
+} columns[COL_CNT] = {
+  { "index", "I", sizeof(uint32_t) },
+  { "source", "C", sizeof(uint8_t) },
+  { "id", "I", sizeof(uint32_t) },
+  { "country_code", "i", sizeof(int32_t) },
+  { "continent_code", "i", sizeof(int32_t) },
+  { "region", "i", sizeof(int32_t) },
+  { "city", "i", sizeof(int32_t) },
+  { "latitude", "g", sizeof(double) },
+  { "longitude", "g", sizeof(double) },
+  { "asns", "+l", sizeof(int32_t) },
+  { "polygon_ids", "+l", sizeof(int32_t) },
+  { "matched_ip_count", "L", sizeof(uint64_t) },
+};
+
+struct pyipmeta_arrow_batch {
+  /* number of users (the ArrowBatch object and exported arrays); freed when
+     this drops to zero (updated atomically) */
+  int refcnt;
+
+  int64_t rows;
+
+  /* dictionaries the code columns refer to */
+  pyipmeta_arrow_dicts_t *dicts;
+
+  /* values (offsets for lists) of each column, with room for rows + 1 */
+  void *cols[COL_CNT];
+
+  /* items of the list columns */
+  uint32_t *items[LIST_CNT];
+  int64_t items_cnt[LIST_CNT];
+};
+
+/* ========== DICTIONARIES ========== */
+
+/* Get a string field of a record ("" if unset) */
+static const char *rec_str(const ipmeta_record_t *rec, int field)
+{
+  const char *str;
+
+  switch (field) {
+  case 0:
+    str = rec->country_code;
+    break;
+  case 1:
+    str = rec->continent_code;
+    break;
+  case 2:
+    str = rec->region;
+    break;
+  default:
+    str = rec->city;
+    break;
+  }
+  return str != NULL ? str : "";
+}
+
+/* Build the dictionary of one field, and the code of each record in it.
+ * Arrow utf8 values must be valid UTF-8, so invalid bytes are replaced with
+ * U+FFFD, as lookup() and lookup_json do. */
+static int dict_build(pyipmeta_arrow_dicts_t *dicts,
+                      const pyipmeta_index_t *idx, int field)
+{
+  uint32_t *hash, hmask, h, code, r;
+  size_t hsize = 16, len = 0, alloc = 4096, slen;
+  pyipmeta_buf_t val = {NULL, 0, 0};
+  const char *str;
+  int32_t *offs;
+  char *data, *tmp;
+  int rc = -1;
+
+  while (hsize < (size_t)idx->recs_cnt * 2) {
+    hsize <<= 1;
+  }
+  hmask = hsize - 1;
+  if ((hash = malloc(hsize * sizeof(uint32_t))) == NULL) {
+    return -1;
+  }
+  memset(hash, 0xff, hsize * sizeof(uint32_t));
+  dicts->codes[field] = malloc(((size_t)idx->recs_cnt + 1) * sizeof(int32_t));
+  offs = dicts->offs[field] =
+    malloc(((size_t)idx->recs_cnt + 1) * sizeof(int32_t));
+  data = dicts->data[field] = malloc(alloc);
+  /* val.data must not be NULL even for empty strings */
+  if (dicts->codes[field] == NULL || offs == NULL || data == NULL ||
+      _pyipmeta_buf_reserve(&val, 1) != 0) {
+    goto done;
+  }
+
+  offs[0] = 0;
+  for (r = 0; r < idx->recs_cnt; r++) {
+    str = rec_str(idx->recs[r], field);
+    val.len = 0;
+    if (_pyipmeta_buf_utf8(&val, str, strlen(str)) != 0) {
+      goto done;
+    }
+    str = val.data;
+    slen = val.len;
+    h = _pyipmeta_hash_str(str, slen) & hmask;
+    while ((code = hash[h]) != UINT32_MAX) {
+      if ((size_t)(offs[code + 1] - offs[code]) == slen &&
+          memcmp(data + offs[code], str, slen) == 0) {
+        break;
+      }
+      h = (h + 1) & hmask;
+    }
+    if (code == UINT32_MAX) {
+      if (len + slen > INT32_MAX) {
+        goto done;
+      }
+      if (len + slen > alloc) {
+        while (len + slen > alloc) {
+          alloc *= 2;
+        }
+        if ((tmp = realloc(data, alloc)) == NULL) {
+          goto done;
+        }
+        data = dicts->data[field] = tmp;
+      }
+      memcpy(data + len, str, slen);
+      len += slen;
+      code = hash[h] = dicts->cnt[field]++;
+      offs[code + 1] = (int32_t)len;
+    }
+    dicts->codes[field][r] = (int32_t)code;
+  }
+  dicts->bytes += ((size_t)idx->recs_cnt * 2 + 2) * sizeof(int32_t) + alloc;
+  rc = 0;
+
+ done:
+  _pyipmeta_buf_free(&val);
+  free(hash);
+  return rc;
+}
+
+pyipmeta_arrow_dicts_t *_pyipmeta_arrow_dicts_build(const pyipmeta_index_t *idx)
+{
+  pyipmeta_arrow_dicts_t *dicts;
+  int i;
+
+  if ((dicts = calloc(1, sizeof(*dicts))) == NULL) {
+    return NULL;
+  }
+  dicts->refcnt = 1;
+  dicts->recs_cnt = idx->recs_cnt;
+  for (i = 0; i < PYIPMETA_ARROW_DICT_CNT; i++) {
+    if (dict_build(dicts, idx, i) != 0) {
+      _pyipmeta_arrow_dicts_decref(dicts);
+      return NULL;
+    }
+  }
+  return dicts;
+}
+
+void _pyipmeta_arrow_dicts_decref(pyipmeta_arrow_dicts_t *dicts)
+{
+  int i;
+
+  if (dicts == NULL ||
+      __atomic_sub_fetch(&dicts->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  for (i = 0; i < PYIPMETA_ARROW_DICT_CNT; i++) {
+    free(dicts->codes[i]);
+    free(dicts->offs[i]);
+    free(dicts->data[i]);
+  }
+  free(dicts);
+}
+
+/* ========== ADDRESS COLUMNS ========== */
+
+/* Get the addresses of an object that exports an Arrow array */
+static int addrs_get_arrow(PyObject *obj, pyipmeta_arrow_addrs_t *addrs)
+{
+  struct ArrowSchema *schema;
+  struct ArrowArray *arr;
+  size_t width;
+
+  if ((addrs->capsules =
+       PyObject_CallMethod(obj, "__arrow_c_array__", NULL)) == NULL) {
+    return -1;
+  }
+  if (!PyTuple_Check(addrs->capsules) ||
+      PyTuple_GET_SIZE(addrs->capsules) != 2) {
+    PyErr_SetString(PyExc_TypeError,
+                    "__arrow_c_array__ did not return a (schema, array) "
+                    "tuple");
+    goto err;
+  }
+  if ((schema = PyCapsule_GetPointer(PyTuple_GET_ITEM(addrs->capsules, 0),
+                                     "arrow_schema")) == NULL ||
+      (arr = PyCapsule_GetPointer(PyTuple_GET_ITEM(addrs->capsules, 1),
+                                  "arrow_array")) == NULL) {
+    goto err;
+  }
+
+  if (strcmp(schema->format, "I") == 0) {
+    addrs->family = AF_INET;
+    width = 4;
+  } else if (strcmp(schema->format, "w:16") == 0) {
+    addrs->family = AF_INET6;
+    width = 16;
+  } else {
+    PyErr_Format(PyExc_TypeError,
+                 "Expected an Arrow array of uint32 (IPv4) or "
+                 "fixed_size_binary(16) (IPv6) addresses, not format '%s'",
+                 schema->format);
+    goto err;
+  }
+  if (arr->null_count != 0 && arr->buffers[0] != NULL) {
+    PyErr_SetString(PyExc_ValueError,
+                    "The address column must not contain nulls");
+    goto err;
+  }
+  addrs->cnt = arr->length;
+  addrs->buf = (arr->length == 0)
+    ? "" : (const char *)arr->buffers[1] + arr->offset * width;
+  return 0;
+
+ err:
+  Py_CLEAR(addrs->capsules);
+  return -1;
+}
+
+int _pyipmeta_arrow_addrs_get(PyObject *obj, pyipmeta_arrow_addrs_t *addrs)
+{
+  Py_buffer *view = &addrs->view;
+  const char *fmt;
+
+  memset(addrs, 0, sizeof(*addrs));
+  if (PyObject_HasAttrString(obj, "__arrow_c_array__")) {
+    return addrs_get_arrow(obj, addrs);
+  }
+
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return -1;
+  }
+  fmt = (view->format != NULL) ? view->format : "B";
+  if (view->itemsize == 4 && strchr("ILN", fmt[strlen(fmt) - 1]) != NULL) {
+    addrs->family = AF_INET;
+    addrs->cnt = view->len / 4;
+  } else if ((view->itemsize == 1 || view->itemsize == 16) &&
+             view->len % 16 == 0) {
+    addrs->family = AF_INET6;
+    addrs->cnt = view->len / 16;
+  } else {
+    PyErr_SetString(PyExc_TypeError,
+                    "Expected a buffer of 32-bit unsigned integers (IPv4) or "
+                    "of packed 16-byte addresses (IPv6)");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  addrs->buf = view->buf;
+  return 0;
+}
+
+void _pyipmeta_arrow_addrs_release(pyipmeta_arrow_addrs_t *addrs)
+{
+  Py_CLEAR(addrs->capsules);
+  if (addrs->view.obj != NULL) {
+    PyBuffer_Release(&addrs->view);
+  }
+}
+
+/* ========== BATCHES ========== */
+
+static void batch_incref(pyipmeta_arrow_batch_t *batch)
+{
+  __atomic_add_fetch(&batch->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void _pyipmeta_arrow_batch_decref(pyipmeta_arrow_batch_t *batch)
+{
+  int i;
+
+  if (batch == NULL ||
+      __atomic_sub_fetch(&batch->refcnt, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  for (i = 0; i < COL_CNT; i++) {
+    free(batch->cols[i]);
+  }
+  for (i = 0; i < LIST_CNT; i++) {
+    free(batch->items[i]);
+  }
+  _pyipmeta_arrow_dicts_decref(batch->dicts);
+  free(batch);
+}
+
+int _pyipmeta_arrow_batch_build(const pyipmeta_index_t *idx,
+                                pyipmeta_arrow_dicts_t *dicts,
+                                const uint32_t *res, size_t cnt,
+                                size_t tbls_cnt,
+                                pyipmeta_arrow_batch_t **batchp)
+{
+  pyipmeta_arrow_batch_t *batch;
+  const ipmeta_record_t *rec;
+  int64_t rows = 0, items[LIST_CNT] = { 0, 0 };
+  size_t a, t;
+  uint32_t r;
+  int64_t row;
+  int c, i;
+
+  if (cnt > UINT32_MAX) {
+    return -2;
+  }
+  for (a = 0; a < cnt * tbls_cnt; a++) {
+    if ((r = res[a]) != PYIPMETA_INDEX_NONE) {
+      rows++;
+      items[0] += idx->recs[r]->asn_cnt;
+      items[1] += idx->recs[r]->polygon_ids_cnt;
+    }
+  }
+  if (items[0] > INT32_MAX || items[1] > INT32_MAX) {
+    return -2;
+  }
+
+  if ((batch = calloc(1, sizeof(*batch))) == NULL) {
+    return -1;
+  }
+  batch->refcnt = 1;
+  batch->rows = rows;
+  __atomic_add_fetch(&dicts->refcnt, 1, __ATOMIC_RELAXED);
+  batch->dicts = dicts;
+  for (c = 0; c < COL_CNT; c++) {
+    if ((batch->cols[c] = malloc(columns[c].size * (rows + 1))) == NULL) {
+      goto err;
+    }
+  }
+  for (i = 0; i < LIST_CNT; i++) {
+    batch->items_cnt[i] = items[i];
+    if ((batch->items[i] = malloc((items[i] + 1) * sizeof(uint32_t))) ==
+        NULL) {
+      goto err;
+    }
+    items[i] = 0;
+  }
+
+#define COL(c, type) ((type *)batch->cols[c])
+  row = 0;
+  for (a = 0; a < cnt; a++) {
+    for (t = 0; t < tbls_cnt; t++) {
+      if ((r = res[a * tbls_cnt + t]) == PYIPMETA_INDEX_NONE) {
+        continue;
+      }
+      rec = idx->recs[r];
+      COL(COL_INDEX, uint32_t)[row] = (uint32_t)a;
+      COL(COL_SOURCE, uint8_t)[row] = (uint8_t)rec->source;
+      COL(COL_ID, uint32_t)[row] = rec->id;
+      for (i = 0; i < PYIPMETA_ARROW_DICT_CNT; i++) {
+        COL(COL_DICT + i, int32_t)[row] = dicts->codes[i][r];
+      }
+      COL(COL_LATITUDE, double)[row] = rec->latitude;
+      COL(COL_LONGITUDE, double)[row] = rec->longitude;
+      COL(COL_ASNS, int32_t)[row] = (int32_t)items[0];
+      memcpy(batch->items[0] + items[0], rec->asn,
+             rec->asn_cnt * sizeof(uint32_t));
+      items[0] += rec->asn_cnt;
+      COL(COL_POLYGON_IDS, int32_t)[row] = (int32_t)items[1];
+      memcpy(batch->items[1] + items[1], rec->polygon_ids,
+             rec->polygon_ids_cnt * sizeof(uint32_t));
+      items[1] += rec->polygon_ids_cnt;
+      /* each row is the match for a single address */
+      COL(COL_MATCHED_IP_COUNT, uint64_t)[row] = 1;
+      row++;
+    }
+  }
+  COL(COL_ASNS, int32_t)[rows] = (int32_t)items[0];
+  COL(COL_POLYGON_IDS, int32_t)[rows] = (int32_t)items[1];
+#undef COL
+
+  *batchp = batch;
+  return 0;
+
+ err:
+  _pyipmeta_arrow_batch_decref(batch);
+  return -1;
+}
+
+/* ========== ARROW C DATA INTERFACE EXPORT ========== */
+
+/* Allocate an array of n pointers to n zeroed structs of the given size,
+   all in one block */
+static void *children_alloc(int64_t n, size_t size)
+{
+  char **ptrs;
+  char *structs;
+  int64_t i;
+
+  if ((ptrs = calloc(n, sizeof(char *) + size)) == NULL) {
+    return NULL;
+  }
+  structs = (char *)(ptrs + n);
+  for (i = 0; i < n; i++) {
+    ptrs[i] = structs + i * size;
+  }
+  return ptrs;
+}
+
+static void schema_release(struct ArrowSchema *schema)
+{
+  int64_t i;
+
+  for (i = 0; i < schema->n_children; i++) {
+    if (schema->children[i]->release != NULL) {
+      schema->children[i]->release(schema->children[i]);
+    }
+  }
+  free(schema->children);
+  if (schema->dictionary != NULL) {
+    if (schema->dictionary->release != NULL) {
+      schema->dictionary->release(schema->dictionary);
+    }
+    free(schema->dictionary);
+  }
+  schema->release = NULL;
+}
+
+static int schema_init(struct ArrowSchema *schema, const char *format,
+                       const char *name, int64_t n_children)
+{
+  memset(schema, 0, sizeof(*schema));
+  if (n_children > 0 &&
+      (schema->children =
+       children_alloc(n_children, sizeof(struct ArrowSchema))) == NULL) {
+    return -1;
+  }
+  schema->format = format;
+  schema->name = name;
+  schema->n_children = n_children;
+  schema->release = schema_release;
+  return 0;
+}
+
+/* Export the (fixed) schema of the batches */
+static int export_schema(struct ArrowSchema *out)
+{
+  struct ArrowSchema *child;
+  int c;
+
+  if (schema_init(out, "+s", "", COL_CNT) != 0) {
+    return -1;
+  }
+  for (c = 0; c < COL_CNT; c++) {
+    child = out->children[c];
+    if (schema_init(child, columns[c].format, columns[c].name,
+                    IS_LIST(c) ? 1 : 0) != 0) {
+      goto err;
+    }
+    if (IS_LIST(c) && schema_init(child->children[0], "I", "item", 0) != 0) {
+      goto err;
+    }
+    if (IS_DICT(c) &&
+        ((child->dictionary = malloc(sizeof(struct ArrowSchema))) == NULL ||
+         schema_init(child->dictionary, "u", "", 0) != 0)) {
+      free(child->dictionary);
+      child->dictionary = NULL;
+      goto err;
+    }
+  }
+  return 0;
+
+ err:
+  out->release(out);
+  return -1;
+}
+
+typedef struct array_priv {
+  pyipmeta_arrow_batch_t *batch;
+  const void *buffers[3];
+} array_priv_t;
+
+static void array_release(struct ArrowArray *arr)
+{
+  int64_t i;
+
+  for (i = 0; i < arr->n_children; i++) {
+    if (arr->children[i]->release != NULL) {
+      arr->children[i]->release(arr->children[i]);
+    }
+  }
+  free(arr->children);
+  if (arr->dictionary != NULL) {
+    if (arr->dictionary->release != NULL) {
+      arr->dictionary->release(arr->dictionary);
+    }
+    free(arr->dictionary);
+  }
+  _pyipmeta_arrow_batch_decref(((array_priv_t *)arr->private_data)->batch);
+  free(arr->private_data);
+  arr->release = NULL;
+}
+
+/* Set up an array without nulls over buffers of a batch (which it keeps a
+   reference to) */
+static int array_init(struct ArrowArray *arr, pyipmeta_arrow_batch_t *batch,
+                      int64_t length, int64_t n_buffers, const void *buf1,
+                      const void *buf2, int64_t n_children)
+{
+  array_priv_t *priv;
+
+  memset(arr, 0, sizeof(*arr));
+  if ((priv = calloc(1, sizeof(*priv))) == NULL) {
+    return -1;
+  }
+  if (n_children > 0 &&
+      (arr->children =
+       children_alloc(n_children, sizeof(struct ArrowArray))) == NULL) {
+    free(priv);
+    return -1;
+  }
+  batch_incref(batch);
+  priv->batch = batch;
+  priv->buffers[1] = buf1;
+  priv->buffers[2] = buf2;
+  arr->length = length;
+  arr->n_buffers = n_buffers;
+  arr->buffers = priv->buffers;
+  arr->n_children = n_children;
+  arr->private_data = priv;
+  arr->release = array_release;
+  return 0;
+}
+
+/* Export the columns of a batch as a struct array. The buffers are shared,
+   not copied. */
+static int export_array(pyipmeta_arrow_batch_t *batch, struct ArrowArray *out)
+{
+  pyipmeta_arrow_dicts_t *dicts = batch->dicts;
+  struct ArrowArray *child;
+  int c, i;
+
+  if (array_init(out, batch, batch->rows, 1, NULL, NULL, COL_CNT) != 0) {
+    return -1;
+  }
+  for (c = 0; c < COL_CNT; c++) {
+    child = out->children[c];
+    if (array_init(child, batch, batch->rows, 2, batch->cols[c], NULL,
+                   IS_LIST(c) ? 1 : 0) != 0) {
+      goto err;
+    }
+    if (IS_LIST(c)) {
+      i = c - COL_LIST;
+      if (array_init(child->children[0], batch, batch->items_cnt[i], 2,
+                     batch->items[i], NULL, 0) != 0) {
+        goto err;
+      }
+    }
+    if (IS_DICT(c)) {
+      i = c - COL_DICT;
+      if ((child->dictionary = malloc(sizeof(struct ArrowArray))) == NULL ||
+          array_init(child->dictionary, batch, dicts->cnt[i], 3,
+                     dicts->offs[i], dicts->data[i], 0) != 0) {
+        free(child->dictionary);
+        child->dictionary = NULL;
+        goto err;
+      }
+    }
+  }
+  return 0;
+
+ err:
+  out->release(out);
+  return -1;
+}
+
+typedef struct stream_priv {
+  pyipmeta_arrow_batch_t *batch;
+  int done;
+} stream_priv_t;
+
+static int stream_get_schema(struct ArrowArrayStream *stream,
+                             struct ArrowSchema *out)
+{
+  return export_schema(out) == 0 ? 0 : ENOMEM;
+}
+
+/* A stream has the batch as its only array */
+static int stream_get_next(struct ArrowArrayStream *stream,
+                           struct ArrowArray *out)
+{
+  stream_priv_t *priv = stream->private_data;
+
+  if (priv->done) {
+    memset(out, 0, sizeof(*out));
+    return 0;
+  }
+  if (export_array(priv->batch, out) != 0) {
+    return ENOMEM;
+  }
+  priv->done = 1;
+  return 0;
+}
+
+static const char *stream_get_last_error(struct ArrowArrayStream *stream)
+{
+  return "Out of memory";
+}
+
+static void stream_release(struct ArrowArrayStream *stream)
+{
+  stream_priv_t *priv = stream->private_data;
+
+  _pyipmeta_arrow_batch_decref(priv->batch);
+  free(priv);
+  stream->release = NULL;
+}
+
+/* ========== PYCAPSULES ========== */
+
+static void schema_capsule_free(PyObject *capsule)
+{
+  struct ArrowSchema *schema = PyCapsule_GetPointer(capsule, "arrow_schema");
+
+  if (schema->release != NULL) {
+    schema->release(schema);
+  }
+  free(schema);
+}
+
+static void array_capsule_free(PyObject *capsule)
+{
+  struct ArrowArray *arr = PyCapsule_GetPointer(capsule, "arrow_array");
+
+  if (arr->release != NULL) {
+    arr->release(arr);
+  }
+  free(arr);
+}
+
+static void stream_capsule_free(PyObject *capsule)
+{
+  struct ArrowArrayStream *stream =
+    PyCapsule_GetPointer(capsule, "arrow_array_stream");
+
+  if (stream->release != NULL) {
+    stream->release(stream);
+  }
+  free(stream);
+}
+
+static PyObject *schema_capsule(void)
+{
+  struct ArrowSchema *schema;
+  PyObject *capsule;
+
+  if ((schema = malloc(sizeof(*schema))) == NULL) {
+    return PyErr_NoMemory();
+  }
+  if (export_schema(schema) != 0) {
+    free(schema);
+    return PyErr_NoMemory();
+  }
+  if ((capsule = PyCapsule_New(schema, "arrow_schema",
+                               schema_capsule_free)) == NULL) {
+    schema->release(schema);
+    free(schema);
+  }
+  return capsule;
+}
+
+static PyObject *array_capsule(pyipmeta_arrow_batch_t *batch)
+{
+  struct ArrowArray *arr;
+  PyObject *capsule;
+
+  if ((arr = malloc(sizeof(*arr))) == NULL) {
+    return PyErr_NoMemory();
+  }
+  if (export_array(batch, arr) != 0) {
+    free(arr);
+    return PyErr_NoMemory();
+  }
+  if ((capsule = PyCapsule_New(arr, "arrow_array",
+                               array_capsule_free)) == NULL) {
+    arr->release(arr);
+    free(arr);
+  }
+  return capsule;
+}
+
+static PyObject *stream_capsule(pyipmeta_arrow_batch_t *batch)
+{
+  struct ArrowArrayStream *stream;
+  stream_priv_t *priv;
+  PyObject *capsule;
+
+  if ((stream = calloc(1, sizeof(*stream))) == NULL ||
+      (priv = calloc(1, sizeof(*priv))) == NULL) {
+    free(stream);
+    return PyErr_NoMemory();
+  }
+  batch_incref(batch);
+  priv->batch = batch;
+  stream->get_schema = stream_get_schema;
+  stream->get_next = stream_get_next;
+  stream->get_last_error = stream_get_last_error;
+  stream->release = stream_release;
+  stream->private_data = priv;
+  if ((capsule = PyCapsule_New(stream, "arrow_array_stream",
+                               stream_capsule_free)) == NULL) {
+    stream->release(stream);
+    free(stream);
+  }
+  return capsule;
+}
+
+/* ========== PYTHON INTERFACE ========== */
+
+typedef struct {
+  PyObject_HEAD
+
+  pyipmeta_arrow_batch_t *batch;
+} ArrowBatchObject;
+
+static void
+ArrowBatch_dealloc(ArrowBatchObject *self)
+{
+  _pyipmeta_arrow_batch_decref(self->batch);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
+}
+
+PyObject *_pyipmeta_arrow_batch_wrap(PyTypeObject *type,
+                                     pyipmeta_arrow_batch_t *batch)
+{
+  ArrowBatchObject *self;
+
+  if ((self = (ArrowBatchObject *)type->tp_alloc(type, 0)) == NULL) {
+    _pyipmeta_arrow_batch_decref(batch);
+    return NULL;
+  }
+  self->batch = batch;
+  return (PyObject *)self;
+}
+
+static Py_ssize_t
+ArrowBatch_len(ArrowBatchObject *self)
+{
+  return (Py_ssize_t)self->batch->rows;
+}
+
+static PyObject *
+ArrowBatch_get_num_rows(ArrowBatchObject *self, void *closure)
+{
+  return PyLong_FromLongLong(self->batch->rows);
+}
+
+/* Export the schema as an "arrow_schema" PyCapsule */
+static PyObject *
+ArrowBatch_arrow_c_schema(ArrowBatchObject *self, PyObject *Py_UNUSED(args))
+{
+  return schema_capsule();
+}
+
+/* Export the columns as a struct array ("arrow_schema" and "arrow_array"
+ * PyCapsules). The schema cannot be changed, so a requested schema is
+ * ignored and left for the consumer to check. */
+static PyObject *
+ArrowBatch_arrow_c_array(ArrowBatchObject *self, PyObject *args,
+                         PyObject *kwds)
+{
+  PyObject *requested_schema = Py_None;
+  static char *kwlist[] = { "requested_schema", NULL };
+  PyObject *schema, *arr;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist,
+                                   &requested_schema)) {
+    return NULL;
+  }
+  if ((schema = schema_capsule()) == NULL) {
+    return NULL;
+  }
+  if ((arr = array_capsule(self->batch)) == NULL) {
+    Py_DECREF(schema);
+    return NULL;
+  }
+  return Py_BuildValue("(NN)", schema, arr);
+}
+
+/* Export the columns as a stream of one struct array (an
+ * "arrow_array_stream" PyCapsule) */
+static PyObject *
+ArrowBatch_arrow_c_stream(ArrowBatchObject *self, PyObject *args,
+                          PyObject *kwds)
+{
+  PyObject *requested_schema = Py_None;
+  static char *kwlist[] = { "requested_schema", NULL };
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist,
+                                   &requested_schema)) {
+    return NULL;
+  }
+  return stream_capsule(self->batch);
+}
+
+static PyGetSetDef ArrowBatch_getsetters[] = {
+
+  {
+    "num_rows",
+    (getter)ArrowBatch_get_num_rows, NULL,
+    "Number of rows",
+    NULL
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyMethodDef ArrowBatch_methods[] = {
+
+  {
+    "__arrow_c_schema__",
+    (PyCFunction)ArrowBatch_arrow_c_schema,
+    METH_NOARGS,
+    "Export the schema as an Arrow PyCapsule"
+  },
+
+  {
+    "__arrow_c_array__",
+    (PyCFunction)ArrowBatch_arrow_c_array,
+    METH_VARARGS | METH_KEYWORDS,
+    "Export the columns as an Arrow struct array, returning a (schema, "
+    "array) tuple of PyCapsules"
+  },
+
+  {
+    "__arrow_c_stream__",
+    (PyCFunction)ArrowBatch_arrow_c_stream,
+    METH_VARARGS | METH_KEYWORDS,
+    "Export the columns as an Arrow stream of one struct array"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot ArrowBatch_slots[] = {
+  {Py_tp_dealloc, ArrowBatch_dealloc},
+  {Py_tp_doc, ArrowBatchDocstring},
+  {Py_tp_methods, ArrowBatch_methods},
+  {Py_tp_getset, ArrowBatch_getsetters},
+  {Py_mp_length, ArrowBatch_len},
+  {0, NULL},
+};
+
+static PyType_Spec ArrowBatch_spec = {
+  ArrowBatchTypeName,
+  sizeof(ArrowBatchObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_IMMUTABLETYPE |
+    Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  ArrowBatch_slots,
+};
+
+PyType_Spec *_pyipmeta_arrow_get_ArrowBatchSpec()
+{
+  return &ArrowBatch_spec;
+}
@@ -0,0 +1,192 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_arrow_H
+#define ___pyipmeta_arrow_H
+
+#include "_pyipmeta_index.h"
+#include <Python.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Arrow C data and stream interfaces, as given in the Arrow specification
+ * (https://arrow.apache.org/docs/format/CDataInterface.html), so that no
+ * Arrow library is needed to build */
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char *format;
+  const char *name;
+  const char *metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema **children;
+  struct ArrowSchema *dictionary;
+  void (*release)(struct ArrowSchema *);
+  void *private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void **buffers;
+  struct ArrowArray **children;
+  struct ArrowArray *dictionary;
+  void (*release)(struct ArrowArray *);
+  void *private_data;
+};
+
+#endif /* ARROW_C_DATA_INTERFACE */
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+  int (*get_schema)(struct ArrowArrayStream *, struct ArrowSchema *out);
+  int (*get_next)(struct ArrowArrayStream *, struct ArrowArray *out);
+  const char *(*get_last_error)(struct ArrowArrayStream *);
+  void (*release)(struct ArrowArrayStream *);
+  void *private_data;
+};
+
+#endif /* ARROW_C_STREAM_INTERFACE */
+
+/** Number of dictionary-encoded string fields (country_code,
+ * continent_code, region and city) */
+#define PYIPMETA_ARROW_DICT_CNT 4
+
+/** Dictionaries of the string fields of the records of a range index
+ *
+ * Each dictionary holds the distinct values of one field as an Arrow utf8
+ * array (value i is data[offs[i]] to data[offs[i + 1] - 1]), and codes give
+ * the position of each record's value in it, so that a batch only has to
+ * copy one code per row. Batches keep a reference to the dictionaries, which
+ * may outlive the index.
+ */
+typedef struct pyipmeta_arrow_dicts {
+  /* number of users; freed when this drops to zero (updated atomically) */
+  int refcnt;
+
+  /* number of range index records when the dictionaries were built */
+  uint32_t recs_cnt;
+
+  int32_t *codes[PYIPMETA_ARROW_DICT_CNT];
+  int32_t *offs[PYIPMETA_ARROW_DICT_CNT];
+  char *data[PYIPMETA_ARROW_DICT_CNT];
+  uint32_t cnt[PYIPMETA_ARROW_DICT_CNT];
+
+  /* memory used by the dictionaries */
+  size_t bytes;
+} pyipmeta_arrow_dicts_t;
+
+/** Columns of a batch of lookup results (opaque) */
+typedef struct pyipmeta_arrow_batch pyipmeta_arrow_batch_t;
+
+/** Address column borrowed from an Arrow array or a buffer */
+typedef struct pyipmeta_arrow_addrs {
+  /* AF_INET (host byte order uint32s) or AF_INET6 (packed 16-byte
+     addresses in network byte order) */
+  int family;
+  const void *buf;
+  size_t cnt;
+
+  /* what keeps buf alive */
+  PyObject *capsules;
+  Py_buffer view;
+} pyipmeta_arrow_addrs_t;
+
+/** Build the dictionaries of the string fields of all index records
+ *
+ * @return the dictionaries with a reference count of one, or NULL if out of
+ * memory
+ */
+pyipmeta_arrow_dicts_t *_pyipmeta_arrow_dicts_build(const pyipmeta_index_t *idx);
+
+/** Drop a reference to the dictionaries, freeing them when unused */
+void _pyipmeta_arrow_dicts_decref(pyipmeta_arrow_dicts_t *dicts);
+
+/** Get the addresses of an address column
+ *
+ * The column is either an object that exports an Arrow array of uint32
+ * (IPv4) or fixed_size_binary(16) (IPv6) through the Arrow PyCapsule
+ * interface, or a buffer of 32-bit unsigned integers (IPv4) or packed
+ * 16-byte addresses (IPv6).
+ *
+ * @return 0 if successful, -1 with a Python exception set otherwise
+ */
+int _pyipmeta_arrow_addrs_get(PyObject *obj, pyipmeta_arrow_addrs_t *addrs);
+
+/** Release an address column */
+void _pyipmeta_arrow_addrs_release(pyipmeta_arrow_addrs_t *addrs);
+
+/** Build a batch from the results of a batch lookup
+ *
+ * Does not need the GIL.
+ *
+ * @param idx           range index that was searched
+ * @param dicts         dictionaries of idx (the batch takes a reference)
+ * @param res           record index for each address and table, as written
+ *                      by _pyipmeta_index_search4/6 with a stride of
+ *                      tbls_cnt
+ * @param cnt           number of addresses
+ * @param tbls_cnt      number of tables searched
+ * @param batch         set to the batch, with one row per address and
+ *                      table that matched a record
+ * @return 0 if successful, -1 if out of memory, -2 if the batch is too
+ * large for 32-bit Arrow offsets
+ */
+int _pyipmeta_arrow_batch_build(const pyipmeta_index_t *idx,
+                                pyipmeta_arrow_dicts_t *dicts,
+                                const uint32_t *res, size_t cnt,
+                                size_t tbls_cnt,
+                                pyipmeta_arrow_batch_t **batch);
+
+/** Drop a reference to a batch, freeing it when unused */
+void _pyipmeta_arrow_batch_decref(pyipmeta_arrow_batch_t *batch);
+
+/** Wrap a batch in a new ArrowBatch object (stealing the reference) */
+PyObject *_pyipmeta_arrow_batch_wrap(PyTypeObject *type,
+                                     pyipmeta_arrow_batch_t *batch);
+
+/** Expose the ArrowBatch type spec */
+PyType_Spec *_pyipmeta_arrow_get_ArrowBatchSpec(void);
+
+#endif /* ___pyipmeta_arrow_H */
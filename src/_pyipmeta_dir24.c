@@ -0,0 +1,173 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_dir24.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Number of /24s */
+#define TBL24_CNT (1U << 24)
+
+/* Number of addresses looked up ahead of the one being resolved, so that
+ * the tbl24 loads of a batch overlap */
+#define PREFETCH_DIST 8
+
+/* Local record numbers in the order the ranges use them, with the last
+ * entry for "no record" */
+static int map_recs(pyipmeta_dir24_t *dir, const pyipmeta_ranges4_t *tbl,
+                    uint32_t *local)
+{
+  uint32_t max = 0, i, *map;
+
+  for (i = 0; i < tbl->cnt; i++) {
+    if (tbl->vals[i] != PYIPMETA_INDEX_NONE && tbl->vals[i] >= max) {
+      max = tbl->vals[i] + 1;
+    }
+  }
+  if ((map = malloc(sizeof(uint32_t) * (max + 1))) == NULL ||
+      (dir->recs = malloc(sizeof(uint32_t) * (tbl->cnt + 1))) == NULL) {
+    free(map);
+    return -1;
+  }
+  memset(map, 0xff, sizeof(uint32_t) * (max + 1));
+  for (i = 0; i < tbl->cnt; i++) {
+    if (tbl->vals[i] == PYIPMETA_INDEX_NONE) {
+      continue;
+    }
+    if (map[tbl->vals[i]] == PYIPMETA_INDEX_NONE) {
+      map[tbl->vals[i]] = dir->recs_cnt;
+      dir->recs[dir->recs_cnt++] = tbl->vals[i];
+    }
+  }
+  for (i = 0; i < tbl->cnt; i++) {
+    local[i] = (tbl->vals[i] == PYIPMETA_INDEX_NONE) ? dir->recs_cnt
+                                                      : map[tbl->vals[i]];
+  }
+  dir->recs[dir->recs_cnt] = PYIPMETA_INDEX_NONE;
+  free(map);
+  return 0;
+}
+
+/* Store an entry of the table's width */
+static inline void put(const pyipmeta_dir24_t *dir, void *arr, size_t i,
+                       uint32_t val)
+{
+  if (dir->entry_size == 2) {
+    ((uint16_t *)arr)[i] = (uint16_t)val;
+  } else {
+    ((uint32_t *)arr)[i] = val;
+  }
+}
+
+pyipmeta_dir24_t *_pyipmeta_dir24_build(const pyipmeta_ranges4_t *tbl)
+{
+  pyipmeta_dir24_t *dir;
+  uint32_t *local = NULL, blk, i, j, a, blocks = 0, flag;
+
+  if ((dir = calloc(1, sizeof(*dir))) == NULL ||
+      (local = malloc(sizeof(uint32_t) * (tbl->cnt + 1))) == NULL ||
+      map_recs(dir, tbl, local) != 0) {
+    goto err;
+  }
+
+  /* a /24 needs a tbl8 block if a range starts inside it */
+  for (i = 1, blk = UINT32_MAX; i < tbl->cnt; i++) {
+    if ((tbl->starts[i] & 0xff) != 0 && (tbl->starts[i] >> 8) != blk) {
+      blk = tbl->starts[i] >> 8;
+      blocks++;
+    }
+  }
+  dir->tbl8_blocks = blocks;
+  dir->entry_size = (dir->recs_cnt < 0x7fff && blocks <= 0x8000) ? 2 : 4;
+  flag = (dir->entry_size == 2) ? 0x8000 : 0x80000000;
+  dir->bytes = sizeof(*dir) + sizeof(uint32_t) * (dir->recs_cnt + 1) +
+               (size_t)dir->entry_size * (TBL24_CNT + ((size_t)blocks << 8));
+  if ((dir->tbl24 = malloc((size_t)dir->entry_size * TBL24_CNT)) == NULL ||
+      (blocks > 0 &&
+       (dir->tbl8 = malloc((size_t)dir->entry_size * (blocks << 8))) ==
+         NULL)) {
+    goto err;
+  }
+
+  /* i is the range that covers the start of the current /24 */
+  for (blk = 0, i = 0, blocks = 0; blk < TBL24_CNT; blk++) {
+    a = blk << 8;
+    while (i + 1 < tbl->cnt && tbl->starts[i + 1] <= a) {
+      i++;
+    }
+    if (i + 1 == tbl->cnt || tbl->starts[i + 1] > (a | 0xff)) {
+      put(dir, dir->tbl24, blk, local[i]);
+      continue;
+    }
+    put(dir, dir->tbl24, blk, flag | blocks);
+    for (j = 0; j < 256; j++) {
+      while (i + 1 < tbl->cnt && tbl->starts[i + 1] <= (a | j)) {
+        i++;
+      }
+      put(dir, dir->tbl8, ((size_t)blocks << 8) | j, local[i]);
+    }
+    blocks++;
+  }
+  free(local);
+  return dir;
+
+ err:
+  free(local);
+  _pyipmeta_dir24_free(dir);
+  return NULL;
+}
+
+void _pyipmeta_dir24_free(pyipmeta_dir24_t *dir)
+{
+  if (dir == NULL) {
+    return;
+  }
+  free(dir->tbl24);
+  free(dir->tbl8);
+  free(dir->recs);
+  free(dir);
+}
+
+void _pyipmeta_dir24_search(const pyipmeta_dir24_t *dir,
+                            const uint32_t *addrs, size_t cnt,
+                            uint32_t *out, size_t stride)
+{
+  size_t i;
+
+  for (i = 0; i < cnt; i++) {
+    if (i + PREFETCH_DIST < cnt) {
+      __builtin_prefetch((const char *)dir->tbl24 +
+                         (size_t)dir->entry_size *
+                           (addrs[i + PREFETCH_DIST] >> 8));
+    }
+    out[i * stride] = _pyipmeta_dir24_find(dir, addrs[i]);
+  }
+}
@@ -0,0 +1,103 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_dir24_H
+#define ___pyipmeta_dir24_H
+
+#include "_pyipmeta_index.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/** DIR-24-8 direct-index table over the IPv4 ranges of one provider
+ *
+ * tbl24 has an entry for each /24. If the top bit of an entry is clear, the
+ * rest is the (local) record for the whole /24; otherwise it is the number
+ * of a block of 256 entries in tbl8 that hold the record for each address of
+ * the /24. Entries are 16 bits wide when the provider has few enough
+ * records and blocks, 32 bits otherwise. Local record numbers are mapped to
+ * range index records through recs, whose last entry is
+ * PYIPMETA_INDEX_NONE.
+ */
+typedef struct pyipmeta_dir24 {
+  /* 2 or 4 */
+  int entry_size;
+  void *tbl24;
+  void *tbl8;
+  uint32_t tbl8_blocks;
+
+  /* local record -> range index record */
+  uint32_t *recs;
+  uint32_t recs_cnt;
+
+  /* memory used by the table */
+  size_t bytes;
+} pyipmeta_dir24_t;
+
+/** Build a DIR-24-8 table from a range table
+ *
+ * @return the table, or NULL if out of memory
+ */
+pyipmeta_dir24_t *_pyipmeta_dir24_build(const pyipmeta_ranges4_t *tbl);
+
+/** Free a DIR-24-8 table */
+void _pyipmeta_dir24_free(pyipmeta_dir24_t *dir);
+
+/** Find the range index record for an IPv4 address (host byte order) */
+static inline uint32_t _pyipmeta_dir24_find(const pyipmeta_dir24_t *dir,
+                                            uint32_t addr)
+{
+  uint32_t e;
+
+  if (dir->entry_size == 2) {
+    e = ((const uint16_t *)dir->tbl24)[addr >> 8];
+    if (e & 0x8000) {
+      e = ((const uint16_t *)dir->tbl8)[((e & 0x7fff) << 8) | (addr & 0xff)];
+    }
+  } else {
+    e = ((const uint32_t *)dir->tbl24)[addr >> 8];
+    if (e & 0x80000000) {
+      e = ((const uint32_t *)dir->tbl8)[((e & 0x7fffffff) << 8) |
+                                        (addr & 0xff)];
+    }
+  }
+  return dir->recs[e];
+}
+
+/** Find the range index record for each of the given IPv4 addresses
+ *
+ * Same interface as _pyipmeta_index_search4.
+ */
+void _pyipmeta_dir24_search(const pyipmeta_dir24_t *dir,
+                            const uint32_t *addrs, size_t cnt,
+                            uint32_t *out, size_t stride);
+
+#endif /* ___pyipmeta_dir24_H */
@@ -0,0 +1,294 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_fused.h"
+#include <arpa/inet.h>
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Range table of one provider being swept */
+typedef struct sweep {
+  int family;
+  const void *tbl;
+  uint32_t cnt;
+  const uint32_t *vals;
+  /* provider id - 1 */
+  int prov;
+  /* current range */
+  uint32_t pos;
+} sweep_t;
+
+static int key_cmp(pyipmeta_key6_t a, pyipmeta_key6_t b)
+{
+  if (a.hi != b.hi) {
+    return a.hi < b.hi ? -1 : 1;
+  }
+  return (a.lo == b.lo) ? 0 : (a.lo < b.lo ? -1 : 1);
+}
+
+static pyipmeta_key6_t key_inc(pyipmeta_key6_t k)
+{
+  if (++k.lo == 0) {
+    k.hi++;
+  }
+  return k;
+}
+
+static pyipmeta_key6_t key_dec(pyipmeta_key6_t k)
+{
+  if (k.lo-- == 0) {
+    k.hi--;
+  }
+  return k;
+}
+
+static pyipmeta_key6_t sweep_start(const sweep_t *s, uint32_t i)
+{
+  pyipmeta_key6_t k;
+  if (s->family == AF_INET) {
+    k.hi = 0;
+    k.lo = ((const pyipmeta_ranges4_t *)s->tbl)->starts[i];
+  } else {
+    k = ((const pyipmeta_ranges6_t *)s->tbl)->starts[i];
+  }
+  return k;
+}
+
+/* Move to the last range that starts at or before key */
+static void sweep_seek(sweep_t *s, pyipmeta_key6_t key)
+{
+  uint32_t lo = s->pos + 1, hi = s->cnt, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (key_cmp(sweep_start(s, mid), key) <= 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  s->pos = lo - 1;
+}
+
+static uint64_t range_size(int family, int query_len, pyipmeta_key6_t first,
+                           pyipmeta_key6_t last)
+{
+  if (family == AF_INET) {
+    return last.lo - first.lo + 1;
+  }
+  if (query_len > 64) {
+    return (last.lo - first.lo == UINT64_MAX) ? UINT64_MAX
+                                              : last.lo - first.lo + 1;
+  }
+  /* counted in /64s, like libipmeta */
+  return (last.hi - first.hi == UINT64_MAX) ? UINT64_MAX
+                                            : last.hi - first.hi + 1;
+}
+
+static int rows_add(pyipmeta_fused_rows_t *rows, const sweep_t *sweeps,
+                    int sweeps_cnt, pyipmeta_key6_t first,
+                    pyipmeta_key6_t last)
+{
+  pyipmeta_fused_row_t *row, *prev;
+  int i, found = 0;
+
+  if (rows->cnt == rows->alloc) {
+    size_t alloc = rows->alloc ? rows->alloc * 2 : 16;
+    pyipmeta_fused_row_t *r = realloc(rows->rows, alloc * sizeof(*r));
+    if (r == NULL) {
+      return -1;
+    }
+    rows->rows = r;
+    rows->alloc = alloc;
+  }
+  row = &rows->rows[rows->cnt];
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    row->vals[i] = PYIPMETA_INDEX_NONE;
+  }
+  for (i = 0; i < sweeps_cnt; i++) {
+    row->vals[sweeps[i].prov] = sweeps[i].vals[sweeps[i].pos];
+    found |= (row->vals[sweeps[i].prov] != PYIPMETA_INDEX_NONE);
+  }
+  if (!found) {
+    return 0;
+  }
+  prev = rows->cnt > 0 ? row - 1 : NULL;
+  if (prev != NULL && memcmp(prev->vals, row->vals, sizeof(row->vals)) == 0 &&
+      key_cmp(key_inc(prev->last), first) == 0) {
+    prev->last = last;
+    return 0;
+  }
+  row->first = first;
+  row->last = last;
+  rows->cnt++;
+  return 0;
+}
+
+int _pyipmeta_fused_lookup(const pyipmeta_index_t *idx, uint32_t provmask,
+                           int family, pyipmeta_key6_t first,
+                           pyipmeta_key6_t last, int query_len,
+                           pyipmeta_fused_rows_t *rows)
+{
+  sweep_t sweeps[IPMETA_PROVIDER_MAX];
+  pyipmeta_key6_t cur = first, end, next;
+  size_t start_cnt = rows->cnt, r;
+  int i, cnt = 0;
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (idx->v4[i] == NULL ||
+        (provmask != 0 && (provmask & IPMETA_PROV_TO_MASK(i + 1)) == 0)) {
+      continue;
+    }
+    sweeps[cnt].family = family;
+    sweeps[cnt].prov = i;
+    if (family == AF_INET) {
+      sweeps[cnt].tbl = idx->v4[i];
+      sweeps[cnt].cnt = idx->v4[i]->cnt;
+      sweeps[cnt].vals = idx->v4[i]->vals;
+    } else {
+      sweeps[cnt].tbl = idx->v6[i];
+      sweeps[cnt].cnt = idx->v6[i]->cnt;
+      sweeps[cnt].vals = idx->v6[i]->vals;
+    }
+    sweeps[cnt].pos = 0;
+    sweep_seek(&sweeps[cnt], cur);
+    cnt++;
+  }
+  if (cnt == 0) {
+    return 0;
+  }
+
+  /* each step ends where the first of the current ranges ends */
+  for (;;) {
+    end = last;
+    for (i = 0; i < cnt; i++) {
+      if (sweeps[i].pos + 1 < sweeps[i].cnt) {
+        next = sweep_start(&sweeps[i], sweeps[i].pos + 1);
+        if (key_cmp(key_dec(next), end) < 0) {
+          end = key_dec(next);
+        }
+      }
+    }
+    if (rows_add(rows, sweeps, cnt, cur, end) != 0) {
+      return -1;
+    }
+    if (key_cmp(end, last) == 0) {
+      break;
+    }
+    cur = key_inc(end);
+    for (i = 0; i < cnt; i++) {
+      sweep_seek(&sweeps[i], cur);
+    }
+  }
+
+  for (r = start_cnt; r < rows->cnt; r++) {
+    rows->rows[r].num_ips = range_size(family, query_len, rows->rows[r].first,
+                                       rows->rows[r].last);
+  }
+  return 0;
+}
+
+static int str_empty(const char *str)
+{
+  return str == NULL || str[0] == '\0';
+}
+
+/* Does the record have a value for the field? */
+static int has_field(const ipmeta_record_t *rec, pyipmeta_field_t field)
+{
+  switch (field) {
+  case PYIPMETA_FIELD_COUNTRY_CODE:
+    return !str_empty(rec->country_code);
+  case PYIPMETA_FIELD_CONTINENT_CODE:
+    return !str_empty(rec->continent_code);
+  case PYIPMETA_FIELD_REGION:
+    return !str_empty(rec->region);
+  case PYIPMETA_FIELD_CITY:
+    return !str_empty(rec->city);
+  case PYIPMETA_FIELD_POST_CODE:
+    return !str_empty(rec->post_code);
+  case PYIPMETA_FIELD_LAT_LONG:
+    return rec->latitude != 0 || rec->longitude != 0;
+  case PYIPMETA_FIELD_METRO_CODE:
+    return rec->metro_code != 0;
+  case PYIPMETA_FIELD_AREA_CODE:
+    return rec->area_code != 0;
+  case PYIPMETA_FIELD_REGION_CODE:
+    return rec->region_code != 0;
+  case PYIPMETA_FIELD_CONNECTION_SPEED:
+    return !str_empty(rec->conn_speed);
+  case PYIPMETA_FIELD_ASNS:
+  case PYIPMETA_FIELD_ASN_IP_COUNT:
+    /* the count belongs with the ASNs */
+    return rec->asn_cnt != 0;
+  case PYIPMETA_FIELD_POLYGON_IDS:
+    return rec->polygon_ids_cnt != 0;
+  default:
+    return 1;
+  }
+}
+
+void _pyipmeta_fused_pick(const pyipmeta_index_t *idx,
+                          const pyipmeta_fused_row_t *row, const int *order,
+                          int order_cnt, const int *sources,
+                          ipmeta_record_t **out)
+{
+  ipmeta_record_t *rec;
+  uint32_t val;
+  int f, i;
+
+  for (f = 0; f < PYIPMETA_FIELD_CNT; f++) {
+    out[f] = NULL;
+    if (sources != NULL && sources[f] != 0) {
+      val = row->vals[sources[f] - 1];
+      out[f] = (val == PYIPMETA_INDEX_NONE) ? NULL : idx->recs[val];
+      continue;
+    }
+    for (i = 0; i < order_cnt; i++) {
+      if ((val = row->vals[order[i] - 1]) == PYIPMETA_INDEX_NONE) {
+        continue;
+      }
+      rec = idx->recs[val];
+      if (has_field(rec, f)) {
+        out[f] = rec;
+        break;
+      }
+    }
+  }
+}
+
+void _pyipmeta_fused_rows_free(pyipmeta_fused_rows_t *rows)
+{
+  free(rows->rows);
+  rows->rows = NULL;
+  rows->cnt = 0;
+  rows->alloc = 0;
+}
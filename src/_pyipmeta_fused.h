@@ -0,0 +1,111 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_fused_H
+#define ___pyipmeta_fused_H
+
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_json.h"
+#include <libipmeta.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** A range of addresses over which every provider has the same record
+ *
+ * IPv4 addresses are stored in lo (hi is 0). IPv6 addresses are in host byte
+ * order halves, and since the range index resolves IPv6 to /64s, ranges of
+ * IPv6 addresses always start and end on /64 boundaries unless they are
+ * clipped to a longer query prefix.
+ */
+typedef struct pyipmeta_fused_row {
+  pyipmeta_key6_t first;
+  pyipmeta_key6_t last;
+
+  /** Number of addresses (IPv4) or /64s (IPv6 queries of /64 or shorter) */
+  uint64_t num_ips;
+
+  /** Record index for each provider (by provider id - 1), or
+   * PYIPMETA_INDEX_NONE */
+  uint32_t vals[IPMETA_PROVIDER_MAX];
+} pyipmeta_fused_row_t;
+
+/** Growable array of fused rows */
+typedef struct pyipmeta_fused_rows {
+  pyipmeta_fused_row_t *rows;
+  size_t cnt;
+  size_t alloc;
+} pyipmeta_fused_rows_t;
+
+/** Split a query into the ranges where the records of the given providers
+ * do not change, in a single pass over their range tables
+ *
+ * Ranges that have no record from any of the providers are left out, and
+ * adjacent ranges with the same records are merged. The index tables for
+ * the providers must have been built.
+ *
+ * @param idx           range index
+ * @param provmask      providers to combine (0 for all indexed providers)
+ * @param family        AF_INET or AF_INET6
+ * @param first         first address of the query
+ * @param last          last address of the query
+ * @param query_len     prefix length of the query
+ * @param rows          rows are appended here
+ * @return 0 if successful, -1 if out of memory
+ */
+int _pyipmeta_fused_lookup(const pyipmeta_index_t *idx, uint32_t provmask,
+                           int family, pyipmeta_key6_t first,
+                           pyipmeta_key6_t last, int query_len,
+                           pyipmeta_fused_rows_t *rows);
+
+/** Pick the record that each field of a fused row is taken from
+ *
+ * Each field comes from the first provider in order whose record has a
+ * non-empty value for it (e.g., country from netacq-edge, ASNs from pfx2as),
+ * unless sources names the provider to use for the field.
+ *
+ * @param idx           range index the row was built from
+ * @param row           fused row
+ * @param order         provider ids in order of preference
+ * @param order_cnt     number of provider ids in order
+ * @param sources       provider id for each field, or 0 to use order
+ * @param out           record for each field (NULL if none), indexed by
+ *                      pyipmeta_field_t
+ */
+void _pyipmeta_fused_pick(const pyipmeta_index_t *idx,
+                          const pyipmeta_fused_row_t *row, const int *order,
+                          int order_cnt, const int *sources,
+                          ipmeta_record_t **out);
+
+/** Free the memory used by the rows (the array itself is reusable) */
+void _pyipmeta_fused_rows_free(pyipmeta_fused_rows_t *rows);
+
+#endif /* ___pyipmeta_fused_H */
@@ -0,0 +1,101 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_guard.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* shard used by the current thread (assigned round-robin on first use) */
+static __thread int thread_shard = -1;
+static int next_shard = 0;
+
+pyipmeta_guard_t *_pyipmeta_guard_init(void)
+{
+  pyipmeta_guard_t *guard;
+
+  if (posix_memalign((void **)&guard, 64, sizeof(*guard)) != 0) {
+    return NULL;
+  }
+  memset(guard, 0, sizeof(*guard));
+  return guard;
+}
+
+void _pyipmeta_guard_free(pyipmeta_guard_t *guard)
+{
+  free(guard);
+}
+
+/* Readers announce themselves before checking for a writer, and the writer
+ * announces itself before counting readers, so with sequentially consistent
+ * operations at least one of them sees the other and backs off. */
+
+int _pyipmeta_guard_read_begin(pyipmeta_guard_t *guard)
+{
+  int shard = thread_shard;
+
+  if (shard < 0) {
+    shard = thread_shard =
+      __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) %
+      PYIPMETA_GUARD_SHARDS;
+  }
+  __atomic_fetch_add(&guard->shards[shard].readers, 1, __ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&guard->writer, __ATOMIC_SEQ_CST)) {
+    __atomic_fetch_sub(&guard->shards[shard].readers, 1, __ATOMIC_RELEASE);
+    return -1;
+  }
+  return shard;
+}
+
+void _pyipmeta_guard_read_end(pyipmeta_guard_t *guard, int shard)
+{
+  __atomic_fetch_sub(&guard->shards[shard].readers, 1, __ATOMIC_RELEASE);
+}
+
+int _pyipmeta_guard_write_begin(pyipmeta_guard_t *guard)
+{
+  int i;
+
+  if (__atomic_exchange_n(&guard->writer, 1, __ATOMIC_SEQ_CST)) {
+    return -1;
+  }
+  for (i = 0; i < PYIPMETA_GUARD_SHARDS; i++) {
+    if (__atomic_load_n(&guard->shards[i].readers, __ATOMIC_SEQ_CST) != 0) {
+      __atomic_store_n(&guard->writer, 0, __ATOMIC_RELEASE);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void _pyipmeta_guard_write_end(pyipmeta_guard_t *guard)
+{
+  __atomic_store_n(&guard->writer, 0, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,85 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_guard_H
+#define ___pyipmeta_guard_H
+
+/** Number of reader count shards; threads are spread over them so that
+ * readers on different threads rarely touch the same cache line */
+#define PYIPMETA_GUARD_SHARDS 16
+
+/** One shard of reader counts */
+typedef struct pyipmeta_guard_shard {
+  int readers;
+} __attribute__((aligned(64))) pyipmeta_guard_shard_t;
+
+/** Guard that lets any number of threads read an object, or one thread
+ * change it, at a time
+ *
+ * Nobody ever waits on a guard: a thread that cannot enter fails, and the
+ * caller reports that the object is busy. Readers only update their own
+ * shard, so readers on different threads do not contend, with or without the
+ * GIL.
+ */
+typedef struct pyipmeta_guard {
+  pyipmeta_guard_shard_t shards[PYIPMETA_GUARD_SHARDS];
+
+  /** set while a writer is in */
+  int writer;
+} pyipmeta_guard_t;
+
+/** Allocate a guard with no readers or writer */
+pyipmeta_guard_t *_pyipmeta_guard_init(void);
+
+/** Free a guard */
+void _pyipmeta_guard_free(pyipmeta_guard_t *guard);
+
+/** Enter the guard as a reader
+ *
+ * @return the shard to pass to _pyipmeta_guard_read_end, or -1 if a writer
+ * is in
+ */
+int _pyipmeta_guard_read_begin(pyipmeta_guard_t *guard);
+
+/** Leave the guard as a reader */
+void _pyipmeta_guard_read_end(pyipmeta_guard_t *guard, int shard);
+
+/** Enter the guard as the writer
+ *
+ * @return 0 if successful, or -1 if there are readers or another writer
+ */
+int _pyipmeta_guard_write_begin(pyipmeta_guard_t *guard);
+
+/** Leave the guard as the writer */
+void _pyipmeta_guard_write_end(pyipmeta_guard_t *guard);
+
+#endif /* ___pyipmeta_guard_H */
@@ -0,0 +1,1049 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_guard.h"
+#include "_pyipmeta_history.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_ipmeta.h"
+#include "_pyipmeta_module.h"
+#include "_pyipmeta_record.h"
+#include "_pyipmeta_util.h"
+#include "pyutils.h"
+#include <arpa/inet.h>
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Python.h>
+
+#define HistoryDocstring "Dated snapshots of IpMeta data with shared storage"
+
+#define HistoryTypeName "_pyipmeta.History"
+
+/* Range tables are split into blocks of 2^BLOCK_SHIFT keys, and blocks are
+ * grouped into pages of 2^(PAGE_SHIFT - BLOCK_SHIFT) blocks. A snapshot that
+ * changes a few prefixes only needs new copies of the blocks (and pages)
+ * that contain them; everything else is shared with the previous snapshot.
+ *
+ * IPv4 keys are addresses (/16 blocks, /8 pages); IPv6 keys are the upper 64
+ * bits of addresses, which is as far as the range index splits them (/32
+ * blocks, /24 pages). */
+#define V4_BLOCK_SHIFT 16
+#define V4_PAGE_SHIFT 24
+#define V6_BLOCK_SHIFT 32
+#define V6_PAGE_SHIFT 40
+
+/* Ranges starting in one block. Every block starts with a range at the
+ * block start, so lookups never need to look at the previous block. */
+typedef struct hist_block {
+  uint32_t cnt;
+  uint64_t *starts;
+  uint32_t *vals;
+} hist_block_t;
+
+/* Blocks of one page, sorted by block key. Every page starts with a block at
+ * the page start. */
+typedef struct hist_page {
+  uint32_t cnt;
+  uint64_t *keys;
+  hist_block_t **blocks;
+} hist_page_t;
+
+/* Pages of one provider in one snapshot, sorted by page key. The first page
+ * is always at key 0. */
+typedef struct hist_tree {
+  uint32_t cnt;
+  uint64_t *keys;
+  hist_page_t **pages;
+} hist_tree_t;
+
+typedef struct hist_snapshot {
+  int64_t time;
+  /* indexed by provider id - 1; NULL if the provider was not loaded */
+  hist_tree_t *v4[IPMETA_PROVIDER_MAX];
+  hist_tree_t *v6[IPMETA_PROVIDER_MAX];
+} hist_snapshot_t;
+
+/* Array of pointers to everything allocated, so that shared nodes can be
+ * freed exactly once */
+typedef struct ptr_list {
+  void **ptrs;
+  size_t cnt;
+  size_t alloc;
+} ptr_list_t;
+
+/* Scratch space for building a tree */
+typedef struct hist_builder {
+  uint64_t *starts;
+  uint32_t *vals;
+  uint32_t cnt;
+  uint32_t alloc;
+} hist_builder_t;
+
+typedef struct {
+  PyObject_HEAD
+
+  hist_snapshot_t *snaps;
+  size_t snaps_cnt;
+  size_t snaps_alloc;
+
+  /* records copied out of the snapshots, with equal records stored once */
+  ipmeta_record_t **recs;
+  uint32_t recs_cnt;
+  uint32_t recs_alloc;
+  uint32_t *rec_hash;
+  uint32_t rec_hash_size;
+
+  ptr_list_t nodes;
+
+  /* lookups are readers, and add_snapshot() (which runs without the GIL)
+   * is the writer */
+  pyipmeta_guard_t *guard;
+
+  /* sizes of the distinct nodes */
+  uint64_t blocks_cnt;
+  uint64_t pages_cnt;
+  uint64_t trees_cnt;
+  uint64_t ranges_cnt;
+  uint64_t bytes;
+
+} HistoryObject;
+
+/* ========== RECORDS ========== */
+
+static uint64_t hash_field(uint64_t h, const char *str)
+{
+  /* include the terminator so that ("ab", "c") != ("a", "bc") */
+  return _pyipmeta_hash_bytes(h, STR_SAFE(str), strlen(STR_SAFE(str)) + 1);
+}
+
+/* pfx2as record ids are assigned in load order, so they say nothing about
+ * the record and would stop otherwise equal records from being shared */
+static int rec_id_matters(const ipmeta_record_t *rec)
+{
+  return rec->source != IPMETA_PROVIDER_PFX2AS;
+}
+
+static uint64_t rec_hash(const ipmeta_record_t *rec)
+{
+  uint64_t h = PYIPMETA_FNV_OFFSET;
+  uint32_t id = rec_id_matters(rec) ? rec->id : 0;
+
+  h = _pyipmeta_hash_bytes(h, &rec->source, sizeof(rec->source));
+  h = _pyipmeta_hash_bytes(h, &id, sizeof(id));
+  h = hash_field(h, rec->country_code);
+  h = hash_field(h, rec->continent_code);
+  h = hash_field(h, rec->region);
+  h = hash_field(h, rec->city);
+  h = hash_field(h, rec->post_code);
+  h = _pyipmeta_hash_bytes(h, &rec->latitude, sizeof(rec->latitude));
+  h = _pyipmeta_hash_bytes(h, &rec->longitude, sizeof(rec->longitude));
+  h = _pyipmeta_hash_bytes(h, &rec->metro_code, sizeof(rec->metro_code));
+  h = _pyipmeta_hash_bytes(h, &rec->area_code, sizeof(rec->area_code));
+  h = _pyipmeta_hash_bytes(h, &rec->region_code, sizeof(rec->region_code));
+  h = hash_field(h, rec->conn_speed);
+  h = _pyipmeta_hash_bytes(h, rec->asn, rec->asn_cnt * sizeof(*rec->asn));
+  h = _pyipmeta_hash_bytes(h, &rec->asn_ip_cnt, sizeof(rec->asn_ip_cnt));
+  h = _pyipmeta_hash_bytes(h, rec->polygon_ids,
+                           rec->polygon_ids_cnt * sizeof(*rec->polygon_ids));
+  return h ^ (h >> 32);
+}
+
+static int str_eq(const char *a, const char *b)
+{
+  return strcmp(STR_SAFE(a), STR_SAFE(b)) == 0;
+}
+
+static int rec_eq(const ipmeta_record_t *a, const ipmeta_record_t *b)
+{
+  return a->source == b->source &&
+         (!rec_id_matters(a) || a->id == b->id) &&
+         str_eq(a->country_code, b->country_code) &&
+         str_eq(a->continent_code, b->continent_code) &&
+         str_eq(a->region, b->region) && str_eq(a->city, b->city) &&
+         str_eq(a->post_code, b->post_code) &&
+         a->latitude == b->latitude && a->longitude == b->longitude &&
+         a->metro_code == b->metro_code && a->area_code == b->area_code &&
+         a->region_code == b->region_code &&
+         str_eq(a->conn_speed, b->conn_speed) &&
+         a->asn_cnt == b->asn_cnt &&
+         memcmp(a->asn, b->asn, a->asn_cnt * sizeof(*a->asn)) == 0 &&
+         a->asn_ip_cnt == b->asn_ip_cnt &&
+         a->polygon_ids_cnt == b->polygon_ids_cnt &&
+         memcmp(a->polygon_ids, b->polygon_ids,
+                a->polygon_ids_cnt * sizeof(*a->polygon_ids)) == 0;
+}
+
+static void rec_free(ipmeta_record_t *rec)
+{
+  if (rec == NULL) {
+    return;
+  }
+  free(rec->region);
+  free(rec->city);
+  free(rec->post_code);
+  free(rec->conn_speed);
+  free(rec->asn);
+  free(rec->polygon_ids);
+  free(rec);
+}
+
+static char *dup_str(const char *str, int *err)
+{
+  char *copy;
+  if (str == NULL) {
+    return NULL;
+  }
+  if ((copy = strdup(str)) == NULL) {
+    *err = 1;
+  }
+  return copy;
+}
+
+static void *dup_mem(const void *data, size_t len, int *err)
+{
+  void *copy;
+  if (len == 0) {
+    return NULL;
+  }
+  if ((copy = malloc(len)) == NULL) {
+    *err = 1;
+    return NULL;
+  }
+  return memcpy(copy, data, len);
+}
+
+/* Make a copy of a record that does not refer to the ipmeta instance */
+static ipmeta_record_t *rec_copy(const ipmeta_record_t *rec)
+{
+  ipmeta_record_t *copy;
+  int err = 0;
+
+  if ((copy = calloc(1, sizeof(*copy))) == NULL) {
+    return NULL;
+  }
+  copy->id = rec->id;
+  copy->source = rec->source;
+  memcpy(copy->country_code, rec->country_code, sizeof(copy->country_code));
+  memcpy(copy->continent_code, rec->continent_code,
+         sizeof(copy->continent_code));
+  copy->region_code = rec->region_code;
+  copy->region = dup_str(rec->region, &err);
+  copy->city = dup_str(rec->city, &err);
+  copy->post_code = dup_str(rec->post_code, &err);
+  copy->latitude = rec->latitude;
+  copy->longitude = rec->longitude;
+  copy->metro_code = rec->metro_code;
+  copy->area_code = rec->area_code;
+  copy->conn_speed = dup_str(rec->conn_speed, &err);
+  copy->asn = dup_mem(rec->asn, rec->asn_cnt * sizeof(*rec->asn), &err);
+  copy->asn_cnt = rec->asn_cnt;
+  copy->asn_ip_cnt = rec->asn_ip_cnt;
+  copy->polygon_ids = dup_mem(rec->polygon_ids,
+                                          rec->polygon_ids_cnt *
+                                sizeof(*rec->polygon_ids),
+                              &err);
+  copy->polygon_ids_cnt = rec->polygon_ids_cnt;
+  if (err) {
+    rec_free(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+static int rec_hash_grow(HistoryObject *self)
+{
+  uint32_t size = self->rec_hash_size ? self->rec_hash_size * 2 : 1024;
+  uint32_t *hash, i, slot;
+
+  if ((hash = malloc(size * sizeof(*hash))) == NULL) {
+    return -1;
+  }
+  memset(hash, 0xff, size * sizeof(*hash));
+  for (i = 0; i < self->recs_cnt; i++) {
+    slot = rec_hash(self->recs[i]) & (size - 1);
+    while (hash[slot] != PYIPMETA_INDEX_NONE) {
+      slot = (slot + 1) & (size - 1);
+    }
+    hash[slot] = i;
+  }
+  free(self->rec_hash);
+  self->rec_hash = hash;
+  self->rec_hash_size = size;
+  return 0;
+}
+
+/* Get the id of a record equal to rec, copying it if there is none yet
+ *
+ * @return the id, or PYIPMETA_INDEX_NONE if out of memory
+ */
+static uint32_t rec_intern(HistoryObject *self, const ipmeta_record_t *rec)
+{
+  uint32_t slot;
+  ipmeta_record_t *copy, **recs;
+
+  if ((self->recs_cnt + 1) * 2 > self->rec_hash_size &&
+      rec_hash_grow(self) != 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  slot = rec_hash(rec) & (self->rec_hash_size - 1);
+  while (self->rec_hash[slot] != PYIPMETA_INDEX_NONE) {
+    if (rec_eq(self->recs[self->rec_hash[slot]], rec)) {
+      return self->rec_hash[slot];
+    }
+    slot = (slot + 1) & (self->rec_hash_size - 1);
+  }
+
+  if (self->recs_cnt == self->recs_alloc) {
+    self->recs_alloc = self->recs_alloc ? self->recs_alloc * 2 : 1024;
+    if ((recs = realloc(self->recs, self->recs_alloc * sizeof(*recs))) ==
+        NULL) {
+      return PYIPMETA_INDEX_NONE;
+    }
+    self->recs = recs;
+  }
+  if ((copy = rec_copy(rec)) == NULL) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  self->recs[self->recs_cnt] = copy;
+  self->rec_hash[slot] = self->recs_cnt;
+  self->bytes += sizeof(*copy);
+  return self->recs_cnt++;
+}
+
+/* ========== TREES ========== */
+
+static int ptr_list_add(ptr_list_t *l, void *ptr)
+{
+  void **ptrs;
+  if (l->cnt == l->alloc) {
+    l->alloc = l->alloc ? l->alloc * 2 : 1024;
+    if ((ptrs = realloc(l->ptrs, l->alloc * sizeof(void *))) == NULL) {
+      return -1;
+    }
+    l->ptrs = ptrs;
+  }
+  l->ptrs[l->cnt++] = ptr;
+  return 0;
+}
+
+/* Allocate a node with room for cnt keys and cnt values of the given size,
+ * laid out as: header, keys, values */
+static void *node_alloc(HistoryObject *self, size_t hdr, uint32_t cnt,
+                        size_t val_size, uint64_t **keys, void **vals)
+{
+  size_t size = hdr + cnt * (sizeof(uint64_t) + val_size);
+  char *node;
+
+  if ((node = malloc(size)) == NULL) {
+    return NULL;
+  }
+  if (ptr_list_add(&self->nodes, node) != 0) {
+    free(node);
+    return NULL;
+  }
+  *keys = (uint64_t *)(node + hdr);
+  *vals = node + hdr + cnt * sizeof(uint64_t);
+  self->bytes += size;
+  return node;
+}
+
+static int builder_push(hist_builder_t *b, uint64_t start, uint32_t val)
+{
+  uint64_t *starts;
+  uint32_t *vals;
+
+  if (b->cnt > 0 && b->vals[b->cnt - 1] == val) {
+    /* same record as the previous range */
+    return 0;
+  }
+  if (b->cnt == b->alloc) {
+    b->alloc = b->alloc ? b->alloc * 2 : 1024;
+    if ((starts = realloc(b->starts, b->alloc * sizeof(*starts))) == NULL) {
+      return -1;
+    }
+    b->starts = starts;
+    if ((vals = realloc(b->vals, b->alloc * sizeof(*vals))) == NULL) {
+      return -1;
+    }
+    b->vals = vals;
+  }
+  b->starts[b->cnt] = start;
+  b->vals[b->cnt++] = val;
+  return 0;
+}
+
+static void builder_free(hist_builder_t *b)
+{
+  free(b->starts);
+  free(b->vals);
+  memset(b, 0, sizeof(*b));
+}
+
+/* Node at exactly the given key, or NULL */
+static void *find_exact(const uint64_t *keys, void *const *nodes,
+                        uint32_t cnt, uint64_t key)
+{
+  int64_t i = _pyipmeta_pred(keys, cnt, key);
+  return (i >= 0 && keys[i] == key) ? nodes[i] : NULL;
+}
+
+/* State while splitting a range table into a tree */
+typedef struct tree_build {
+  HistoryObject *self;
+  int bshift;
+  int pshift;
+  /* the same provider's tree in the previous snapshot, if any */
+  const hist_tree_t *prev;
+  const hist_page_t *prev_page;
+
+  /* ranges of the current block */
+  hist_builder_t block;
+  uint64_t block_key;
+  int in_block;
+
+  /* blocks of the current page (vals hold block pointers) */
+  uint64_t *page_keys;
+  hist_block_t **page_blocks;
+  uint32_t page_cnt;
+  uint32_t page_alloc;
+  uint64_t page_key;
+  int in_page;
+
+  /* pages of the tree */
+  uint64_t *tree_keys;
+  hist_page_t **tree_pages;
+  uint32_t tree_cnt;
+  uint32_t tree_alloc;
+} tree_build_t;
+
+static int grow(void **keys, void **vals, uint32_t *alloc, size_t val_size)
+{
+  uint32_t n = *alloc ? *alloc * 2 : 256;
+  void *k, *v;
+  if ((k = realloc(*keys, n * sizeof(uint64_t))) == NULL) {
+    return -1;
+  }
+  *keys = k;
+  if ((v = realloc(*vals, n * val_size)) == NULL) {
+    return -1;
+  }
+  *vals = v;
+  *alloc = n;
+  return 0;
+}
+
+static int finish_block(tree_build_t *tb)
+{
+  hist_block_t *blk = NULL, *old = NULL;
+  uint64_t *keys;
+  void *vals;
+
+  if (!tb->in_block) {
+    return 0;
+  }
+  tb->in_block = 0;
+  if (tb->prev_page != NULL) {
+    old = find_exact(tb->prev_page->keys, (void *const *)tb->prev_page->blocks,
+                     tb->prev_page->cnt, tb->block_key);
+  }
+  if (old != NULL && old->cnt == tb->block.cnt &&
+      memcmp(old->starts, tb->block.starts,
+             old->cnt * sizeof(uint64_t)) == 0 &&
+      memcmp(old->vals, tb->block.vals, old->cnt * sizeof(uint32_t)) == 0) {
+    blk = old;
+  } else {
+    if ((blk = node_alloc(tb->self, sizeof(*blk), tb->block.cnt,
+                          sizeof(uint32_t), &keys, &vals)) == NULL) {
+      return -1;
+    }
+    blk->cnt = tb->block.cnt;
+    blk->starts = keys;
+    blk->vals = vals;
+    memcpy(blk->starts, tb->block.starts, blk->cnt * sizeof(uint64_t));
+    memcpy(blk->vals, tb->block.vals, blk->cnt * sizeof(uint32_t));
+    tb->self->blocks_cnt++;
+    tb->self->ranges_cnt += blk->cnt;
+  }
+
+  if (tb->page_cnt == tb->page_alloc &&
+      grow((void **)&tb->page_keys, (void **)&tb->page_blocks,
+           &tb->page_alloc, sizeof(hist_block_t *)) != 0) {
+    return -1;
+  }
+  tb->page_keys[tb->page_cnt] = tb->block_key;
+  tb->page_blocks[tb->page_cnt++] = blk;
+  tb->block.cnt = 0;
+  return 0;
+}
+
+static int finish_page(tree_build_t *tb)
+{
+  const hist_page_t *old = tb->prev_page;
+  hist_page_t *pg;
+  uint64_t *keys;
+  void *vals;
+
+  if (!tb->in_page) {
+    return 0;
+  }
+  tb->in_page = 0;
+  if (old != NULL && old->cnt == tb->page_cnt &&
+      memcmp(old->keys, tb->page_keys, old->cnt * sizeof(uint64_t)) == 0 &&
+      memcmp(old->blocks, tb->page_blocks,
+             old->cnt * sizeof(hist_block_t *)) == 0) {
+    pg = (hist_page_t *)old;
+  } else {
+    if ((pg = node_alloc(tb->self, sizeof(*pg), tb->page_cnt,
+                         sizeof(hist_block_t *), &keys, &vals)) == NULL) {
+      return -1;
+    }
+    pg->cnt = tb->page_cnt;
+    pg->keys = keys;
+    pg->blocks = vals;
+    memcpy(pg->keys, tb->page_keys, pg->cnt * sizeof(uint64_t));
+    memcpy(pg->blocks, tb->page_blocks, pg->cnt * sizeof(hist_block_t *));
+    tb->self->pages_cnt++;
+  }
+
+  if (tb->tree_cnt == tb->tree_alloc &&
+      grow((void **)&tb->tree_keys, (void **)&tb->tree_pages,
+           &tb->tree_alloc, sizeof(hist_page_t *)) != 0) {
+    return -1;
+  }
+  tb->tree_keys[tb->tree_cnt] = tb->page_key;
+  tb->tree_pages[tb->tree_cnt++] = pg;
+  tb->page_cnt = 0;
+  return 0;
+}
+
+static int start_page(tree_build_t *tb, uint64_t page_key)
+{
+  tb->in_page = 1;
+  tb->page_key = page_key;
+  tb->prev_page = NULL;
+  if (tb->prev != NULL) {
+    tb->prev_page = find_exact(tb->prev->keys, (void *const *)tb->prev->pages,
+                               tb->prev->cnt, page_key);
+  }
+  return 0;
+}
+
+static int start_block(tree_build_t *tb, uint64_t block_key, uint32_t carry)
+{
+  tb->in_block = 1;
+  tb->block_key = block_key;
+  tb->block.cnt = 0;
+  /* carry the range that covers the start of the block over from the
+   * previous block */
+  return builder_push(&tb->block, block_key << tb->bshift, carry);
+}
+
+/* Add one range (in increasing order of starts) */
+static int tree_add(tree_build_t *tb, uint64_t start, uint32_t val,
+                    uint32_t *carry)
+{
+  uint64_t block_key = start >> tb->bshift;
+  uint64_t page_key = start >> tb->pshift;
+
+  if (tb->in_block && block_key != tb->block_key &&
+      finish_block(tb) != 0) {
+    return -1;
+  }
+  if (tb->in_page && page_key != tb->page_key &&
+      finish_page(tb) != 0) {
+    return -1;
+  }
+  if (!tb->in_page) {
+    start_page(tb, page_key);
+    if (block_key != page_key << (tb->pshift - tb->bshift)) {
+      /* pages start with a block at the page start */
+      if (start_block(tb, page_key << (tb->pshift - tb->bshift), *carry) !=
+            0 ||
+          finish_block(tb) != 0) {
+        return -1;
+      }
+    }
+  }
+  if (!tb->in_block && start_block(tb, block_key, *carry) != 0) {
+    return -1;
+  }
+  if (tb->block.cnt > 0 && tb->block.starts[tb->block.cnt - 1] == start) {
+    /* replaces the carried range */
+    tb->block.cnt--;
+  }
+  *carry = val;
+  return builder_push(&tb->block, start, val);
+}
+
+/* Finish the tree, sharing it with the previous snapshot if it is the same
+ *
+ * @return the tree, or NULL if out of memory
+ */
+static hist_tree_t *tree_finish(tree_build_t *tb)
+{
+  const hist_tree_t *old = tb->prev;
+  hist_tree_t *tree;
+  uint64_t *keys;
+  void *vals;
+
+  if (finish_block(tb) != 0 || finish_page(tb) != 0) {
+    return NULL;
+  }
+  if (old != NULL && old->cnt == tb->tree_cnt &&
+      memcmp(old->keys, tb->tree_keys, old->cnt * sizeof(uint64_t)) == 0 &&
+      memcmp(old->pages, tb->tree_pages,
+             old->cnt * sizeof(hist_page_t *)) == 0) {
+    return (hist_tree_t *)old;
+  }
+  if ((tree = node_alloc(tb->self, sizeof(*tree), tb->tree_cnt,
+                         sizeof(hist_page_t *), &keys, &vals)) == NULL) {
+    return NULL;
+  }
+  tree->cnt = tb->tree_cnt;
+  tree->keys = keys;
+  tree->pages = vals;
+  memcpy(tree->keys, tb->tree_keys, tree->cnt * sizeof(uint64_t));
+  memcpy(tree->pages, tb->tree_pages, tree->cnt * sizeof(hist_page_t *));
+  tb->self->trees_cnt++;
+  return tree;
+}
+
+static void tree_build_free(tree_build_t *tb)
+{
+  builder_free(&tb->block);
+  free(tb->page_keys);
+  free(tb->page_blocks);
+  free(tb->tree_keys);
+  free(tb->tree_pages);
+}
+
+/* Find the record id for a key */
+static uint32_t tree_find(const hist_tree_t *tree, uint64_t key, int bshift,
+                          int pshift)
+{
+  const hist_page_t *pg;
+  const hist_block_t *blk;
+  int64_t i;
+
+  if (tree == NULL ||
+      (i = _pyipmeta_pred(tree->keys, tree->cnt, key >> pshift)) < 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  pg = tree->pages[i];
+  if (tree->keys[i] < key >> pshift) {
+    /* the last range of the page covers the key */
+    blk = pg->blocks[pg->cnt - 1];
+    return blk->vals[blk->cnt - 1];
+  }
+  if ((i = _pyipmeta_pred(pg->keys, pg->cnt, key >> bshift)) < 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  blk = pg->blocks[i];
+  if (pg->keys[i] < key >> bshift) {
+    return blk->vals[blk->cnt - 1];
+  }
+  if ((i = _pyipmeta_pred(blk->starts, blk->cnt, key)) < 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  return blk->vals[i];
+}
+
+/* Build the tree for one provider's ranges in an index. recmap caches the
+ * interned id of each index record (PYIPMETA_INDEX_NONE if not seen yet). */
+static hist_tree_t *build_tree(HistoryObject *self, pyipmeta_index_t *idx,
+                               uint32_t *recmap, int prov, int family,
+                               const hist_tree_t *prev)
+{
+  tree_build_t tb;
+  hist_tree_t *tree = NULL;
+  uint32_t i, cnt, val, carry = PYIPMETA_INDEX_NONE;
+  uint64_t start;
+
+  memset(&tb, 0, sizeof(tb));
+  tb.self = self;
+  tb.prev = prev;
+  if (family == AF_INET) {
+    tb.bshift = V4_BLOCK_SHIFT;
+    tb.pshift = V4_PAGE_SHIFT;
+    cnt = idx->v4[prov]->cnt;
+  } else {
+    tb.bshift = V6_BLOCK_SHIFT;
+    tb.pshift = V6_PAGE_SHIFT;
+    cnt = idx->v6[prov]->cnt;
+  }
+
+  for (i = 0; i < cnt; i++) {
+    if (family == AF_INET) {
+      start = idx->v4[prov]->starts[i];
+      val = idx->v4[prov]->vals[i];
+    } else {
+      start = idx->v6[prov]->starts[i].hi;
+      val = idx->v6[prov]->vals[i];
+    }
+    if (val != PYIPMETA_INDEX_NONE) {
+      if (recmap[val] == PYIPMETA_INDEX_NONE &&
+          (recmap[val] = rec_intern(self, idx->recs[val])) ==
+            PYIPMETA_INDEX_NONE) {
+        goto done;
+      }
+      val = recmap[val];
+    }
+    if (tree_add(&tb, start, val, &carry) != 0) {
+      goto done;
+    }
+  }
+  tree = tree_finish(&tb);
+
+ done:
+  tree_build_free(&tb);
+  return tree;
+}
+
+/* ========== PYTHON INTERFACE ========== */
+
+static void
+History_dealloc(HistoryObject *self)
+{
+  size_t i;
+
+  for (i = 0; i < self->nodes.cnt; i++) {
+    free(self->nodes.ptrs[i]);
+  }
+  free(self->nodes.ptrs);
+  for (i = 0; i < self->recs_cnt; i++) {
+    rec_free(self->recs[i]);
+  }
+  free(self->recs);
+  free(self->rec_hash);
+  free(self->snaps);
+  _pyipmeta_guard_free(self->guard);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
+}
+
+static PyObject *
+History_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  HistoryObject *self;
+
+  if ((self = (HistoryObject *)type->tp_alloc(type, 0)) == NULL) {
+    return NULL;
+  }
+  if ((self->guard = _pyipmeta_guard_init()) == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  return (PyObject *)self;
+}
+
+static int
+History_init(HistoryObject *self, PyObject *args, PyObject *kwds)
+{
+  return 0;
+}
+
+/* Add the data of an IpMeta instance as the snapshot for the given time */
+static PyObject *
+History_add_snapshot(HistoryObject *self, PyObject *args, PyObject *kwds)
+{
+  long long time;
+  IpMetaObject *pyipm = NULL;
+  int provmask = 0, i, err = 0;
+  static char *kwlist[] = { "time", "ipm", "provmask", NULL };
+  pyipmeta_index_t *idx;
+  hist_snapshot_t *snap, *prev, *snaps;
+  uint32_t *recmap = NULL;
+  PyObject *res = NULL;
+  int shard;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "LO!|i", kwlist, &time,
+                                   _pyipmeta_get_state(Py_TYPE(self))
+                                     ->IpMetaType,
+                                   &pyipm, &provmask)) {
+    return NULL;
+  }
+  if (_pyipmeta_guard_write_begin(self->guard) != 0) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Cannot add a snapshot while the history is in use");
+    return NULL;
+  }
+  if (self->snaps_cnt > 0 && time <= self->snaps[self->snaps_cnt - 1].time) {
+    PyErr_SetString(PyExc_ValueError,
+                    "Snapshots must be added in order of time");
+    goto done;
+  }
+  /* enable_provider cannot replace the index while we are copying it */
+  if ((shard = _pyipmeta_ipmeta_begin(pyipm)) < 0) {
+    goto done;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(pyipm)) == NULL) {
+    goto done_ipm;
+  }
+
+  if (self->snaps_cnt == self->snaps_alloc) {
+    self->snaps_alloc = self->snaps_alloc ? self->snaps_alloc * 2 : 16;
+    if ((snaps = realloc(self->snaps,
+                         self->snaps_alloc * sizeof(*snaps))) == NULL) {
+      PyErr_NoMemory();
+      goto done_ipm;
+    }
+    self->snaps = snaps;
+  }
+  if ((recmap = malloc((idx->recs_cnt + 1) * sizeof(uint32_t))) == NULL) {
+    PyErr_NoMemory();
+    goto done_ipm;
+  }
+  memset(recmap, 0xff, (idx->recs_cnt + 1) * sizeof(uint32_t));
+
+  snap = &self->snaps[self->snaps_cnt];
+  prev = self->snaps_cnt > 0 ? &self->snaps[self->snaps_cnt - 1] : NULL;
+  memset(snap, 0, sizeof(*snap));
+  snap->time = time;
+
+  Py_BEGIN_ALLOW_THREADS
+  for (i = 0; i < IPMETA_PROVIDER_MAX && !err; i++) {
+    if (idx->v4[i] == NULL ||
+        (provmask != 0 && (provmask & IPMETA_PROV_TO_MASK(i + 1)) == 0)) {
+      continue;
+    }
+    if ((snap->v4[i] = build_tree(self, idx, recmap, i, AF_INET,
+                                  prev ? prev->v4[i] : NULL)) == NULL ||
+        (snap->v6[i] = build_tree(self, idx, recmap, i, AF_INET6,
+                                  prev ? prev->v6[i] : NULL)) == NULL) {
+      err = 1;
+    }
+  }
+  Py_END_ALLOW_THREADS
+
+  if (err) {
+    /* nodes built so far are freed with the object */
+    PyErr_NoMemory();
+    goto done_ipm;
+  }
+  self->snaps_cnt++;
+  res = Py_None;
+  Py_INCREF(res);
+
+ done_ipm:
+  _pyipmeta_ipmeta_end(pyipm, shard);
+ done:
+  free(recmap);
+  _pyipmeta_guard_write_end(self->guard);
+  return res;
+}
+
+/* Start reading the snapshots */
+static int
+read_begin(HistoryObject *self)
+{
+  int shard;
+
+  if ((shard = _pyipmeta_guard_read_begin(self->guard)) < 0) {
+    PyErr_SetString(PyExc_RuntimeError, "A snapshot is being added");
+  }
+  return shard;
+}
+
+/* Find the snapshot in effect at the given time */
+static hist_snapshot_t *find_snapshot(HistoryObject *self, long long time)
+{
+  size_t lo = 0, hi = self->snaps_cnt, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (self->snaps[mid].time <= time) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo > 0 ? &self->snaps[lo - 1] : NULL;
+}
+
+/* Look up an address as it was at the given time */
+static PyObject *
+History_lookup(HistoryObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *addr;
+  long long time;
+  int provmask = 0, family, i;
+  static char *kwlist[] = { "addr", "time", "provmask", NULL };
+  hist_snapshot_t *snap;
+  unsigned char buf[16];
+  uint64_t key = 0;
+  uint32_t val;
+  PyObject *list, *dict;
+  int shard;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "sL|i", kwlist, &addr, &time,
+                                   &provmask)) {
+    return NULL;
+  }
+  if (inet_pton(AF_INET, addr, buf) == 1) {
+    family = AF_INET;
+    key = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+          ((uint32_t)buf[2] << 8) | buf[3];
+  } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+    family = AF_INET6;
+    for (i = 0; i < 8; i++) {
+      key = (key << 8) | buf[i];
+    }
+  } else {
+    PyErr_Format(PyExc_ValueError, "Invalid address '%s'", addr);
+    return NULL;
+  }
+  if ((shard = read_begin(self)) < 0) {
+    return NULL;
+  }
+  if ((snap = find_snapshot(self, time)) == NULL) {
+    PyErr_SetString(PyExc_ValueError, "No snapshot at or before that time");
+    list = NULL;
+    goto done;
+  }
+
+  if ((list = PyList_New(0)) == NULL) {
+    goto done;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (provmask != 0 && (provmask & IPMETA_PROV_TO_MASK(i + 1)) == 0) {
+      continue;
+    }
+    val = (family == AF_INET)
+            ? tree_find(snap->v4[i], key, V4_BLOCK_SHIFT, V4_PAGE_SHIFT)
+            : tree_find(snap->v6[i], key, V6_BLOCK_SHIFT, V6_PAGE_SHIFT);
+    if (val == PYIPMETA_INDEX_NONE) {
+      continue;
+    }
+    if ((dict = _pyipmeta_record_as_dict(self->recs[val], 1)) == NULL ||
+        PyList_Append(list, dict) != 0) {
+      Py_XDECREF(dict);
+      Py_CLEAR(list);
+      goto done;
+    }
+    Py_DECREF(dict);
+  }
+
+ done:
+  _pyipmeta_guard_read_end(self->guard, shard);
+  return list;
+}
+
+/* Get the times of the snapshots */
+static PyObject *
+History_snapshot_times(HistoryObject *self)
+{
+  PyObject *list;
+  size_t i;
+  int shard;
+
+  if ((shard = read_begin(self)) < 0) {
+    return NULL;
+  }
+  if ((list = PyList_New(self->snaps_cnt)) != NULL) {
+    for (i = 0; i < self->snaps_cnt; i++) {
+      PyList_SET_ITEM(list, i, PyLong_FromLongLong(self->snaps[i].time));
+    }
+  }
+  _pyipmeta_guard_read_end(self->guard, shard);
+  return list;
+}
+
+/* Get storage counters */
+static PyObject *
+History_stats(HistoryObject *self)
+{
+  return Py_BuildValue(
+    "{s:n,s:I,s:K,s:K,s:K,s:K,s:K}",
+    "snapshots", (Py_ssize_t)self->snaps_cnt,
+    "records", (unsigned int)self->recs_cnt,
+    "trees", (unsigned long long)self->trees_cnt,
+    "pages", (unsigned long long)self->pages_cnt,
+    "blocks", (unsigned long long)self->blocks_cnt,
+    "ranges", (unsigned long long)self->ranges_cnt,
+    "bytes", (unsigned long long)self->bytes);
+}
+
+static PyMethodDef History_methods[] = {
+
+  {
+    "add_snapshot",
+    (PyCFunction)History_add_snapshot,
+    METH_VARARGS | METH_KEYWORDS,
+    "Add the data of an IpMeta object as the snapshot for the given time "
+    "(seconds since the epoch, later than any previous snapshot)"
+  },
+
+  {
+    "lookup",
+    (PyCFunction)History_lookup,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up an IP address in the snapshot in effect at the given time"
+  },
+
+  {
+    "snapshot_times",
+    (PyCFunction)History_snapshot_times,
+    METH_NOARGS,
+    "Get the list of snapshot times"
+  },
+
+  {
+    "stats",
+    (PyCFunction)History_stats,
+    METH_NOARGS,
+    "Get a dict of storage counters"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot History_slots[] = {
+  {Py_tp_dealloc, History_dealloc},
+  {Py_tp_doc, HistoryDocstring},
+  {Py_tp_methods, History_methods},
+  {Py_tp_init, History_init},
+  {Py_tp_new, History_new},
+  {0, NULL},
+};
+
+static PyType_Spec History_spec = {
+  HistoryTypeName,
+  sizeof(HistoryObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE,
+  History_slots,
+};
+
+PyType_Spec *_pyipmeta_history_get_HistorySpec()
+{
+  return &History_spec;
+}
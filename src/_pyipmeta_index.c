@@ -0,0 +1,729 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_arrow.h"
+#include "_pyipmeta_dir24.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_spatial.h"
+#include <arpa/inet.h>
+#include <libipmeta.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PYIPMETA_X86 1
+#include <immintrin.h>
+#endif
+
+/* Number of addresses searched in lockstep by the batch kernel. Interleaving
+   independent searches lets the prefetches of one search overlap with the
+   comparisons of the others. */
+#define SEARCH_GROUP 16
+
+/* First prefix length probed when building an IPv4 table */
+#define PROBE4_START_LEN 8
+
+/* Prefix lengths probed when building an IPv6 table. libipmeta counts IPv6
+   matches in /64s, so ranges are not split any further than that. */
+#define PROBE6_START_LEN 1
+#define PROBE6_MAX_LEN 64
+
+/* Growable array of ranges, used while probing a provider */
+typedef struct ranges_builder {
+  uint32_t *starts;
+  uint32_t *vals;
+  uint32_t cnt;
+  uint32_t alloc;
+} ranges_builder_t;
+
+/* Growable array of IPv6 ranges */
+typedef struct ranges6_builder {
+  pyipmeta_key6_t *starts;
+  uint32_t *vals;
+  uint32_t cnt;
+  uint32_t alloc;
+} ranges6_builder_t;
+
+/* ========== RECORD TABLE ========== */
+
+static uint32_t rec_hash_slot(ipmeta_record_t *rec, uint32_t size)
+{
+  uint64_t h = (uint64_t)(uintptr_t)rec;
+  h = (h >> 4) * 0x9E3779B97F4A7C15ULL;
+  return (uint32_t)(h >> 32) & (size - 1);
+}
+
+static int rec_hash_grow(pyipmeta_index_t *idx)
+{
+  uint32_t new_size = idx->rec_hash_size ? idx->rec_hash_size * 2 : 1024;
+  uint32_t i, slot;
+  void *new_hash;
+
+  if ((new_hash = calloc(new_size, sizeof(*idx->rec_hash))) == NULL) {
+    return -1;
+  }
+  free(idx->rec_hash);
+  idx->rec_hash = new_hash;
+  idx->rec_hash_size = new_size;
+
+  /* re-insert every known record */
+  for (i = 0; i < idx->recs_cnt; i++) {
+    slot = rec_hash_slot(idx->recs[i], new_size);
+    while (idx->rec_hash[slot].rec != NULL) {
+      slot = (slot + 1) & (new_size - 1);
+    }
+    idx->rec_hash[slot].rec = idx->recs[i];
+    idx->rec_hash[slot].idx = i;
+  }
+  return 0;
+}
+
+/* Get the index of the given record, adding it to the table if needed */
+static uint32_t rec_index(pyipmeta_index_t *idx, ipmeta_record_t *rec)
+{
+  uint32_t slot;
+
+  if (idx->recs_cnt * 2 >= idx->rec_hash_size && rec_hash_grow(idx) != 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+
+  slot = rec_hash_slot(rec, idx->rec_hash_size);
+  while (idx->rec_hash[slot].rec != NULL) {
+    if (idx->rec_hash[slot].rec == rec) {
+      return idx->rec_hash[slot].idx;
+    }
+    slot = (slot + 1) & (idx->rec_hash_size - 1);
+  }
+
+  if (idx->recs_cnt == idx->recs_alloc) {
+    uint32_t new_alloc = idx->recs_alloc ? idx->recs_alloc * 2 : 1024;
+    ipmeta_record_t **new_recs;
+    if ((new_recs = realloc(idx->recs, sizeof(*new_recs) * new_alloc)) ==
+        NULL) {
+      return PYIPMETA_INDEX_NONE;
+    }
+    idx->recs = new_recs;
+    idx->recs_alloc = new_alloc;
+  }
+  idx->rec_hash[slot].rec = rec;
+  idx->rec_hash[slot].idx = idx->recs_cnt;
+  idx->recs[idx->recs_cnt] = rec;
+  return idx->recs_cnt++;
+}
+
+/* ========== TABLE CONSTRUCTION ========== */
+
+/* Append a range to the builder, merging it with the previous range if they
+   map to the same record */
+static int builder_emit(ranges_builder_t *b, uint32_t start, uint32_t val)
+{
+  if (b->cnt > 0 && b->vals[b->cnt - 1] == val) {
+    return 0;
+  }
+  if (b->cnt == b->alloc) {
+    uint32_t new_alloc = b->alloc ? b->alloc * 2 : 4096;
+    uint32_t *s, *v;
+    if ((s = realloc(b->starts, sizeof(uint32_t) * new_alloc)) == NULL) {
+      return -1;
+    }
+    b->starts = s;
+    if ((v = realloc(b->vals, sizeof(uint32_t) * new_alloc)) == NULL) {
+      return -1;
+    }
+    b->vals = v;
+    b->alloc = new_alloc;
+  }
+  b->starts[b->cnt] = start;
+  b->vals[b->cnt] = val;
+  b->cnt++;
+  return 0;
+}
+
+/* libipmeta does not expose the ranges stored by a provider, so recover them
+   by looking up prefixes and splitting each one until it is either unmatched
+   or entirely covered by a single record. */
+static int probe4(pyipmeta_index_t *idx, ranges_builder_t *b, ipmeta_t *ipm,
+                  ipmeta_record_set_t *set, uint32_t provmask,
+                  uint32_t addr, int len)
+{
+  struct in_addr in;
+  ipmeta_record_t *rec, *first = NULL;
+  uint64_t num_ips = 0, first_ips = 0;
+  int rec_cnt = 0;
+  uint32_t val;
+
+  in.s_addr = htonl(addr);
+  ipmeta_record_set_clear(set);
+  if (ipmeta_lookup_pfx(ipm, AF_INET, &in, len, provmask, set) < 0) {
+    return -1;
+  }
+  ipmeta_record_set_rewind(set);
+  while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+    if (rec_cnt++ == 0) {
+      first = rec;
+      first_ips = num_ips;
+    }
+  }
+
+  if (rec_cnt == 0) {
+    return builder_emit(b, addr, PYIPMETA_INDEX_NONE);
+  }
+  if ((rec_cnt == 1 && first_ips == ((uint64_t)1 << (32 - len))) ||
+      len == 32) {
+    if ((val = rec_index(idx, first)) == PYIPMETA_INDEX_NONE) {
+      return -1;
+    }
+    return builder_emit(b, addr, val);
+  }
+
+  if (probe4(idx, b, ipm, set, provmask, addr, len + 1) != 0) {
+    return -1;
+  }
+  return probe4(idx, b, ipm, set, provmask, addr | (1U << (31 - len)),
+                len + 1);
+}
+
+static int builder6_emit(ranges6_builder_t *b, pyipmeta_key6_t start,
+                         uint32_t val)
+{
+  if (b->cnt > 0 && b->vals[b->cnt - 1] == val) {
+    return 0;
+  }
+  if (b->cnt == b->alloc) {
+    uint32_t new_alloc = b->alloc ? b->alloc * 2 : 4096;
+    pyipmeta_key6_t *s;
+    uint32_t *v;
+    if ((s = realloc(b->starts, sizeof(*s) * new_alloc)) == NULL) {
+      return -1;
+    }
+    b->starts = s;
+    if ((v = realloc(b->vals, sizeof(uint32_t) * new_alloc)) == NULL) {
+      return -1;
+    }
+    b->vals = v;
+    b->alloc = new_alloc;
+  }
+  b->starts[b->cnt] = start;
+  b->vals[b->cnt] = val;
+  b->cnt++;
+  return 0;
+}
+
+static void key6_to_in6(pyipmeta_key6_t key, struct in6_addr *in6)
+{
+  int i;
+  for (i = 0; i < 8; i++) {
+    in6->s6_addr[i] = (uint8_t)(key.hi >> (56 - i * 8));
+    in6->s6_addr[i + 8] = (uint8_t)(key.lo >> (56 - i * 8));
+  }
+}
+
+static pyipmeta_key6_t key6_from_bytes(const uint8_t *buf)
+{
+  pyipmeta_key6_t key = {0, 0};
+  int i;
+  for (i = 0; i < 8; i++) {
+    key.hi = (key.hi << 8) | buf[i];
+    key.lo = (key.lo << 8) | buf[i + 8];
+  }
+  return key;
+}
+
+static inline int key6_le(pyipmeta_key6_t a, pyipmeta_key6_t b)
+{
+  return a.hi < b.hi || (a.hi == b.hi && a.lo <= b.lo);
+}
+
+/* IPv6 version of probe4. At PROBE6_MAX_LEN the range is assigned to the
+   record that covers most of it. */
+static int probe6(pyipmeta_index_t *idx, ranges6_builder_t *b, ipmeta_t *ipm,
+                  ipmeta_record_set_t *set, uint32_t provmask,
+                  pyipmeta_key6_t addr, int len)
+{
+  struct in6_addr in6;
+  ipmeta_record_t *rec, *best = NULL;
+  uint64_t num_ips = 0, best_ips = 0;
+  int rec_cnt = 0;
+  uint32_t val;
+  pyipmeta_key6_t upper;
+
+  key6_to_in6(addr, &in6);
+  ipmeta_record_set_clear(set);
+  if (ipmeta_lookup_pfx(ipm, AF_INET6, &in6, len, provmask, set) < 0) {
+    return -1;
+  }
+  ipmeta_record_set_rewind(set);
+  while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+    rec_cnt++;
+    if (best == NULL || num_ips > best_ips) {
+      best = rec;
+      best_ips = num_ips;
+    }
+  }
+
+  if (rec_cnt == 0) {
+    return builder6_emit(b, addr, PYIPMETA_INDEX_NONE);
+  }
+  if ((rec_cnt == 1 && best_ips == ((uint64_t)1 << (64 - len))) ||
+      len == PROBE6_MAX_LEN) {
+    if ((val = rec_index(idx, best)) == PYIPMETA_INDEX_NONE) {
+      return -1;
+    }
+    return builder6_emit(b, addr, val);
+  }
+
+  if (probe6(idx, b, ipm, set, provmask, addr, len + 1) != 0) {
+    return -1;
+  }
+  upper = addr;
+  upper.hi |= (uint64_t)1 << (63 - len);
+  return probe6(idx, b, ipm, set, provmask, upper, len + 1);
+}
+
+static void ranges4_free(pyipmeta_ranges4_t *tbl)
+{
+  if (tbl == NULL) {
+    return;
+  }
+  free(tbl->starts);
+  free(tbl->vals);
+  free(tbl->tops);
+  _pyipmeta_dir24_free(tbl->dir24);
+  free(tbl);
+}
+
+/* Turn the probed ranges into a padded, block-aligned search table */
+static pyipmeta_ranges4_t *ranges4_finish(ranges_builder_t *b)
+{
+  pyipmeta_ranges4_t *tbl;
+  uint32_t padded, i;
+
+  if ((tbl = calloc(1, sizeof(*tbl))) == NULL) {
+    return NULL;
+  }
+  padded = (b->cnt + PYIPMETA_INDEX_BLOCK - 1) & ~(PYIPMETA_INDEX_BLOCK - 1);
+  if (posix_memalign((void **)&tbl->starts, 64,
+                     sizeof(uint32_t) * padded) != 0) {
+    tbl->starts = NULL;
+    goto err;
+  }
+  memcpy(tbl->starts, b->starts, sizeof(uint32_t) * b->cnt);
+  for (i = b->cnt; i < padded; i++) {
+    tbl->starts[i] = UINT32_MAX;
+  }
+  if ((tbl->vals = malloc(sizeof(uint32_t) * b->cnt)) == NULL) {
+    goto err;
+  }
+  memcpy(tbl->vals, b->vals, sizeof(uint32_t) * b->cnt);
+  tbl->cnt = b->cnt;
+
+  tbl->tops_cnt = padded / PYIPMETA_INDEX_BLOCK;
+  if ((tbl->tops = malloc(sizeof(uint32_t) * tbl->tops_cnt)) == NULL) {
+    goto err;
+  }
+  for (i = 0; i < tbl->tops_cnt; i++) {
+    tbl->tops[i] = tbl->starts[i * PYIPMETA_INDEX_BLOCK];
+  }
+  return tbl;
+
+ err:
+  ranges4_free(tbl);
+  return NULL;
+}
+
+static void ranges6_free(pyipmeta_ranges6_t *tbl)
+{
+  if (tbl == NULL) {
+    return;
+  }
+  free(tbl->starts);
+  free(tbl->vals);
+  free(tbl->dir_keys);
+  free(tbl->dir_offs);
+  free(tbl);
+}
+
+static pyipmeta_ranges6_t *ranges6_finish(ranges6_builder_t *b)
+{
+  pyipmeta_ranges6_t *tbl;
+  uint32_t i, top;
+
+  if ((tbl = calloc(1, sizeof(*tbl))) == NULL) {
+    return NULL;
+  }
+  /* the builder arrays are handed over as-is */
+  tbl->starts = b->starts;
+  tbl->vals = b->vals;
+  tbl->cnt = b->cnt;
+  b->starts = NULL;
+  b->vals = NULL;
+
+  /* at most one directory entry per range, plus the terminator */
+  if ((tbl->dir_keys = malloc(sizeof(uint32_t) * tbl->cnt)) == NULL ||
+      (tbl->dir_offs = malloc(sizeof(uint32_t) * (tbl->cnt + 1))) == NULL) {
+    ranges6_free(tbl);
+    return NULL;
+  }
+  for (i = 0; i < tbl->cnt; i++) {
+    top = (uint32_t)(tbl->starts[i].hi >> 32);
+    if (tbl->dir_cnt == 0 || tbl->dir_keys[tbl->dir_cnt - 1] != top) {
+      tbl->dir_keys[tbl->dir_cnt] = top;
+      tbl->dir_offs[tbl->dir_cnt] = i;
+      tbl->dir_cnt++;
+    }
+  }
+  tbl->dir_offs[tbl->dir_cnt] = tbl->cnt;
+  return tbl;
+}
+
+static pyipmeta_ranges6_t *build6(pyipmeta_index_t *idx, ipmeta_t *ipm,
+                                  ipmeta_record_set_t *set, uint32_t provmask)
+{
+  ranges6_builder_t b = {NULL, NULL, 0, 0};
+  pyipmeta_ranges6_t *tbl = NULL;
+  pyipmeta_key6_t addr = {0, 0};
+  uint64_t i;
+
+  for (i = 0; i < ((uint64_t)1 << PROBE6_START_LEN); i++) {
+    addr.hi = i << (64 - PROBE6_START_LEN);
+    if (probe6(idx, &b, ipm, set, provmask, addr, PROBE6_START_LEN) != 0) {
+      goto done;
+    }
+  }
+  tbl = ranges6_finish(&b);
+
+ done:
+  free(b.starts);
+  free(b.vals);
+  return tbl;
+}
+
+static pyipmeta_ranges4_t *build4(pyipmeta_index_t *idx, ipmeta_t *ipm,
+                                  ipmeta_record_set_t *set, uint32_t provmask)
+{
+  ranges_builder_t b = {NULL, NULL, 0, 0};
+  pyipmeta_ranges4_t *tbl = NULL;
+  uint32_t i;
+
+  for (i = 0; i < (1U << PROBE4_START_LEN); i++) {
+    if (probe4(idx, &b, ipm, set, provmask, i << (32 - PROBE4_START_LEN),
+               PROBE4_START_LEN) != 0) {
+      goto done;
+    }
+  }
+  tbl = ranges4_finish(&b);
+  if (tbl != NULL && idx->dir24 &&
+      (tbl->dir24 = _pyipmeta_dir24_build(tbl)) == NULL) {
+    ranges4_free(tbl);
+    tbl = NULL;
+  }
+
+ done:
+  free(b.starts);
+  free(b.vals);
+  return tbl;
+}
+
+/* ========== SEARCH KERNELS ========== */
+
+/* Count the entries of a block that are <= key */
+static inline uint32_t block_rank_scalar(const uint32_t *blk, uint32_t key)
+{
+  uint32_t i, rank = 0;
+  for (i = 0; i < PYIPMETA_INDEX_BLOCK; i++) {
+    rank += (blk[i] <= key);
+  }
+  return rank;
+}
+
+#ifdef PYIPMETA_X86
+__attribute__((target("sse4.2")))
+static inline uint32_t block_rank_sse42(const uint32_t *blk, uint32_t key)
+{
+  /* SSE only has signed compares, so flip the sign bits first */
+  const __m128i bias = _mm_set1_epi32(INT32_MIN);
+  const __m128i k = _mm_xor_si128(_mm_set1_epi32((int)key), bias);
+  uint32_t gt = 0;
+  int i;
+  for (i = 0; i < PYIPMETA_INDEX_BLOCK / 4; i++) {
+    __m128i v = _mm_xor_si128(
+      _mm_load_si128((const __m128i *)(blk + i * 4)), bias);
+    gt |= (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, k)))
+          << (i * 4);
+  }
+  return PYIPMETA_INDEX_BLOCK - __builtin_popcount(gt);
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t block_rank_avx2(const uint32_t *blk, uint32_t key)
+{
+  const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+  const __m256i k = _mm256_xor_si256(_mm256_set1_epi32((int)key), bias);
+  __m256i lo = _mm256_xor_si256(_mm256_load_si256((const __m256i *)blk), bias);
+  __m256i hi =
+    _mm256_xor_si256(_mm256_load_si256((const __m256i *)(blk + 8)), bias);
+  uint32_t gt =
+    (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(lo, k))) |
+    ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(hi, k)))
+     << 8);
+  return PYIPMETA_INDEX_BLOCK - __builtin_popcount(gt);
+}
+#endif
+
+/* Batch search: a branchless binary search over the block tops, run for
+   SEARCH_GROUP addresses in lockstep with the next probes prefetched, then a
+   vector rank within the selected block. */
+#define DEFINE_SEARCH4(name, attr, block_rank)                                 \
+  attr static void name(const pyipmeta_ranges4_t *tbl, const uint32_t *addrs, \
+                        size_t cnt, uint32_t *out, size_t stride)             \
+  {                                                                           \
+    const uint32_t *tops = tbl->tops;                                         \
+    uint32_t base[SEARCH_GROUP];                                              \
+    size_t i, g, gn;                                                          \
+    uint32_t len, half, pos;                                                  \
+    for (i = 0; i < cnt; i += SEARCH_GROUP) {                                 \
+      gn = (cnt - i < SEARCH_GROUP) ? cnt - i : SEARCH_GROUP;                 \
+      for (g = 0; g < gn; g++) {                                              \
+        base[g] = 0;                                                          \
+      }                                                                       \
+      for (len = tbl->tops_cnt; len > 1; len -= half) {                       \
+        half = len / 2;                                                       \
+        for (g = 0; g < gn; g++) {                                            \
+          __builtin_prefetch(&tops[base[g] + half / 2]);                      \
+          __builtin_prefetch(&tops[base[g] + half + half / 2]);               \
+        }                                                                     \
+        for (g = 0; g < gn; g++) {                                            \
+          base[g] = (tops[base[g] + half] <= addrs[i + g]) ? base[g] + half   \
+                                                           : base[g];         \
+        }                                                                     \
+      }                                                                       \
+      for (g = 0; g < gn; g++) {                                              \
+        __builtin_prefetch(&tbl->starts[base[g] * PYIPMETA_INDEX_BLOCK]);     \
+      }                                                                       \
+      for (g = 0; g < gn; g++) {                                              \
+        pos = base[g] * PYIPMETA_INDEX_BLOCK +                                \
+              block_rank(&tbl->starts[base[g] * PYIPMETA_INDEX_BLOCK],        \
+                         addrs[i + g]) - 1;                                   \
+        if (pos >= tbl->cnt) {                                                \
+          pos = tbl->cnt - 1;                                                 \
+        }                                                                     \
+        out[(i + g) * stride] = tbl->vals[pos];                               \
+      }                                                                       \
+    }                                                                         \
+  }
+
+DEFINE_SEARCH4(search4_scalar, , block_rank_scalar)
+#ifdef PYIPMETA_X86
+DEFINE_SEARCH4(search4_sse42, __attribute__((target("sse4.2"))),
+               block_rank_sse42)
+DEFINE_SEARCH4(search4_avx2, __attribute__((target("avx2"))), block_rank_avx2)
+#endif
+
+/* IPv6 search: the directory search is run in lockstep like the IPv4 top
+   level search, then each address is resolved within its (short) bucket */
+static void search6(const pyipmeta_ranges6_t *tbl, const uint8_t *addrs,
+                    size_t cnt, uint32_t *out, size_t stride)
+{
+  const uint32_t *dir = tbl->dir_keys;
+  pyipmeta_key6_t keys[SEARCH_GROUP];
+  uint32_t base[SEARCH_GROUP];
+  uint32_t len, half, top, lo, hi, mid, pos;
+  size_t i, g, gn;
+
+  for (i = 0; i < cnt; i += SEARCH_GROUP) {
+    gn = (cnt - i < SEARCH_GROUP) ? cnt - i : SEARCH_GROUP;
+    for (g = 0; g < gn; g++) {
+      keys[g] = key6_from_bytes(addrs + (i + g) * 16);
+      base[g] = 0;
+    }
+    for (len = tbl->dir_cnt; len > 1; len -= half) {
+      half = len / 2;
+      for (g = 0; g < gn; g++) {
+        __builtin_prefetch(&dir[base[g] + half / 2]);
+        __builtin_prefetch(&dir[base[g] + half + half / 2]);
+      }
+      for (g = 0; g < gn; g++) {
+        top = (uint32_t)(keys[g].hi >> 32);
+        base[g] = (dir[base[g] + half] <= top) ? base[g] + half : base[g];
+      }
+    }
+    for (g = 0; g < gn; g++) {
+      __builtin_prefetch(&tbl->starts[tbl->dir_offs[base[g]]]);
+    }
+    for (g = 0; g < gn; g++) {
+      lo = tbl->dir_offs[base[g]];
+      hi = tbl->dir_offs[base[g] + 1];
+      if (dir[base[g]] != (uint32_t)(keys[g].hi >> 32)) {
+        /* no range starts in this /32, so the last one before it covers it */
+        pos = hi - 1;
+      } else if (!key6_le(tbl->starts[lo], keys[g])) {
+        /* the key is before the first range of its /32 */
+        pos = lo - 1;
+      } else {
+        /* last range in [lo, hi) that starts at or before the key */
+        while (hi - lo > 1) {
+          mid = lo + (hi - lo) / 2;
+          if (key6_le(tbl->starts[mid], keys[g])) {
+            lo = mid;
+          } else {
+            hi = mid;
+          }
+        }
+        pos = lo;
+      }
+      out[(i + g) * stride] = tbl->vals[pos];
+    }
+  }
+}
+
+typedef void (search4_fn_t)(const pyipmeta_ranges4_t *, const uint32_t *,
+                            size_t, uint32_t *, size_t);
+
+static search4_fn_t *search4_kernel = NULL;
+static const char *search4_kernel_name = NULL;
+static pthread_once_t search4_kernel_once = PTHREAD_ONCE_INIT;
+
+/* Pick the best kernel supported by this CPU */
+static void select_kernel(void)
+{
+#ifdef PYIPMETA_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    search4_kernel = search4_avx2;
+    search4_kernel_name = "avx2";
+    return;
+  }
+  if (__builtin_cpu_supports("sse4.2")) {
+    search4_kernel = search4_sse42;
+    search4_kernel_name = "sse4.2";
+    return;
+  }
+#endif
+  search4_kernel = search4_scalar;
+  search4_kernel_name = "scalar";
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+pyipmeta_index_t *_pyipmeta_index_init(void)
+{
+  pyipmeta_index_t *idx;
+
+  if ((idx = calloc(1, sizeof(*idx))) == NULL) {
+    return NULL;
+  }
+  idx->refcnt = 1;
+  return idx;
+}
+
+void _pyipmeta_index_decref(pyipmeta_index_t *idx)
+{
+  int i;
+
+  if (idx == NULL || --idx->refcnt > 0) {
+    return;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    ranges4_free(idx->v4[i]);
+    ranges6_free(idx->v6[i]);
+  }
+  _pyipmeta_spatial_free(idx->spatial);
+  _pyipmeta_arrow_dicts_decref(idx->arrow);
+  free(idx->recs);
+  free(idx->rec_hash);
+  free(idx);
+}
+
+int _pyipmeta_index_build(pyipmeta_index_t *idx, ipmeta_t *ipm,
+                          uint32_t providermask)
+{
+  ipmeta_provider_t **provs;
+  ipmeta_record_set_t *set;
+  uint32_t mask;
+  int i, id, rc = -1;
+
+  if ((provs = ipmeta_get_all_providers(ipm)) == NULL) {
+    return -1;
+  }
+  if ((set = ipmeta_record_set_init()) == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (provs[i] == NULL || ipmeta_is_provider_enabled(provs[i]) == 0) {
+      continue;
+    }
+    id = ipmeta_get_provider_id(provs[i]);
+    mask = IPMETA_PROV_TO_MASK(id);
+    if (providermask != 0 && (providermask & mask) == 0) {
+      continue;
+    }
+    if (idx->v4[id - 1] == NULL &&
+        (idx->v4[id - 1] = build4(idx, ipm, set, mask)) == NULL) {
+      goto done;
+    }
+    if (idx->v6[id - 1] == NULL &&
+        (idx->v6[id - 1] = build6(idx, ipm, set, mask)) == NULL) {
+      goto done;
+    }
+  }
+  rc = 0;
+
+ done:
+  ipmeta_record_set_free(&set);
+  return rc;
+}
+
+void _pyipmeta_index_search4(const pyipmeta_ranges4_t *tbl,
+                             const uint32_t *addrs, size_t cnt,
+                             uint32_t *out, size_t stride)
+{
+  if (tbl->dir24 != NULL) {
+    _pyipmeta_dir24_search(tbl->dir24, addrs, cnt, out, stride);
+    return;
+  }
+  pthread_once(&search4_kernel_once, select_kernel);
+  search4_kernel(tbl, addrs, cnt, out, stride);
+}
+
+void _pyipmeta_index_search6(const pyipmeta_ranges6_t *tbl,
+                             const uint8_t *addrs, size_t cnt,
+                             uint32_t *out, size_t stride)
+{
+  search6(tbl, addrs, cnt, out, stride);
+}
+
+const char *_pyipmeta_index_kernel_name(void)
+{
+  pthread_once(&search4_kernel_once, select_kernel);
+  return search4_kernel_name;
+}
@@ -0,0 +1,173 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_index_H
+#define ___pyipmeta_index_H
+
+#include <libipmeta.h>
+#include <stdint.h>
+
+/** Value stored in batch results for addresses that have no record */
+#define PYIPMETA_INDEX_NONE UINT32_MAX
+
+/** Sorted table of IPv4 ranges for a single provider.
+ *
+ * Range i covers [starts[i], starts[i+1]) and maps to the record with index
+ * vals[i] (or PYIPMETA_INDEX_NONE). starts[0] is always 0, and the starts
+ * array is padded with UINT32_MAX up to a multiple of
+ * PYIPMETA_INDEX_BLOCK entries so that the search kernel can always
+ * compare a whole block.
+ */
+typedef struct pyipmeta_ranges4 {
+  uint32_t *starts;
+  uint32_t *vals;
+  uint32_t cnt;
+
+  /* first start of each block of PYIPMETA_INDEX_BLOCK ranges */
+  uint32_t *tops;
+  uint32_t tops_cnt;
+
+  /* DIR-24-8 table over the same ranges (only if the index has dir24 set),
+     which _pyipmeta_index_search4 uses instead of the ranges */
+  struct pyipmeta_dir24 *dir24;
+} pyipmeta_ranges4_t;
+
+/** IPv6 address split into two host byte order halves */
+typedef struct pyipmeta_key6 {
+  uint64_t hi;
+  uint64_t lo;
+} pyipmeta_key6_t;
+
+/** Sorted table of IPv6 ranges for a single provider.
+ *
+ * Laid out like pyipmeta_ranges4_t, with a directory over the upper 32 bits
+ * of the range starts. Allocations are sparse and mostly /32 to /48, so the
+ * directory lookup leaves only a handful of ranges to search.
+ */
+typedef struct pyipmeta_ranges6 {
+  pyipmeta_key6_t *starts;
+  uint32_t *vals;
+  uint32_t cnt;
+
+  /* distinct upper 32 bits of the range starts, and the index of the first
+     range with each of them (dir_offs[dir_cnt] == cnt) */
+  uint32_t *dir_keys;
+  uint32_t *dir_offs;
+  uint32_t dir_cnt;
+} pyipmeta_ranges6_t;
+
+/** Read-only range index built from the providers of an ipmeta instance */
+typedef struct pyipmeta_index {
+  /* records referenced by the range tables */
+  ipmeta_record_t **recs;
+  uint32_t recs_cnt;
+  uint32_t recs_alloc;
+
+  /* record pointer -> record index hash (open addressing) */
+  struct {
+    ipmeta_record_t *rec;
+    uint32_t idx;
+  } *rec_hash;
+  uint32_t rec_hash_size;
+
+  /* IPv4 range tables, indexed by provider id - 1 */
+  pyipmeta_ranges4_t *v4[IPMETA_PROVIDER_MAX];
+
+  /* IPv6 range tables, indexed by provider id - 1 */
+  pyipmeta_ranges6_t *v6[IPMETA_PROVIDER_MAX];
+
+  /* number of users; the index is freed when this drops to zero */
+  int refcnt;
+
+  /* build a DIR-24-8 table for each IPv4 range table */
+  int dir24;
+
+  /* spatial index over the records (built on demand by IpMeta) */
+  struct pyipmeta_spatial *spatial;
+
+  /* dictionaries of the record string fields for Arrow output (built on
+     demand by IpMeta) */
+  struct pyipmeta_arrow_dicts *arrow;
+} pyipmeta_index_t;
+
+/** Number of ranges compared at once by the search kernel */
+#define PYIPMETA_INDEX_BLOCK 16
+
+/** Create an empty index with a reference count of one */
+pyipmeta_index_t *_pyipmeta_index_init(void);
+
+/** Drop a reference to the index, freeing it when unused */
+void _pyipmeta_index_decref(pyipmeta_index_t *idx);
+
+/** Build the IPv4 and IPv6 range tables for the enabled providers in the
+ * given mask
+ *
+ * IPv6 ranges are tracked down to /64 granularity. Tables that already
+ * exist are left untouched, so this is cheap to call before every batch. A
+ * providermask of 0 selects all enabled providers.
+ *
+ * @return 0 if successful, -1 otherwise
+ */
+int _pyipmeta_index_build(pyipmeta_index_t *idx, ipmeta_t *ipm,
+                          uint32_t providermask);
+
+/** Find the record index for each of the given IPv4 addresses
+ *
+ * Uses the table's DIR-24-8 table if it has one.
+ *
+ * @param tbl           range table to search
+ * @param addrs         addresses to look up, in host byte order
+ * @param cnt           number of addresses
+ * @param out           result array, out[i * stride] is set for addrs[i]
+ * @param stride        distance between consecutive results in out
+ */
+void _pyipmeta_index_search4(const pyipmeta_ranges4_t *tbl,
+                             const uint32_t *addrs, size_t cnt,
+                             uint32_t *out, size_t stride);
+
+/** Find the record index for each of the given IPv6 addresses
+ *
+ * @param tbl           range table to search
+ * @param addrs         addresses to look up, as 16-byte network order
+ *                      (struct in6_addr) values
+ * @param cnt           number of addresses
+ * @param out           result array, out[i * stride] is set for addrs[i]
+ * @param stride        distance between consecutive results in out
+ */
+void _pyipmeta_index_search6(const pyipmeta_ranges6_t *tbl,
+                             const uint8_t *addrs, size_t cnt,
+                             uint32_t *out, size_t stride);
+
+/** Name of the search kernel selected for this CPU */
+const char *_pyipmeta_index_kernel_name(void);
+
+#endif /* ___pyipmeta_index_H */
@@ -29,39 +29,118 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include "_pyipmeta_annotate.h"
+#include "_pyipmeta_arrow.h"
+#include "_pyipmeta_dir24.h"
+#include "_pyipmeta_fused.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_ipmeta.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_module.h"
+#include "_pyipmeta_pool.h"
 #include "_pyipmeta_provider.h"
 #include "_pyipmeta_record.h"
+#include "_pyipmeta_spatial.h"
 #include "pyutils.h"
 #include <arpa/inet.h>
 #include <libipmeta.h>
+#include <math.h>
+#include <pthread.h>
 #include <Python.h>
+#include <unistd.h>
 
-typedef struct {
-  PyObject_HEAD
+#define IpMetaDocstring "IpMeta object"
 
-  /* libipmeta Instance Handle */
-  ipmeta_t *ipm;
+#define IpMetaTypeName "_pyipmeta.IpMeta"
 
-  /* reusable record set */
-  ipmeta_record_set_t *recordset;
+/* Datastructure name that selects DIR-24-8 tables for IPv4 lookups (on top
+ * of the default libipmeta datastructure) */
+#define DIR24_DS_NAME "dir-24-8"
 
-} IpMetaObject;
+/* Providers that locate their records (all but pfx2as) */
+#define GEO_PROVIDERS (~IPMETA_PROV_TO_MASK(IPMETA_PROVIDER_PFX2AS))
 
-#define IpMetaDocstring "IpMeta object"
+static pyipmeta_spatial_t *get_spatial(IpMetaObject *self,
+                                       pyipmeta_index_t **idxp);
 
-#define IpMetaTypeName "_pyipmeta.IpMeta"
+/* Record set and JSON buffer reused by the lookups of one thread, so that
+ * any number of threads can look up in the same IpMeta object */
+typedef struct scratch {
+  ipmeta_record_set_t *set;
+  pyipmeta_buf_t json;
+} scratch_t;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+static int scratch_key_err = 0;
+
+/* Free the scratch space of a thread when it exits */
+static void scratch_free(void *ptr)
+{
+  scratch_t *scratch = ptr;
+
+  if (scratch->set != NULL) {
+    ipmeta_record_set_free(&scratch->set);
+  }
+  _pyipmeta_buf_free(&scratch->json);
+  free(scratch);
+}
+
+static void scratch_key_create(void)
+{
+  scratch_key_err = pthread_key_create(&scratch_key, scratch_free);
+}
+
+/* Get the scratch space of the current thread, creating it if needed */
+static scratch_t *get_scratch(void)
+{
+  scratch_t *scratch;
+
+  pthread_once(&scratch_once, scratch_key_create);
+  if (scratch_key_err != 0) {
+    PyErr_SetString(PyExc_RuntimeError, "pthread_key_create failed");
+    return NULL;
+  }
+  if ((scratch = pthread_getspecific(scratch_key)) != NULL) {
+    return scratch;
+  }
+  if ((scratch = calloc(1, sizeof(*scratch))) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  if ((scratch->set = ipmeta_record_set_init()) == NULL ||
+      pthread_setspecific(scratch_key, scratch) != 0) {
+    PyErr_SetString(PyExc_RuntimeError, "ipmeta_record_set_init failed");
+    scratch_free(scratch);
+    return NULL;
+  }
+  return scratch;
+}
 
+/* Get the range index if it has been built. It is published once complete,
+ * so lookups can read it without taking the lock. */
+static pyipmeta_index_t *
+load_index(IpMetaObject *self)
+{
+  return __atomic_load_n(&self->index, __ATOMIC_ACQUIRE);
+}
 
 static void
 IpMeta_dealloc(IpMetaObject *self)
 {
+  /* the workers must be stopped before ipm goes away */
+  _pyipmeta_pool_free(self->pool);
   if (self->ipm != NULL) {
       ipmeta_free(self->ipm);
   }
-  if (self->recordset) {
-      ipmeta_record_set_free(&self->recordset);
-  }
-  Py_TYPE(self)->tp_free((PyObject*)self);
+  _pyipmeta_index_decref(self->index);
+  _pyipmeta_presence_free(&self->presence);
+  _pyipmeta_guard_free(self->guard);
+  _pyipmeta_metrics_decref(self->metrics);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
 }
 
 static PyObject *
@@ -74,15 +153,45 @@ IpMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     return NULL;
   }
   self->ipm = NULL;
-  self->recordset = NULL;
+  self->index = NULL;
+  self->dir24 = 0;
+  self->spatial = 0;
+  self->pool = NULL;
+  self->metrics = NULL;
+  if ((self->guard = _pyipmeta_guard_init()) == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
 
   const char *dsname = NULL;
-  static char *kwlist[] = { "datastructure", NULL };
-  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|s", kwlist, &dsname)) {
+  PyObject *pyshare = Py_None;
+  static char *kwlist[] = { "datastructure", "share_metrics",
+                            "spatial_index", NULL };
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "|zOp", kwlist, &dsname,
+                                   &pyshare, &self->spatial)) {
+    Py_DECREF(self);
     return NULL;
   }
 
+  if (pyshare != Py_None) {
+    /* keep counting where the instance we are replacing left off */
+    if (!PyObject_TypeCheck(pyshare, _pyipmeta_get_state(type)->IpMetaType)) {
+      PyErr_SetString(PyExc_TypeError, "share_metrics must be an IpMeta");
+      Py_DECREF(self);
+      return NULL;
+    }
+    self->metrics = ((IpMetaObject *)pyshare)->metrics;
+    _pyipmeta_metrics_incref(self->metrics);
+  } else if ((self->metrics = _pyipmeta_metrics_init()) == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+
   ipmeta_ds_id_t dsid = IPMETA_DS_DEFAULT;
+  if (dsname && strcmp(dsname, DIR24_DS_NAME) == 0) {
+    self->dir24 = 1;
+    dsname = NULL;
+  }
   if (dsname) {
     if ((dsid = ipmeta_ds_name_to_id(dsname)) == IPMETA_DS_NONE) {
       PyErr_SetString(PyExc_RuntimeError, "Invalid IpMeta Datastructure name");
@@ -95,12 +204,6 @@ IpMeta_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
     return NULL;
   }
 
-  if ((self->recordset = ipmeta_record_set_init()) == NULL) {
-    PyErr_SetString(PyExc_RuntimeError, "ipmeta_record_set_init failed");
-    Py_DECREF(self);
-    return NULL;
-  }
-
   return (PyObject *)self;
 }
 
@@ -117,10 +220,12 @@ IpMeta_enable_provider(IpMetaObject *self, PyObject *args)
 {
   ProviderObject *pyprov = NULL;
   const char *optstr = NULL;
+  PyObject *res = NULL;
+  pyipmeta_pool_t *pool;
 
   /* get the Provider argument */
   if (!PyArg_ParseTuple(args, "O!|s",
-                        _pyipmeta_provider_get_ProviderType(),
+                        _pyipmeta_get_state(Py_TYPE(self))->ProviderType,
                         &pyprov, &optstr)) {
     return NULL;
   }
@@ -130,11 +235,47 @@ IpMeta_enable_provider(IpMetaObject *self, PyObject *args)
     return NULL;
   }
 
-  if (ipmeta_enable_provider(self->ipm, pyprov->prov, optstr) == 0) {
-    Py_RETURN_TRUE;
+  /* lookups on other threads must not see the providers change */
+  if (_pyipmeta_guard_write_begin(self->guard) != 0) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Cannot enable a provider while lookups are running");
+    return NULL;
+  }
+  pool = __atomic_load_n(&self->pool, __ATOMIC_ACQUIRE);
+  if (pool != NULL && _pyipmeta_pool_pending(pool) > 0) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Cannot enable a provider while asynchronous lookups "
+                    "are pending");
+    goto done;
+  }
+  if (ipmeta_enable_provider(self->ipm, pyprov->prov, optstr) != 0) {
+    res = Py_False;
+    goto done;
+  }
+  /* the index will be rebuilt with the new provider when next needed */
+  _pyipmeta_index_decref(self->index);
+  self->index = NULL;
+  /* without its bitmaps the provider is simply never filtered */
+  if (_pyipmeta_presence_build(&self->presence, self->ipm,
+                               ipmeta_get_provider_id(pyprov->prov)) != 0) {
+    self->presence.failures++;
+  }
+  /* except for DIR-24-8 tables, which are built up front so that no
+   * lookup pays for it */
+  if (self->dir24 && _pyipmeta_ipmeta_get_index(self) == NULL) {
+    goto done;
+  }
+  /* and the spatial index, if asked for */
+  if (self->spatial && (self->presence.enabled & GEO_PROVIDERS) != 0 &&
+      get_spatial(self, NULL) == NULL) {
+    goto done;
   }
+  res = Py_True;
 
-  Py_RETURN_FALSE;
+ done:
+  _pyipmeta_guard_write_end(self->guard);
+  Py_XINCREF(res);
+  return res;
 }
 
 /** Get the provider with the given ID */
@@ -204,6 +345,53 @@ IpMeta_get_all_providers(IpMetaObject *self)
   return list;
 }
 
+/* Look up an IPv4 address in the DIR-24-8 tables */
+static PyObject *
+lookup_dir24(IpMetaObject *self, pyipmeta_index_t *idx, uint32_t addr,
+             uint32_t provmask)
+{
+  PyObject *list, *pyrec;
+  uint32_t vals[IPMETA_PROVIDER_MAX], found = 0;
+  uint64_t start;
+  int i;
+
+  /* counted and timed like an ipmeta_lookup call */
+  start = _pyipmeta_metrics_now(self->metrics);
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    vals[i] = PYIPMETA_INDEX_NONE;
+    if (idx->v4[i] == NULL || idx->v4[i]->dir24 == NULL ||
+        (provmask != 0 && (provmask & IPMETA_PROV_TO_MASK(i + 1)) == 0)) {
+      continue;
+    }
+    if ((vals[i] = _pyipmeta_dir24_find(idx->v4[i]->dir24, addr)) !=
+        PYIPMETA_INDEX_NONE) {
+      found |= IPMETA_PROV_TO_MASK(i + 1);
+    }
+  }
+  start = _pyipmeta_metrics_found(self->metrics, found, start);
+  if (found == 0) {
+    return PyTuple_New(0);
+  }
+
+  if ((list = PyList_New(0)) == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (vals[i] == PYIPMETA_INDEX_NONE) {
+      continue;
+    }
+    if ((pyrec = _pyipmeta_record_as_dict(idx->recs[vals[i]], 1)) == NULL ||
+        PyList_Append(list, pyrec) != 0) {
+      Py_XDECREF(pyrec);
+      Py_DECREF(list);
+      return NULL;
+    }
+    Py_DECREF(pyrec);
+  }
+  _pyipmeta_metrics_time(self->metrics, PYIPMETA_HIST_CONVERT, start);
+  return list;
+}
+
 /* Look up an IP address or a prefix */
 static PyObject *
 IpMeta_lookup(IpMetaObject *self, PyObject *args)
@@ -215,6 +403,37 @@ IpMeta_lookup(IpMetaObject *self, PyObject *args)
     return NULL;
   }
 
+  /* addresses (but not prefixes) in blocks that no provider has records
+   * for are sure to miss */
+  struct in_addr in4;
+  struct in6_addr in6;
+  int family = 0;
+  if (inet_pton(AF_INET, pyaddrstr, &in4) == 1) {
+    family = AF_INET;
+  } else if (inet_pton(AF_INET6, pyaddrstr, &in6) == 1) {
+    family = AF_INET6;
+  }
+  if ((family == AF_INET &&
+       !_pyipmeta_presence_test4(&self->presence, provmask,
+                                 ntohl(in4.s_addr))) ||
+      (family == AF_INET6 &&
+       !_pyipmeta_presence_test6(&self->presence, provmask, &in6))) {
+    _pyipmeta_metrics_filtered(self->metrics);
+    return PyTuple_New(0);
+  }
+
+  /* IPv4 addresses can be served by DIR-24-8 tables */
+  pyipmeta_index_t *idx;
+  if (family == AF_INET && self->dir24 && (idx = load_index(self)) != NULL) {
+    return lookup_dir24(self, idx, ntohl(in4.s_addr), provmask);
+  }
+
+  scratch_t *scratch;
+  if ((scratch = get_scratch()) == NULL) {
+    return NULL;
+  }
+  ipmeta_record_set_t *set = scratch->set;
+
   /* create a list */
   PyObject *list = NULL;
   if((list = PyList_New(0)) == NULL)
@@ -222,7 +441,9 @@ IpMeta_lookup(IpMetaObject *self, PyObject *args)
 
   PyObject *pyrec = NULL;
 
-  int rc = ipmeta_lookup(self->ipm, pyaddrstr, provmask, self->recordset);
+  uint64_t start = _pyipmeta_metrics_now(self->metrics);
+  int rc = ipmeta_lookup(self->ipm, pyaddrstr, provmask, set);
+  start = _pyipmeta_metrics_lookup(self->metrics, rc, set, start);
   if (rc < 0) {
     if (rc == IPMETA_ERR_INPUT) {
       PyErr_Format(PyExc_ValueError, "Invalid address or prefix '%s'", pyaddrstr);
@@ -231,10 +452,10 @@ IpMeta_lookup(IpMetaObject *self, PyObject *args)
     }
     goto err;
   }
-  ipmeta_record_set_rewind(self->recordset);
+  ipmeta_record_set_rewind(set);
   ipmeta_record_t *record = NULL;
   uint64_t num_ips = 0;
-  while ((record = ipmeta_record_set_next(self->recordset, &num_ips)) != NULL) {
+  while ((record = ipmeta_record_set_next(set, &num_ips)) != NULL) {
     pyrec = _pyipmeta_record_as_dict(record, num_ips);
     if(PyList_Append(list, pyrec) == -1) {
       goto err;
@@ -242,12 +463,18 @@ IpMeta_lookup(IpMetaObject *self, PyObject *args)
     Py_DECREF(pyrec);
     pyrec = NULL;
   }
-  ipmeta_record_set_clear(self->recordset);
+  ipmeta_record_set_clear(set);
+  _pyipmeta_metrics_time(self->metrics, PYIPMETA_HIST_CONVERT, start);
 
+  if (PyList_GET_SIZE(list) == 0) {
+    /* misses all share the empty tuple */
+    Py_DECREF(list);
+    return PyTuple_New(0);
+  }
   return list;
 
  err:
-  ipmeta_record_set_clear(self->recordset);
+  ipmeta_record_set_clear(set);
   if (list != NULL) {
     Py_DECREF(list);
   }
@@ -257,88 +484,1578 @@ IpMeta_lookup(IpMetaObject *self, PyObject *args)
   return NULL;
 }
 
-static PyMethodDef IpMeta_methods[] = {
+/* Parse an address or prefix query into its first and last addresses */
+static int
+parse_query(const char *query, int *family, pyipmeta_key6_t *first,
+            pyipmeta_key6_t *last, int *len)
+{
+  char addr[INET6_ADDRSTRLEN];
+  const char *slash = strchr(query, '/');
+  unsigned char buf[16];
+  size_t addr_len = slash ? (size_t)(slash - query) : strlen(query);
+  char *end;
+  int i, bits;
 
-  {
-    "enable_provider",
-    (PyCFunction)IpMeta_enable_provider,
-    METH_VARARGS,
-    "Enable the given IpMeta Provider"
-  },
+  if (addr_len >= sizeof(addr)) {
+    return -1;
+  }
+  memcpy(addr, query, addr_len);
+  addr[addr_len] = '\0';
+  first->hi = first->lo = 0;
+  if (inet_pton(AF_INET, addr, buf) == 1) {
+    *family = AF_INET;
+    bits = 32;
+    first->lo = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+                ((uint32_t)buf[2] << 8) | buf[3];
+  } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+    *family = AF_INET6;
+    bits = 128;
+    for (i = 0; i < 8; i++) {
+      first->hi = (first->hi << 8) | buf[i];
+      first->lo = (first->lo << 8) | buf[i + 8];
+    }
+  } else {
+    return -1;
+  }
+  *len = bits;
+  if (slash != NULL) {
+    *len = (int)strtol(slash + 1, &end, 10);
+    if (end == slash + 1 || *end != '\0' || *len < 0 || *len > bits) {
+      return -1;
+    }
+  }
 
-  {
-    "get_provider_by_id",
-    (PyCFunction)IpMeta_get_provider_by_id,
-    METH_VARARGS,
-    "Get the provider with the given ID"
-  },
+  /* clear the host bits */
+  if (*family == AF_INET) {
+    uint64_t host = ((uint64_t)1 << (32 - *len)) - 1;
+    first->lo &= ~host;
+    last->hi = 0;
+    last->lo = first->lo | host;
+  } else {
+    uint64_t host_hi = (*len >= 64) ? 0
+                       : (*len == 0) ? UINT64_MAX
+                       : ((uint64_t)1 << (64 - *len)) - 1;
+    uint64_t host_lo = (*len <= 64) ? UINT64_MAX
+                       : (*len == 128) ? 0
+                       : ((uint64_t)1 << (128 - *len)) - 1;
+    first->hi &= ~host_hi;
+    first->lo &= ~host_lo;
+    last->hi = first->hi | host_hi;
+    last->lo = first->lo | host_lo;
+  }
+  return 0;
+}
 
-  {
-    "get_provider_by_name",
-    (PyCFunction)IpMeta_get_provider_by_name,
-    METH_VARARGS,
-    "Get the provider with the given name"
-  },
+/* Format an address from parse_query */
+static PyObject *
+key_to_str(int family, pyipmeta_key6_t key)
+{
+  char str[INET6_ADDRSTRLEN];
+  unsigned char buf[16];
+  int i;
 
-  {
-    "get_all_providers",
-    (PyCFunction)IpMeta_get_all_providers,
-    METH_NOARGS,
-    "Get a list of all available providers"
-  },
+  if (family == AF_INET) {
+    for (i = 0; i < 4; i++) {
+      buf[i] = (key.lo >> (24 - 8 * i)) & 0xff;
+    }
+  } else {
+    for (i = 0; i < 8; i++) {
+      buf[i] = (key.hi >> (56 - 8 * i)) & 0xff;
+      buf[i + 8] = (key.lo >> (56 - 8 * i)) & 0xff;
+    }
+  }
+  inet_ntop(family, buf, str, sizeof(str));
+  return PYSTR_FROMSTR(str);
+}
 
-  {
-    "lookup",
-    (PyCFunction)IpMeta_lookup,
-    METH_VARARGS,
-    "Look up metadata for an IP address or prefix"
-  },
+/* Get a sequence of provider ids */
+static int
+get_provider_ids(PyObject *pyids, int *ids, int *ids_cnt)
+{
+  PyObject *seq;
+  Py_ssize_t i;
+  long id;
 
-  {NULL}  /* Sentinel */
+  if ((seq = PySequence_Fast(pyids, "order must be a sequence of provider "
+                                    "ids")) == NULL) {
+    return -1;
+  }
+  if (PySequence_Fast_GET_SIZE(seq) > IPMETA_PROVIDER_MAX) {
+    PyErr_SetString(PyExc_ValueError, "Too many provider ids");
+    goto err;
+  }
+  *ids_cnt = 0;
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    id = PyLong_AsLong(PySequence_Fast_GET_ITEM(seq, i));
+    if (id < 1 || id > IPMETA_PROVIDER_MAX) {
+      if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_ValueError, "Invalid provider id %ld", id);
+      }
+      goto err;
+    }
+    ids[(*ids_cnt)++] = (int)id;
+  }
+  Py_DECREF(seq);
+  return 0;
+
+ err:
+  Py_DECREF(seq);
+  return -1;
+}
+
+/* Get the provider id for each field from a {field name: provider id} dict */
+static int
+get_field_sources(PyObject *pysources, int *sources)
+{
+  PyObject *key, *value;
+  Py_ssize_t pos = 0;
+  const char *name;
+  long id;
+  int field;
+
+  if (!PyDict_Check(pysources)) {
+    PyErr_SetString(PyExc_TypeError,
+                    "sources must be a dict of field name: provider id");
+    return -1;
+  }
+  while (PyDict_Next(pysources, &pos, &key, &value)) {
+    if ((name = PyUnicode_AsUTF8(key)) == NULL) {
+      return -1;
+    }
+    if ((field = _pyipmeta_field_by_name(name)) < 0) {
+      PyErr_Format(PyExc_ValueError, "Invalid field '%s'", name);
+      return -1;
+    }
+    id = PyLong_AsLong(value);
+    if (id < 1 || id > IPMETA_PROVIDER_MAX) {
+      if (!PyErr_Occurred()) {
+        PyErr_Format(PyExc_ValueError, "Invalid provider id %ld", id);
+      }
+      return -1;
+    }
+    sources[field] = (int)id;
+  }
+  return 0;
+}
+
+/* Convert a fused row into a dict */
+static PyObject *
+fused_row_as_dict(IpMetaObject *self, pyipmeta_index_t *idx, int family,
+                  const pyipmeta_fused_row_t *row, const int *order,
+                  int order_cnt, const int *sources)
+{
+  ipmeta_record_t *recs[PYIPMETA_FIELD_CNT];
+  ipmeta_provider_t *prov;
+  PyObject *dict, *ids = NULL, *val = NULL;
+  int i;
+
+  _pyipmeta_fused_pick(idx, row, order, order_cnt, sources, recs);
+  if ((dict = PyDict_New()) == NULL) {
+    return NULL;
+  }
+  if ((val = key_to_str(family, row->first)) == NULL ||
+      PyDict_SetItemString(dict, "start", val) != 0) {
+    goto err;
+  }
+  Py_DECREF(val);
+  if ((val = key_to_str(family, row->last)) == NULL ||
+      PyDict_SetItemString(dict, "end", val) != 0) {
+    goto err;
+  }
+  Py_CLEAR(val);
+
+  /* the id of the record from each provider */
+  if ((ids = PyDict_New()) == NULL) {
+    goto err;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (row->vals[i] == PYIPMETA_INDEX_NONE ||
+        (prov = ipmeta_get_provider_by_id(self->ipm, i + 1)) == NULL) {
+      continue;
+    }
+    if ((val = PyLong_FromUnsignedLong(idx->recs[row->vals[i]]->id)) ==
+          NULL ||
+        PyDict_SetItemString(ids, ipmeta_get_provider_name(prov), val) != 0) {
+      goto err;
+    }
+    Py_CLEAR(val);
+  }
+  if (PyDict_SetItemString(dict, "record_ids", ids) != 0) {
+    goto err;
+  }
+  Py_CLEAR(ids);
+
+  for (i = 0; i < PYIPMETA_FIELD_CNT; i++) {
+    if (i == PYIPMETA_FIELD_SOURCE || i == PYIPMETA_FIELD_ID) {
+      continue;
+    }
+    if ((val = _pyipmeta_record_field(recs[i], i, row->num_ips)) == NULL ||
+        PyDict_SetItemString(dict, _pyipmeta_field_name(i), val) != 0) {
+      goto err;
+    }
+    Py_CLEAR(val);
+  }
+  return dict;
+
+ err:
+  Py_XDECREF(val);
+  Py_XDECREF(ids);
+  Py_DECREF(dict);
+  return NULL;
+}
+
+/* Look up an IP address or prefix in all providers at once, returning one
+ * joined row per range over which none of their records change */
+static PyObject *
+IpMeta_lookup_fused(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *query;
+  int provmask = 0;
+  PyObject *pyorder = Py_None, *pysources = Py_None;
+  static char *kwlist[] = { "query", "provmask", "order", "sources", NULL };
+  int order[IPMETA_PROVIDER_MAX], order_cnt = 0;
+  int sources[PYIPMETA_FIELD_CNT];
+  pyipmeta_fused_rows_t rows = {NULL, 0, 0};
+  pyipmeta_index_t *idx;
+  pyipmeta_key6_t first, last;
+  PyObject *list = NULL, *dict;
+  int family, len, i;
+  size_t r;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|iOO", kwlist, &query,
+                                   &provmask, &pyorder, &pysources)) {
+    return NULL;
+  }
+  memset(sources, 0, sizeof(sources));
+  if (pyorder != Py_None) {
+    if (get_provider_ids(pyorder, order, &order_cnt) != 0) {
+      return NULL;
+    }
+  } else {
+    for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+      order[order_cnt++] = i + 1;
+    }
+  }
+  if (pysources != Py_None && get_field_sources(pysources, sources) != 0) {
+    return NULL;
+  }
+  if (parse_query(query, &family, &first, &last, &len) != 0) {
+    PyErr_Format(PyExc_ValueError, "Invalid address or prefix '%s'", query);
+    return NULL;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(self)) == NULL) {
+    return NULL;
+  }
+
+  /* a single sweep over the range tables of all the providers */
+  if (_pyipmeta_fused_lookup(idx, provmask, family, first, last, len,
+                             &rows) != 0) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  _pyipmeta_metrics_batch(self->metrics, 1);
+  if ((list = PyList_New(0)) == NULL) {
+    goto done;
+  }
+  for (r = 0; r < rows.cnt; r++) {
+    if ((dict = fused_row_as_dict(self, idx, family, &rows.rows[r], order,
+                                  order_cnt, sources)) == NULL ||
+        PyList_Append(list, dict) != 0) {
+      Py_XDECREF(dict);
+      Py_CLEAR(list);
+      goto done;
+    }
+    Py_DECREF(dict);
+  }
+
+ done:
+  _pyipmeta_fused_rows_free(&rows);
+  return list;
+}
+
+/* Get the spatial index over the enabled geolocation providers, building it
+ * (and their range index tables) if needed. The range index it was built
+ * over is returned in idxp, if not NULL. */
+static pyipmeta_spatial_t *
+get_spatial(IpMetaObject *self, pyipmeta_index_t **idxp)
+{
+  uint32_t mask = self->presence.enabled & GEO_PROVIDERS;
+  pyipmeta_index_t *idx;
+  pyipmeta_spatial_t *sp;
+
+  if (mask == 0) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "No geolocation provider is enabled");
+    return NULL;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(self)) == NULL) {
+    return NULL;
+  }
+  if (idxp != NULL) {
+    *idxp = idx;
+  }
+  /* built once per index, like the index itself */
+  if ((sp = __atomic_load_n(&idx->spatial, __ATOMIC_ACQUIRE)) != NULL) {
+    return sp;
+  }
+  PYLOCK_BEGIN(self);
+  if ((sp = idx->spatial) == NULL) {
+    if ((sp = _pyipmeta_spatial_build(idx, mask)) == NULL) {
+      PyErr_NoMemory();
+    } else {
+      __atomic_store_n(&idx->spatial, sp, __ATOMIC_RELEASE);
+    }
+  }
+  PYLOCK_END();
+  return sp;
+}
+
+/* Append the CIDR prefixes that make up a range of IPv4 addresses (width
+ * 32) or of IPv6 /64s (width 64) to a list */
+static int
+append_prefixes(PyObject *list, uint64_t first, uint64_t last, int width)
+{
+  char str[INET6_ADDRSTRLEN + 4];
+  unsigned char buf[16];
+  PyObject *pystr;
+  uint64_t span;
+  int bits, i;
+
+  for (;;) {
+    /* the largest aligned block that starts at first and ends by last */
+    bits = first == 0 ? width : __builtin_ctzll(first);
+    if (bits > width) {
+      bits = width;
+    }
+    while (bits > 0 && (bits == 64 ? last - first != UINT64_MAX :
+                        ((uint64_t)1 << bits) - 1 > last - first)) {
+      bits--;
+    }
+
+    memset(buf, 0, sizeof(buf));
+    for (i = 0; i < width / 8; i++) {
+      buf[i] = (first >> (width - 8 - 8 * i)) & 0xff;
+    }
+    inet_ntop(width == 32 ? AF_INET : AF_INET6, buf, str, INET6_ADDRSTRLEN);
+    snprintf(str + strlen(str), 5, "/%d", width - bits);
+    if ((pystr = PYSTR_FROMSTR(str)) == NULL ||
+        PyList_Append(list, pystr) != 0) {
+      Py_XDECREF(pystr);
+      return -1;
+    }
+    Py_DECREF(pystr);
+
+    span = bits == 64 ? 0 : (uint64_t)1 << bits;
+    if (bits == 64 || last - first == span - 1) {
+      return 0;
+    }
+    first += span;
+  }
+}
+
+/* Build the result dict for a record found by a spatial query: the record,
+ * with its prefixes and the number of IPv4 addresses (matched_ip_count) and
+ * IPv6 /64s (matched_ip6_count) they hold */
+static PyObject *
+spatial_hit_as_dict(const pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+                    uint32_t r)
+{
+  PyObject *dict = NULL, *prefixes = NULL, *val;
+  uint64_t ips4 = 0, ips6 = 0;
+  uint32_t i;
+
+  if ((prefixes = PyList_New(0)) == NULL) {
+    return NULL;
+  }
+  for (i = sp->rng4_offs[r]; i < sp->rng4_offs[r + 1]; i++) {
+    ips4 += (uint64_t)sp->rng4[i * 2 + 1] - sp->rng4[i * 2] + 1;
+    if (append_prefixes(prefixes, sp->rng4[i * 2], sp->rng4[i * 2 + 1],
+                        32) != 0) {
+      goto err;
+    }
+  }
+  for (i = sp->rng6_offs[r]; i < sp->rng6_offs[r + 1]; i++) {
+    ips6 += sp->rng6[i * 2 + 1] - sp->rng6[i * 2] + 1;
+    if (append_prefixes(prefixes, sp->rng6[i * 2], sp->rng6[i * 2 + 1],
+                        64) != 0) {
+      goto err;
+    }
+  }
+
+  if ((dict = _pyipmeta_record_as_dict(idx->recs[r], ips4)) == NULL) {
+    goto err;
+  }
+  if ((val = PyLong_FromUnsignedLongLong(ips6)) == NULL ||
+      PyDict_SetItemString(dict, "matched_ip6_count", val) != 0) {
+    Py_XDECREF(val);
+    goto err;
+  }
+  Py_DECREF(val);
+  if (PyDict_SetItemString(dict, "prefixes", prefixes) != 0) {
+    goto err;
+  }
+  Py_DECREF(prefixes);
+  return dict;
+
+ err:
+  Py_XDECREF(dict);
+  Py_DECREF(prefixes);
+  return NULL;
+}
+
+/* Convert the records found by a spatial query to a list of dicts */
+static PyObject *
+spatial_result(const pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+               pyipmeta_spatial_hits_t *hits, int rc)
+{
+  PyObject *list = NULL, *dict;
+  size_t i;
+
+  if (rc != 0) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  if ((list = PyList_New(hits->cnt)) == NULL) {
+    goto done;
+  }
+  for (i = 0; i < hits->cnt; i++) {
+    if ((dict = spatial_hit_as_dict(sp, idx, hits->recs[i])) == NULL) {
+      Py_CLEAR(list);
+      goto done;
+    }
+    PyList_SET_ITEM(list, i, dict);
+  }
+
+ done:
+  _pyipmeta_spatial_hits_free(hits);
+  return list;
+}
+
+/* Find the records located within a bounding box */
+static PyObject *
+IpMeta_lookup_bbox(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  double min_lat, min_lon, max_lat, max_lon;
+  int provmask = 0;
+  static char *kwlist[] = { "min_lat", "min_lon", "max_lat", "max_lon",
+                            "provmask", NULL };
+  pyipmeta_spatial_hits_t hits = {NULL, 0, 0};
+  pyipmeta_spatial_t *sp;
+  pyipmeta_index_t *idx;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "dddd|i", kwlist, &min_lat,
+                                   &min_lon, &max_lat, &max_lon, &provmask)) {
+    return NULL;
+  }
+  if (!isfinite(min_lat) || !isfinite(min_lon) || !isfinite(max_lat) ||
+      !isfinite(max_lon)) {
+    PyErr_SetString(PyExc_ValueError, "Coordinates must be finite");
+    return NULL;
+  }
+  if ((sp = get_spatial(self, &idx)) == NULL) {
+    return NULL;
+  }
+  return spatial_result(sp, idx, &hits,
+                        _pyipmeta_spatial_bbox(sp, idx, min_lat, min_lon,
+                                               max_lat, max_lon, provmask,
+                                               &hits));
+}
+
+/* Find the records located within a distance of a point */
+static PyObject *
+IpMeta_lookup_radius(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  double lat, lon, radius_km;
+  int provmask = 0;
+  static char *kwlist[] = { "lat", "lon", "radius_km", "provmask", NULL };
+  pyipmeta_spatial_hits_t hits = {NULL, 0, 0};
+  pyipmeta_spatial_t *sp;
+  pyipmeta_index_t *idx;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "ddd|i", kwlist, &lat, &lon,
+                                   &radius_km, &provmask)) {
+    return NULL;
+  }
+  if (!isfinite(lat) || !isfinite(lon) || !isfinite(radius_km)) {
+    PyErr_SetString(PyExc_ValueError,
+                    "Coordinates and radius must be finite");
+    return NULL;
+  }
+  if ((sp = get_spatial(self, &idx)) == NULL) {
+    return NULL;
+  }
+  return spatial_result(sp, idx, &hits,
+                        _pyipmeta_spatial_radius(sp, idx, lat, lon, radius_km,
+                                                 provmask, &hits));
+}
+
+/* Find the records that have a polygon id */
+static PyObject *
+IpMeta_lookup_polygon(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *pyid;
+  unsigned long polygon_id;
+  int provmask = 0;
+  static char *kwlist[] = { "polygon_id", "provmask", NULL };
+  pyipmeta_spatial_hits_t hits = {NULL, 0, 0};
+  pyipmeta_spatial_t *sp;
+  pyipmeta_index_t *idx;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|i", kwlist, &PyLong_Type,
+                                   &pyid, &provmask)) {
+    return NULL;
+  }
+  /* "k" would silently wrap negative and oversized ids */
+  polygon_id = PyLong_AsUnsignedLong(pyid);
+  if ((polygon_id == (unsigned long)-1 && PyErr_Occurred()) ||
+      polygon_id > UINT32_MAX) {
+    PyErr_Clear();
+    PyErr_SetString(PyExc_ValueError,
+                    "polygon_id must be an unsigned 32-bit integer");
+    return NULL;
+  }
+  if ((sp = get_spatial(self, &idx)) == NULL) {
+    return NULL;
+  }
+  return spatial_result(sp, idx, &hits,
+                        _pyipmeta_spatial_polygon(sp, idx, (uint32_t)polygon_id,
+                                                  provmask, &hits));
+}
+
+/* Get the UTF-8 form of a str or bytes query */
+static const char *
+get_query(PyObject *obj, Py_ssize_t *len)
+{
+  char *str;
+
+  if (PyBytes_Check(obj)) {
+    if (PyBytes_AsStringAndSize(obj, &str, len) != 0) {
+      return NULL;
+    }
+    return str;
+  }
+  if (PyUnicode_Check(obj)) {
+    return PyUnicode_AsUTF8AndSize(obj, len);
+  }
+  PyErr_SetString(PyExc_TypeError, "Expected a str or bytes query");
+  return NULL;
+}
+
+/* Append the JSON lookup result for one query to the JSON buffer */
+static int
+lookup_json_one(IpMetaObject *self, scratch_t *scratch, const char *query,
+                Py_ssize_t len, int provmask)
+{
+  uint64_t start = _pyipmeta_metrics_now(self->metrics);
+  int rc = ipmeta_lookup(self->ipm, query, provmask, scratch->set);
+  start = _pyipmeta_metrics_lookup(self->metrics, rc, scratch->set, start);
+  if (rc < 0 && rc != IPMETA_ERR_INPUT) {
+    PyErr_SetString(PyExc_RuntimeError, "Internal error");
+    return -1;
+  }
+  rc = _pyipmeta_json_lookup(&scratch->json, query, len, rc, scratch->set,
+                             NULL, 0);
+  ipmeta_record_set_clear(scratch->set);
+  _pyipmeta_metrics_time(self->metrics, PYIPMETA_HIST_CONVERT, start);
+  if (rc != 0) {
+    PyErr_NoMemory();
+    return -1;
+  }
+  return 0;
+}
+
+/* Look up one or more queries, returning the results as JSON bytes */
+static PyObject *
+IpMeta_lookup_json(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *pyqueries = NULL;
+  PyObject *pyout = Py_None;
+  PyObject *seq = NULL;
+  int provmask = 0;
+  static char *kwlist[] = { "queries", "provmask", "out", NULL };
+  const char *query;
+  Py_ssize_t i, len;
+  scratch_t *scratch;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iO", kwlist,
+                                   &pyqueries, &provmask, &pyout)) {
+    return NULL;
+  }
+  if (pyout != Py_None && !PyByteArray_Check(pyout)) {
+    PyErr_SetString(PyExc_TypeError, "out must be a bytearray");
+    return NULL;
+  }
+
+  if ((scratch = get_scratch()) == NULL) {
+    return NULL;
+  }
+  scratch->json.len = 0;
+  if (PyUnicode_Check(pyqueries) || PyBytes_Check(pyqueries)) {
+    /* a single query gives a single JSON object */
+    if ((query = get_query(pyqueries, &len)) == NULL ||
+        lookup_json_one(self, scratch, query, len, provmask) != 0) {
+      return NULL;
+    }
+  } else {
+    /* a sequence of queries gives one JSON object per line */
+    if ((seq = PySequence_Fast(pyqueries,
+                               "Expected a query or sequence of queries"))
+        == NULL) {
+      return NULL;
+    }
+    for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+      if ((query = get_query(PySequence_Fast_GET_ITEM(seq, i), &len)) ==
+            NULL ||
+          lookup_json_one(self, scratch, query, len, provmask) != 0) {
+        Py_DECREF(seq);
+        return NULL;
+      }
+      if (_pyipmeta_buf_append(&scratch->json, "\n", 1) != 0) {
+        Py_DECREF(seq);
+        return PyErr_NoMemory();
+      }
+    }
+    Py_DECREF(seq);
+  }
+
+  if (pyout == Py_None) {
+    return PyBytes_FromStringAndSize(scratch->json.data, scratch->json.len);
+  }
+  if (PyByteArray_Resize(pyout, scratch->json.len) != 0) {
+    return NULL;
+  }
+  memcpy(PyByteArray_AS_STRING(pyout), scratch->json.data,
+         scratch->json.len);
+  Py_INCREF(pyout);
+  return pyout;
+}
+
+/* Convert a sequence of field names to a list of fields */
+static int
+get_fields(PyObject *pyfields, pyipmeta_field_t *fields, int *fields_cnt)
+{
+  PyObject *seq;
+  const char *name;
+  Py_ssize_t i;
+  int field;
+
+  if ((seq = PySequence_Fast(pyfields, "fields must be a sequence")) == NULL) {
+    return -1;
+  }
+  if (PySequence_Fast_GET_SIZE(seq) > PYIPMETA_FIELD_CNT) {
+    PyErr_SetString(PyExc_ValueError, "Too many fields");
+    goto err;
+  }
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+    if ((name = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) == NULL) {
+      goto err;
+    }
+    if ((field = _pyipmeta_field_by_name(name)) < 0) {
+      PyErr_Format(PyExc_ValueError, "Invalid field '%s'", name);
+      goto err;
+    }
+    fields[i] = field;
+  }
+  *fields_cnt = (int)i;
+  Py_DECREF(seq);
+  return 0;
+
+ err:
+  Py_DECREF(seq);
+  return -1;
+}
+
+/* Look up each line of a chunk of input, returning the annotated output */
+static PyObject *
+IpMeta_annotate(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  int provmask = 0, header = 0, rc;
+  const char *fmtname = "ndjson";
+  PyObject *pyfields = Py_None;
+  PyObject *res = NULL;
+  static char *kwlist[] = { "chunk", "provmask", "format", "fields", "header",
+                            NULL };
+  Py_buffer chunk;
+  pyipmeta_format_t format;
+  pyipmeta_field_t fields_buf[PYIPMETA_FIELD_CNT], *fields = NULL;
+  int fields_cnt = 0;
+  pyipmeta_buf_t out = {NULL, 0, 0};
+  pyipmeta_annotate_stats_t stats = {0, 0, 0};
+  ipmeta_record_set_t *set;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*|isOp", kwlist,
+                                   &chunk, &provmask, &fmtname, &pyfields,
+                                   &header)) {
+    return NULL;
+  }
+  if (strcmp(fmtname, "ndjson") == 0) {
+    format = PYIPMETA_FORMAT_NDJSON;
+  } else if (strcmp(fmtname, "csv") == 0) {
+    format = PYIPMETA_FORMAT_CSV;
+  } else {
+    PyErr_Format(PyExc_ValueError, "Invalid format '%s'", fmtname);
+    goto done;
+  }
+  if (pyfields != Py_None) {
+    if (get_fields(pyfields, fields_buf, &fields_cnt) != 0) {
+      goto done;
+    }
+    fields = fields_buf;
+  }
+  if ((set = ipmeta_record_set_init()) == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "ipmeta_record_set_init failed");
+    goto done;
+  }
+
+  /* each call has its own record set and buffer, so several threads can
+   * annotate chunks at once */
+  Py_BEGIN_ALLOW_THREADS
+  rc = (header && format == PYIPMETA_FORMAT_CSV &&
+        _pyipmeta_csv_header(&out, fields, fields_cnt) != 0) ||
+       _pyipmeta_annotate(self->ipm, provmask, set, self->metrics, format,
+                          fields, fields_cnt, chunk.buf, chunk.len, &out,
+                          &stats);
+  Py_END_ALLOW_THREADS
+  ipmeta_record_set_free(&set);
+
+  if (rc != 0) {
+    PyErr_SetString(PyExc_RuntimeError, "Internal error");
+    goto done;
+  }
+  res = Py_BuildValue("(NKKK)",
+                      PyBytes_FromStringAndSize(out.data, out.len),
+                      (unsigned long long)stats.lines,
+                      (unsigned long long)stats.errors,
+                      (unsigned long long)stats.records);
+
+ done:
+  _pyipmeta_buf_free(&out);
+  PyBuffer_Release(&chunk);
+  return res;
+}
+
+/* Get a read-only buffer of 32-bit unsigned integers */
+static int
+get_u32_buffer(PyObject *obj, Py_buffer *view)
+{
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) != 0) {
+    return -1;
+  }
+  if (view->itemsize != 4 || view->format == NULL ||
+      strchr("ILN", view->format[strlen(view->format) - 1]) == NULL) {
+    PyErr_SetString(PyExc_TypeError,
+                    "Expected a buffer of 32-bit unsigned integers");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+/* Build the range index (with the lock held) */
+static pyipmeta_index_t *
+build_index(IpMetaObject *self)
+{
+  pyipmeta_index_t *idx;
+
+  if ((idx = self->index) != NULL) {
+    /* another thread got here first */
+    return idx;
+  }
+  if ((idx = _pyipmeta_index_init()) == NULL) {
+    PyErr_NoMemory();
+    return NULL;
+  }
+  idx->dir24 = self->dir24;
+  if (_pyipmeta_index_build(idx, self->ipm, 0) != 0) {
+    _pyipmeta_index_decref(idx);
+    PyErr_SetString(PyExc_RuntimeError, "Could not build IpMeta index");
+    return NULL;
+  }
+  __atomic_store_n(&self->index, idx, __ATOMIC_RELEASE);
+  return idx;
+}
+
+pyipmeta_index_t *
+_pyipmeta_ipmeta_get_index(IpMetaObject *self)
+{
+  pyipmeta_index_t *idx;
+
+  if ((idx = load_index(self)) != NULL) {
+    return idx;
+  }
+  PYLOCK_BEGIN(self);
+  idx = build_index(self);
+  PYLOCK_END();
+  return idx;
+}
+
+/* Get a read-only buffer of packed 16-byte IPv6 addresses */
+static int
+get_in6_buffer(PyObject *obj, Py_buffer *view)
+{
+  if (PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS) != 0) {
+    return -1;
+  }
+  if (view->len % 16 != 0) {
+    PyErr_SetString(PyExc_TypeError,
+                    "Expected a buffer of packed 16-byte IPv6 addresses");
+    PyBuffer_Release(view);
+    return -1;
+  }
+  return 0;
+}
+
+/* Look up a batch of addresses of the given family using the range index */
+static PyObject *
+lookup_batch(IpMetaObject *self, PyObject *args, PyObject *kwds, int family)
+{
+  PyObject *pyaddrs = NULL;
+  PyObject *pyout = Py_None;
+  int provmask = 0;
+  static char *kwlist[] = { "addrs", "provmask", "out", NULL };
+  Py_buffer addrs, out;
+  pyipmeta_index_t *idx;
+  void *tbls[IPMETA_PROVIDER_MAX];
+  size_t cnt, i, tbls_cnt = 0;
+  uint32_t mask;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|iO", kwlist,
+                                   &pyaddrs, &provmask, &pyout)) {
+    return NULL;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(self)) == NULL) {
+    return NULL;
+  }
+  /* one result column per indexed provider, in provider id order */
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    mask = IPMETA_PROV_TO_MASK(i + 1);
+    if (idx->v4[i] != NULL && (provmask == 0 || (provmask & mask) != 0)) {
+      tbls[tbls_cnt++] = (family == AF_INET) ? (void *)idx->v4[i]
+                                             : (void *)idx->v6[i];
+    }
+  }
+
+  if (family == AF_INET) {
+    if (get_u32_buffer(pyaddrs, &addrs) != 0) {
+      return NULL;
+    }
+    cnt = addrs.len / 4;
+  } else {
+    if (get_in6_buffer(pyaddrs, &addrs) != 0) {
+      return NULL;
+    }
+    cnt = addrs.len / 16;
+  }
+
+  if (pyout == Py_None) {
+    if ((pyout = PyByteArray_FromStringAndSize(NULL,
+                                               cnt * tbls_cnt * 4)) == NULL) {
+      PyBuffer_Release(&addrs);
+      return NULL;
+    }
+  } else {
+    Py_INCREF(pyout);
+  }
+  if (PyObject_GetBuffer(pyout, &out, PyBUF_WRITABLE | PyBUF_C_CONTIGUOUS)) {
+    goto err;
+  }
+  if ((size_t)out.len < cnt * tbls_cnt * 4) {
+    PyErr_Format(PyExc_ValueError, "Output buffer too small (need %zu bytes)",
+                 cnt * tbls_cnt * 4);
+    PyBuffer_Release(&out);
+    goto err;
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  for (i = 0; i < tbls_cnt; i++) {
+    if (family == AF_INET) {
+      _pyipmeta_index_search4(tbls[i], (const uint32_t *)addrs.buf, cnt,
+                              (uint32_t *)out.buf + i, tbls_cnt);
+    } else {
+      _pyipmeta_index_search6(tbls[i], (const uint8_t *)addrs.buf, cnt,
+                              (uint32_t *)out.buf + i, tbls_cnt);
+    }
+  }
+  Py_END_ALLOW_THREADS
+  _pyipmeta_metrics_batch(self->metrics, cnt);
+
+  PyBuffer_Release(&out);
+  PyBuffer_Release(&addrs);
+  return pyout;
+
+ err:
+  PyBuffer_Release(&addrs);
+  Py_DECREF(pyout);
+  return NULL;
+}
+
+/* Look up a batch of IPv4 addresses */
+static PyObject *
+IpMeta_lookup_batch(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  return lookup_batch(self, args, kwds, AF_INET);
+}
+
+/* Look up a batch of IPv6 addresses */
+static PyObject *
+IpMeta_lookup_batch6(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  return lookup_batch(self, args, kwds, AF_INET6);
+}
+
+/* Get the dictionaries of the record string fields, building them if
+ * needed */
+static pyipmeta_arrow_dicts_t *
+get_arrow_dicts(IpMetaObject *self, pyipmeta_index_t *idx)
+{
+  pyipmeta_arrow_dicts_t *dicts;
+
+  /* built once per index, like the spatial index */
+  if ((dicts = __atomic_load_n(&idx->arrow, __ATOMIC_ACQUIRE)) != NULL) {
+    return dicts;
+  }
+  PYLOCK_BEGIN(self);
+  if ((dicts = idx->arrow) == NULL) {
+    if ((dicts = _pyipmeta_arrow_dicts_build(idx)) == NULL) {
+      PyErr_NoMemory();
+    } else {
+      __atomic_store_n(&idx->arrow, dicts, __ATOMIC_RELEASE);
+    }
+  }
+  PYLOCK_END();
+  return dicts;
+}
+
+/* Look up a column of addresses, returning the results as Arrow columns */
+static PyObject *
+IpMeta_lookup_arrow(IpMetaObject *self, PyObject *args, PyObject *kwds)
+{
+  PyObject *pyaddrs = NULL;
+  int provmask = 0;
+  static char *kwlist[] = { "addrs", "provmask", NULL };
+  pyipmeta_arrow_addrs_t addrs;
+  pyipmeta_arrow_dicts_t *dicts;
+  pyipmeta_arrow_batch_t *batch = NULL;
+  pyipmeta_index_t *idx;
+  void *tbls[IPMETA_PROVIDER_MAX];
+  size_t cnt, i, tbls_cnt = 0;
+  uint32_t *res, mask;
+  int rc;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|i", kwlist,
+                                   &pyaddrs, &provmask)) {
+    return NULL;
+  }
+  if ((idx = _pyipmeta_ipmeta_get_index(self)) == NULL ||
+      (dicts = get_arrow_dicts(self, idx)) == NULL) {
+    return NULL;
+  }
+  if (_pyipmeta_arrow_addrs_get(pyaddrs, &addrs) != 0) {
+    return NULL;
+  }
+  cnt = addrs.cnt;
+  /* rows are ordered by address, then by provider id */
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    mask = IPMETA_PROV_TO_MASK(i + 1);
+    if (idx->v4[i] != NULL && (provmask == 0 || (provmask & mask) != 0)) {
+      tbls[tbls_cnt++] = (addrs.family == AF_INET) ? (void *)idx->v4[i]
+                                                   : (void *)idx->v6[i];
+    }
+  }
+  if ((res = malloc(cnt * tbls_cnt * sizeof(uint32_t) + 1)) == NULL) {
+    _pyipmeta_arrow_addrs_release(&addrs);
+    return PyErr_NoMemory();
+  }
+
+  Py_BEGIN_ALLOW_THREADS
+  for (i = 0; i < tbls_cnt; i++) {
+    if (addrs.family == AF_INET) {
+      _pyipmeta_index_search4(tbls[i], (const uint32_t *)addrs.buf, cnt,
+                              res + i, tbls_cnt);
+    } else {
+      _pyipmeta_index_search6(tbls[i], (const uint8_t *)addrs.buf, cnt,
+                              res + i, tbls_cnt);
+    }
+  }
+  rc = _pyipmeta_arrow_batch_build(idx, dicts, res, cnt, tbls_cnt, &batch);
+  Py_END_ALLOW_THREADS
+
+  free(res);
+  _pyipmeta_arrow_addrs_release(&addrs);
+  if (rc == -1) {
+    return PyErr_NoMemory();
+  }
+  if (rc == -2) {
+    PyErr_SetString(PyExc_ValueError,
+                    "Too many addresses or list items for one Arrow batch");
+    return NULL;
+  }
+  _pyipmeta_metrics_batch(self->metrics, cnt);
+  return _pyipmeta_arrow_batch_wrap(
+    _pyipmeta_get_state(Py_TYPE(self))->ArrowBatchType, batch);
+}
+
+/* Get a record referenced by lookup_batch results */
+static PyObject *
+IpMeta_get_record(IpMetaObject *self, PyObject *args)
+{
+  unsigned int recidx;
+  pyipmeta_index_t *idx;
+
+  if (!PyArg_ParseTuple(args, "I", &recidx)) {
+    return NULL;
+  }
+  if (recidx == PYIPMETA_INDEX_NONE) {
+    Py_RETURN_NONE;
+  }
+  if ((idx = load_index(self)) == NULL || recidx >= idx->recs_cnt) {
+    PyErr_Format(PyExc_IndexError, "Invalid record index %u", recidx);
+    return NULL;
+  }
+  return _pyipmeta_record_as_dict(idx->recs[recidx], 1);
+}
+
+/* Build a dict for a latency histogram */
+static PyObject *
+hist_as_dict(pyipmeta_metrics_shard_t *total, pyipmeta_metrics_hist_t hist)
+{
+  PyObject *buckets;
+  uint64_t le, cnt = 0;
+  int i;
+
+  if ((buckets = PyList_New(PYIPMETA_METRICS_BUCKETS)) == NULL) {
+    return NULL;
+  }
+  for (i = 0; i < PYIPMETA_METRICS_BUCKETS; i++) {
+    /* (upper bound in seconds, count) with an infinite last bound */
+    le = _pyipmeta_metrics_bucket_le(i);
+    PyList_SET_ITEM(buckets, i,
+                    Py_BuildValue("(dK)", le ? le / 1e9 : INFINITY,
+                                  (unsigned long long)total->hist[hist][i]));
+    cnt += total->hist[hist][i];
+  }
+  return Py_BuildValue("{s:N,s:K,s:d}", "buckets", buckets, "count",
+                       (unsigned long long)cnt, "sum_seconds",
+                       total->hist_sum_ns[hist] / 1e9);
+}
+
+/* Get the lookup counters and latency histograms */
+static PyObject *
+IpMeta_stats(IpMetaObject *self)
+{
+  pyipmeta_metrics_shard_t total;
+  ipmeta_provider_t *prov;
+  PyObject *records, *pycnt;
+  int id;
+
+  _pyipmeta_metrics_sum(self->metrics, &total);
+
+  if ((records = PyDict_New()) == NULL) {
+    return NULL;
+  }
+  for (id = 1; id <= IPMETA_PROVIDER_MAX; id++) {
+    if ((prov = ipmeta_get_provider_by_id(self->ipm, id)) == NULL) {
+      continue;
+    }
+    if ((pycnt = PyLong_FromUnsignedLongLong(total.records[id])) == NULL ||
+        PyDict_SetItemString(records, ipmeta_get_provider_name(prov),
+                             pycnt) != 0) {
+      Py_XDECREF(pycnt);
+      Py_DECREF(records);
+      return NULL;
+    }
+    Py_DECREF(pycnt);
+  }
+
+  return Py_BuildValue(
+    "{s:O,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:N,s:{s:N,s:N}}",
+    "timing", self->metrics->timing ? Py_True : Py_False,
+    "lookups", (unsigned long long)total.lookups,
+    "errors_input", (unsigned long long)total.errors_input,
+    "errors_internal", (unsigned long long)total.errors_internal,
+    "misses", (unsigned long long)total.misses,
+    "batch_lookups", (unsigned long long)total.batch_lookups,
+    "filtered", (unsigned long long)total.filtered,
+    "presence_bytes",
+    (unsigned long long)_pyipmeta_presence_bytes(&self->presence),
+    "presence_failures", (unsigned long long)self->presence.failures,
+    "records", records,
+    "latency",
+    "lookup", hist_as_dict(&total, PYIPMETA_HIST_LOOKUP),
+    "convert", hist_as_dict(&total, PYIPMETA_HIST_CONVERT));
+}
+
+/* Get the memory used by the DIR-24-8 tables */
+static PyObject *
+IpMeta_dir24_stats(IpMetaObject *self)
+{
+  pyipmeta_index_t *idx = load_index(self);
+  pyipmeta_dir24_t *dir;
+  ipmeta_provider_t *prov;
+  PyObject *provs, *pydir;
+  unsigned long long bytes = 0;
+  int i;
+
+  if ((provs = PyDict_New()) == NULL) {
+    return NULL;
+  }
+  for (i = 0; idx != NULL && i < IPMETA_PROVIDER_MAX; i++) {
+    if (idx->v4[i] == NULL || (dir = idx->v4[i]->dir24) == NULL ||
+        (prov = ipmeta_get_provider_by_id(self->ipm, i + 1)) == NULL) {
+      continue;
+    }
+    if ((pydir = Py_BuildValue("{s:K,s:i,s:I,s:I}",
+                               "bytes", (unsigned long long)dir->bytes,
+                               "entry_size", dir->entry_size,
+                               "tbl8_blocks", dir->tbl8_blocks,
+                               "records", dir->recs_cnt)) == NULL ||
+        PyDict_SetItemString(provs, ipmeta_get_provider_name(prov),
+                             pydir) != 0) {
+      Py_XDECREF(pydir);
+      Py_DECREF(provs);
+      return NULL;
+    }
+    Py_DECREF(pydir);
+    bytes += dir->bytes;
+  }
+  return Py_BuildValue("{s:O,s:K,s:N}",
+                       "enabled", self->dir24 ? Py_True : Py_False,
+                       "bytes", bytes,
+                       "providers", provs);
+}
+
+/* Turn lookup timing on or off */
+static PyObject *
+IpMeta_set_timing(IpMetaObject *self, PyObject *args)
+{
+  int timing = 0;
+
+  if (!PyArg_ParseTuple(args, "p", &timing)) {
+    return NULL;
+  }
+  __atomic_store_n(&self->metrics->timing, timing, __ATOMIC_RELAXED);
+  Py_RETURN_NONE;
+}
+
+/* Start the worker pool (if needed) and return its notification fd */
+static PyObject *
+IpMeta_async_start(IpMetaObject *self, PyObject *args)
+{
+  int threads_cnt = 0;
+  pyipmeta_pool_t *pool;
+
+  if (!PyArg_ParseTuple(args, "|i", &threads_cnt)) {
+    return NULL;
+  }
+  PYLOCK_BEGIN(self);
+  if ((pool = self->pool) == NULL) {
+    if (threads_cnt <= 0) {
+      threads_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if ((pool = _pyipmeta_pool_init(self->ipm, self->metrics,
+                                    threads_cnt)) == NULL) {
+      PyErr_SetString(PyExc_RuntimeError, "Could not start IpMeta workers");
+    } else {
+      __atomic_store_n(&self->pool, pool, __ATOMIC_RELEASE);
+    }
+  }
+  PYLOCK_END();
+  if (pool == NULL) {
+    return NULL;
+  }
+  return Py_BuildValue("i", pool->notify_rfd);
+}
+
+/* Submit an address/prefix (or a list of them) to the worker pool */
+static PyObject *
+IpMeta_async_submit(IpMetaObject *self, PyObject *args)
+{
+  PyObject *pyqueries, *seq = NULL;
+  int provmask = 0;
+  pyipmeta_job_t *job = NULL;
+  const char *query;
+  Py_ssize_t i, cnt;
+  pyipmeta_pool_t *pool = __atomic_load_n(&self->pool, __ATOMIC_ACQUIRE);
+
+  if (!PyArg_ParseTuple(args, "O|i", &pyqueries, &provmask)) {
+    return NULL;
+  }
+  if (pool == NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "IpMeta workers are not running");
+    return NULL;
+  }
+
+  if (PyUnicode_Check(pyqueries)) {
+    if ((query = PyUnicode_AsUTF8(pyqueries)) == NULL ||
+        (job = _pyipmeta_job_init(1, provmask)) == NULL ||
+        (job->queries[0] = strdup(query)) == NULL) {
+      goto err;
+    }
+  } else {
+    if ((seq = PySequence_Fast(pyqueries,
+                               "Expected a string or a sequence of "
+                               "strings")) == NULL) {
+      return NULL;
+    }
+    cnt = PySequence_Fast_GET_SIZE(seq);
+    if ((job = _pyipmeta_job_init(cnt, provmask)) == NULL) {
+      goto err;
+    }
+    job->batch = 1;
+    for (i = 0; i < cnt; i++) {
+      if ((query = PyUnicode_AsUTF8(PySequence_Fast_GET_ITEM(seq, i))) ==
+            NULL ||
+          (job->queries[i] = strdup(query)) == NULL) {
+        goto err;
+      }
+    }
+    Py_DECREF(seq);
+  }
+
+  return PyLong_FromUnsignedLongLong(_pyipmeta_pool_submit(pool, job));
+
+ err:
+  if (!PyErr_Occurred()) {
+    PyErr_NoMemory();
+  }
+  Py_XDECREF(seq);
+  _pyipmeta_job_free(job);
+  return NULL;
+}
+
+/* Convert the result of a single query into a list of records (or an
+   exception instance) */
+static PyObject *
+job_result_as_list(pyipmeta_job_t *job, size_t i)
+{
+  pyipmeta_job_result_t *res = &job->results[i];
+  PyObject *list, *pyrec;
+  size_t j;
+
+  if (res->rc == IPMETA_ERR_INPUT) {
+    return PyObject_CallFunction(PyExc_ValueError, "N",
+                                 PyUnicode_FromFormat(
+                                   "Invalid address or prefix '%s'",
+                                   job->queries[i]));
+  } else if (res->rc < 0) {
+    return PyObject_CallFunction(PyExc_RuntimeError, "s", "Internal error");
+  }
+
+  if ((list = PyList_New(res->cnt)) == NULL) {
+    return NULL;
+  }
+  for (j = 0; j < res->cnt; j++) {
+    if ((pyrec = _pyipmeta_record_as_dict(res->recs[j],
+                                          res->num_ips[j])) == NULL) {
+      Py_DECREF(list);
+      return NULL;
+    }
+    PyList_SET_ITEM(list, j, pyrec);
+  }
+  return list;
+}
+
+/* Collect the results of completed asynchronous lookups */
+static PyObject *
+IpMeta_async_collect(IpMetaObject *self)
+{
+  pyipmeta_job_t *done, *job;
+  PyObject *list = NULL, *result = NULL, *item, *tuple;
+  size_t i;
+  pyipmeta_pool_t *pool = __atomic_load_n(&self->pool, __ATOMIC_ACQUIRE);
+
+  if (pool == NULL) {
+    return PyList_New(0);
+  }
+  done = _pyipmeta_pool_collect(pool);
+
+  if ((list = PyList_New(0)) == NULL) {
+    goto done;
+  }
+  for (job = done; job != NULL; job = job->next) {
+    if (job->batch == 0) {
+      result = job_result_as_list(job, 0);
+    } else if ((result = PyList_New(job->cnt)) != NULL) {
+      for (i = 0; i < job->cnt; i++) {
+        if ((item = job_result_as_list(job, i)) == NULL) {
+          Py_CLEAR(result);
+          break;
+        }
+        if (PyExceptionInstance_Check(item)) {
+          /* an invalid query fails the whole batch */
+          Py_DECREF(result);
+          result = item;
+          break;
+        }
+        PyList_SET_ITEM(result, i, item);
+      }
+    }
+    if (result == NULL ||
+        (tuple = Py_BuildValue("KN", (unsigned long long)job->id,
+                               result)) == NULL) {
+      Py_CLEAR(list);
+      goto done;
+    }
+    if (PyList_Append(list, tuple) != 0) {
+      Py_DECREF(tuple);
+      Py_CLEAR(list);
+      goto done;
+    }
+    Py_DECREF(tuple);
+  }
+
+ done:
+  while (done != NULL) {
+    job = done->next;
+    _pyipmeta_job_free(done);
+    done = job;
+  }
+  return list;
+}
+
+int
+_pyipmeta_ipmeta_begin(IpMetaObject *self)
+{
+  int shard;
+
+  if ((shard = _pyipmeta_guard_read_begin(self->guard)) < 0) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "Cannot look up while a provider is being enabled");
+  }
+  return shard;
+}
+
+void
+_pyipmeta_ipmeta_end(IpMetaObject *self, int shard)
+{
+  _pyipmeta_guard_read_end(self->guard, shard);
+}
+
+/* Define a method that runs the given one between _pyipmeta_ipmeta_begin and
+ * _pyipmeta_ipmeta_end, so that enable_provider cannot change the providers,
+ * index or presence filter under it */
+#define READER(func, sig) READER_(func, sig)
+#define READER_(func, params, call)                                     \
+  static PyObject *func##_reader params                                 \
+  {                                                                     \
+    PyObject *res;                                                      \
+    int shard;                                                          \
+                                                                        \
+    if ((shard = _pyipmeta_ipmeta_begin(self)) < 0) {                   \
+      return NULL;                                                      \
+    }                                                                   \
+    res = func call;                                                    \
+    _pyipmeta_ipmeta_end(self, shard);                                  \
+    return res;                                                         \
+  }
+
+#define NOARGS (IpMetaObject *self), (self)
+#define VARARGS (IpMetaObject *self, PyObject *args), (self, args)
+#define KEYWORDS                                                        \
+  (IpMetaObject *self, PyObject *args, PyObject *kwds), (self, args, kwds)
+
+READER(IpMeta_lookup, VARARGS)
+READER(IpMeta_dir24_stats, NOARGS)
+READER(IpMeta_lookup_fused, KEYWORDS)
+READER(IpMeta_lookup_bbox, KEYWORDS)
+READER(IpMeta_lookup_radius, KEYWORDS)
+READER(IpMeta_lookup_polygon, KEYWORDS)
+READER(IpMeta_lookup_json, KEYWORDS)
+READER(IpMeta_annotate, KEYWORDS)
+READER(IpMeta_lookup_batch, KEYWORDS)
+READER(IpMeta_lookup_batch6, KEYWORDS)
+READER(IpMeta_lookup_arrow, KEYWORDS)
+READER(IpMeta_async_submit, VARARGS)
+READER(IpMeta_get_record, VARARGS)
+READER(IpMeta_stats, NOARGS)
+
+static PyMethodDef IpMeta_methods[] = {
+
+  {
+    "enable_provider",
+    (PyCFunction)IpMeta_enable_provider,
+    METH_VARARGS,
+    "Enable the given IpMeta Provider"
+  },
+
+  {
+    "get_provider_by_id",
+    (PyCFunction)IpMeta_get_provider_by_id,
+    METH_VARARGS,
+    "Get the provider with the given ID"
+  },
+
+  {
+    "get_provider_by_name",
+    (PyCFunction)IpMeta_get_provider_by_name,
+    METH_VARARGS,
+    "Get the provider with the given name"
+  },
+
+  {
+    "get_all_providers",
+    (PyCFunction)IpMeta_get_all_providers,
+    METH_NOARGS,
+    "Get a list of all available providers"
+  },
+
+  {
+    "lookup",
+    (PyCFunction)IpMeta_lookup_reader,
+    METH_VARARGS,
+    "Look up metadata for an IP address or prefix (returns a list of "
+    "records, or an empty tuple if there are none)"
+  },
+
+  {
+    "dir24_stats",
+    (PyCFunction)IpMeta_dir24_stats_reader,
+    METH_NOARGS,
+    "Get the memory used by the DIR-24-8 tables (datastructure=\"dir-24-8\")"
+  },
+
+  {
+    "lookup_fused",
+    (PyCFunction)IpMeta_lookup_fused_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up an IP address or prefix in all the (given) providers at once, "
+    "returning one joined dict per range over which their records do not "
+    "change. Each field is taken from the first provider in order (a list "
+    "of provider ids) that has a value for it, unless sources (a dict of "
+    "field name: provider id) says otherwise"
+  },
+
+  {
+    "lookup_bbox",
+    (PyCFunction)IpMeta_lookup_bbox_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Find the records of the geolocation providers located within a "
+    "bounding box, with their prefixes and IP counts"
+  },
+
+  {
+    "lookup_radius",
+    (PyCFunction)IpMeta_lookup_radius_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Find the records of the geolocation providers located within a "
+    "distance (in km) of a point, with their prefixes and IP counts"
+  },
+
+  {
+    "lookup_polygon",
+    (PyCFunction)IpMeta_lookup_polygon_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Find the records that have the given polygon id, with their prefixes "
+    "and IP counts"
+  },
+
+  {
+    "lookup_json",
+    (PyCFunction)IpMeta_lookup_json_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up an IP address or prefix (or a sequence of them), returning the "
+    "results as JSON (or newline-delimited JSON) bytes"
+  },
+
+  {
+    "annotate",
+    (PyCFunction)IpMeta_annotate_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up each line of a chunk of bytes without holding the GIL, "
+    "returning (output, lines, errors, records)"
+  },
+
+  {
+    "lookup_batch",
+    (PyCFunction)IpMeta_lookup_batch_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up a buffer of IPv4 addresses (host byte order uint32), returning "
+    "one record index per address and provider"
+  },
+
+  {
+    "lookup_batch6",
+    (PyCFunction)IpMeta_lookup_batch6_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up a buffer of packed 16-byte IPv6 addresses (network byte order), "
+    "returning one record index per address and provider"
+  },
+
+  {
+    "lookup_arrow",
+    (PyCFunction)IpMeta_lookup_arrow_reader,
+    METH_VARARGS | METH_KEYWORDS,
+    "Look up an Arrow array or buffer of IPv4 (uint32) or IPv6 (16-byte) "
+    "addresses, returning an ArrowBatch with one row per address and "
+    "matching provider"
+  },
+
+  {
+    "async_start",
+    (PyCFunction)IpMeta_async_start,
+    METH_VARARGS,
+    "Start the asynchronous lookup workers, returning a file descriptor "
+    "that becomes readable when lookups complete"
+  },
+
+  {
+    "async_submit",
+    (PyCFunction)IpMeta_async_submit_reader,
+    METH_VARARGS,
+    "Queue an address/prefix (or a sequence of them) for lookup by the "
+    "workers, returning a job ID"
+  },
+
+  {
+    "async_collect",
+    (PyCFunction)IpMeta_async_collect,
+    METH_NOARGS,
+    "Get a list of (job ID, result) tuples for completed lookups"
+  },
+
+  {
+    "get_record",
+    (PyCFunction)IpMeta_get_record_reader,
+    METH_VARARGS,
+    "Get the record with the given lookup_batch record index"
+  },
+
+  {
+    "stats",
+    (PyCFunction)IpMeta_stats_reader,
+    METH_NOARGS,
+    "Get lookup counters and latency histograms"
+  },
+
+  {
+    "set_timing",
+    (PyCFunction)IpMeta_set_timing,
+    METH_VARARGS,
+    "Turn lookup latency histograms on or off"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot IpMeta_slots[] = {
+  {Py_tp_dealloc, IpMeta_dealloc},
+  {Py_tp_doc, IpMetaDocstring},
+  {Py_tp_methods, IpMeta_methods},
+  {Py_tp_init, IpMeta_init},
+  {Py_tp_new, IpMeta_new},
+  {0, NULL},
 };
 
-static PyTypeObject IpMetaType = {
-  PyVarObject_HEAD_INIT(NULL, 0)
-  IpMetaTypeName,             /* tp_name */
-  sizeof(IpMetaObject), /* tp_basicsize */
-  0,                                    /* tp_itemsize */
-  (destructor)IpMeta_dealloc,        /* tp_dealloc */
-  0,                                    /* tp_print */
-  0,                                    /* tp_getattr */
-  0,                                    /* tp_setattr */
-  0,                                    /* tp_compare */
-  0,                                    /* tp_repr */
-  0,                                    /* tp_as_number */
-  0,                                    /* tp_as_sequence */
-  0,                                    /* tp_as_mapping */
-  0,                                    /* tp_hash */
-  0,                                    /* tp_call */
-  0,                                    /* tp_str */
-  0,                                    /* tp_getattro */
-  0,                                    /* tp_setattro */
-  0,                                    /* tp_as_buffer */
-  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-  IpMetaDocstring,      /* tp_doc */
-  0,		               /* tp_traverse */
-  0,		               /* tp_clear */
-  0,		               /* tp_richcompare */
-  0,		               /* tp_weaklistoffset */
-  0,		               /* tp_iter */
-  0,		               /* tp_iternext */
-  IpMeta_methods,             /* tp_methods */
-  0,             /* tp_members */
-  0,                         /* tp_getset */
-  0,                         /* tp_base */
-  0,                         /* tp_dict */
-  0,                         /* tp_descr_get */
-  0,                         /* tp_descr_set */
-  0,                         /* tp_dictoffset */
-  (initproc)IpMeta_init,  /* tp_init */
-  0,                         /* tp_alloc */
-  IpMeta_new,             /* tp_new */
+static PyType_Spec IpMeta_spec = {
+  IpMetaTypeName,
+  sizeof(IpMetaObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE,
+  IpMeta_slots,
 };
 
-PyTypeObject *_pyipmeta_ipmeta_get_IpMetaType()
+PyType_Spec *_pyipmeta_ipmeta_get_IpMetaSpec()
 {
-  return &IpMetaType;
+  return &IpMeta_spec;
 }
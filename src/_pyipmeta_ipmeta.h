@@ -35,7 +35,72 @@
 #ifndef ___pyipmeta_ipmeta_H
 #define ___pyipmeta_ipmeta_H
 
-/** Expose the IpMetaType structure */
-PyTypeObject *_pyipmeta_ipmeta_get_IpMetaType(void);
+#include "_pyipmeta_annotate.h"
+#include "_pyipmeta_guard.h"
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_pool.h"
+#include "_pyipmeta_presence.h"
+#include <libipmeta.h>
+
+typedef struct {
+  PyObject_HEAD
+
+  /* libipmeta Instance Handle */
+  ipmeta_t *ipm;
+
+  /* range index used for batch lookups (built on demand, and not changed
+   * once published) */
+  pyipmeta_index_t *index;
+
+  /* build DIR-24-8 tables for IPv4 lookups as soon as providers are
+   * enabled (datastructure="dir-24-8") */
+  int dir24;
+
+  /* which blocks of address space each provider has records for, so that
+   * lookups that are sure to miss can skip libipmeta */
+  pyipmeta_presence_t presence;
+
+  /* build the spatial index as soon as geolocation providers are enabled
+   * (spatial_index=True) rather than on the first spatial query */
+  int spatial;
+
+  /* worker threads for asynchronous lookups (started on demand) */
+  pyipmeta_pool_t *pool;
+
+  /* lookups (on any thread, with or without the GIL) are readers, and
+   * enable_provider is the writer */
+  pyipmeta_guard_t *guard;
+
+  /* lookup counters and latency histograms (may be shared with the
+   * instances this one replaces) */
+  pyipmeta_metrics_t *metrics;
+
+} IpMetaObject;
+
+/** Expose the IpMeta type spec */
+PyType_Spec *_pyipmeta_ipmeta_get_IpMetaSpec(void);
+
+/** Start using the IpMeta object from outside its own methods, so that
+ * enable_provider cannot change it in the meantime
+ *
+ * @return the value to pass to _pyipmeta_ipmeta_end, or -1 with a Python
+ * exception set
+ */
+int _pyipmeta_ipmeta_begin(IpMetaObject *self);
+
+/** Stop using the IpMeta object */
+void _pyipmeta_ipmeta_end(IpMetaObject *self, int shard);
+
+/** Make sure the range index has been built
+ *
+ * The index has tables for all the enabled providers, so that it never
+ * changes once returned and threads can search it at will.
+ *
+ * @return the index (owned by the IpMeta object), or NULL with a Python
+ * exception set
+ */
+pyipmeta_index_t *_pyipmeta_ipmeta_get_index(IpMetaObject *self);
 
 #endif /* ___pyipmeta_ipmeta_H */
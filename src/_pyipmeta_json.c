@@ -0,0 +1,482 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_util.h"
+#include <inttypes.h>
+#include <libipmeta.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* ========== BUFFER ========== */
+
+int _pyipmeta_buf_reserve(pyipmeta_buf_t *buf, size_t extra)
+{
+  size_t new_alloc;
+  char *new_data;
+
+  if (buf->len + extra <= buf->alloc) {
+    return 0;
+  }
+  new_alloc = buf->alloc ? buf->alloc : 1024;
+  while (new_alloc < buf->len + extra) {
+    new_alloc *= 2;
+  }
+  if ((new_data = realloc(buf->data, new_alloc)) == NULL) {
+    return -1;
+  }
+  buf->data = new_data;
+  buf->alloc = new_alloc;
+  return 0;
+}
+
+int _pyipmeta_buf_append(pyipmeta_buf_t *buf, const char *data, size_t len)
+{
+  if (_pyipmeta_buf_reserve(buf, len) != 0) {
+    return -1;
+  }
+  memcpy(buf->data + buf->len, data, len);
+  buf->len += len;
+  return 0;
+}
+
+int _pyipmeta_buf_puts(pyipmeta_buf_t *buf, const char *str)
+{
+  return _pyipmeta_buf_append(buf, str, strlen(str));
+}
+
+void _pyipmeta_buf_consume(pyipmeta_buf_t *buf, size_t len)
+{
+  if (len >= buf->len) {
+    buf->len = 0;
+    return;
+  }
+  memmove(buf->data, buf->data + len, buf->len - len);
+  buf->len -= len;
+}
+
+void _pyipmeta_buf_free(pyipmeta_buf_t *buf)
+{
+  free(buf->data);
+  buf->data = NULL;
+  buf->len = buf->alloc = 0;
+}
+
+int _pyipmeta_buf_u64(pyipmeta_buf_t *buf, uint64_t val)
+{
+  char tmp[24];
+  int len = snprintf(tmp, sizeof(tmp), "%" PRIu64, val);
+  return _pyipmeta_buf_append(buf, tmp, len);
+}
+
+int _pyipmeta_buf_double(pyipmeta_buf_t *buf, double val)
+{
+  char tmp[32], digits[20], out[48];
+  int prec, exp, ndigits = 0, len = 0, i;
+  char *p;
+
+  /* JSON has no NaN or infinity */
+  if (!isfinite(val)) {
+    return _pyipmeta_buf_append(buf, "null", 4);
+  }
+  /* the fewest significant digits that read back as the same double */
+  for (prec = 0; prec < 17; prec++) {
+    snprintf(tmp, sizeof(tmp), "%.*e", prec, val);
+    if (strtod(tmp, NULL) == val) {
+      break;
+    }
+  }
+  for (p = tmp; *p != 'e'; p++) {
+    if (*p >= '0' && *p <= '9') {
+      digits[ndigits++] = *p;
+    }
+  }
+  exp = atoi(p + 1);
+  if (val < 0 || (val == 0 && signbit(val))) {
+    out[len++] = '-';
+  }
+
+  /* like float.__repr__, positional unless the exponent is < -4 or >= 16 */
+  if (exp < -4 || exp >= 16) {
+    out[len++] = digits[0];
+    if (ndigits > 1) {
+      out[len++] = '.';
+      memcpy(out + len, digits + 1, ndigits - 1);
+      len += ndigits - 1;
+    }
+    len += snprintf(out + len, sizeof(out) - len, "e%c%02d",
+                    exp < 0 ? '-' : '+', abs(exp));
+  } else if (exp < 0) {
+    out[len++] = '0';
+    out[len++] = '.';
+    for (i = -1; i > exp; i--) {
+      out[len++] = '0';
+    }
+    memcpy(out + len, digits, ndigits);
+    len += ndigits;
+  } else {
+    for (i = 0; i <= exp; i++) {
+      out[len++] = (i < ndigits) ? digits[i] : '0';
+    }
+    out[len++] = '.';
+    if (ndigits > exp + 1) {
+      memcpy(out + len, digits + exp + 1, ndigits - exp - 1);
+      len += ndigits - exp - 1;
+    } else {
+      out[len++] = '0';
+    }
+  }
+  return _pyipmeta_buf_append(buf, out, len);
+}
+
+/* ========== JSON VALUES ========== */
+
+/* Length of the valid UTF-8 sequence at s, or 0 if it is invalid */
+static size_t utf8_seq_len(const unsigned char *s, size_t avail)
+{
+  size_t len, i;
+  uint32_t cp;
+
+  if (s[0] < 0x80) {
+    return 1;
+  } else if ((s[0] & 0xE0) == 0xC0) {
+    len = 2;
+    cp = s[0] & 0x1F;
+  } else if ((s[0] & 0xF0) == 0xE0) {
+    len = 3;
+    cp = s[0] & 0x0F;
+  } else if ((s[0] & 0xF8) == 0xF0) {
+    len = 4;
+    cp = s[0] & 0x07;
+  } else {
+    return 0;
+  }
+  if (len > avail) {
+    return 0;
+  }
+  for (i = 1; i < len; i++) {
+    if ((s[i] & 0xC0) != 0x80) {
+      return 0;
+    }
+    cp = (cp << 6) | (s[i] & 0x3F);
+  }
+  /* reject overlong encodings, surrogates and out of range code points */
+  if ((len == 2 && cp < 0x80) || (len == 3 && cp < 0x800) ||
+      (len == 4 && cp < 0x10000) || (cp >= 0xD800 && cp <= 0xDFFF) ||
+      cp > 0x10FFFF) {
+    return 0;
+  }
+  return len;
+}
+
+int _pyipmeta_buf_utf8(pyipmeta_buf_t *buf, const char *str, size_t len)
+{
+  const unsigned char *s = (const unsigned char *)str;
+  size_t i = 0, run, seq;
+
+  /* worst case every byte is replaced */
+  if (_pyipmeta_buf_reserve(buf, len * 3) != 0) {
+    return -1;
+  }
+  while (i < len) {
+    for (run = i; run < len && s[run] < 0x80; run++) {
+    }
+    while (run < len && (seq = utf8_seq_len(s + run, len - run)) != 0) {
+      run += seq;
+      while (run < len && s[run] < 0x80) {
+        run++;
+      }
+    }
+    memcpy(buf->data + buf->len, s + i, run - i);
+    buf->len += run - i;
+    if ((i = run) < len) {
+      memcpy(buf->data + buf->len, "\xEF\xBF\xBD", 3);
+      buf->len += 3;
+      i++;
+    }
+  }
+  return 0;
+}
+
+int _pyipmeta_json_string(pyipmeta_buf_t *buf, const char *str, size_t len)
+{
+  const unsigned char *s = (const unsigned char *)str;
+  size_t i = 0, run, seq;
+  char esc[8];
+
+  /* worst case every byte is expanded to \u00XX */
+  if (_pyipmeta_buf_reserve(buf, len * 6 + 2) != 0) {
+    return -1;
+  }
+  buf->data[buf->len++] = '"';
+  while (i < len) {
+    /* copy runs of characters that need no escaping in one go */
+    for (run = i; run < len && s[run] >= 0x20 && s[run] < 0x80 &&
+                  s[run] != '"' && s[run] != '\\';
+         run++) {
+    }
+    memcpy(buf->data + buf->len, s + i, run - i);
+    buf->len += run - i;
+    if ((i = run) == len) {
+      break;
+    }
+
+    if (s[i] >= 0x80) {
+      if ((seq = utf8_seq_len(s + i, len - i)) == 0) {
+        /* U+FFFD, like the "replace" error handler */
+        memcpy(buf->data + buf->len, "\xEF\xBF\xBD", 3);
+        buf->len += 3;
+        i++;
+      } else {
+        memcpy(buf->data + buf->len, s + i, seq);
+        buf->len += seq;
+        i += seq;
+      }
+      continue;
+    }
+
+    switch (s[i]) {
+    case '"':
+      memcpy(esc, "\\\"", 3);
+      break;
+    case '\\':
+      memcpy(esc, "\\\\", 3);
+      break;
+    case '\n':
+      memcpy(esc, "\\n", 3);
+      break;
+    case '\r':
+      memcpy(esc, "\\r", 3);
+      break;
+    case '\t':
+      memcpy(esc, "\\t", 3);
+      break;
+    default:
+      snprintf(esc, sizeof(esc), "\\u%04x", s[i]);
+      break;
+    }
+    memcpy(buf->data + buf->len, esc, strlen(esc));
+    buf->len += strlen(esc);
+    i++;
+  }
+  buf->data[buf->len++] = '"';
+  return 0;
+}
+
+static int json_cstring(pyipmeta_buf_t *buf, const char *str)
+{
+  return _pyipmeta_json_string(buf, str, strlen(str));
+}
+
+static int json_u32_list(pyipmeta_buf_t *buf, const uint32_t *vals, int cnt)
+{
+  int i;
+
+  if (_pyipmeta_buf_append(buf, "[", 1) != 0) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    if ((i > 0 && _pyipmeta_buf_append(buf, ", ", 2) != 0) ||
+        _pyipmeta_buf_u64(buf, vals[i]) != 0) {
+      return -1;
+    }
+  }
+  return _pyipmeta_buf_append(buf, "]", 1);
+}
+
+/* ========== RECORDS ========== */
+
+#define KEY(name) _pyipmeta_buf_puts(buf, name)
+
+static const char *field_names[PYIPMETA_FIELD_CNT] = {
+  "source",
+  "id",
+  "country_code",
+  "continent_code",
+  "region",
+  "city",
+  "post_code",
+  "lat_long",
+  "metro_code",
+  "area_code",
+  "region_code",
+  "connection_speed",
+  "asns",
+  "asn_ip_count",
+  "polygon_ids",
+  "matched_ip_count",
+};
+
+const pyipmeta_field_t _pyipmeta_all_fields[PYIPMETA_FIELD_CNT] = {
+  PYIPMETA_FIELD_SOURCE,
+  PYIPMETA_FIELD_ID,
+  PYIPMETA_FIELD_COUNTRY_CODE,
+  PYIPMETA_FIELD_CONTINENT_CODE,
+  PYIPMETA_FIELD_REGION,
+  PYIPMETA_FIELD_CITY,
+  PYIPMETA_FIELD_POST_CODE,
+  PYIPMETA_FIELD_LAT_LONG,
+  PYIPMETA_FIELD_METRO_CODE,
+  PYIPMETA_FIELD_AREA_CODE,
+  PYIPMETA_FIELD_REGION_CODE,
+  PYIPMETA_FIELD_CONNECTION_SPEED,
+  PYIPMETA_FIELD_ASNS,
+  PYIPMETA_FIELD_ASN_IP_COUNT,
+  PYIPMETA_FIELD_POLYGON_IDS,
+  PYIPMETA_FIELD_MATCHED_IP_COUNT,
+};
+
+const char *_pyipmeta_field_name(pyipmeta_field_t field)
+{
+  return field_names[field];
+}
+
+int _pyipmeta_field_by_name(const char *name)
+{
+  int i;
+  for (i = 0; i < PYIPMETA_FIELD_CNT; i++) {
+    if (strcmp(field_names[i], name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static int json_field(pyipmeta_buf_t *buf, ipmeta_record_t *rec,
+                      uint64_t num_ips, pyipmeta_field_t field)
+{
+  switch (field) {
+  case PYIPMETA_FIELD_SOURCE:
+    return _pyipmeta_buf_u64(buf, rec->source);
+  case PYIPMETA_FIELD_ID:
+    return _pyipmeta_buf_u64(buf, rec->id);
+  case PYIPMETA_FIELD_COUNTRY_CODE:
+    return json_cstring(buf, STR_SAFE(rec->country_code));
+  case PYIPMETA_FIELD_CONTINENT_CODE:
+    return json_cstring(buf, STR_SAFE(rec->continent_code));
+  case PYIPMETA_FIELD_REGION:
+    return json_cstring(buf, STR_SAFE(rec->region));
+  case PYIPMETA_FIELD_CITY:
+    return json_cstring(buf, STR_SAFE(rec->city));
+  case PYIPMETA_FIELD_POST_CODE:
+    return json_cstring(buf, STR_SAFE(rec->post_code));
+  case PYIPMETA_FIELD_LAT_LONG:
+    return (KEY("[") || _pyipmeta_buf_double(buf, rec->latitude) || KEY(", ") ||
+            _pyipmeta_buf_double(buf, rec->longitude) || KEY("]"));
+  case PYIPMETA_FIELD_METRO_CODE:
+    return _pyipmeta_buf_u64(buf, rec->metro_code);
+  case PYIPMETA_FIELD_AREA_CODE:
+    return _pyipmeta_buf_u64(buf, rec->area_code);
+  case PYIPMETA_FIELD_REGION_CODE:
+    return _pyipmeta_buf_u64(buf, rec->region_code);
+  case PYIPMETA_FIELD_CONNECTION_SPEED:
+    return json_cstring(buf, STR_SAFE(rec->conn_speed));
+  case PYIPMETA_FIELD_ASNS:
+    return json_u32_list(buf, rec->asn, rec->asn_cnt);
+  case PYIPMETA_FIELD_ASN_IP_COUNT:
+    return _pyipmeta_buf_u64(buf, rec->asn_ip_cnt);
+  case PYIPMETA_FIELD_POLYGON_IDS:
+    return json_u32_list(buf, rec->polygon_ids, rec->polygon_ids_cnt);
+  case PYIPMETA_FIELD_MATCHED_IP_COUNT:
+    return _pyipmeta_buf_u64(buf, num_ips);
+  default:
+    return -1;
+  }
+}
+
+int _pyipmeta_json_record(pyipmeta_buf_t *buf, ipmeta_record_t *rec,
+                          uint64_t num_ips, const pyipmeta_field_t *fields,
+                          int fields_cnt)
+{
+  int i;
+
+  if (fields == NULL) {
+    fields = _pyipmeta_all_fields;
+    fields_cnt = PYIPMETA_FIELD_CNT;
+  }
+  if (KEY("{")) {
+    return -1;
+  }
+  for (i = 0; i < fields_cnt; i++) {
+    if ((i > 0 && KEY(", ")) || KEY("\"") ||
+        KEY(field_names[fields[i]]) || KEY("\": ") ||
+        json_field(buf, rec, num_ips, fields[i])) {
+      return -1;
+    }
+  }
+  return KEY("}");
+}
+
+int _pyipmeta_json_record_set(pyipmeta_buf_t *buf, ipmeta_record_set_t *set,
+                              const pyipmeta_field_t *fields,
+                              int fields_cnt)
+{
+  ipmeta_record_t *rec;
+  uint64_t num_ips = 0;
+  int first = 1;
+
+  if (KEY("[")) {
+    return -1;
+  }
+  ipmeta_record_set_rewind(set);
+  while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+    if ((!first && KEY(", ")) ||
+        _pyipmeta_json_record(buf, rec, num_ips, fields, fields_cnt)) {
+      return -1;
+    }
+    first = 0;
+  }
+  return KEY("]");
+}
+
+int _pyipmeta_json_lookup(pyipmeta_buf_t *buf, const char *query,
+                          size_t query_len, int rc, ipmeta_record_set_t *set,
+                          const pyipmeta_field_t *fields, int fields_cnt)
+{
+  if (KEY("{\"query\": ") ||
+      _pyipmeta_json_string(buf, query, query_len)) {
+    return -1;
+  }
+  if (rc < 0) {
+    return (KEY(", \"error\": ") ||
+            json_cstring(buf, rc == IPMETA_ERR_INPUT
+                                ? "Invalid address or prefix"
+                                : "Internal error") ||
+            KEY("}"));
+  }
+  if (KEY(", \"result\": ") ||
+      _pyipmeta_json_record_set(buf, set, fields, fields_cnt) || KEY("}")) {
+    return -1;
+  }
+  return 0;
+}
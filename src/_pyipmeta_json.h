@@ -0,0 +1,138 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_json_H
+#define ___pyipmeta_json_H
+
+#include <libipmeta.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Record fields that can be selected for output, in the same order as the
+ * keys of the Python dicts returned by IpMeta.lookup */
+typedef enum pyipmeta_field {
+  PYIPMETA_FIELD_SOURCE,
+  PYIPMETA_FIELD_ID,
+  PYIPMETA_FIELD_COUNTRY_CODE,
+  PYIPMETA_FIELD_CONTINENT_CODE,
+  PYIPMETA_FIELD_REGION,
+  PYIPMETA_FIELD_CITY,
+  PYIPMETA_FIELD_POST_CODE,
+  PYIPMETA_FIELD_LAT_LONG,
+  PYIPMETA_FIELD_METRO_CODE,
+  PYIPMETA_FIELD_AREA_CODE,
+  PYIPMETA_FIELD_REGION_CODE,
+  PYIPMETA_FIELD_CONNECTION_SPEED,
+  PYIPMETA_FIELD_ASNS,
+  PYIPMETA_FIELD_ASN_IP_COUNT,
+  PYIPMETA_FIELD_POLYGON_IDS,
+  PYIPMETA_FIELD_MATCHED_IP_COUNT,
+  PYIPMETA_FIELD_CNT,
+} pyipmeta_field_t;
+
+/** Growable byte buffer that JSON is written into */
+typedef struct pyipmeta_buf {
+  char *data;
+  size_t len;
+  size_t alloc;
+} pyipmeta_buf_t;
+
+/** Make sure there is room for extra bytes in the buffer
+ *
+ * @return 0 if successful, -1 if out of memory
+ */
+int _pyipmeta_buf_reserve(pyipmeta_buf_t *buf, size_t extra);
+
+/** Append bytes to the buffer */
+int _pyipmeta_buf_append(pyipmeta_buf_t *buf, const char *data, size_t len);
+
+/** Append a NUL-terminated string to the buffer */
+int _pyipmeta_buf_puts(pyipmeta_buf_t *buf, const char *str);
+
+/** Append an unsigned integer in decimal */
+int _pyipmeta_buf_u64(pyipmeta_buf_t *buf, uint64_t val);
+
+/** Append the shortest representation that reads back as the same double,
+ * written the way Python's json module (i.e., float.__repr__) does, or null
+ * if it is not finite */
+int _pyipmeta_buf_double(pyipmeta_buf_t *buf, double val);
+
+/** Remove the first len bytes from the buffer */
+void _pyipmeta_buf_consume(pyipmeta_buf_t *buf, size_t len);
+
+/** Free the memory used by the buffer (the buffer itself is reusable) */
+void _pyipmeta_buf_free(pyipmeta_buf_t *buf);
+
+/** All the fields, in order */
+extern const pyipmeta_field_t _pyipmeta_all_fields[PYIPMETA_FIELD_CNT];
+
+/** Get the name of a field (i.e., its Python dict key) */
+const char *_pyipmeta_field_name(pyipmeta_field_t field);
+
+/** Get the field with the given name
+ *
+ * @return the field, or -1 if there is no such field
+ */
+int _pyipmeta_field_by_name(const char *name);
+
+/** Append a JSON string, replacing invalid UTF-8 with U+FFFD */
+int _pyipmeta_json_string(pyipmeta_buf_t *buf, const char *str, size_t len);
+
+/** Append a string as it is, except that invalid UTF-8 is replaced with
+ * U+FFFD (like Python's "replace" error handler) */
+int _pyipmeta_buf_utf8(pyipmeta_buf_t *buf, const char *str, size_t len);
+
+/** Append a record as a JSON object with the given fields
+ *
+ * If fields is NULL, all fields are written, giving the same keys as the
+ * Python dicts returned by IpMeta.lookup.
+ */
+int _pyipmeta_json_record(pyipmeta_buf_t *buf, ipmeta_record_t *rec,
+                          uint64_t num_ips, const pyipmeta_field_t *fields,
+                          int fields_cnt);
+
+/** Append the records in a record set as a JSON array */
+int _pyipmeta_json_record_set(pyipmeta_buf_t *buf, ipmeta_record_set_t *set,
+                              const pyipmeta_field_t *fields,
+                              int fields_cnt);
+
+/** Append a {"query": ..., "result": [...]} object for a lookup result.
+ *
+ * If rc is negative (i.e., the lookup failed), a {"query": ...,
+ * "error": ...} object is written instead. Fields are selected as for
+ * _pyipmeta_json_record.
+ */
+int _pyipmeta_json_lookup(pyipmeta_buf_t *buf, const char *query,
+                          size_t query_len, int rc, ipmeta_record_set_t *set,
+                          const pyipmeta_field_t *fields, int fields_cnt);
+
+#endif /* ___pyipmeta_json_H */
@@ -0,0 +1,244 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_metrics.h"
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* counters may be shared by threads that landed on the same shard */
+#define ADD(field, val) __atomic_fetch_add(&(field), (val), __ATOMIC_RELAXED)
+#define LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+/* shard used by the current thread (assigned round-robin on first use) */
+static __thread int thread_shard = -1;
+static int next_shard = 0;
+
+static pyipmeta_metrics_shard_t *get_shard(pyipmeta_metrics_t *metrics)
+{
+  if (thread_shard < 0) {
+    thread_shard = __atomic_fetch_add(&next_shard, 1, __ATOMIC_RELAXED) %
+                   PYIPMETA_METRICS_SHARDS;
+  }
+  return &metrics->shards[thread_shard];
+}
+
+static int get_bucket(uint64_t ns)
+{
+  int bucket;
+
+  if (ns <= 256) {
+    return 0;
+  }
+  /* smallest b such that ns <= 2^b, less the 2^8 of the first bucket */
+  bucket = (64 - __builtin_clzll(ns - 1)) - 8;
+  return bucket < PYIPMETA_METRICS_BUCKETS ? bucket
+                                           : PYIPMETA_METRICS_BUCKETS - 1;
+}
+
+pyipmeta_metrics_t *_pyipmeta_metrics_init(void)
+{
+  pyipmeta_metrics_t *metrics;
+
+  if (posix_memalign((void **)&metrics, 64, sizeof(*metrics)) != 0) {
+    return NULL;
+  }
+  memset(metrics, 0, sizeof(*metrics));
+  metrics->refcnt = 1;
+  return metrics;
+}
+
+void _pyipmeta_metrics_incref(pyipmeta_metrics_t *metrics)
+{
+  __atomic_add_fetch(&metrics->refcnt, 1, __ATOMIC_RELAXED);
+}
+
+void _pyipmeta_metrics_decref(pyipmeta_metrics_t *metrics)
+{
+  if (metrics != NULL &&
+      __atomic_sub_fetch(&metrics->refcnt, 1, __ATOMIC_ACQ_REL) == 0) {
+    free(metrics);
+  }
+}
+
+uint64_t _pyipmeta_metrics_now(pyipmeta_metrics_t *metrics)
+{
+  struct timespec ts;
+
+  if (metrics == NULL || !LOAD(metrics->timing)) {
+    return 0;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  /* never 0, which means "not timed" */
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec + 1;
+}
+
+/* Count a lookup in the shard and time it from start, returning the time */
+static uint64_t count_lookup(pyipmeta_metrics_t *metrics,
+                             pyipmeta_metrics_shard_t *shard, uint64_t start)
+{
+  uint64_t now = 0;
+
+  if (start != 0) {
+    now = _pyipmeta_metrics_now(metrics);
+    if (now != 0) {
+      ADD(shard->hist[PYIPMETA_HIST_LOOKUP][get_bucket(now - start)], 1);
+      ADD(shard->hist_sum_ns[PYIPMETA_HIST_LOOKUP], now - start);
+    }
+  }
+  ADD(shard->lookups, 1);
+  return now;
+}
+
+uint64_t _pyipmeta_metrics_lookup(pyipmeta_metrics_t *metrics, int rc,
+                                  ipmeta_record_set_t *set, uint64_t start)
+{
+  pyipmeta_metrics_shard_t *shard;
+  ipmeta_record_t *rec;
+  uint64_t num_ips, now, matched = 0;
+
+  if (metrics == NULL) {
+    return 0;
+  }
+  shard = get_shard(metrics);
+  now = count_lookup(metrics, shard, start);
+  if (rc < 0) {
+    if (rc == IPMETA_ERR_INPUT) {
+      ADD(shard->errors_input, 1);
+    } else {
+      ADD(shard->errors_internal, 1);
+    }
+    return now;
+  }
+  ipmeta_record_set_rewind(set);
+  while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+    if (rec->source <= IPMETA_PROVIDER_MAX) {
+      ADD(shard->records[rec->source], 1);
+    }
+    matched++;
+  }
+  if (matched == 0) {
+    ADD(shard->misses, 1);
+  }
+  return now;
+}
+
+uint64_t _pyipmeta_metrics_found(pyipmeta_metrics_t *metrics, uint32_t found,
+                                 uint64_t start)
+{
+  pyipmeta_metrics_shard_t *shard;
+  uint64_t now;
+  int id;
+
+  if (metrics == NULL) {
+    return 0;
+  }
+  shard = get_shard(metrics);
+  now = count_lookup(metrics, shard, start);
+  if (found == 0) {
+    ADD(shard->misses, 1);
+  }
+  for (id = 1; id <= IPMETA_PROVIDER_MAX; id++) {
+    if (found & IPMETA_PROV_TO_MASK(id)) {
+      ADD(shard->records[id], 1);
+    }
+  }
+  return now;
+}
+
+void _pyipmeta_metrics_time(pyipmeta_metrics_t *metrics,
+                            pyipmeta_metrics_hist_t hist, uint64_t start)
+{
+  pyipmeta_metrics_shard_t *shard;
+  uint64_t now;
+
+  if (start == 0 || (now = _pyipmeta_metrics_now(metrics)) == 0) {
+    return;
+  }
+  shard = get_shard(metrics);
+  ADD(shard->hist[hist][get_bucket(now - start)], 1);
+  ADD(shard->hist_sum_ns[hist], now - start);
+}
+
+void _pyipmeta_metrics_batch(pyipmeta_metrics_t *metrics, uint64_t cnt)
+{
+  if (metrics != NULL) {
+    ADD(get_shard(metrics)->batch_lookups, cnt);
+  }
+}
+
+void _pyipmeta_metrics_filtered(pyipmeta_metrics_t *metrics)
+{
+  pyipmeta_metrics_shard_t *shard;
+
+  if (metrics != NULL) {
+    shard = get_shard(metrics);
+    ADD(shard->lookups, 1);
+    ADD(shard->misses, 1);
+    ADD(shard->filtered, 1);
+  }
+}
+
+void _pyipmeta_metrics_sum(pyipmeta_metrics_t *metrics,
+                           pyipmeta_metrics_shard_t *total)
+{
+  pyipmeta_metrics_shard_t *shard;
+  int i, j, k;
+
+  memset(total, 0, sizeof(*total));
+  for (i = 0; i < PYIPMETA_METRICS_SHARDS; i++) {
+    shard = &metrics->shards[i];
+    total->lookups += LOAD(shard->lookups);
+    total->errors_input += LOAD(shard->errors_input);
+    total->errors_internal += LOAD(shard->errors_internal);
+    total->misses += LOAD(shard->misses);
+    total->batch_lookups += LOAD(shard->batch_lookups);
+    total->filtered += LOAD(shard->filtered);
+    for (j = 0; j <= IPMETA_PROVIDER_MAX; j++) {
+      total->records[j] += LOAD(shard->records[j]);
+    }
+    for (j = 0; j < PYIPMETA_HIST_CNT; j++) {
+      for (k = 0; k < PYIPMETA_METRICS_BUCKETS; k++) {
+        total->hist[j][k] += LOAD(shard->hist[j][k]);
+      }
+      total->hist_sum_ns[j] += LOAD(shard->hist_sum_ns[j]);
+    }
+  }
+}
+
+uint64_t _pyipmeta_metrics_bucket_le(int bucket)
+{
+  if (bucket >= PYIPMETA_METRICS_BUCKETS - 1) {
+    return 0;
+  }
+  return (uint64_t)1 << (bucket + 8);
+}
@@ -0,0 +1,140 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_metrics_H
+#define ___pyipmeta_metrics_H
+
+#include <libipmeta.h>
+#include <stdint.h>
+
+/** Number of counter shards; threads are spread over them so that they
+ * rarely update the same cache line */
+#define PYIPMETA_METRICS_SHARDS 32
+
+/** Number of latency histogram buckets. Bucket i counts durations of at most
+ * 2^(i+8) ns (256 ns up to about 1 s); the last bucket counts the rest. */
+#define PYIPMETA_METRICS_BUCKETS 24
+
+/** Stages of a lookup with latency histograms */
+typedef enum pyipmeta_metrics_hist {
+  /** ipmeta_lookup itself */
+  PYIPMETA_HIST_LOOKUP,
+  /** converting the records to Python objects, JSON or CSV */
+  PYIPMETA_HIST_CONVERT,
+  PYIPMETA_HIST_CNT,
+} pyipmeta_metrics_hist_t;
+
+/** One shard of lookup counters */
+typedef struct pyipmeta_metrics_shard {
+  /** number of single lookups (ipmeta_lookup calls and filtered ones) */
+  uint64_t lookups;
+  /** lookups that failed with IPMETA_ERR_INPUT */
+  uint64_t errors_input;
+  /** lookups that failed for any other reason */
+  uint64_t errors_internal;
+  /** successful lookups that matched no records */
+  uint64_t misses;
+  /** records returned, indexed by provider ID */
+  uint64_t records[IPMETA_PROVIDER_MAX + 1];
+  /** addresses looked up with lookup_batch/lookup_batch6 */
+  uint64_t batch_lookups;
+  /** lookups (and misses) answered by the presence filter without calling
+   * ipmeta_lookup */
+  uint64_t filtered;
+
+  uint64_t hist[PYIPMETA_HIST_CNT][PYIPMETA_METRICS_BUCKETS];
+  uint64_t hist_sum_ns[PYIPMETA_HIST_CNT];
+} __attribute__((aligned(64))) pyipmeta_metrics_shard_t;
+
+/** Lookup metrics, shared by an IpMeta object and the threads working on
+ * its behalf */
+typedef struct pyipmeta_metrics {
+  pyipmeta_metrics_shard_t shards[PYIPMETA_METRICS_SHARDS];
+
+  /** set if lookups should be timed */
+  int timing;
+
+  /** number of IpMeta objects sharing these metrics */
+  int refcnt;
+} pyipmeta_metrics_t;
+
+/** Allocate a set of metrics with a reference count of 1 */
+pyipmeta_metrics_t *_pyipmeta_metrics_init(void);
+
+/** Take an extra reference to the metrics */
+void _pyipmeta_metrics_incref(pyipmeta_metrics_t *metrics);
+
+/** Drop a reference to the metrics, freeing them when none are left */
+void _pyipmeta_metrics_decref(pyipmeta_metrics_t *metrics);
+
+/** Get the current time for timing a lookup stage
+ *
+ * @return the time in ns, or 0 if timing is disabled (or metrics is NULL)
+ */
+uint64_t _pyipmeta_metrics_now(pyipmeta_metrics_t *metrics);
+
+/** Count the result of an ipmeta_lookup call that started at the given time
+ *
+ * @return the current time as for _pyipmeta_metrics_now, so that the
+ * conversion stage can be timed from it
+ */
+uint64_t _pyipmeta_metrics_lookup(pyipmeta_metrics_t *metrics, int rc,
+                                  ipmeta_record_set_t *set, uint64_t start);
+
+/** Count a lookup that was answered from the index without calling
+ * ipmeta_lookup, and that started at the given time
+ *
+ * @param found         mask (as IPMETA_PROV_TO_MASK) of the providers that
+ *                      returned a record
+ * @return the current time as for _pyipmeta_metrics_lookup
+ */
+uint64_t _pyipmeta_metrics_found(pyipmeta_metrics_t *metrics, uint32_t found,
+                                 uint64_t start);
+
+/** Add the time since start to the histogram for the given stage */
+void _pyipmeta_metrics_time(pyipmeta_metrics_t *metrics,
+                            pyipmeta_metrics_hist_t hist, uint64_t start);
+
+/** Count addresses looked up in a batch */
+void _pyipmeta_metrics_batch(pyipmeta_metrics_t *metrics, uint64_t cnt);
+
+/** Count a lookup that the presence filter answered with a miss */
+void _pyipmeta_metrics_filtered(pyipmeta_metrics_t *metrics);
+
+/** Add up all the shards */
+void _pyipmeta_metrics_sum(pyipmeta_metrics_t *metrics,
+                           pyipmeta_metrics_shard_t *total);
+
+/** Get the upper bound of a histogram bucket in ns (0 for the last one) */
+uint64_t _pyipmeta_metrics_bucket_le(int bucket);
+
+#endif /* ___pyipmeta_metrics_H */
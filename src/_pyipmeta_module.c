@@ -31,60 +31,36 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "_pyipmeta_aggregator.h"
+#include "_pyipmeta_arrow.h"
+#include "_pyipmeta_history.h"
+#include "_pyipmeta_index.h"
 #include "_pyipmeta_ipmeta.h"
+#include "_pyipmeta_module.h"
+#include "_pyipmeta_pfx2as.h"
 #include "_pyipmeta_provider.h"
 #include "_pyipmeta_record.h"
+#include "_pyipmeta_server.h"
 #include <Python.h>
 
 static PyMethodDef module_methods[] = {
     {NULL}  /* Sentinel */
 };
 
-#define ADD_OBJECT(modname, objname)                                             \
+#define ADD_OBJECT(modname, objname)                                    \
   do {                                                                  \
-    if ((obj = _pyipmeta_##modname##_get_##objname##Type()) == NULL)   \
-      return NULL;                                                      \
-    if (PyType_Ready(obj) < 0)                                          \
-      return NULL;                                                      \
-    Py_INCREF(obj);                                                     \
-    PyModule_AddObject(m, #objname, (PyObject*)obj);         \
+    if ((state->objname##Type = (PyTypeObject *)PyType_FromModuleAndSpec( \
+           m, _pyipmeta_##modname##_get_##objname##Spec(), NULL)) == NULL) \
+      return -1;                                                        \
+    if (PyModule_AddType(m, state->objname##Type) != 0)                 \
+      return -1;                                                        \
   } while(0)
 
 #define MODULE_DOCSTRING "Module that provides a low-level interface to libipmeta"
 
-#if PY_MAJOR_VERSION > 2
-static struct PyModuleDef module_def = {
-	PyModuleDef_HEAD_INIT,
-	"_pyipmeta",
-	MODULE_DOCSTRING,
-	-1,
-	module_methods,
-	NULL,
-	NULL,
-	NULL,
-	NULL,
-};
-#endif
-
-#ifndef PyMODINIT_FUNC	/* declarations for DLL import/export */
-#define PyMODINIT_FUNC void
-#endif
-
-static PyObject *moduleinit(void)
+static int module_exec(PyObject *m)
 {
-  PyObject *m;
-  PyTypeObject *obj;
-
-#if PY_MAJOR_VERSION > 2
-  m = PyModule_Create(&module_def);
-#else
-  m = Py_InitModule3("_pyipmeta",
-					 module_methods,
-					 MODULE_DOCSTRING);
-#endif
-
-  if (m == NULL)
-    return NULL;
+  pyipmeta_state_t *state = PyModule_GetState(m);
 
   /* IpMeta object */
   ADD_OBJECT(ipmeta, IpMeta);
@@ -92,19 +68,98 @@ static PyObject *moduleinit(void)
   /* ipmeta provider object */
   ADD_OBJECT(provider, Provider);
 
-  return m;
+  /* native lookup server */
+  ADD_OBJECT(server, Server);
+
+  /* native aggregator of lookups into line protocol */
+  ADD_OBJECT(aggregator, Aggregator);
+
+  /* dated snapshots for time-travel lookups */
+  ADD_OBJECT(history, History);
+
+  /* pfx2as table reloaded by applying differences */
+  ADD_OBJECT(pfx2as, Pfx2asTable);
+
+  /* lookup results exported as Arrow columns */
+  ADD_OBJECT(arrow, ArrowBatch);
+
+  /* batch lookup constants */
+  if (PyModule_AddIntConstant(m, "INDEX_NONE", PYIPMETA_INDEX_NONE) != 0 ||
+      PyModule_AddStringConstant(m, "SEARCH_KERNEL",
+                                 _pyipmeta_index_kernel_name()) != 0) {
+    return -1;
+  }
+
+  return 0;
 }
 
-#if PY_MAJOR_VERSION > 2
-PyMODINIT_FUNC
-PyInit__pyipmeta(void)
+static int module_traverse(PyObject *m, visitproc visit, void *arg)
 {
-  return moduleinit();
+  pyipmeta_state_t *state = PyModule_GetState(m);
+
+  Py_VISIT(state->IpMetaType);
+  Py_VISIT(state->ProviderType);
+  Py_VISIT(state->ServerType);
+  Py_VISIT(state->AggregatorType);
+  Py_VISIT(state->HistoryType);
+  Py_VISIT(state->Pfx2asTableType);
+  Py_VISIT(state->ArrowBatchType);
+  return 0;
 }
-#else
-PyMODINIT_FUNC
-init_pyipmeta(void)
+
+static int module_clear(PyObject *m)
 {
-  moduleinit();
+  pyipmeta_state_t *state = PyModule_GetState(m);
+
+  Py_CLEAR(state->IpMetaType);
+  Py_CLEAR(state->ProviderType);
+  Py_CLEAR(state->ServerType);
+  Py_CLEAR(state->AggregatorType);
+  Py_CLEAR(state->HistoryType);
+  Py_CLEAR(state->Pfx2asTableType);
+  Py_CLEAR(state->ArrowBatchType);
+  return 0;
 }
+
+static void module_free(void *m)
+{
+  module_clear((PyObject *)m);
+}
+
+/* Nothing native is shared between interpreters (or needs the GIL): lookups
+ * keep their scratch space per thread, and objects guard their own state */
+static PyModuleDef_Slot module_slots[] = {
+  {Py_mod_exec, module_exec},
+#ifdef Py_mod_multiple_interpreters
+  {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
 #endif
+#ifdef Py_mod_gil
+  {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+  {0, NULL},
+};
+
+static struct PyModuleDef module_def = {
+  PyModuleDef_HEAD_INIT,
+  "_pyipmeta",
+  MODULE_DOCSTRING,
+  sizeof(pyipmeta_state_t),
+  module_methods,
+  module_slots,
+  module_traverse,
+  module_clear,
+  module_free,
+};
+
+pyipmeta_state_t *_pyipmeta_get_state(PyTypeObject *type)
+{
+  PyObject *m = PyType_GetModuleByDef(type, &module_def);
+
+  return m != NULL ? PyModule_GetState(m) : NULL;
+}
+
+PyMODINIT_FUNC
+PyInit__pyipmeta(void)
+{
+  return PyModuleDef_Init(&module_def);
+}
@@ -0,0 +1,58 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_module_H
+#define ___pyipmeta_module_H
+
+#include <Python.h>
+
+/** Per-module state, so that each (sub-)interpreter that imports the module
+ * gets its own types */
+typedef struct pyipmeta_state {
+  PyTypeObject *IpMetaType;
+  PyTypeObject *ProviderType;
+  PyTypeObject *ServerType;
+  PyTypeObject *AggregatorType;
+  PyTypeObject *HistoryType;
+  PyTypeObject *Pfx2asTableType;
+  PyTypeObject *ArrowBatchType;
+} pyipmeta_state_t;
+
+/** Get the state of the module that defines the given type (or one of its
+ * bases)
+ *
+ * This cannot fail for the types of the module and their subclasses, so the
+ * type of self (or the type given to tp_new) can always be passed.
+ */
+pyipmeta_state_t *_pyipmeta_get_state(PyTypeObject *type);
+
+#endif /* ___pyipmeta_module_H */
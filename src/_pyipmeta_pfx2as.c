@@ -0,0 +1,1499 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_index.h"
+#include "_pyipmeta_pfx2as.h"
+#include "_pyipmeta_record.h"
+#include "_pyipmeta_util.h"
+#include "pyutils.h"
+#include <arpa/inet.h>
+#include <libipmeta.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <Python.h>
+
+#define Pfx2asTableDocstring                                                \
+  "pfx2as table that is reloaded by applying only the changed prefixes"
+
+#define Pfx2asTableTypeName "_pyipmeta.Pfx2asTable"
+
+/* Maximum number of ranges in a chunk */
+#define CHUNK_MAX 256
+
+/* Pending ranges shorter than this are merged with the next chunk rather than
+ * written as a chunk of their own, so that chunks do not fragment */
+#define CHUNK_MIN (CHUNK_MAX / 4)
+
+/* Records are stored in fixed-size chunks that never move, so that readers
+ * can use them while new ones are added */
+#define REC_CHUNK_SHIFT 12
+#define REC_CHUNK (1 << REC_CHUNK_SHIFT)
+#define REC_DIR_SIZE 4096
+
+#define FAM_CNT 2
+#define FAM_V4 0
+#define FAM_V6 1
+
+/* Longer lines cannot be valid pfx2as lines */
+#define MAX_LINE_LEN 4096
+
+/* ========== RANGE TABLES ==========
+ *
+ * Each family's table is a sorted sequence of (start, record) ranges, where a
+ * range extends up to the start of the next one. Keys are IPv4 addresses, or
+ * the upper 64 bits of IPv6 addresses (like the range index, IPv6 is resolved
+ * to /64s). The sequence is split into chunks of at most CHUNK_MAX ranges,
+ * and a root lists the chunks. An update copies the chunks that contain
+ * changed ranges and the root; every other chunk is shared with the previous
+ * version.
+ */
+
+typedef struct chunk {
+  uint32_t cnt;
+  uint64_t *starts;
+  uint32_t *vals;
+} chunk_t;
+
+typedef struct root {
+  uint32_t cnt;
+  /* first start of each chunk */
+  uint64_t *keys;
+  chunk_t **chunks;
+} root_t;
+
+/* What readers see; replaced as a whole by each update */
+typedef struct version {
+  root_t *roots[FAM_CNT];
+} version_t;
+
+/* ========== WRITER STATE ========== */
+
+/* A prefix from the input (start is masked to the prefix length) */
+typedef struct pfx {
+  uint64_t start;
+  uint32_t group;
+  uint8_t len;
+} pfx_t;
+
+typedef struct pfx_array {
+  pfx_t *pfxs;
+  size_t cnt;
+  size_t alloc;
+} pfx_array_t;
+
+/* Address range whose ranges must be recomputed */
+typedef struct region {
+  uint64_t start;
+  uint8_t len;
+} region_t;
+
+typedef struct region_array {
+  region_t *regions;
+  size_t cnt;
+  size_t alloc;
+} region_array_t;
+
+/* Sequence of ranges being built */
+typedef struct seq {
+  uint64_t *starts;
+  uint32_t *vals;
+  size_t cnt;
+  size_t alloc;
+} seq_t;
+
+typedef struct ptr_array {
+  void **ptrs;
+  size_t cnt;
+  size_t alloc;
+} ptr_array_t;
+
+/* Counters for one update */
+typedef struct update_stats {
+  uint64_t lines;
+  uint64_t errors;
+  uint64_t skipped;
+  uint64_t inserted;
+  uint64_t deleted;
+  uint64_t changed;
+  uint64_t regions;
+  uint64_t chunks_new;
+  uint64_t chunks_freed;
+} update_stats_t;
+
+typedef struct {
+  PyObject_HEAD
+
+  /* current version; readers load it inside a read-side critical section */
+  version_t *version;
+
+  /* read-side critical sections are counted per epoch parity, so that an
+   * update can wait for the readers of the previous version to leave */
+  int epoch;
+  int64_t readers[2];
+
+  /* serializes updates */
+  pthread_mutex_t update_lock;
+
+  /* records (one per AS group); never freed while the table exists */
+  ipmeta_record_t *rec_dir[REC_DIR_SIZE];
+  uint32_t recs_cnt;
+
+  /* writer-only state: AS group string -> record index hash, IP counts,
+   * and the sorted prefixes of each family */
+  char **group_keys;
+  uint64_t *group_ips;
+  uint32_t groups_alloc;
+  uint32_t *group_hash;
+  uint32_t group_hash_size;
+  pfx_array_t pfxs[FAM_CNT];
+
+  uint64_t updates;
+  uint64_t ranges[FAM_CNT];
+  uint64_t chunks[FAM_CNT];
+
+} Pfx2asTableObject;
+
+/* ========== RCU ========== */
+
+static int rcu_read_lock(Pfx2asTableObject *self)
+{
+  int e;
+  for (;;) {
+    e = __atomic_load_n(&self->epoch, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&self->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&self->epoch, __ATOMIC_SEQ_CST) == e) {
+      return e;
+    }
+    __atomic_fetch_sub(&self->readers[e & 1], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void rcu_read_unlock(Pfx2asTableObject *self, int e)
+{
+  __atomic_fetch_sub(&self->readers[e & 1], 1, __ATOMIC_RELEASE);
+}
+
+/* Wait until no reader can still be using a version replaced before this
+ * call */
+static void rcu_synchronize(Pfx2asTableObject *self)
+{
+  int e = __atomic_load_n(&self->epoch, __ATOMIC_SEQ_CST);
+  __atomic_store_n(&self->epoch, e + 1, __ATOMIC_SEQ_CST);
+  while (__atomic_load_n(&self->readers[e & 1], __ATOMIC_SEQ_CST) != 0) {
+    sched_yield();
+  }
+}
+
+/* ========== HELPERS ========== */
+
+static int grow(void **ptr, size_t *alloc, size_t need, size_t size)
+{
+  size_t n = *alloc ? *alloc : 64;
+  void *p;
+  if (need <= *alloc) {
+    return 0;
+  }
+  while (n < need) {
+    n *= 2;
+  }
+  if ((p = realloc(*ptr, n * size)) == NULL) {
+    return -1;
+  }
+  *ptr = p;
+  *alloc = n;
+  return 0;
+}
+
+static int ptr_array_add(ptr_array_t *a, void *ptr)
+{
+  if (grow((void **)&a->ptrs, &a->alloc, a->cnt + 1, sizeof(void *)) != 0) {
+    return -1;
+  }
+  a->ptrs[a->cnt++] = ptr;
+  return 0;
+}
+
+static int seq_reserve(seq_t *s, size_t extra)
+{
+  size_t alloc = s->alloc;
+  if (grow((void **)&s->starts, &alloc, s->cnt + extra, sizeof(uint64_t)) !=
+      0) {
+    return -1;
+  }
+  alloc = s->alloc;
+  if (grow((void **)&s->vals, &alloc, s->cnt + extra, sizeof(uint32_t)) !=
+      0) {
+    return -1;
+  }
+  s->alloc = alloc;
+  return 0;
+}
+
+/* Append a range, merging it with the previous one if that has the same
+ * record, or replacing it if it has the same start */
+static int seq_push(seq_t *s, uint64_t start, uint32_t val)
+{
+  if (s->cnt > 0 && s->starts[s->cnt - 1] == start) {
+    s->cnt--;
+  }
+  if (s->cnt > 0 && s->vals[s->cnt - 1] == val) {
+    return 0;
+  }
+  if (seq_reserve(s, 1) != 0) {
+    return -1;
+  }
+  s->starts[s->cnt] = start;
+  s->vals[s->cnt++] = val;
+  return 0;
+}
+
+static void seq_free(seq_t *s)
+{
+  free(s->starts);
+  free(s->vals);
+  memset(s, 0, sizeof(*s));
+}
+
+static uint64_t key_max(int fam)
+{
+  return (fam == FAM_V4) ? UINT32_MAX : UINT64_MAX;
+}
+
+/* Last key covered by a prefix */
+static uint64_t pfx_end(int fam, uint64_t start, int len)
+{
+  int bits = (fam == FAM_V4) ? 32 : 64;
+  if (len == 0) {
+    return key_max(fam);
+  }
+  return start | (((uint64_t)1 << (bits - len)) - 1);
+}
+
+static uint64_t pfx_mask(int fam, uint64_t key, int len)
+{
+  int bits = (fam == FAM_V4) ? 32 : 64;
+  if (len == 0) {
+    return 0;
+  }
+  return key & ~(((uint64_t)1 << (bits - len)) - 1) & key_max(fam);
+}
+
+/* Number of addresses (IPv4) or /64s (IPv6) in a prefix, as libipmeta counts
+ * them */
+static uint64_t pfx_size(int fam, int len)
+{
+  if (fam == FAM_V4) {
+    return (uint64_t)1 << (32 - len);
+  }
+  return (len == 0) ? UINT64_MAX : (uint64_t)1 << (64 - len);
+}
+
+/* ========== RECORDS ========== */
+
+static ipmeta_record_t *rec_get(Pfx2asTableObject *self, uint32_t idx)
+{
+  return &self->rec_dir[idx >> REC_CHUNK_SHIFT][idx & (REC_CHUNK - 1)];
+}
+
+static int group_hash_grow(Pfx2asTableObject *self)
+{
+  uint32_t size = self->group_hash_size ? self->group_hash_size * 2 : 4096;
+  uint32_t *hash, i, slot;
+
+  if ((hash = malloc(size * sizeof(uint32_t))) == NULL) {
+    return -1;
+  }
+  memset(hash, 0xff, size * sizeof(uint32_t));
+  for (i = 0; i < self->recs_cnt; i++) {
+    slot = _pyipmeta_hash_str(self->group_keys[i],
+                              strlen(self->group_keys[i])) & (size - 1);
+    while (hash[slot] != PYIPMETA_INDEX_NONE) {
+      slot = (slot + 1) & (size - 1);
+    }
+    hash[slot] = i;
+  }
+  free(self->group_hash);
+  self->group_hash = hash;
+  self->group_hash_size = size;
+  return 0;
+}
+
+/* Parse an AS group ("15169", "4_5" for multi-origin, "1,2" for AS sets) */
+static int parse_asns(ipmeta_record_t *rec, const char *str, size_t len)
+{
+  size_t i;
+  uint32_t asn = 0;
+  int digits = 0;
+
+  for (i = 0; i <= len; i++) {
+    if (i < len && str[i] >= '0' && str[i] <= '9') {
+      asn = asn * 10 + (str[i] - '0');
+      digits = 1;
+      continue;
+    }
+    if (digits) {
+      if ((rec->asn_cnt & 7) == 0) {
+        uint32_t *asns = realloc(rec->asn, (rec->asn_cnt + 8) *
+                                             sizeof(uint32_t));
+        if (asns == NULL) {
+          return -1;
+        }
+        rec->asn = asns;
+      }
+      rec->asn[rec->asn_cnt++] = asn;
+    }
+    asn = 0;
+    digits = 0;
+  }
+  return 0;
+}
+
+/* Get the record index for an AS group, adding a record if needed
+ *
+ * @return the index, or PYIPMETA_INDEX_NONE if out of memory
+ */
+static uint32_t group_get(Pfx2asTableObject *self, const char *str,
+                          size_t len)
+{
+  uint32_t slot, idx;
+  size_t alloc;
+  ipmeta_record_t *rec;
+  char *key;
+
+  if ((self->recs_cnt + 1) * 2 > self->group_hash_size &&
+      group_hash_grow(self) != 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  slot = _pyipmeta_hash_str(str, len) & (self->group_hash_size - 1);
+  while ((idx = self->group_hash[slot]) != PYIPMETA_INDEX_NONE) {
+    if (strncmp(self->group_keys[idx], str, len) == 0 &&
+        self->group_keys[idx][len] == '\0') {
+      return idx;
+    }
+    slot = (slot + 1) & (self->group_hash_size - 1);
+  }
+
+  idx = self->recs_cnt;
+  if (idx >= (uint32_t)REC_DIR_SIZE * REC_CHUNK) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  if (self->rec_dir[idx >> REC_CHUNK_SHIFT] == NULL &&
+      (self->rec_dir[idx >> REC_CHUNK_SHIFT] =
+         calloc(REC_CHUNK, sizeof(ipmeta_record_t))) == NULL) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  alloc = self->groups_alloc;
+  if (grow((void **)&self->group_keys, &alloc, idx + 1, sizeof(char *)) !=
+      0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  alloc = self->groups_alloc;
+  if (grow((void **)&self->group_ips, &alloc, idx + 1, sizeof(uint64_t)) !=
+      0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  self->groups_alloc = alloc;
+  if ((key = strndup(str, len)) == NULL) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  rec = rec_get(self, idx);
+  rec->id = idx + 1;
+  rec->source = IPMETA_PROVIDER_PFX2AS;
+  if (parse_asns(rec, str, len) != 0) {
+    free(key);
+    return PYIPMETA_INDEX_NONE;
+  }
+  self->group_keys[idx] = key;
+  self->group_ips[idx] = 0;
+  self->group_hash[slot] = idx;
+  self->recs_cnt++;
+  return idx;
+}
+
+/* Adjust the number of IPs in an AS group. Readers may see the old or the
+ * new count, but never a torn one. */
+static void group_add_ips(Pfx2asTableObject *self, uint32_t idx, int fam,
+                          int len, int sign)
+{
+  ipmeta_record_t *rec = rec_get(self, idx);
+  if (sign > 0) {
+    self->group_ips[idx] += pfx_size(fam, len);
+  } else {
+    self->group_ips[idx] -= pfx_size(fam, len);
+  }
+  __atomic_store_n(&rec->asn_ip_cnt,
+                   (__typeof__(rec->asn_ip_cnt))self->group_ips[idx],
+                   __ATOMIC_RELAXED);
+}
+
+/* ========== PREFIXES ========== */
+
+static int pfx_cmp(const pfx_t *a, uint64_t start, int len)
+{
+  if (a->start != start) {
+    return a->start < start ? -1 : 1;
+  }
+  return (a->len == len) ? 0 : (a->len < len ? -1 : 1);
+}
+
+/* Index of the first prefix >= (start, len) */
+static size_t pfx_lower_bound(const pfx_array_t *a, uint64_t start, int len)
+{
+  size_t lo = 0, hi = a->cnt, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (pfx_cmp(&a->pfxs[mid], start, len) < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+static pfx_t *pfx_find(const pfx_array_t *a, uint64_t start, int len)
+{
+  size_t i = pfx_lower_bound(a, start, len);
+  if (i < a->cnt && pfx_cmp(&a->pfxs[i], start, len) == 0) {
+    return &a->pfxs[i];
+  }
+  return NULL;
+}
+
+static int pfx_sort_cmp(const void *a, const void *b)
+{
+  const pfx_t *pa = a, *pb = b;
+  return pfx_cmp(pa, pb->start, pb->len);
+}
+
+/* Sort prefixes, keeping equal ones in order */
+static int pfx_sort(pfx_t *pfxs, size_t cnt)
+{
+  pfx_t *tmp, *src = pfxs, *dst, *swap;
+  size_t width, lo, mid, hi, i, j, k;
+
+  if (cnt < 2) {
+    return 0;
+  }
+  if ((tmp = malloc(cnt * sizeof(pfx_t))) == NULL) {
+    return -1;
+  }
+  dst = tmp;
+  for (width = 1; width < cnt; width *= 2) {
+    for (lo = 0; lo < cnt; lo += 2 * width) {
+      mid = (lo + width < cnt) ? lo + width : cnt;
+      hi = (lo + 2 * width < cnt) ? lo + 2 * width : cnt;
+      for (i = lo, j = mid, k = lo; k < hi; k++) {
+        if (i < mid && (j == hi || pfx_sort_cmp(&src[i], &src[j]) <= 0)) {
+          dst[k] = src[i++];
+        } else {
+          dst[k] = src[j++];
+        }
+      }
+    }
+    swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != pfxs) {
+    memcpy(pfxs, src, cnt * sizeof(pfx_t));
+  }
+  free(tmp);
+  return 0;
+}
+
+/* Merge the prefixes that are kept, with their new groups (those with
+ * group PYIPMETA_INDEX_NONE are dropped), and sorted inserts into a new
+ * prefix array */
+static int pfx_merge(const pfx_array_t *a, const uint32_t *groups,
+                     const pfx_t *ins, size_t ins_cnt, pfx_array_t *out)
+{
+  size_t i = 0, j = 0;
+
+  if (grow((void **)&out->pfxs, &out->alloc, a->cnt + ins_cnt,
+           sizeof(pfx_t)) != 0) {
+    return -1;
+  }
+  out->cnt = 0;
+  while (i < a->cnt || j < ins_cnt) {
+    if (i < a->cnt && groups[i] == PYIPMETA_INDEX_NONE) {
+      i++;
+    } else if (j == ins_cnt ||
+               (i < a->cnt && pfx_sort_cmp(&a->pfxs[i], &ins[j]) < 0)) {
+      out->pfxs[out->cnt] = a->pfxs[i];
+      out->pfxs[out->cnt++].group = groups[i++];
+    } else {
+      out->pfxs[out->cnt++] = ins[j++];
+    }
+  }
+  return 0;
+}
+
+/* ========== REGIONS ========== */
+
+static int region_add(region_array_t *r, uint64_t start, int len)
+{
+  if (grow((void **)&r->regions, &r->alloc, r->cnt + 1, sizeof(region_t)) !=
+      0) {
+    return -1;
+  }
+  r->regions[r->cnt].start = start;
+  r->regions[r->cnt++].len = len;
+  return 0;
+}
+
+static int region_cmp(const void *a, const void *b)
+{
+  const region_t *ra = a, *rb = b;
+  if (ra->start != rb->start) {
+    return ra->start < rb->start ? -1 : 1;
+  }
+  return (int)ra->len - (int)rb->len;
+}
+
+/* Sort the regions and drop the ones inside others; prefixes either nest or
+ * do not overlap, so what is left is disjoint */
+static void regions_normalize(region_array_t *r, int fam)
+{
+  size_t i, n = 0;
+  uint64_t end = 0;
+
+  qsort(r->regions, r->cnt, sizeof(region_t), region_cmp);
+  for (i = 0; i < r->cnt; i++) {
+    if (n > 0 && r->regions[i].start <= end) {
+      continue;
+    }
+    r->regions[n++] = r->regions[i];
+    end = pfx_end(fam, r->regions[i].start, r->regions[i].len);
+  }
+  r->cnt = n;
+}
+
+/* Find the record for a key in a range table */
+static uint32_t root_find(const root_t *root, uint64_t key)
+{
+  const chunk_t *c;
+  int64_t i;
+
+  if ((i = _pyipmeta_pred(root->keys, root->cnt, key)) < 0) {
+    return PYIPMETA_INDEX_NONE;
+  }
+  c = root->chunks[i];
+  return c->vals[_pyipmeta_pred(c->starts, c->cnt, key)];
+}
+
+/* Compute the ranges covering a region from the prefixes, followed by a
+ * range that restores the old record after the region */
+static int region_ranges(const pfx_array_t *a, int fam, const root_t *old,
+                         const region_t *r, seq_t *out)
+{
+  uint64_t end = pfx_end(fam, r->start, r->len);
+  uint64_t stack_end[129];
+  uint32_t stack_val[129];
+  uint32_t base = PYIPMETA_INDEX_NONE;
+  const pfx_t *p;
+  size_t i;
+  int len, top = 0;
+
+  /* the longest prefix that covers the whole region */
+  for (len = r->len - 1; len >= 0; len--) {
+    if ((p = pfx_find(a, pfx_mask(fam, r->start, len), len)) != NULL) {
+      base = p->group;
+      break;
+    }
+  }
+  if (seq_push(out, r->start, base) != 0) {
+    return -1;
+  }
+
+  /* prefixes inside the region, in order of start and then length (i.e.,
+   * each prefix comes after the prefixes that contain it) */
+  for (i = pfx_lower_bound(a, r->start, r->len);
+       i < a->cnt && a->pfxs[i].start <= end; i++) {
+    p = &a->pfxs[i];
+    while (top > 0 && stack_end[top - 1] < p->start) {
+      top--;
+      if (seq_push(out, stack_end[top] + 1,
+                   top > 0 ? stack_val[top - 1] : base) != 0) {
+        return -1;
+      }
+    }
+    if (seq_push(out, p->start, p->group) != 0) {
+      return -1;
+    }
+    stack_end[top] = pfx_end(fam, p->start, p->len);
+    stack_val[top++] = p->group;
+  }
+  while (top > 0) {
+    top--;
+    if (stack_end[top] < end &&
+        seq_push(out, stack_end[top] + 1,
+                 top > 0 ? stack_val[top - 1] : base) != 0) {
+      return -1;
+    }
+  }
+
+  if (end < key_max(fam) &&
+      seq_push(out, end + 1, root_find(old, end + 1)) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* ========== BUILDING VERSIONS ========== */
+
+static chunk_t *chunk_new(const uint64_t *starts, const uint32_t *vals,
+                          uint32_t cnt)
+{
+  chunk_t *c;
+  if ((c = malloc(sizeof(*c) + cnt * (sizeof(uint64_t) + sizeof(uint32_t))))
+      == NULL) {
+    return NULL;
+  }
+  c->cnt = cnt;
+  c->starts = (uint64_t *)(c + 1);
+  c->vals = (uint32_t *)(c->starts + cnt);
+  memcpy(c->starts, starts, cnt * sizeof(uint64_t));
+  memcpy(c->vals, vals, cnt * sizeof(uint32_t));
+  return c;
+}
+
+static root_t *root_new(uint32_t cnt)
+{
+  root_t *r;
+  if ((r = malloc(sizeof(*r) + cnt * (sizeof(uint64_t) +
+                                      sizeof(chunk_t *)))) == NULL) {
+    return NULL;
+  }
+  r->cnt = cnt;
+  r->chunks = (chunk_t **)(r + 1);
+  r->keys = (uint64_t *)(r->chunks + cnt);
+  return r;
+}
+
+/* Free the chunks of a new version of a table that it does not share with
+ * the old one. Both are sorted by start, so they are walked together. */
+static void chunks_free_new(chunk_t *const *chunks, size_t cnt,
+                            const root_t *old)
+{
+  uint32_t j = 0;
+  size_t i;
+
+  for (i = 0; i < cnt; i++) {
+    while (j < old->cnt && old->keys[j] < chunks[i]->starts[0]) {
+      j++;
+    }
+    if (j == old->cnt || old->chunks[j] != chunks[i]) {
+      free(chunks[i]);
+    }
+  }
+}
+
+/* State while merging new ranges with an old version of a table */
+typedef struct merge {
+  const root_t *old;
+  /* next old range */
+  uint32_t ci;
+  uint32_t off;
+  /* ranges waiting to be written as chunks */
+  seq_t pending;
+  /* chunks of the new version */
+  ptr_array_t chunks;
+  /* old chunks that are not part of the new version */
+  ptr_array_t retired;
+  update_stats_t *stats;
+} merge_t;
+
+/* Write pending ranges as chunks; all of them if force is set, otherwise
+ * only full chunks */
+static int merge_flush(merge_t *m, int force)
+{
+  size_t done = 0, n;
+  chunk_t *c;
+
+  while (m->pending.cnt - done >= CHUNK_MAX ||
+         (force && m->pending.cnt > done)) {
+    n = m->pending.cnt - done;
+    if (n > CHUNK_MAX) {
+      /* leave at least half a chunk for the rest */
+      n = (n < CHUNK_MAX + CHUNK_MAX / 2) ? n / 2 : CHUNK_MAX;
+    }
+    if ((c = chunk_new(m->pending.starts + done, m->pending.vals + done, n))
+        == NULL || ptr_array_add(&m->chunks, c) != 0) {
+      free(c);
+      return -1;
+    }
+    m->stats->chunks_new++;
+    done += n;
+  }
+  memmove(m->pending.starts, m->pending.starts + done,
+          (m->pending.cnt - done) * sizeof(uint64_t));
+  memmove(m->pending.vals, m->pending.vals + done,
+          (m->pending.cnt - done) * sizeof(uint32_t));
+  m->pending.cnt -= done;
+  return 0;
+}
+
+/* Move to the next old range, retiring a chunk once it has been left behind
+ * without being shared */
+static int merge_advance(merge_t *m)
+{
+  if (++m->off == m->old->chunks[m->ci]->cnt) {
+    if (ptr_array_add(&m->retired, m->old->chunks[m->ci]) != 0) {
+      return -1;
+    }
+    m->ci++;
+    m->off = 0;
+  }
+  return 0;
+}
+
+/* Copy old ranges that start before limit (all of them if limit is NULL) */
+static int merge_copy(merge_t *m, const uint64_t *limit)
+{
+  const chunk_t *c;
+
+  while (m->ci < m->old->cnt) {
+    c = m->old->chunks[m->ci];
+    if (m->off == 0 && (limit == NULL || c->starts[c->cnt - 1] < *limit) &&
+        (m->pending.cnt == 0 || m->pending.cnt >= CHUNK_MIN)) {
+      /* the whole chunk is unchanged */
+      if (merge_flush(m, 1) != 0 ||
+          ptr_array_add(&m->chunks, (void *)c) != 0) {
+        return -1;
+      }
+      m->ci++;
+      continue;
+    }
+    if (limit != NULL && c->starts[m->off] >= *limit) {
+      return 0;
+    }
+    if (seq_push(&m->pending, c->starts[m->off], c->vals[m->off]) != 0 ||
+        merge_advance(m) != 0 || merge_flush(m, 0) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Skip old ranges that start at or before key */
+static int merge_skip(merge_t *m, uint64_t key)
+{
+  while (m->ci < m->old->cnt &&
+         m->old->chunks[m->ci]->starts[m->off] <= key) {
+    if (merge_advance(m) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/* Build a new version of a family's table with the regions recomputed from
+ * the prefixes
+ *
+ * @return the new root, or NULL if out of memory; the chunks of the old
+ * version that are no longer used are added to retired
+ */
+static root_t *build_root(const pfx_array_t *pfxs, int fam,
+                          const root_t *old, region_array_t *regions,
+                          ptr_array_t *retired, update_stats_t *stats)
+{
+  merge_t m;
+  seq_t rs;
+  root_t *root = NULL;
+  uint64_t end;
+  size_t i, j;
+
+  memset(&m, 0, sizeof(m));
+  memset(&rs, 0, sizeof(rs));
+  m.old = old;
+  m.stats = stats;
+
+  for (i = 0; i < regions->cnt; i++) {
+    region_t *r = &regions->regions[i];
+    end = pfx_end(fam, r->start, r->len);
+    rs.cnt = 0;
+    if (region_ranges(pfxs, fam, old, r, &rs) != 0 ||
+        merge_copy(&m, &r->start) != 0 || merge_skip(&m, end) != 0) {
+      goto done;
+    }
+    for (j = 0; j < rs.cnt; j++) {
+      if (seq_push(&m.pending, rs.starts[j], rs.vals[j]) != 0) {
+        goto done;
+      }
+    }
+    if (merge_flush(&m, 0) != 0) {
+      goto done;
+    }
+  }
+  if (merge_copy(&m, NULL) != 0 || merge_flush(&m, 1) != 0) {
+    goto done;
+  }
+
+  if ((root = root_new(m.chunks.cnt)) == NULL) {
+    goto done;
+  }
+  for (i = 0; i < m.chunks.cnt; i++) {
+    root->chunks[i] = m.chunks.ptrs[i];
+    root->keys[i] = root->chunks[i]->starts[0];
+  }
+  for (i = 0; i < m.retired.cnt; i++) {
+    if (ptr_array_add(retired, m.retired.ptrs[i]) != 0) {
+      free(root);
+      root = NULL;
+      goto done;
+    }
+  }
+
+ done:
+  if (root == NULL) {
+    /* free the chunks that were created for the new version */
+    chunks_free_new((chunk_t *const *)m.chunks.ptrs, m.chunks.cnt, old);
+  }
+  seq_free(&rs);
+  seq_free(&m.pending);
+  free(m.chunks.ptrs);
+  free(m.retired.ptrs);
+  return root;
+}
+
+static uint64_t root_ranges(const root_t *root)
+{
+  uint64_t cnt = 0;
+  uint32_t i;
+  for (i = 0; i < root->cnt; i++) {
+    cnt += root->chunks[i]->cnt;
+  }
+  return cnt;
+}
+
+/* ========== UPDATES ========== */
+
+/* Parse a pfx2as line ("<addr>\t<len>\t<asns>") */
+static int parse_line(const char *line, size_t len, int *fam,
+                      uint64_t *start, int *pfxlen, const char **asns,
+                      size_t *asns_len)
+{
+  char addr[INET6_ADDRSTRLEN];
+  unsigned char buf[16];
+  const char *tab1, *tab2, *end = line + len;
+  long l;
+  int i;
+
+  if ((tab1 = memchr(line, '\t', len)) == NULL ||
+      (size_t)(tab1 - line) >= sizeof(addr) ||
+      (tab2 = memchr(tab1 + 1, '\t', end - tab1 - 1)) == NULL) {
+    return -1;
+  }
+  memcpy(addr, line, tab1 - line);
+  addr[tab1 - line] = '\0';
+  l = 0;
+  for (i = 1; tab1 + i < tab2; i++) {
+    if (tab1[i] < '0' || tab1[i] > '9' || l > 128) {
+      return -1;
+    }
+    l = l * 10 + (tab1[i] - '0');
+  }
+  if (i == 1) {
+    return -1;
+  }
+  *asns = tab2 + 1;
+  *asns_len = end - tab2 - 1;
+  while (*asns_len > 0 && ((*asns)[*asns_len - 1] == '\r' ||
+                           (*asns)[*asns_len - 1] == ' ')) {
+    (*asns_len)--;
+  }
+  if (*asns_len == 0) {
+    return -1;
+  }
+
+  if (inet_pton(AF_INET, addr, buf) == 1) {
+    if (l > 32) {
+      return -1;
+    }
+    *fam = FAM_V4;
+    *start = ((uint64_t)buf[0] << 24) | ((uint64_t)buf[1] << 16) |
+             ((uint64_t)buf[2] << 8) | buf[3];
+  } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+    if (l > 128) {
+      return -1;
+    }
+    *fam = FAM_V6;
+    *start = 0;
+    for (i = 0; i < 8; i++) {
+      *start = (*start << 8) | buf[i];
+    }
+  } else {
+    return -1;
+  }
+  *pfxlen = (int)l;
+  return 0;
+}
+
+/* Apply a complete pfx2as file to the table, publishing the new version
+ * once every change has been made. The new prefixes are built next to the
+ * current ones, and the writer state only switches over to them once the
+ * new version is published, so a failed update leaves the table as it was
+ * (except for any new AS groups, which are harmless). Runs without the GIL,
+ * with the update lock held. */
+static int update(Pfx2asTableObject *self, const char *data, size_t len,
+                  update_stats_t *stats)
+{
+  region_array_t regions[FAM_CNT];
+  pfx_array_t ins[FAM_CNT], next[FAM_CNT];
+  ptr_array_t retired;
+  /* new group of each current prefix, PYIPMETA_INDEX_NONE until seen */
+  uint32_t *groups[FAM_CNT];
+  version_t *old = self->version, *ver = NULL;
+  const char *line, *eol, *end = data + len, *asns;
+  size_t line_len, asns_len, i, n;
+  uint64_t start;
+  uint32_t group;
+  pfx_t *p;
+  int fam, pfxlen, rc = -1;
+
+  memset(regions, 0, sizeof(regions));
+  memset(ins, 0, sizeof(ins));
+  memset(next, 0, sizeof(next));
+  memset(groups, 0, sizeof(groups));
+  memset(&retired, 0, sizeof(retired));
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    n = self->pfxs[fam].cnt + 1;
+    if ((groups[fam] = malloc(n * sizeof(uint32_t))) == NULL) {
+      goto done;
+    }
+    memset(groups[fam], 0xff, n * sizeof(uint32_t));
+  }
+
+  /* find the inserted and changed prefixes */
+  for (line = data; line < end; line = eol + 1) {
+    if ((eol = memchr(line, '\n', end - line)) == NULL) {
+      eol = end;
+    }
+    line_len = eol - line;
+    if (line_len == 0 || (line_len == 1 && line[0] == '\r')) {
+      continue;
+    }
+    stats->lines++;
+    if (line_len > MAX_LINE_LEN ||
+        parse_line(line, line_len, &fam, &start, &pfxlen, &asns,
+                   &asns_len) != 0) {
+      stats->errors++;
+      continue;
+    }
+    if (fam == FAM_V6 && pfxlen > 64) {
+      /* finer than the /64s the table resolves */
+      stats->skipped++;
+      continue;
+    }
+    start = pfx_mask(fam, start, pfxlen);
+    if ((group = group_get(self, asns, asns_len)) == PYIPMETA_INDEX_NONE) {
+      goto done;
+    }
+    if ((p = pfx_find(&self->pfxs[fam], start, pfxlen)) != NULL) {
+      i = p - self->pfxs[fam].pfxs;
+      if (groups[fam][i] != PYIPMETA_INDEX_NONE) {
+        /* like libipmeta, the first line for a prefix wins */
+        stats->skipped++;
+        continue;
+      }
+      groups[fam][i] = group;
+      if (p->group == group) {
+        continue;
+      }
+      stats->changed++;
+    } else {
+      if (grow((void **)&ins[fam].pfxs, &ins[fam].alloc, ins[fam].cnt + 1,
+               sizeof(pfx_t)) != 0) {
+        goto done;
+      }
+      ins[fam].pfxs[ins[fam].cnt].start = start;
+      ins[fam].pfxs[ins[fam].cnt].len = pfxlen;
+      ins[fam].pfxs[ins[fam].cnt++].group = group;
+    }
+    if (region_add(&regions[fam], start, pfxlen) != 0) {
+      goto done;
+    }
+  }
+
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    /* prefixes that are no longer in the input */
+    for (i = 0; i < self->pfxs[fam].cnt; i++) {
+      p = &self->pfxs[fam].pfxs[i];
+      if (groups[fam][i] != PYIPMETA_INDEX_NONE) {
+        continue;
+      }
+      stats->deleted++;
+      if (region_add(&regions[fam], p->start, p->len) != 0) {
+        goto done;
+      }
+    }
+
+    /* keep the first of the new prefixes that appear more than once */
+    if (pfx_sort(ins[fam].pfxs, ins[fam].cnt) != 0) {
+      goto done;
+    }
+    for (i = 0, n = 0; i < ins[fam].cnt; i++) {
+      if (n > 0 && pfx_sort_cmp(&ins[fam].pfxs[n - 1],
+                                &ins[fam].pfxs[i]) == 0) {
+        stats->skipped++;
+        continue;
+      }
+      ins[fam].pfxs[n++] = ins[fam].pfxs[i];
+    }
+    ins[fam].cnt = n;
+    stats->inserted += n;
+    if (pfx_merge(&self->pfxs[fam], groups[fam], ins[fam].pfxs,
+                  ins[fam].cnt, &next[fam]) != 0) {
+      goto done;
+    }
+    regions_normalize(&regions[fam], fam);
+    stats->regions += regions[fam].cnt;
+  }
+
+  /* build the new version, sharing every chunk that did not change */
+  if ((ver = calloc(1, sizeof(*ver))) == NULL) {
+    goto done;
+  }
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    if (regions[fam].cnt == 0) {
+      ver->roots[fam] = old->roots[fam];
+      continue;
+    }
+    if ((ver->roots[fam] = build_root(&next[fam], fam, old->roots[fam],
+                                      &regions[fam], &retired, stats)) ==
+        NULL) {
+      goto done;
+    }
+  }
+
+  /* publish it; nothing can fail from here on, so the writer state can
+   * switch over to the new prefixes */
+  __atomic_store_n(&self->version, ver, __ATOMIC_SEQ_CST);
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    for (i = 0; i < self->pfxs[fam].cnt; i++) {
+      p = &self->pfxs[fam].pfxs[i];
+      if (groups[fam][i] == p->group) {
+        continue;
+      }
+      group_add_ips(self, p->group, fam, p->len, -1);
+      if (groups[fam][i] != PYIPMETA_INDEX_NONE) {
+        group_add_ips(self, groups[fam][i], fam, p->len, 1);
+      }
+    }
+    for (i = 0; i < ins[fam].cnt; i++) {
+      group_add_ips(self, ins[fam].pfxs[i].group, fam, ins[fam].pfxs[i].len,
+                    1);
+    }
+    free(self->pfxs[fam].pfxs);
+    self->pfxs[fam] = next[fam];
+    memset(&next[fam], 0, sizeof(next[fam]));
+  }
+
+  /* and free what only the old version used once no reader can be looking
+   * at it */
+  rcu_synchronize(self);
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    if (ver->roots[fam] != old->roots[fam]) {
+      free(old->roots[fam]);
+    }
+    self->ranges[fam] = root_ranges(ver->roots[fam]);
+    self->chunks[fam] = ver->roots[fam]->cnt;
+  }
+  for (i = 0; i < retired.cnt; i++) {
+    free(retired.ptrs[i]);
+  }
+  stats->chunks_freed = retired.cnt;
+  free(old);
+  ver = NULL;
+  self->updates++;
+  rc = 0;
+
+ done:
+  if (ver != NULL) {
+    for (fam = 0; fam < FAM_CNT; fam++) {
+      if (ver->roots[fam] != NULL && ver->roots[fam] != old->roots[fam]) {
+        chunks_free_new(ver->roots[fam]->chunks, ver->roots[fam]->cnt,
+                        old->roots[fam]);
+        free(ver->roots[fam]);
+      }
+    }
+    free(ver);
+  }
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    free(groups[fam]);
+    free(ins[fam].pfxs);
+    free(next[fam].pfxs);
+    free(regions[fam].regions);
+  }
+  free(retired.ptrs);
+  return rc;
+}
+
+/* ========== PYTHON INTERFACE ========== */
+
+static void
+Pfx2asTable_dealloc(Pfx2asTableObject *self)
+{
+  version_t *ver = self->version;
+  uint32_t i;
+  int fam;
+
+  if (ver != NULL) {
+    for (fam = 0; fam < FAM_CNT; fam++) {
+      for (i = 0; ver->roots[fam] != NULL && i < ver->roots[fam]->cnt; i++) {
+        free(ver->roots[fam]->chunks[i]);
+      }
+      free(ver->roots[fam]);
+    }
+    free(ver);
+  }
+  for (i = 0; i < self->recs_cnt; i++) {
+    free(rec_get(self, i)->asn);
+    free(self->group_keys[i]);
+  }
+  for (i = 0; i < REC_DIR_SIZE; i++) {
+    free(self->rec_dir[i]);
+  }
+  free(self->group_keys);
+  free(self->group_ips);
+  free(self->group_hash);
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    free(self->pfxs[fam].pfxs);
+  }
+  pthread_mutex_destroy(&self->update_lock);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
+}
+
+static PyObject *
+Pfx2asTable_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  Pfx2asTableObject *self;
+  static const uint64_t zero = 0;
+  static const uint32_t none = PYIPMETA_INDEX_NONE;
+  chunk_t *c;
+  int fam;
+
+  self = (Pfx2asTableObject *)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&self->update_lock, NULL);
+
+  /* start with one range per family that has no record */
+  if ((self->version = calloc(1, sizeof(version_t))) == NULL) {
+    Py_DECREF(self);
+    return PyErr_NoMemory();
+  }
+  for (fam = 0; fam < FAM_CNT; fam++) {
+    if ((self->version->roots[fam] = root_new(1)) == NULL ||
+        (c = chunk_new(&zero, &none, 1)) == NULL) {
+      Py_DECREF(self);
+      return PyErr_NoMemory();
+    }
+    self->version->roots[fam]->chunks[0] = c;
+    self->version->roots[fam]->keys[0] = 0;
+    self->ranges[fam] = 1;
+    self->chunks[fam] = 1;
+  }
+  return (PyObject *)self;
+}
+
+static int
+Pfx2asTable_init(Pfx2asTableObject *self, PyObject *args, PyObject *kwds)
+{
+  return 0;
+}
+
+/* Replace the contents of the table with a pfx2as file */
+static PyObject *
+Pfx2asTable_update(Pfx2asTableObject *self, PyObject *args)
+{
+  Py_buffer data;
+  update_stats_t stats;
+  int rc;
+
+  if (!PyArg_ParseTuple(args, "y*", &data)) {
+    return NULL;
+  }
+  memset(&stats, 0, sizeof(stats));
+
+  /* lookups carry on against the current version while this runs */
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&self->update_lock);
+  rc = update(self, data.buf, data.len, &stats);
+  pthread_mutex_unlock(&self->update_lock);
+  Py_END_ALLOW_THREADS
+  PyBuffer_Release(&data);
+
+  if (rc != 0) {
+    return PyErr_NoMemory();
+  }
+  return Py_BuildValue(
+    "{s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+    "lines", (unsigned long long)stats.lines,
+    "errors", (unsigned long long)stats.errors,
+    "skipped", (unsigned long long)stats.skipped,
+    "inserted", (unsigned long long)stats.inserted,
+    "deleted", (unsigned long long)stats.deleted,
+    "changed", (unsigned long long)stats.changed,
+    "regions", (unsigned long long)stats.regions,
+    "chunks_new", (unsigned long long)stats.chunks_new,
+    "chunks_freed", (unsigned long long)stats.chunks_freed);
+}
+
+/* A record that overlaps a queried prefix */
+typedef struct match {
+  uint32_t val;
+  uint64_t cnt;
+} match_t;
+
+typedef struct match_array {
+  match_t *matches;
+  size_t cnt;
+  size_t alloc;
+} match_array_t;
+
+static int match_cmp(const void *a, const void *b)
+{
+  const match_t *ma = a, *mb = b;
+  return (ma->val == mb->val) ? 0 : (ma->val < mb->val ? -1 : 1);
+}
+
+/* Find the ranges overlapping [first, last], with the number of addresses
+ * (or /64s) of each that are inside it */
+static int lookup_range(const root_t *root, uint64_t first, uint64_t last,
+                        uint64_t kmax, match_array_t *out)
+{
+  const chunk_t *c;
+  int64_t ci, ri;
+  uint64_t s, e, next;
+
+  ci = _pyipmeta_pred(root->keys, root->cnt, first);
+  c = root->chunks[ci];
+  ri = _pyipmeta_pred(c->starts, c->cnt, first);
+  for (;;) {
+    s = c->starts[ri] < first ? first : c->starts[ri];
+    if (ri + 1 < c->cnt) {
+      next = c->starts[ri + 1];
+    } else if (ci + 1 < root->cnt) {
+      next = root->chunks[ci + 1]->starts[0];
+    } else {
+      next = 0; /* no next range */
+    }
+    e = (next == 0 || next - 1 > last) ? last : next - 1;
+    if (c->vals[ri] != PYIPMETA_INDEX_NONE) {
+      if (grow((void **)&out->matches, &out->alloc, out->cnt + 1,
+               sizeof(match_t)) != 0) {
+        return -1;
+      }
+      out->matches[out->cnt].val = c->vals[ri];
+      out->matches[out->cnt++].cnt = (e - s == kmax) ? kmax : e - s + 1;
+    }
+    if (next == 0 || next > last) {
+      return 0;
+    }
+    if (++ri == c->cnt) {
+      c = root->chunks[++ci];
+      ri = 0;
+    }
+  }
+}
+
+/* Sum the matches of each record */
+static void matches_combine(match_array_t *m)
+{
+  size_t i, n = 0;
+
+  qsort(m->matches, m->cnt, sizeof(match_t), match_cmp);
+  for (i = 0; i < m->cnt; i++) {
+    if (n > 0 && m->matches[n - 1].val == m->matches[i].val) {
+      m->matches[n - 1].cnt += m->matches[i].cnt;
+    } else {
+      m->matches[n++] = m->matches[i];
+    }
+  }
+  m->cnt = n;
+}
+
+/* Look up an address or prefix */
+static PyObject *
+Pfx2asTable_lookup(Pfx2asTableObject *self, PyObject *args)
+{
+  const char *query;
+  char addr[INET6_ADDRSTRLEN];
+  const char *slash;
+  unsigned char buf[16];
+  uint64_t key = 0;
+  match_array_t m = {NULL, 0, 0};
+  int fam, len, i, e, rc;
+  size_t j;
+  PyObject *list, *dict;
+
+  if (!PyArg_ParseTuple(args, "s", &query)) {
+    return NULL;
+  }
+  if ((slash = strchr(query, '/')) == NULL) {
+    slash = query + strlen(query);
+    len = -1;
+  } else {
+    len = atoi(slash + 1);
+  }
+  if ((size_t)(slash - query) >= sizeof(addr)) {
+    goto invalid;
+  }
+  memcpy(addr, query, slash - query);
+  addr[slash - query] = '\0';
+  if (inet_pton(AF_INET, addr, buf) == 1) {
+    fam = FAM_V4;
+    key = ((uint64_t)buf[0] << 24) | ((uint64_t)buf[1] << 16) |
+          ((uint64_t)buf[2] << 8) | buf[3];
+    len = (len < 0) ? 32 : len;
+    if (len > 32) {
+      goto invalid;
+    }
+  } else if (inet_pton(AF_INET6, addr, buf) == 1) {
+    fam = FAM_V6;
+    for (i = 0; i < 8; i++) {
+      key = (key << 8) | buf[i];
+    }
+    len = (len < 0 || len > 64) ? 64 : len;
+  } else {
+    goto invalid;
+  }
+  key = pfx_mask(fam, key, len);
+
+  e = rcu_read_lock(self);
+  rc = lookup_range(__atomic_load_n(&self->version,
+                                    __ATOMIC_SEQ_CST)->roots[fam],
+                    key, pfx_end(fam, key, len), key_max(fam), &m);
+  rcu_read_unlock(self, e);
+  if (rc != 0) {
+    free(m.matches);
+    return PyErr_NoMemory();
+  }
+  matches_combine(&m);
+
+  /* records are never freed, so they can be used outside the critical
+   * section */
+  if ((list = PyList_New(0)) == NULL) {
+    free(m.matches);
+    return NULL;
+  }
+  for (j = 0; j < m.cnt; j++) {
+    if ((dict = _pyipmeta_record_as_dict(rec_get(self, m.matches[j].val),
+                                         (uint32_t)m.matches[j].cnt)) ==
+          NULL ||
+        PyList_Append(list, dict) != 0) {
+      Py_XDECREF(dict);
+      Py_DECREF(list);
+      free(m.matches);
+      return NULL;
+    }
+    Py_DECREF(dict);
+  }
+  free(m.matches);
+  return list;
+
+ invalid:
+  PyErr_Format(PyExc_ValueError, "Invalid address or prefix '%s'", query);
+  return NULL;
+}
+
+/* Get table counters */
+static PyObject *
+Pfx2asTable_stats(Pfx2asTableObject *self)
+{
+  return Py_BuildValue(
+    "{s:K,s:n,s:n,s:I,s:K,s:K,s:K,s:K}",
+    "updates", (unsigned long long)self->updates,
+    "prefixes4", (Py_ssize_t)self->pfxs[FAM_V4].cnt,
+    "prefixes6", (Py_ssize_t)self->pfxs[FAM_V6].cnt,
+    "groups", (unsigned int)self->recs_cnt,
+    "ranges4", (unsigned long long)self->ranges[FAM_V4],
+    "ranges6", (unsigned long long)self->ranges[FAM_V6],
+    "chunks4", (unsigned long long)self->chunks[FAM_V4],
+    "chunks6", (unsigned long long)self->chunks[FAM_V6]);
+}
+
+static PyMethodDef Pfx2asTable_methods[] = {
+
+  {
+    "update",
+    (PyCFunction)Pfx2asTable_update,
+    METH_VARARGS,
+    "Load the contents of a (decompressed) pfx2as file, applying only the "
+    "differences from the current contents, and return a dict of counters"
+  },
+
+  {
+    "lookup",
+    (PyCFunction)Pfx2asTable_lookup,
+    METH_VARARGS,
+    "Look up an IP address or prefix, returning a list of record dicts"
+  },
+
+  {
+    "stats",
+    (PyCFunction)Pfx2asTable_stats,
+    METH_NOARGS,
+    "Get a dict of table counters"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Pfx2asTable_slots[] = {
+  {Py_tp_dealloc, Pfx2asTable_dealloc},
+  {Py_tp_doc, Pfx2asTableDocstring},
+  {Py_tp_methods, Pfx2asTable_methods},
+  {Py_tp_init, Pfx2asTable_init},
+  {Py_tp_new, Pfx2asTable_new},
+  {0, NULL},
+};
+
+static PyType_Spec Pfx2asTable_spec = {
+  Pfx2asTableTypeName,
+  sizeof(Pfx2asTableObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE,
+  Pfx2asTable_slots,
+};
+
+PyType_Spec *_pyipmeta_pfx2as_get_Pfx2asTableSpec()
+{
+  return &Pfx2asTable_spec;
+}
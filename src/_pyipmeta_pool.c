@@ -0,0 +1,297 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libipmeta.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Run every query of a job, copying the results out of the record set */
+static void run_job(ipmeta_t *ipm, pyipmeta_metrics_t *metrics,
+                    ipmeta_record_set_t *set, pyipmeta_job_t *job)
+{
+  pyipmeta_job_result_t *res;
+  ipmeta_record_t *rec;
+  uint64_t num_ips, start;
+  size_t i, cnt;
+
+  for (i = 0; i < job->cnt; i++) {
+    res = &job->results[i];
+    ipmeta_record_set_clear(set);
+    start = _pyipmeta_metrics_now(metrics);
+    res->rc = ipmeta_lookup(ipm, job->queries[i], job->provmask, set);
+    _pyipmeta_metrics_lookup(metrics, res->rc, set, start);
+    if (res->rc < 0) {
+      continue;
+    }
+    cnt = 0;
+    ipmeta_record_set_rewind(set);
+    while (ipmeta_record_set_next(set, &num_ips) != NULL) {
+      cnt++;
+    }
+    if (cnt == 0) {
+      continue;
+    }
+    if ((res->recs = malloc(sizeof(*res->recs) * cnt)) == NULL ||
+        (res->num_ips = malloc(sizeof(*res->num_ips) * cnt)) == NULL) {
+      res->rc = IPMETA_ERR_INTERNAL;
+      continue;
+    }
+    ipmeta_record_set_rewind(set);
+    while ((rec = ipmeta_record_set_next(set, &num_ips)) != NULL) {
+      res->recs[res->cnt] = rec;
+      res->num_ips[res->cnt] = num_ips;
+      res->cnt++;
+    }
+  }
+  ipmeta_record_set_clear(set);
+}
+
+static void *worker_run(void *arg)
+{
+  pyipmeta_pool_t *pool = arg;
+  ipmeta_record_set_t *set;
+  pyipmeta_job_t *job;
+  ssize_t unused;
+
+  if ((set = ipmeta_record_set_init()) == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  while (1) {
+    while (pool->todo_head == NULL && pool->shutdown == 0) {
+      pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    if ((job = pool->todo_head) == NULL) {
+      break;
+    }
+    if ((pool->todo_head = job->next) == NULL) {
+      pool->todo_tail = NULL;
+    }
+    job->next = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    run_job(pool->ipm, pool->metrics, set, job);
+
+    pthread_mutex_lock(&pool->lock);
+    if (pool->done_tail != NULL) {
+      pool->done_tail->next = job;
+    } else {
+      pool->done_head = job;
+    }
+    pool->done_tail = job;
+    /* if the pipe is full the reader has wakeups pending anyway */
+    unused = write(pool->notify_wfd, "", 1);
+    (void)unused;
+  }
+  pthread_mutex_unlock(&pool->lock);
+
+  ipmeta_record_set_free(&set);
+  return NULL;
+}
+
+static void free_job_list(pyipmeta_job_t *job)
+{
+  pyipmeta_job_t *next;
+  while (job != NULL) {
+    next = job->next;
+    _pyipmeta_job_free(job);
+    job = next;
+  }
+}
+
+pyipmeta_pool_t *_pyipmeta_pool_init(ipmeta_t *ipm,
+                                     pyipmeta_metrics_t *metrics,
+                                     int threads_cnt)
+{
+  pyipmeta_pool_t *pool;
+  int fds[2];
+
+  if (threads_cnt < 1) {
+    threads_cnt = 1;
+  }
+  if ((pool = calloc(1, sizeof(*pool))) == NULL) {
+    return NULL;
+  }
+  pool->ipm = ipm;
+  pool->metrics = metrics;
+  pool->next_id = 1;
+  pool->notify_rfd = pool->notify_wfd = -1;
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+
+  if (pipe(fds) != 0) {
+    goto err;
+  }
+  pool->notify_rfd = fds[0];
+  pool->notify_wfd = fds[1];
+  if (fcntl(fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+      fcntl(fds[1], F_SETFL, O_NONBLOCK) != 0) {
+    goto err;
+  }
+
+  if ((pool->threads = calloc(threads_cnt, sizeof(pthread_t))) == NULL) {
+    goto err;
+  }
+  for (; pool->threads_cnt < threads_cnt; pool->threads_cnt++) {
+    if (pthread_create(&pool->threads[pool->threads_cnt], NULL, worker_run,
+                       pool) != 0) {
+      goto err;
+    }
+  }
+  return pool;
+
+ err:
+  _pyipmeta_pool_free(pool);
+  return NULL;
+}
+
+void _pyipmeta_pool_free(pyipmeta_pool_t *pool)
+{
+  int i;
+
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->threads_cnt; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+
+  free_job_list(pool->todo_head);
+  free_job_list(pool->done_head);
+  if (pool->notify_rfd != -1) {
+    close(pool->notify_rfd);
+  }
+  if (pool->notify_wfd != -1) {
+    close(pool->notify_wfd);
+  }
+  pthread_cond_destroy(&pool->cond);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+pyipmeta_job_t *_pyipmeta_job_init(size_t cnt, uint32_t provmask)
+{
+  pyipmeta_job_t *job;
+
+  if ((job = calloc(1, sizeof(*job))) == NULL) {
+    return NULL;
+  }
+  job->provmask = provmask;
+  job->cnt = cnt;
+  if ((job->queries = calloc(cnt ? cnt : 1, sizeof(char *))) == NULL ||
+      (job->results = calloc(cnt ? cnt : 1,
+                             sizeof(pyipmeta_job_result_t))) == NULL) {
+    _pyipmeta_job_free(job);
+    return NULL;
+  }
+  return job;
+}
+
+void _pyipmeta_job_free(pyipmeta_job_t *job)
+{
+  size_t i;
+
+  if (job == NULL) {
+    return;
+  }
+  for (i = 0; i < job->cnt; i++) {
+    if (job->queries != NULL) {
+      free(job->queries[i]);
+    }
+    if (job->results != NULL) {
+      free(job->results[i].recs);
+      free(job->results[i].num_ips);
+    }
+  }
+  free(job->queries);
+  free(job->results);
+  free(job);
+}
+
+uint64_t _pyipmeta_pool_submit(pyipmeta_pool_t *pool, pyipmeta_job_t *job)
+{
+  uint64_t id;
+
+  pthread_mutex_lock(&pool->lock);
+  id = job->id = pool->next_id++;
+  job->next = NULL;
+  if (pool->todo_tail != NULL) {
+    pool->todo_tail->next = job;
+  } else {
+    pool->todo_head = job;
+  }
+  pool->todo_tail = job;
+  pool->pending++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+  return id;
+}
+
+pyipmeta_job_t *_pyipmeta_pool_collect(pyipmeta_pool_t *pool)
+{
+  pyipmeta_job_t *done, *job;
+  char buf[256];
+
+  /* drain the notifications first so that a completion that races with
+     this call still leaves the pipe readable */
+  while (read(pool->notify_rfd, buf, sizeof(buf)) > 0) {
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  done = pool->done_head;
+  pool->done_head = pool->done_tail = NULL;
+  for (job = done; job != NULL; job = job->next) {
+    pool->pending--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return done;
+}
+
+uint64_t _pyipmeta_pool_pending(pyipmeta_pool_t *pool)
+{
+  uint64_t pending;
+
+  pthread_mutex_lock(&pool->lock);
+  pending = pool->pending;
+  pthread_mutex_unlock(&pool->lock);
+  return pending;
+}
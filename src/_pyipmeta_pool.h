@@ -0,0 +1,129 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_pool_H
+#define ___pyipmeta_pool_H
+
+#include "_pyipmeta_metrics.h"
+#include <libipmeta.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/** Result of looking up a single query in a worker */
+typedef struct pyipmeta_job_result {
+  /* return code from ipmeta_lookup */
+  int rc;
+
+  /* matched records and the number of IPs they matched */
+  ipmeta_record_t **recs;
+  uint64_t *num_ips;
+  size_t cnt;
+} pyipmeta_job_result_t;
+
+/** A set of queries submitted to the worker pool */
+typedef struct pyipmeta_job {
+  uint64_t id;
+  uint32_t provmask;
+
+  /* set if the results are wanted as one list per query */
+  int batch;
+
+  /* queries (owned by the job) and their results */
+  char **queries;
+  pyipmeta_job_result_t *results;
+  size_t cnt;
+
+  struct pyipmeta_job *next;
+} pyipmeta_job_t;
+
+/** Worker threads that run lookups without holding the GIL.
+ *
+ * Each worker has its own record set. Completed jobs are queued until they
+ * are collected, and a byte is written to the notification pipe for each
+ * one so that an event loop can wait for completions.
+ */
+typedef struct pyipmeta_pool {
+  ipmeta_t *ipm;
+  pyipmeta_metrics_t *metrics;
+
+  pthread_t *threads;
+  int threads_cnt;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  pyipmeta_job_t *todo_head;
+  pyipmeta_job_t *todo_tail;
+  pyipmeta_job_t *done_head;
+  pyipmeta_job_t *done_tail;
+  int shutdown;
+
+  /* jobs submitted but not yet collected */
+  uint64_t pending;
+  uint64_t next_id;
+
+  /* notification pipe */
+  int notify_rfd;
+  int notify_wfd;
+} pyipmeta_pool_t;
+
+/** Start a pool of worker threads for the given ipmeta instance
+ *
+ * Lookups are counted in metrics unless it is NULL.
+ *
+ * @return pointer to the pool if successful, NULL otherwise
+ */
+pyipmeta_pool_t *_pyipmeta_pool_init(ipmeta_t *ipm,
+                                     pyipmeta_metrics_t *metrics,
+                                     int threads_cnt);
+
+/** Stop the workers and free the pool along with any uncollected jobs */
+void _pyipmeta_pool_free(pyipmeta_pool_t *pool);
+
+/** Create a job for the given number of queries
+ *
+ * The caller fills in job->queries (malloc'd strings) before submitting it.
+ */
+pyipmeta_job_t *_pyipmeta_job_init(size_t cnt, uint32_t provmask);
+
+/** Free a job and its queries and results */
+void _pyipmeta_job_free(pyipmeta_job_t *job);
+
+/** Queue a job for the workers, assigning it an ID */
+uint64_t _pyipmeta_pool_submit(pyipmeta_pool_t *pool, pyipmeta_job_t *job);
+
+/** Take the list of completed jobs (linked through job->next) */
+pyipmeta_job_t *_pyipmeta_pool_collect(pyipmeta_pool_t *pool);
+
+/** Get the number of jobs submitted but not yet collected */
+uint64_t _pyipmeta_pool_pending(pyipmeta_pool_t *pool);
+
+#endif /* ___pyipmeta_pool_H */
@@ -0,0 +1,215 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_presence.h"
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Length of the prefixes probing starts from */
+#define PROBE4_START_LEN 8
+#define PROBE6_START_LEN 4
+
+/* Bitmap sizes in uint64_t words */
+#define WORDS4 ((1U << PYIPMETA_PRESENCE_LEN4) / 64)
+#define WORDS6 ((1U << PYIPMETA_PRESENCE_LEN6) / 64)
+
+/* Set the bits of cnt blocks starting at first */
+static void set_bits(uint64_t *bits, uint32_t first, uint32_t cnt)
+{
+  while (cnt > 0 && (first & 63) != 0) {
+    bits[first >> 6] |= (uint64_t)1 << (first & 63);
+    first++;
+    cnt--;
+  }
+  if (cnt >= 64) {
+    memset(&bits[first >> 6], 0xff, sizeof(uint64_t) * (cnt >> 6));
+    first += cnt & ~63U;
+    cnt &= 63;
+  }
+  while (cnt > 0) {
+    bits[first >> 6] |= (uint64_t)1 << (first & 63);
+    first++;
+    cnt--;
+  }
+}
+
+/* Look up a prefix and count the addresses it matched (in /64s for IPv6).
+ * Overlapping records can only make a prefix look more covered than it is,
+ * which at worst leaves bits set that could have been clear. */
+static int probe_count(ipmeta_t *ipm, ipmeta_record_set_t *set,
+                       uint32_t provmask, int family, void *addr, int len,
+                       uint64_t *matched)
+{
+  uint64_t num_ips = 0;
+
+  ipmeta_record_set_clear(set);
+  if (ipmeta_lookup_pfx(ipm, family, addr, len, provmask, set) < 0) {
+    return -1;
+  }
+  *matched = 0;
+  ipmeta_record_set_rewind(set);
+  while (ipmeta_record_set_next(set, &num_ips) != NULL) {
+    *matched += num_ips;
+  }
+  return 0;
+}
+
+/* Mark the /24s of an IPv4 prefix that have records, splitting the prefix
+   until it is either unmatched, fully matched or a /24 */
+static int probe4(uint64_t *bits, ipmeta_t *ipm, ipmeta_record_set_t *set,
+                  uint32_t provmask, uint32_t addr, int len)
+{
+  struct in_addr in;
+  uint64_t matched;
+
+  in.s_addr = htonl(addr);
+  if (probe_count(ipm, set, provmask, AF_INET, &in, len, &matched) != 0) {
+    return -1;
+  }
+  if (matched == 0) {
+    return 0;
+  }
+  if (matched >= ((uint64_t)1 << (32 - len)) ||
+      len == PYIPMETA_PRESENCE_LEN4) {
+    set_bits(bits, addr >> (32 - PYIPMETA_PRESENCE_LEN4),
+             1U << (PYIPMETA_PRESENCE_LEN4 - len));
+    return 0;
+  }
+  if (probe4(bits, ipm, set, provmask, addr, len + 1) != 0) {
+    return -1;
+  }
+  return probe4(bits, ipm, set, provmask, addr | (1U << (31 - len)),
+                len + 1);
+}
+
+/* IPv6 version of probe4, with addr holding the top 32 bits of the
+   prefix */
+static int probe6(uint64_t *bits, ipmeta_t *ipm, ipmeta_record_set_t *set,
+                  uint32_t provmask, uint32_t addr, int len)
+{
+  struct in6_addr in6;
+  uint64_t matched;
+
+  memset(&in6, 0, sizeof(in6));
+  in6.s6_addr[0] = (uint8_t)(addr >> 24);
+  in6.s6_addr[1] = (uint8_t)(addr >> 16);
+  in6.s6_addr[2] = (uint8_t)(addr >> 8);
+  in6.s6_addr[3] = (uint8_t)addr;
+  if (probe_count(ipm, set, provmask, AF_INET6, &in6, len, &matched) != 0) {
+    return -1;
+  }
+  if (matched == 0) {
+    return 0;
+  }
+  if (matched >= ((uint64_t)1 << (64 - len)) ||
+      len == PYIPMETA_PRESENCE_LEN6) {
+    set_bits(bits, addr >> (32 - PYIPMETA_PRESENCE_LEN6),
+             1U << (PYIPMETA_PRESENCE_LEN6 - len));
+    return 0;
+  }
+  if (probe6(bits, ipm, set, provmask, addr, len + 1) != 0) {
+    return -1;
+  }
+  return probe6(bits, ipm, set, provmask, addr | (1U << (31 - len)),
+                len + 1);
+}
+
+int _pyipmeta_presence_build(pyipmeta_presence_t *pres, ipmeta_t *ipm,
+                             int provid)
+{
+  ipmeta_record_set_t *set;
+  uint32_t mask = IPMETA_PROV_TO_MASK(provid), i;
+  uint64_t *v4 = NULL, *v6 = NULL;
+  int rc = -1;
+
+  pres->enabled |= mask;
+  pres->built &= ~mask;
+  free(pres->v4[provid - 1]);
+  free(pres->v6[provid - 1]);
+  pres->v4[provid - 1] = pres->v6[provid - 1] = NULL;
+
+  if ((set = ipmeta_record_set_init()) == NULL) {
+    return -1;
+  }
+  if ((v4 = calloc(WORDS4, sizeof(uint64_t))) == NULL ||
+      (v6 = calloc(WORDS6, sizeof(uint64_t))) == NULL) {
+    goto done;
+  }
+  for (i = 0; i < (1U << PROBE4_START_LEN); i++) {
+    if (probe4(v4, ipm, set, mask, i << (32 - PROBE4_START_LEN),
+               PROBE4_START_LEN) != 0) {
+      goto done;
+    }
+  }
+  for (i = 0; i < (1U << PROBE6_START_LEN); i++) {
+    if (probe6(v6, ipm, set, mask, i << (32 - PROBE6_START_LEN),
+               PROBE6_START_LEN) != 0) {
+      goto done;
+    }
+  }
+  pres->v4[provid - 1] = v4;
+  pres->v6[provid - 1] = v6;
+  pres->built |= mask;
+  v4 = v6 = NULL;
+  rc = 0;
+
+ done:
+  free(v4);
+  free(v6);
+  ipmeta_record_set_free(&set);
+  return rc;
+}
+
+void _pyipmeta_presence_free(pyipmeta_presence_t *pres)
+{
+  int i;
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    free(pres->v4[i]);
+    free(pres->v6[i]);
+    pres->v4[i] = pres->v6[i] = NULL;
+  }
+  pres->enabled = pres->built = 0;
+}
+
+size_t _pyipmeta_presence_bytes(const pyipmeta_presence_t *pres)
+{
+  size_t bytes = 0;
+  int i;
+
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if (pres->v4[i] != NULL) {
+      bytes += sizeof(uint64_t) * (WORDS4 + WORDS6);
+    }
+  }
+  return bytes;
+}
@@ -0,0 +1,129 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_presence_H
+#define ___pyipmeta_presence_H
+
+#include <libipmeta.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Prefix length of the IPv4 blocks with one bit in a presence bitmap */
+#define PYIPMETA_PRESENCE_LEN4 24
+
+/** Prefix length of the IPv6 blocks with one bit in a presence bitmap */
+#define PYIPMETA_PRESENCE_LEN6 20
+
+/** Presence bitmaps of the enabled providers
+ *
+ * For each provider, one bit per IPv4 /24 and per IPv6 /20 is set if any
+ * address in it has a record. A clear bit means that a lookup of an address
+ * in that block is sure to miss, so it does not have to go to libipmeta. The
+ * bitmaps are built when a provider is enabled.
+ */
+typedef struct pyipmeta_presence {
+  uint64_t *v4[IPMETA_PROVIDER_MAX];
+  uint64_t *v6[IPMETA_PROVIDER_MAX];
+
+  /* providers that are enabled */
+  uint32_t enabled;
+
+  /* enabled providers that have bitmaps */
+  uint32_t built;
+
+  /* number of times the bitmaps for a provider could not be built */
+  uint64_t failures;
+} pyipmeta_presence_t;
+
+/** Build the bitmaps for a provider that has just been enabled
+ *
+ * @return 0 if successful, -1 otherwise (in which case the provider is never
+ * filtered)
+ */
+int _pyipmeta_presence_build(pyipmeta_presence_t *pres, ipmeta_t *ipm,
+                             int provid);
+
+/** Free the bitmaps */
+void _pyipmeta_presence_free(pyipmeta_presence_t *pres);
+
+/** Get the memory used by the bitmaps */
+size_t _pyipmeta_presence_bytes(const pyipmeta_presence_t *pres);
+
+/* Providers in the mask (0 for all) that might have a record for the block
+ * with the given number */
+static inline int _pyipmeta_presence_test(uint64_t *const *bits,
+                                          uint32_t enabled, uint32_t built,
+                                          uint32_t provmask, uint32_t block)
+{
+  uint32_t mask = provmask ? (provmask & enabled) : enabled;
+  int i;
+
+  if (mask & ~built) {
+    return 1;
+  }
+  for (i = 0; i < IPMETA_PROVIDER_MAX; i++) {
+    if ((mask & IPMETA_PROV_TO_MASK(i + 1)) &&
+        (bits[i][block >> 6] >> (block & 63)) & 1) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Check whether any of the providers in the mask (0 for all) might have a
+ * record for an IPv4 address (host byte order)
+ *
+ * @return 0 if the lookup is sure to miss, 1 otherwise
+ */
+static inline int _pyipmeta_presence_test4(const pyipmeta_presence_t *pres,
+                                           uint32_t provmask, uint32_t addr)
+{
+  return _pyipmeta_presence_test(pres->v4, pres->enabled, pres->built,
+                                 provmask,
+                                 addr >> (32 - PYIPMETA_PRESENCE_LEN4));
+}
+
+/** IPv6 version of _pyipmeta_presence_test4 */
+static inline int _pyipmeta_presence_test6(const pyipmeta_presence_t *pres,
+                                           uint32_t provmask,
+                                           const struct in6_addr *addr)
+{
+  uint32_t top = ((uint32_t)addr->s6_addr[0] << 24) |
+                 ((uint32_t)addr->s6_addr[1] << 16) |
+                 ((uint32_t)addr->s6_addr[2] << 8) | addr->s6_addr[3];
+  return _pyipmeta_presence_test(pres->v6, pres->enabled, pres->built,
+                                 provmask,
+                                 top >> (32 - PYIPMETA_PRESENCE_LEN6));
+}
+
+#endif /* ___pyipmeta_presence_H */
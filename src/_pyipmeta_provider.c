@@ -29,6 +29,7 @@
  * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
  * POSSIBILITY OF SUCH DAMAGE.
  */
+#include "_pyipmeta_module.h"
 #include "_pyipmeta_provider.h"
 #include "_pyipmeta_record.h"
 #include "pyutils.h"
@@ -46,7 +47,9 @@ Provider_dealloc(ProviderObject *self)
   Py_DECREF(self->pyipm);
   self->pyipm = NULL;
   self->prov = NULL;
-  Py_TYPE(self)->tp_free((PyObject*)self);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
 }
 
 static int
@@ -146,58 +149,41 @@ static PyGetSetDef Provider_getsetters[] = {
   {NULL} /* Sentinel */
 };
 
-static PyTypeObject ProviderType = {
-  PyVarObject_HEAD_INIT(NULL, 0)
-  ProviderTypeName,             /* tp_name */
-  sizeof(ProviderObject), /* tp_basicsize */
-  0,                                    /* tp_itemsize */
-  (destructor)Provider_dealloc,        /* tp_dealloc */
-  0,                                    /* tp_print */
-  0,                                    /* tp_getattr */
-  0,                                    /* tp_setattr */
-  0,                                    /* tp_compare */
-  Provider_repr,                                    /* tp_repr */
-  0,                                    /* tp_as_number */
-  0,                                    /* tp_as_sequence */
-  0,                                    /* tp_as_mapping */
-  0,                                    /* tp_hash */
-  0,                                    /* tp_call */
-  0,                                    /* tp_str */
-  0,                                    /* tp_getattro */
-  0,                                    /* tp_setattro */
-  0,                                    /* tp_as_buffer */
-  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE, /* tp_flags */
-  ProviderDocstring,      /* tp_doc */
-  0,		               /* tp_traverse */
-  0,		               /* tp_clear */
-  0,		               /* tp_richcompare */
-  0,		               /* tp_weaklistoffset */
-  0,		               /* tp_iter */
-  0,		               /* tp_iternext */
-  Provider_methods,             /* tp_methods */
-  0,             /* tp_members */
-  Provider_getsetters,                         /* tp_getset */
-  0,                         /* tp_base */
-  0,                         /* tp_dict */
-  0,                         /* tp_descr_get */
-  0,                         /* tp_descr_set */
-  0,                         /* tp_dictoffset */
-  (initproc)Provider_init,  /* tp_init */
-  0,                         /* tp_alloc */
-  0,             /* tp_new */
+static PyType_Slot Provider_slots[] = {
+  {Py_tp_dealloc, Provider_dealloc},
+  {Py_tp_repr, Provider_repr},
+  {Py_tp_doc, ProviderDocstring},
+  {Py_tp_methods, Provider_methods},
+  {Py_tp_getset, Provider_getsetters},
+  {Py_tp_init, Provider_init},
+  {0, NULL},
 };
 
-PyTypeObject *_pyipmeta_provider_get_ProviderType()
+static PyType_Spec Provider_spec = {
+  ProviderTypeName,
+  sizeof(ProviderObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE | Py_TPFLAGS_DISALLOW_INSTANTIATION,
+  Provider_slots,
+};
+
+PyType_Spec *_pyipmeta_provider_get_ProviderSpec()
 {
-  return &ProviderType;
+  return &Provider_spec;
 }
 
 /* only available to c code */
 PyObject *Provider_new(PyObject *pyipm, ipmeta_provider_t *prov)
 {
   ProviderObject *self;
+  pyipmeta_state_t *state;
 
-  self = (ProviderObject *)(ProviderType.tp_alloc(&ProviderType, 0));
+  if ((state = _pyipmeta_get_state(Py_TYPE(pyipm))) == NULL) {
+    return NULL;
+  }
+  self = (ProviderObject *)(state->ProviderType->tp_alloc(
+    state->ProviderType, 0));
   if(self == NULL) {
     return NULL;
   }
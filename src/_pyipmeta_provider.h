@@ -46,8 +46,8 @@ typedef struct {
 
 } ProviderObject;
 
-/** Expose the ProviderType structure */
-PyTypeObject *_pyipmeta_provider_get_ProviderType(void);
+/** Expose the Provider type spec */
+PyType_Spec *_pyipmeta_provider_get_ProviderSpec(void);
 
 /** Expose our new function as it is not exposed to Python */
 PyObject *Provider_new(PyObject *pyipm, ipmeta_provider_t *prov);
@@ -30,6 +30,7 @@
  * POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include "_pyipmeta_json.h"
 #include "_pyipmeta_record.h"
 #include "pyutils.h"
 #include <Python.h>
@@ -192,3 +193,50 @@ _pyipmeta_record_as_dict(ipmeta_record_t *rec, uint32_t num_ips)
 
   return dict;
 }
+
+PyObject *
+_pyipmeta_record_field(ipmeta_record_t *rec, int field, uint64_t num_ips)
+{
+  static ipmeta_record_t empty;
+
+  if (rec == NULL) {
+    rec = &empty;
+  }
+  switch (field) {
+  case PYIPMETA_FIELD_SOURCE:
+    return get_source(rec);
+  case PYIPMETA_FIELD_ID:
+    return get_id(rec);
+  case PYIPMETA_FIELD_COUNTRY_CODE:
+    return get_country_code(rec);
+  case PYIPMETA_FIELD_CONTINENT_CODE:
+    return get_continent_code(rec);
+  case PYIPMETA_FIELD_REGION:
+    return get_region(rec);
+  case PYIPMETA_FIELD_CITY:
+    return get_city(rec);
+  case PYIPMETA_FIELD_POST_CODE:
+    return get_post_code(rec);
+  case PYIPMETA_FIELD_LAT_LONG:
+    return get_lat_long(rec);
+  case PYIPMETA_FIELD_METRO_CODE:
+    return get_metro_code(rec);
+  case PYIPMETA_FIELD_AREA_CODE:
+    return get_area_code(rec);
+  case PYIPMETA_FIELD_REGION_CODE:
+    return get_region_code(rec);
+  case PYIPMETA_FIELD_CONNECTION_SPEED:
+    return get_connection_speed(rec);
+  case PYIPMETA_FIELD_ASNS:
+    return get_asns(rec);
+  case PYIPMETA_FIELD_ASN_IP_COUNT:
+    return get_asn_ip_count(rec);
+  case PYIPMETA_FIELD_POLYGON_IDS:
+    return get_polygon_ids(rec);
+  case PYIPMETA_FIELD_MATCHED_IP_COUNT:
+    return PyLong_FromUnsignedLongLong(num_ips);
+  default:
+    PyErr_SetString(PyExc_ValueError, "Invalid record field");
+    return NULL;
+  }
+}
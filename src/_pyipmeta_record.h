@@ -39,4 +39,12 @@
 /** Convert an IP Meta record into a dictionary */
 PyObject *_pyipmeta_record_as_dict(ipmeta_record_t *rec, uint32_t num_ips);
 
+/** Get one field (a pyipmeta_field_t) of a record as a Python object
+ *
+ * If rec is NULL, the field has the value of an empty record (e.g., "" or
+ * []). num_ips is only used for the matched_ip_count field.
+ */
+PyObject *_pyipmeta_record_field(ipmeta_record_t *rec, int field,
+                                 uint64_t num_ips);
+
 #endif /* ___pyipmeta_record_H */
@@ -0,0 +1,1078 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_ipmeta.h"
+#include "_pyipmeta_module.h"
+#include "_pyipmeta_json.h"
+#include "_pyipmeta_metrics.h"
+#include "_pyipmeta_server.h"
+#include "pyutils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libipmeta.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <Python.h>
+
+#define ServerDocstring "Native lookup server"
+
+#define ServerTypeName "_pyipmeta.Server"
+
+/* Maximum number of listening sockets */
+#define MAX_LISTENERS 16
+
+/* Requests with larger headers (or lines) are rejected */
+#define MAX_HEADER_LEN 8192
+
+/* Requests with larger bodies are rejected */
+#define MAX_BODY_LEN (16 * 1024 * 1024)
+
+#define READ_CHUNK 16384
+
+/* Reads from one connection before its input is processed, so that a client
+ * that keeps sending cannot hold up the others */
+#define READ_BURST 16
+
+/* Unprocessed input beyond the largest acceptable request is rejected */
+#define MAX_IN_LEN (MAX_HEADER_LEN + MAX_BODY_LEN)
+#define EPOLL_EVENTS 64
+
+typedef struct pyipmeta_server pyipmeta_server_t;
+typedef struct pyipmeta_conn pyipmeta_conn_t;
+
+/* Per-thread lookup state */
+typedef struct worker {
+  pyipmeta_server_t *srv;
+  ipmeta_record_set_t *set;
+  pyipmeta_buf_t query;
+  pthread_t thread;
+} worker_t;
+
+/* A front end turns the bytes received on a connection into responses.
+ *
+ * process() handles as many complete requests from conn->in as possible,
+ * consuming them and appending the responses to conn->out. It returns 0 to
+ * keep the connection open or -1 to close it once the output is flushed.
+ */
+typedef struct frontend {
+  const char *name;
+  int (*process)(worker_t *w, pyipmeta_conn_t *conn);
+} frontend_t;
+
+enum { SOCK_LISTENER, SOCK_CONN };
+
+typedef struct listener {
+  int kind;
+  int fd;
+  const frontend_t *fe;
+} listener_t;
+
+struct pyipmeta_conn {
+  int kind;
+  int fd;
+  const frontend_t *fe;
+  pyipmeta_buf_t in;
+  pyipmeta_buf_t out;
+  int closing;
+  int want_write;
+  struct pyipmeta_conn *prev;
+  struct pyipmeta_conn *next;
+};
+
+struct pyipmeta_server {
+  /* current ipmeta instance; swapped under the write lock */
+  pthread_rwlock_t ipm_lock;
+  ipmeta_t *ipm;
+  pyipmeta_metrics_t *metrics;
+  uint32_t provmask;
+
+  listener_t listeners[MAX_LISTENERS];
+  int listeners_cnt;
+
+  worker_t *workers;
+  int workers_cnt;
+
+  /* closing the write end stops the workers */
+  int stop_pipe[2];
+};
+
+typedef struct {
+  PyObject_HEAD
+
+  /* IpMeta object the server answers queries from */
+  PyObject *pyipm;
+
+  /* while the workers run, they hold a reader on the IpMeta object's guard
+   * (so that enable_provider cannot change it under them); this is the
+   * shard, or -1 */
+  int shard;
+
+  pyipmeta_server_t srv;
+
+  /* serializes listen, start, stop and set_ipm, which may be called from
+   * different threads (taken without the GIL) */
+  pthread_mutex_t ctl_lock;
+
+} ServerObject;
+
+/* ========== LOOKUPS ========== */
+
+/* Look up a query and append the JSON result to out */
+static int lookup_json(worker_t *w, const char *query, size_t len,
+                       uint32_t provmask, pyipmeta_buf_t *out, int *rcp)
+{
+  pyipmeta_server_t *srv = w->srv;
+  uint64_t start;
+  int rc, err;
+
+  /* ipmeta_lookup needs a NUL-terminated string */
+  w->query.len = 0;
+  if (_pyipmeta_buf_append(&w->query, query, len) != 0 ||
+      _pyipmeta_buf_append(&w->query, "", 1) != 0) {
+    return -1;
+  }
+
+  ipmeta_record_set_clear(w->set);
+  pthread_rwlock_rdlock(&srv->ipm_lock);
+  start = _pyipmeta_metrics_now(srv->metrics);
+  rc = ipmeta_lookup(srv->ipm, w->query.data, provmask ? provmask
+                                                       : srv->provmask,
+                     w->set);
+  start = _pyipmeta_metrics_lookup(srv->metrics, rc, w->set, start);
+  err = _pyipmeta_json_lookup(out, query, len, rc, w->set, NULL, 0);
+  _pyipmeta_metrics_time(srv->metrics, PYIPMETA_HIST_CONVERT, start);
+  pthread_rwlock_unlock(&srv->ipm_lock);
+  ipmeta_record_set_clear(w->set);
+
+  if (rcp != NULL) {
+    *rcp = rc;
+  }
+  return err;
+}
+
+/* ========== LINE PROTOCOL ========== */
+
+/* One query per line; one JSON object per line in response */
+static int line_process(worker_t *w, pyipmeta_conn_t *conn)
+{
+  char *line, *eol;
+  size_t len, used = 0;
+
+  while ((eol = memchr(conn->in.data + used, '\n', conn->in.len - used)) !=
+         NULL) {
+    line = conn->in.data + used;
+    len = eol - line;
+    used += len + 1;
+    if (len > 0 && line[len - 1] == '\r') {
+      len--;
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (lookup_json(w, line, len, 0, &conn->out, NULL) != 0 ||
+        _pyipmeta_buf_append(&conn->out, "\n", 1) != 0) {
+      return -1;
+    }
+  }
+  _pyipmeta_buf_consume(&conn->in, used);
+  return (conn->in.len > MAX_HEADER_LEN) ? -1 : 0;
+}
+
+/* ========== HTTP ========== */
+
+static int hexval(char c)
+{
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/* Percent-decode a path segment in place, returning the new length */
+static size_t url_decode(char *s, size_t len)
+{
+  size_t i, j = 0;
+  for (i = 0; i < len; i++) {
+    if (s[i] == '%' && i + 2 < len && hexval(s[i + 1]) >= 0 &&
+        hexval(s[i + 2]) >= 0) {
+      s[j++] = (char)(hexval(s[i + 1]) * 16 + hexval(s[i + 2]));
+      i += 2;
+    } else {
+      s[j++] = s[i];
+    }
+  }
+  return j;
+}
+
+static int http_respond(pyipmeta_conn_t *conn, const char *status,
+                        int keepalive, const char *body, size_t body_len)
+{
+  char hdr[256];
+  int len = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %s\r\n"
+                     "Content-Type: application/json\r\n"
+                     "Content-Length: %zu\r\n"
+                     "%s"
+                     "\r\n",
+                     status, body_len,
+                     keepalive ? "" : "Connection: close\r\n");
+  if (_pyipmeta_buf_append(&conn->out, hdr, len) != 0 ||
+      _pyipmeta_buf_append(&conn->out, body, body_len) != 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/* Case-insensitive check for a header line with the given name */
+static const char *header_value(const char *line, const char *eol,
+                                const char *name)
+{
+  size_t nlen = strlen(name);
+  if ((size_t)(eol - line) <= nlen || strncasecmp(line, name, nlen) != 0 ||
+      line[nlen] != ':') {
+    return NULL;
+  }
+  line += nlen + 1;
+  while (line < eol && *line == ' ') {
+    line++;
+  }
+  return line;
+}
+
+/* Route a single HTTP request, appending the response body to body.
+ * Returns the HTTP status line to use. */
+static const char *http_route(worker_t *w, const char *method, char *target,
+                              size_t target_len, const char *req_body,
+                              size_t req_body_len, pyipmeta_buf_t *body)
+{
+  uint32_t provmask = 0;
+  const char *params, *pm, *params_end;
+  const char *line, *eol, *end;
+  size_t len;
+  int rc, first = 1;
+
+  /* the only parameter we understand is provmask=<n>; the target is not
+     NUL-terminated, so stay within the query string */
+  if ((params = memchr(target, '?', target_len)) != NULL) {
+    params_end = target + target_len;
+    pm = params + 1;
+    while ((pm = memmem(pm, params_end - pm, "provmask=", 9)) != NULL &&
+           pm[-1] != '?' && pm[-1] != '&') {
+      pm++;
+    }
+    if (pm != NULL) {
+      for (pm += 9; pm < params_end && *pm >= '0' && *pm <= '9'; pm++) {
+        provmask = provmask * 10 + (*pm - '0');
+      }
+    }
+    target_len = params - target;
+  }
+
+  if (strcmp(method, "GET") == 0 && target_len > 8 &&
+      strncmp(target, "/lookup/", 8) == 0) {
+    /* GET /lookup/<addr> or /lookup/<addr>/<len> */
+    len = url_decode(target + 8, target_len - 8);
+    if (lookup_json(w, target + 8, len, provmask, body, &rc) != 0) {
+      return NULL;
+    }
+    return (rc < 0) ? "400 Bad Request" : "200 OK";
+  }
+
+  if (strcmp(method, "POST") == 0 && target_len == 7 &&
+      strncmp(target, "/lookup", 7) == 0) {
+    /* POST /lookup with one query per line; returns a JSON array */
+    if (_pyipmeta_buf_append(body, "[", 1) != 0) {
+      return NULL;
+    }
+    end = req_body + req_body_len;
+    for (line = req_body; line < end; line = eol + 1) {
+      if ((eol = memchr(line, '\n', end - line)) == NULL) {
+        eol = end;
+      }
+      len = eol - line;
+      if (len > 0 && line[len - 1] == '\r') {
+        len--;
+      }
+      if (len == 0) {
+        continue;
+      }
+      if ((!first && _pyipmeta_buf_append(body, ", ", 2) != 0) ||
+          lookup_json(w, line, len, provmask, body, NULL) != 0) {
+        return NULL;
+      }
+      first = 0;
+    }
+    if (_pyipmeta_buf_append(body, "]", 1) != 0) {
+      return NULL;
+    }
+    return "200 OK";
+  }
+
+  if (_pyipmeta_buf_puts(body, "{\"error\": \"Not found\"}") != 0) {
+    return NULL;
+  }
+  return "404 Not Found";
+}
+
+static int http_process(worker_t *w, pyipmeta_conn_t *conn)
+{
+  pyipmeta_buf_t body = {NULL, 0, 0};
+  char *hdr_end, *line, *eol, *sp1, *sp2;
+  const char *val, *status;
+  char method[8];
+  size_t hdr_len, body_len;
+  int keepalive, http11;
+
+  while (conn->in.len > 0) {
+    if ((hdr_end = memmem(conn->in.data, conn->in.len, "\r\n\r\n", 4)) ==
+        NULL) {
+      if (conn->in.len > MAX_HEADER_LEN) {
+        http_respond(conn, "431 Request Header Fields Too Large", 0, "", 0);
+        goto close;
+      }
+      break;
+    }
+    hdr_len = hdr_end + 4 - conn->in.data;
+
+    /* request line: METHOD SP target SP HTTP/1.x */
+    line = conn->in.data;
+    eol = memchr(line, '\r', hdr_len);
+    if ((sp1 = memchr(line, ' ', eol - line)) == NULL ||
+        (sp2 = memchr(sp1 + 1, ' ', eol - sp1 - 1)) == NULL ||
+        (size_t)(sp1 - line) >= sizeof(method) ||
+        eol - sp2 - 1 != 8 || strncmp(sp2 + 1, "HTTP/1.", 7) != 0) {
+      http_respond(conn, "400 Bad Request", 0, "", 0);
+      goto close;
+    }
+    memcpy(method, line, sp1 - line);
+    method[sp1 - line] = '\0';
+    http11 = (sp2[8] == '1');
+    keepalive = http11;
+
+    /* headers */
+    body_len = 0;
+    for (line = eol + 2; line < hdr_end; line = eol + 2) {
+      eol = memchr(line, '\r', hdr_end + 2 - line);
+      if ((val = header_value(line, eol, "Content-Length")) != NULL) {
+        body_len = strtoul(val, NULL, 10);
+      } else if ((val = header_value(line, eol, "Connection")) != NULL) {
+        if (strncasecmp(val, "close", 5) == 0) {
+          keepalive = 0;
+        } else if (strncasecmp(val, "keep-alive", 10) == 0) {
+          keepalive = 1;
+        }
+      }
+    }
+    if (body_len > MAX_BODY_LEN) {
+      http_respond(conn, "413 Payload Too Large", 0, "", 0);
+      goto close;
+    }
+    if (conn->in.len < hdr_len + body_len) {
+      /* wait for the rest of the body */
+      break;
+    }
+
+    body.len = 0;
+    if ((status = http_route(w, method, sp1 + 1, sp2 - sp1 - 1,
+                             conn->in.data + hdr_len, body_len,
+                             &body)) == NULL ||
+        http_respond(conn, status, keepalive, body.data, body.len) != 0) {
+      goto close;
+    }
+    _pyipmeta_buf_consume(&conn->in, hdr_len + body_len);
+    if (!keepalive) {
+      goto close;
+    }
+  }
+  _pyipmeta_buf_free(&body);
+  return 0;
+
+ close:
+  _pyipmeta_buf_free(&body);
+  conn->in.len = 0;
+  return -1;
+}
+
+static const frontend_t frontends[] = {
+  {"http", http_process},
+  {"line", line_process},
+  {NULL, NULL},
+};
+
+static const frontend_t *frontend_by_name(const char *name)
+{
+  const frontend_t *fe;
+  for (fe = frontends; fe->name != NULL; fe++) {
+    if (strcmp(fe->name, name) == 0) {
+      return fe;
+    }
+  }
+  return NULL;
+}
+
+/* ========== EVENT LOOP ========== */
+
+static void conn_free(pyipmeta_conn_t *conn)
+{
+  if (conn->fd != -1) {
+    close(conn->fd);
+  }
+  _pyipmeta_buf_free(&conn->in);
+  _pyipmeta_buf_free(&conn->out);
+  free(conn);
+}
+
+/* Write as much pending output as possible.
+ * Returns -1 if the connection should be closed. */
+static int conn_flush(int epfd, pyipmeta_conn_t *conn)
+{
+  struct epoll_event ev;
+  ssize_t rc;
+  size_t sent = 0;
+
+  while (sent < conn->out.len) {
+    rc = write(conn->fd, conn->out.data + sent, conn->out.len - sent);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    sent += rc;
+  }
+  _pyipmeta_buf_consume(&conn->out, sent);
+
+  if ((conn->out.len > 0) != conn->want_write) {
+    conn->want_write = (conn->out.len > 0);
+    ev.events = EPOLLIN | EPOLLRDHUP | (conn->want_write ? EPOLLOUT : 0);
+    ev.data.ptr = conn;
+    epoll_ctl(epfd, EPOLL_CTL_MOD, conn->fd, &ev);
+  }
+  return (conn->out.len == 0 && conn->closing) ? -1 : 0;
+}
+
+/* Read what is available and process complete requests.
+ * Returns -1 if the connection should be closed. */
+static int conn_read(worker_t *w, pyipmeta_conn_t *conn)
+{
+  ssize_t rc;
+  int reads = 0;
+
+  /* epoll is level-triggered, so whatever is left is read next time */
+  while (reads < READ_BURST) {
+    if (conn->in.len > MAX_IN_LEN ||
+        _pyipmeta_buf_reserve(&conn->in, READ_CHUNK) != 0) {
+      return -1;
+    }
+    rc = read(conn->fd, conn->in.data + conn->in.len, READ_CHUNK);
+    if (rc < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        break;
+      }
+      return -1;
+    }
+    if (rc == 0) {
+      conn->closing = 1;
+      break;
+    }
+    conn->in.len += rc;
+    reads++;
+  }
+  if (conn->fe->process(w, conn) != 0) {
+    conn->closing = 1;
+  }
+  return 0;
+}
+
+static void *worker_run(void *arg)
+{
+  worker_t *w = arg;
+  pyipmeta_server_t *srv = w->srv;
+  struct epoll_event ev, events[EPOLL_EVENTS];
+  pyipmeta_conn_t *conns = NULL, *conn;
+  listener_t *lst;
+  int epfd, nev, i, fd, done = 0;
+
+  if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    return NULL;
+  }
+  /* the stop pipe is registered with a NULL pointer */
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, srv->stop_pipe[0], &ev);
+  for (i = 0; i < srv->listeners_cnt; i++) {
+    /* only wake one worker per incoming connection */
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+    ev.data.ptr = &srv->listeners[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, srv->listeners[i].fd, &ev);
+  }
+
+  while (!done) {
+    if ((nev = epoll_wait(epfd, events, EPOLL_EVENTS, -1)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    for (i = 0; i < nev; i++) {
+      if (events[i].data.ptr == NULL) {
+        done = 1;
+        break;
+      }
+
+      if (*(int *)events[i].data.ptr == SOCK_LISTENER) {
+        lst = events[i].data.ptr;
+        while ((fd = accept4(lst->fd, NULL, NULL,
+                             SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+          if ((conn = calloc(1, sizeof(*conn))) == NULL) {
+            close(fd);
+            continue;
+          }
+          conn->kind = SOCK_CONN;
+          conn->fd = fd;
+          conn->fe = lst->fe;
+          ev.events = EPOLLIN | EPOLLRDHUP;
+          ev.data.ptr = conn;
+          if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            conn_free(conn);
+            continue;
+          }
+          if ((conn->next = conns) != NULL) {
+            conns->prev = conn;
+          }
+          conns = conn;
+        }
+        continue;
+      }
+
+      conn = events[i].data.ptr;
+      if (((events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP)) &&
+           conn_read(w, conn) != 0) ||
+          (events[i].events & EPOLLERR) || conn_flush(epfd, conn) != 0) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, conn->fd, NULL);
+        if (conn->prev != NULL) {
+          conn->prev->next = conn->next;
+        } else {
+          conns = conn->next;
+        }
+        if (conn->next != NULL) {
+          conn->next->prev = conn->prev;
+        }
+        conn_free(conn);
+      }
+    }
+  }
+
+  while (conns != NULL) {
+    conn = conns->next;
+    conn_free(conns);
+    conns = conn;
+  }
+  close(epfd);
+  return NULL;
+}
+
+static int worker_init(worker_t *w, pyipmeta_server_t *srv)
+{
+  memset(w, 0, sizeof(*w));
+  w->srv = srv;
+  if ((w->set = ipmeta_record_set_init()) == NULL) {
+    return -1;
+  }
+  return 0;
+}
+
+static void worker_free(worker_t *w)
+{
+  if (w->set != NULL) {
+    ipmeta_record_set_free(&w->set);
+  }
+  _pyipmeta_buf_free(&w->query);
+}
+
+static void server_stop(pyipmeta_server_t *srv)
+{
+  int i;
+
+  if (srv->workers == NULL) {
+    return;
+  }
+  /* wake everyone up by closing the write end */
+  close(srv->stop_pipe[1]);
+  for (i = 0; i < srv->workers_cnt; i++) {
+    pthread_join(srv->workers[i].thread, NULL);
+    worker_free(&srv->workers[i]);
+  }
+  close(srv->stop_pipe[0]);
+  free(srv->workers);
+  srv->workers = NULL;
+  srv->workers_cnt = 0;
+}
+
+/* ========== PYTHON OBJECT ========== */
+
+/* Stop the workers and leave the IpMeta object's guard. Called with the
+ * control lock held (or from dealloc). */
+static void
+server_stop_reading(ServerObject *self)
+{
+  server_stop(&self->srv);
+  if (self->shard >= 0) {
+    _pyipmeta_ipmeta_end((IpMetaObject *)self->pyipm, self->shard);
+    self->shard = -1;
+  }
+}
+
+static void
+Server_dealloc(ServerObject *self)
+{
+  int i;
+
+  server_stop_reading(self);
+  for (i = 0; i < self->srv.listeners_cnt; i++) {
+    close(self->srv.listeners[i].fd);
+  }
+  pthread_rwlock_destroy(&self->srv.ipm_lock);
+  pthread_mutex_destroy(&self->ctl_lock);
+  Py_XDECREF(self->pyipm);
+  PyTypeObject *tp = Py_TYPE(self);
+  tp->tp_free((PyObject*)self);
+  Py_DECREF(tp);
+}
+
+static PyObject *
+Server_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+  ServerObject *self;
+  IpMetaObject *pyipm = NULL;
+  int provmask = 0;
+  static char *kwlist[] = { "ipm", "provmask", NULL };
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "O!|i", kwlist,
+                                   _pyipmeta_get_state(type)->IpMetaType,
+                                   &pyipm, &provmask)) {
+    return NULL;
+  }
+
+  self = (ServerObject *)type->tp_alloc(type, 0);
+  if (self == NULL) {
+    return NULL;
+  }
+  pthread_rwlock_init(&self->srv.ipm_lock, NULL);
+  pthread_mutex_init(&self->ctl_lock, NULL);
+  self->shard = -1;
+  Py_INCREF(pyipm);
+  self->pyipm = (PyObject *)pyipm;
+  self->srv.ipm = pyipm->ipm;
+  self->srv.metrics = pyipm->metrics;
+  self->srv.provmask = provmask;
+
+  return (PyObject *)self;
+}
+
+static int
+Server_init(ServerObject *self, PyObject *args, PyObject *kwds)
+{
+  return 0;
+}
+
+/* Take the control lock, without holding the GIL while waiting for it */
+static void
+ctl_lock(ServerObject *self)
+{
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&self->ctl_lock);
+  Py_END_ALLOW_THREADS
+}
+
+static void
+ctl_unlock(ServerObject *self)
+{
+  pthread_mutex_unlock(&self->ctl_lock);
+}
+
+/* Add a listening socket */
+static PyObject *
+Server_listen(ServerObject *self, PyObject *args, PyObject *kwds)
+{
+  const char *host = NULL, *port = NULL, *protocol = "http";
+  static char *kwlist[] = { "host", "port", "protocol", NULL };
+  struct addrinfo hints, *res = NULL, *ai;
+  struct sockaddr_storage ss;
+  socklen_t sslen = sizeof(ss);
+  char portbuf[NI_MAXSERV];
+  const frontend_t *fe;
+  int fd = -1, one = 1, rc;
+  PyObject *ret = NULL;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwds, "zs|s", kwlist,
+                                   &host, &port, &protocol)) {
+    return NULL;
+  }
+  if ((fe = frontend_by_name(protocol)) == NULL) {
+    PyErr_Format(PyExc_ValueError, "Unknown protocol '%s'", protocol);
+    return NULL;
+  }
+  ctl_lock(self);
+  if (self->srv.workers != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "Server is already running");
+    goto done;
+  }
+  if (self->srv.listeners_cnt == MAX_LISTENERS) {
+    PyErr_SetString(PyExc_RuntimeError, "Too many listeners");
+    goto done;
+  }
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  Py_BEGIN_ALLOW_THREADS
+  rc = getaddrinfo(host, port, &hints, &res);
+  Py_END_ALLOW_THREADS
+  if (rc != 0) {
+    PyErr_Format(PyExc_OSError, "Could not resolve %s:%s: %s",
+                 host ? host : "*", port, gai_strerror(rc));
+    goto done;
+  }
+  for (ai = res; ai != NULL; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK |
+                     SOCK_CLOEXEC, ai->ai_protocol)) < 0) {
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+        listen(fd, SOMAXCONN) == 0) {
+      break;
+    }
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    goto done;
+  }
+
+  self->srv.listeners[self->srv.listeners_cnt].kind = SOCK_LISTENER;
+  self->srv.listeners[self->srv.listeners_cnt].fd = fd;
+  self->srv.listeners[self->srv.listeners_cnt].fe = fe;
+  self->srv.listeners_cnt++;
+
+  /* return the bound port, which is useful when port "0" was requested */
+  if (getsockname(fd, (struct sockaddr *)&ss, &sslen) != 0 ||
+      getnameinfo((struct sockaddr *)&ss, sslen, NULL, 0, portbuf,
+                  sizeof(portbuf), NI_NUMERICSERV) != 0) {
+    ret = Py_None;
+    Py_INCREF(ret);
+  } else {
+    ret = Py_BuildValue("i", atoi(portbuf));
+  }
+
+ done:
+  ctl_unlock(self);
+  return ret;
+}
+
+/* Start the worker threads */
+static PyObject *
+Server_start(ServerObject *self, PyObject *args)
+{
+  pyipmeta_server_t *srv = &self->srv;
+  int threads_cnt = 0;
+  PyObject *ret = NULL;
+
+  if (!PyArg_ParseTuple(args, "|i", &threads_cnt)) {
+    return NULL;
+  }
+  ctl_lock(self);
+  if (srv->workers != NULL) {
+    PyErr_SetString(PyExc_RuntimeError, "Server is already running");
+    goto done;
+  }
+  if (threads_cnt <= 0) {
+    threads_cnt = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if ((self->shard = _pyipmeta_ipmeta_begin((IpMetaObject *)self->pyipm)) <
+      0) {
+    goto done;
+  }
+  if (pipe2(srv->stop_pipe, O_CLOEXEC) != 0) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    server_stop_reading(self);
+    goto done;
+  }
+  if ((srv->workers = calloc(threads_cnt, sizeof(worker_t))) == NULL) {
+    close(srv->stop_pipe[0]);
+    close(srv->stop_pipe[1]);
+    server_stop_reading(self);
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (; srv->workers_cnt < threads_cnt; srv->workers_cnt++) {
+    worker_t *w = &srv->workers[srv->workers_cnt];
+    if (worker_init(w, srv) != 0 ||
+        pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+      worker_free(w);
+      server_stop_reading(self);
+      PyErr_SetString(PyExc_RuntimeError, "Could not start server threads");
+      goto done;
+    }
+  }
+  ret = Py_None;
+  Py_INCREF(ret);
+
+ done:
+  ctl_unlock(self);
+  return ret;
+}
+
+/* Stop the worker threads (listening sockets stay open) */
+static PyObject *
+Server_stop(ServerObject *self)
+{
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&self->ctl_lock);
+  server_stop_reading(self);
+  pthread_mutex_unlock(&self->ctl_lock);
+  Py_END_ALLOW_THREADS
+  Py_RETURN_NONE;
+}
+
+/* Switch to a different IpMeta instance (e.g., after a reload) */
+static PyObject *
+Server_set_ipm(ServerObject *self, PyObject *args)
+{
+  IpMetaObject *pyipm = NULL;
+  PyObject *old;
+  int shard = -1;
+
+  if (!PyArg_ParseTuple(args, "O!",
+                        _pyipmeta_get_state(Py_TYPE(self))->IpMetaType,
+                        &pyipm)) {
+    return NULL;
+  }
+
+  ctl_lock(self);
+  /* running workers hold a reader on the new instance from now on */
+  if (self->srv.workers != NULL &&
+      (shard = _pyipmeta_ipmeta_begin(pyipm)) < 0) {
+    ctl_unlock(self);
+    return NULL;
+  }
+  Py_INCREF(pyipm);
+  Py_BEGIN_ALLOW_THREADS
+  pthread_rwlock_wrlock(&self->srv.ipm_lock);
+  self->srv.ipm = pyipm->ipm;
+  self->srv.metrics = pyipm->metrics;
+  pthread_rwlock_unlock(&self->srv.ipm_lock);
+  Py_END_ALLOW_THREADS
+  /* no worker can be using the old instance any more */
+  old = self->pyipm;
+  if (self->shard >= 0) {
+    _pyipmeta_ipmeta_end((IpMetaObject *)old, self->shard);
+  }
+  self->shard = shard;
+  self->pyipm = (PyObject *)pyipm;
+  ctl_unlock(self);
+  Py_DECREF(old);
+
+  Py_RETURN_NONE;
+}
+
+/* Run data through a front end without a socket, returning the response
+ * bytes. This is the same code path used for network connections. A
+ * sequence of chunks is processed as successive reads from one
+ * connection. */
+static PyObject *
+Server_feed(ServerObject *self, PyObject *args)
+{
+  const char *protocol;
+  PyObject *pydata, *seq, *res = NULL;
+  IpMetaObject *pyipm;
+  Py_buffer data;
+  pyipmeta_server_t srv;
+  pyipmeta_conn_t conn;
+  worker_t w;
+  Py_ssize_t i;
+  int rc = 0, shard;
+
+  if (!PyArg_ParseTuple(args, "sO", &protocol, &pydata)) {
+    return NULL;
+  }
+  memset(&conn, 0, sizeof(conn));
+  conn.kind = SOCK_CONN;
+  conn.fd = -1;
+  if ((conn.fe = frontend_by_name(protocol)) == NULL) {
+    PyErr_Format(PyExc_ValueError, "Unknown protocol '%s'", protocol);
+    return NULL;
+  }
+  if (PyObject_CheckBuffer(pydata)) {
+    seq = PyTuple_Pack(1, pydata);
+  } else {
+    seq = PySequence_Fast(pydata,
+                          "data must be bytes or a sequence of bytes");
+  }
+  if (seq == NULL) {
+    return NULL;
+  }
+  /* each call has its own lookup state, and answers from the IpMeta object
+   * of the moment (holding a reader on it), so threads can feed at once */
+  ctl_lock(self);
+  pyipm = (IpMetaObject *)self->pyipm;
+  Py_INCREF(pyipm);
+  memset(&srv, 0, sizeof(srv));
+  srv.provmask = self->srv.provmask;
+  ctl_unlock(self);
+  srv.ipm = pyipm->ipm;
+  srv.metrics = pyipm->metrics;
+  pthread_rwlock_init(&srv.ipm_lock, NULL);
+  if ((shard = _pyipmeta_ipmeta_begin(pyipm)) < 0) {
+    goto unref;
+  }
+  if (worker_init(&w, &srv) != 0) {
+    _pyipmeta_ipmeta_end(pyipm, shard);
+    PyErr_NoMemory();
+    goto unref;
+  }
+
+  for (i = 0; i < PySequence_Fast_GET_SIZE(seq) && rc == 0; i++) {
+    if (PyObject_GetBuffer(PySequence_Fast_GET_ITEM(seq, i), &data,
+                           PyBUF_SIMPLE) != 0) {
+      goto done;
+    }
+    rc = _pyipmeta_buf_append(&conn.in, data.buf, data.len);
+    PyBuffer_Release(&data);
+    if (rc != 0) {
+      PyErr_NoMemory();
+      goto done;
+    }
+    /* the connection would be closed on failure, dropping later chunks */
+    Py_BEGIN_ALLOW_THREADS
+    rc = conn.fe->process(&w, &conn);
+    Py_END_ALLOW_THREADS
+  }
+  res = PyBytes_FromStringAndSize(conn.out.data, conn.out.len);
+
+ done:
+  worker_free(&w);
+  _pyipmeta_ipmeta_end(pyipm, shard);
+ unref:
+  pthread_rwlock_destroy(&srv.ipm_lock);
+  Py_DECREF(pyipm);
+  Py_DECREF(seq);
+  _pyipmeta_buf_free(&conn.in);
+  _pyipmeta_buf_free(&conn.out);
+  return res;
+}
+
+static PyMethodDef Server_methods[] = {
+
+  {
+    "listen",
+    (PyCFunction)Server_listen,
+    METH_VARARGS | METH_KEYWORDS,
+    "Listen on the given host and port using the given protocol ('http' or "
+    "'line'), returning the bound port"
+  },
+
+  {
+    "start",
+    (PyCFunction)Server_start,
+    METH_VARARGS,
+    "Start serving requests with the given number of threads"
+  },
+
+  {
+    "stop",
+    (PyCFunction)Server_stop,
+    METH_NOARGS,
+    "Stop serving requests"
+  },
+
+  {
+    "set_ipm",
+    (PyCFunction)Server_set_ipm,
+    METH_VARARGS,
+    "Answer queries from the given IpMeta object from now on"
+  },
+
+  {
+    "feed",
+    (PyCFunction)Server_feed,
+    METH_VARARGS,
+    "Process request bytes (or a sequence of chunks, as successive reads) "
+    "with the given protocol, returning the response bytes"
+  },
+
+  {NULL}  /* Sentinel */
+};
+
+static PyType_Slot Server_slots[] = {
+  {Py_tp_dealloc, Server_dealloc},
+  {Py_tp_doc, ServerDocstring},
+  {Py_tp_methods, Server_methods},
+  {Py_tp_init, Server_init},
+  {Py_tp_new, Server_new},
+  {0, NULL},
+};
+
+static PyType_Spec Server_spec = {
+  ServerTypeName,
+  sizeof(ServerObject),
+  0,
+  Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE |
+    Py_TPFLAGS_IMMUTABLETYPE,
+  Server_slots,
+};
+
+PyType_Spec *_pyipmeta_server_get_ServerSpec()
+{
+  return &Server_spec;
+}
@@ -0,0 +1,529 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+#include "_pyipmeta_spatial.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Grid dimensions */
+#define ROWS (180 / PYIPMETA_SPATIAL_CELL_DEG)
+#define COLS (360 / PYIPMETA_SPATIAL_CELL_DEG)
+
+/* Mean radius of the earth in km */
+#define EARTH_RADIUS_KM 6371.0088
+
+#define DEG2RAD(deg) ((deg) * M_PI / 180.0)
+#define RAD2DEG(rad) ((rad) * 180.0 / M_PI)
+
+/* Bounds of a query, with a test for the records in the candidate cells */
+typedef struct query {
+  double min_lat, max_lat, min_lon, max_lon;
+  int (*match)(const struct query *q, const ipmeta_record_t *rec);
+
+  /* radius queries */
+  double lat, lon, radius_km;
+} query_t;
+
+/* Cells are clamped before converting to int, which would be undefined for
+ * values out of range (or NaN, e.g., from a record with a bad location) */
+static int cell_row(double lat)
+{
+  double row = floor((lat + 90.0) / PYIPMETA_SPATIAL_CELL_DEG);
+  return !(row >= 0) ? 0 : (row >= ROWS ? ROWS - 1 : (int)row);
+}
+
+static int cell_col(double lon)
+{
+  double col = floor((lon + 180.0) / PYIPMETA_SPATIAL_CELL_DEG);
+  return !(col >= 0) ? 0 : (col >= COLS ? COLS - 1 : (int)col);
+}
+
+static int has_location(const ipmeta_record_t *rec)
+{
+  return rec->latitude != 0 || rec->longitude != 0;
+}
+
+/* Turn per-record counts into offsets (with offs[cnt] the total) */
+static uint32_t counts_to_offs(uint32_t *offs, uint32_t cnt)
+{
+  uint32_t i, total = 0, n;
+
+  for (i = 0; i < cnt; i++) {
+    n = offs[i];
+    offs[i] = total;
+    total += n;
+  }
+  offs[cnt] = total;
+  return total;
+}
+
+/* Collect the IPv4 and IPv6 ranges of each record */
+static int build_ranges(pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+                        uint32_t *fill)
+{
+  const pyipmeta_ranges4_t *t4;
+  const pyipmeta_ranges6_t *t6;
+  uint32_t i, r, total;
+  int p;
+
+  if ((sp->rng4_offs = calloc(sp->recs_cnt + 1, sizeof(uint32_t))) == NULL ||
+      (sp->rng6_offs = calloc(sp->recs_cnt + 1, sizeof(uint32_t))) == NULL) {
+    return -1;
+  }
+  for (p = 0; p < IPMETA_PROVIDER_MAX; p++) {
+    if ((sp->provmask & IPMETA_PROV_TO_MASK(p + 1)) == 0) {
+      continue;
+    }
+    if ((t4 = idx->v4[p]) != NULL) {
+      for (i = 0; i < t4->cnt; i++) {
+        if (t4->vals[i] != PYIPMETA_INDEX_NONE) {
+          sp->rng4_offs[t4->vals[i]]++;
+        }
+      }
+    }
+    if ((t6 = idx->v6[p]) != NULL) {
+      for (i = 0; i < t6->cnt; i++) {
+        if (t6->vals[i] != PYIPMETA_INDEX_NONE) {
+          sp->rng6_offs[t6->vals[i]]++;
+        }
+      }
+    }
+  }
+
+  total = counts_to_offs(sp->rng4_offs, sp->recs_cnt);
+  if ((sp->rng4 = malloc(sizeof(uint32_t) * 2 * (total + 1))) == NULL) {
+    return -1;
+  }
+  sp->bytes += sizeof(uint32_t) * 2 * total;
+  memcpy(fill, sp->rng4_offs, sizeof(uint32_t) * sp->recs_cnt);
+  for (p = 0; p < IPMETA_PROVIDER_MAX; p++) {
+    if ((sp->provmask & IPMETA_PROV_TO_MASK(p + 1)) == 0 ||
+        (t4 = idx->v4[p]) == NULL) {
+      continue;
+    }
+    for (i = 0; i < t4->cnt; i++) {
+      if ((r = t4->vals[i]) == PYIPMETA_INDEX_NONE) {
+        continue;
+      }
+      sp->rng4[fill[r] * 2] = t4->starts[i];
+      sp->rng4[fill[r] * 2 + 1] =
+        i + 1 < t4->cnt ? t4->starts[i + 1] - 1 : UINT32_MAX;
+      fill[r]++;
+    }
+  }
+
+  total = counts_to_offs(sp->rng6_offs, sp->recs_cnt);
+  if ((sp->rng6 = malloc(sizeof(uint64_t) * 2 * (total + 1))) == NULL) {
+    return -1;
+  }
+  sp->bytes += sizeof(uint64_t) * 2 * total;
+  memcpy(fill, sp->rng6_offs, sizeof(uint32_t) * sp->recs_cnt);
+  for (p = 0; p < IPMETA_PROVIDER_MAX; p++) {
+    if ((sp->provmask & IPMETA_PROV_TO_MASK(p + 1)) == 0 ||
+        (t6 = idx->v6[p]) == NULL) {
+      continue;
+    }
+    for (i = 0; i < t6->cnt; i++) {
+      if ((r = t6->vals[i]) == PYIPMETA_INDEX_NONE) {
+        continue;
+      }
+      sp->rng6[fill[r] * 2] = t6->starts[i].hi;
+      sp->rng6[fill[r] * 2 + 1] =
+        i + 1 < t6->cnt ? t6->starts[i + 1].hi - 1 : UINT64_MAX;
+      fill[r]++;
+    }
+  }
+  return 0;
+}
+
+/* Place the records that have ranges and a location in the grid */
+static int build_grid(pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+                      uint32_t *cells)
+{
+  const ipmeta_record_t *rec;
+  uint32_t r, total;
+
+  if ((sp->cell_offs = calloc(ROWS * COLS + 1, sizeof(uint32_t))) == NULL) {
+    return -1;
+  }
+  for (r = 0; r < sp->recs_cnt; r++) {
+    rec = idx->recs[r];
+    if (sp->rng4_offs[r] == sp->rng4_offs[r + 1] &&
+        sp->rng6_offs[r] == sp->rng6_offs[r + 1]) {
+      cells[r] = UINT32_MAX;
+      continue;
+    }
+    if (!has_location(rec)) {
+      cells[r] = UINT32_MAX;
+      continue;
+    }
+    cells[r] = cell_row(rec->latitude) * COLS + cell_col(rec->longitude);
+    sp->cell_offs[cells[r]]++;
+  }
+  total = counts_to_offs(sp->cell_offs, ROWS * COLS);
+  if ((sp->cell_recs = malloc(sizeof(uint32_t) * (total + 1))) == NULL) {
+    return -1;
+  }
+  sp->bytes += sizeof(uint32_t) * (ROWS * COLS + 1 + total);
+
+  /* fill each cell from the back so that its records stay in order */
+  for (r = sp->recs_cnt; r-- > 0;) {
+    if (cells[r] != UINT32_MAX) {
+      sp->cell_recs[--sp->cell_offs[cells[r] + 1]] = r;
+    }
+  }
+  /* which left the start of each cell c in cell_offs[c + 1] */
+  memmove(&sp->cell_offs[0], &sp->cell_offs[1],
+          sizeof(uint32_t) * ROWS * COLS);
+  sp->cell_offs[ROWS * COLS] = total;
+  return 0;
+}
+
+static int cmp_pair(const void *a, const void *b)
+{
+  const uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/* Build the polygon id -> record inverted list */
+static int build_polygons(pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx)
+{
+  const ipmeta_record_t *rec;
+  uint64_t *pairs;
+  uint32_t r, i, cnt = 0;
+
+  for (r = 0; r < sp->recs_cnt; r++) {
+    if (sp->rng4_offs[r] != sp->rng4_offs[r + 1] ||
+        sp->rng6_offs[r] != sp->rng6_offs[r + 1]) {
+      cnt += idx->recs[r]->polygon_ids_cnt;
+    }
+  }
+  if ((pairs = malloc(sizeof(uint64_t) * (cnt + 1))) == NULL) {
+    return -1;
+  }
+  cnt = 0;
+  for (r = 0; r < sp->recs_cnt; r++) {
+    rec = idx->recs[r];
+    if (sp->rng4_offs[r] == sp->rng4_offs[r + 1] &&
+        sp->rng6_offs[r] == sp->rng6_offs[r + 1]) {
+      continue;
+    }
+    for (i = 0; i < (uint32_t)rec->polygon_ids_cnt; i++) {
+      pairs[cnt++] = ((uint64_t)rec->polygon_ids[i] << 32) | r;
+    }
+  }
+  qsort(pairs, cnt, sizeof(uint64_t), cmp_pair);
+
+  if ((sp->poly_ids = malloc(sizeof(uint32_t) * (cnt + 1))) == NULL ||
+      (sp->poly_recs = malloc(sizeof(uint32_t) * (cnt + 1))) == NULL) {
+    free(pairs);
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    /* a record may list the same polygon more than once */
+    if (sp->poly_cnt > 0 && pairs[i] == pairs[i - 1]) {
+      continue;
+    }
+    sp->poly_ids[sp->poly_cnt] = (uint32_t)(pairs[i] >> 32);
+    sp->poly_recs[sp->poly_cnt] = (uint32_t)pairs[i];
+    sp->poly_cnt++;
+  }
+  sp->bytes += sizeof(uint32_t) * 2 * sp->poly_cnt;
+  free(pairs);
+  return 0;
+}
+
+/* ========== QUERIES ========== */
+
+static int hits_add(pyipmeta_spatial_hits_t *hits, uint32_t rec)
+{
+  if (hits->cnt == hits->alloc) {
+    size_t new_alloc = hits->alloc ? hits->alloc * 2 : 256;
+    uint32_t *new_recs;
+    if ((new_recs = realloc(hits->recs, sizeof(uint32_t) * new_alloc)) ==
+        NULL) {
+      return -1;
+    }
+    hits->recs = new_recs;
+    hits->alloc = new_alloc;
+  }
+  hits->recs[hits->cnt++] = rec;
+  return 0;
+}
+
+/* Order the hits by provider and record id */
+static int hits_sort(const pyipmeta_index_t *idx,
+                     pyipmeta_spatial_hits_t *hits, size_t first)
+{
+  const ipmeta_record_t *rec;
+  uint64_t *keys;
+  size_t i, cnt = hits->cnt - first;
+
+  if (cnt < 2) {
+    return 0;
+  }
+  if ((keys = malloc(sizeof(uint64_t) * cnt * 2)) == NULL) {
+    return -1;
+  }
+  for (i = 0; i < cnt; i++) {
+    rec = idx->recs[hits->recs[first + i]];
+    keys[i * 2] = ((uint64_t)rec->source << 32) | rec->id;
+    keys[i * 2 + 1] = hits->recs[first + i];
+  }
+  qsort(keys, cnt, sizeof(uint64_t) * 2, cmp_pair);
+  for (i = 0; i < cnt; i++) {
+    hits->recs[first + i] = (uint32_t)keys[i * 2 + 1];
+  }
+  free(keys);
+  return 0;
+}
+
+static int provider_ok(const ipmeta_record_t *rec, uint32_t provmask)
+{
+  return provmask == 0 ||
+         (rec->source >= 1 && rec->source <= IPMETA_PROVIDER_MAX &&
+          (provmask & IPMETA_PROV_TO_MASK(rec->source)) != 0);
+}
+
+/* Check the records of the cells in a range of columns */
+static int scan_cols(const pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+                     const query_t *q, uint32_t provmask, int col_lo,
+                     int col_hi, pyipmeta_spatial_hits_t *hits)
+{
+  const ipmeta_record_t *rec;
+  int row, col;
+  uint32_t i, r;
+
+  for (row = cell_row(q->min_lat); row <= cell_row(q->max_lat); row++) {
+    for (col = col_lo; col <= col_hi; col++) {
+      for (i = sp->cell_offs[row * COLS + col];
+           i < sp->cell_offs[row * COLS + col + 1]; i++) {
+        r = sp->cell_recs[i];
+        rec = idx->recs[r];
+        if (provider_ok(rec, provmask) && q->match(q, rec) &&
+            hits_add(hits, r) != 0) {
+          return -1;
+        }
+      }
+    }
+  }
+  return 0;
+}
+
+/* Check the records of the cells that overlap the query bounds */
+static int scan(const pyipmeta_spatial_t *sp, const pyipmeta_index_t *idx,
+                const query_t *q, uint32_t provmask,
+                pyipmeta_spatial_hits_t *hits)
+{
+  size_t first = hits->cnt;
+
+  if (q->min_lat > q->max_lat) {
+    return 0;
+  }
+  if (q->min_lon <= q->max_lon) {
+    if (scan_cols(sp, idx, q, provmask, cell_col(q->min_lon),
+                  cell_col(q->max_lon), hits) != 0) {
+      return -1;
+    }
+  } else if (scan_cols(sp, idx, q, provmask, cell_col(q->min_lon), COLS - 1,
+                       hits) != 0 ||
+             scan_cols(sp, idx, q, provmask, 0, cell_col(q->max_lon),
+                       hits) != 0) {
+    return -1;
+  }
+  return hits_sort(idx, hits, first);
+}
+
+static int match_bbox(const query_t *q, const ipmeta_record_t *rec)
+{
+  if (rec->latitude < q->min_lat || rec->latitude > q->max_lat) {
+    return 0;
+  }
+  if (q->min_lon <= q->max_lon) {
+    return rec->longitude >= q->min_lon && rec->longitude <= q->max_lon;
+  }
+  return rec->longitude >= q->min_lon || rec->longitude <= q->max_lon;
+}
+
+/* Great-circle distance in km (haversine formula) */
+static double distance_km(double lat1, double lon1, double lat2, double lon2)
+{
+  double dlat = DEG2RAD(lat2 - lat1) / 2, dlon = DEG2RAD(lon2 - lon1) / 2;
+  double a = sin(dlat) * sin(dlat) +
+             cos(DEG2RAD(lat1)) * cos(DEG2RAD(lat2)) * sin(dlon) * sin(dlon);
+  return 2 * EARTH_RADIUS_KM * asin(sqrt(a < 1 ? a : 1));
+}
+
+static int match_radius(const query_t *q, const ipmeta_record_t *rec)
+{
+  return distance_km(q->lat, q->lon, rec->latitude, rec->longitude) <=
+         q->radius_km;
+}
+
+/* ========== PUBLIC FUNCTIONS ========== */
+
+pyipmeta_spatial_t *_pyipmeta_spatial_build(const pyipmeta_index_t *idx,
+                                            uint32_t provmask)
+{
+  pyipmeta_spatial_t *sp;
+  uint32_t *tmp;
+  int p;
+
+  if ((sp = calloc(1, sizeof(*sp))) == NULL) {
+    return NULL;
+  }
+  for (p = 0; p < IPMETA_PROVIDER_MAX; p++) {
+    if ((provmask == 0 || (provmask & IPMETA_PROV_TO_MASK(p + 1))) &&
+        (idx->v4[p] != NULL || idx->v6[p] != NULL)) {
+      sp->provmask |= IPMETA_PROV_TO_MASK(p + 1);
+    }
+  }
+  sp->recs_cnt = idx->recs_cnt;
+  sp->bytes = sizeof(*sp) + sizeof(uint32_t) * 2 * (sp->recs_cnt + 1);
+
+  if ((tmp = malloc(sizeof(uint32_t) * (sp->recs_cnt + 1))) == NULL) {
+    goto err;
+  }
+  if (build_ranges(sp, idx, tmp) != 0 || build_grid(sp, idx, tmp) != 0 ||
+      build_polygons(sp, idx) != 0) {
+    free(tmp);
+    goto err;
+  }
+  free(tmp);
+  return sp;
+
+ err:
+  _pyipmeta_spatial_free(sp);
+  return NULL;
+}
+
+void _pyipmeta_spatial_free(pyipmeta_spatial_t *sp)
+{
+  if (sp == NULL) {
+    return;
+  }
+  free(sp->rng4_offs);
+  free(sp->rng4);
+  free(sp->rng6_offs);
+  free(sp->rng6);
+  free(sp->cell_offs);
+  free(sp->cell_recs);
+  free(sp->poly_ids);
+  free(sp->poly_recs);
+  free(sp);
+}
+
+int _pyipmeta_spatial_bbox(const pyipmeta_spatial_t *sp,
+                           const pyipmeta_index_t *idx, double min_lat,
+                           double min_lon, double max_lat, double max_lon,
+                           uint32_t provmask, pyipmeta_spatial_hits_t *hits)
+{
+  query_t q;
+
+  memset(&q, 0, sizeof(q));
+  q.min_lat = min_lat;
+  q.max_lat = max_lat;
+  q.min_lon = min_lon;
+  q.max_lon = max_lon;
+  q.match = match_bbox;
+  return scan(sp, idx, &q, provmask, hits);
+}
+
+int _pyipmeta_spatial_radius(const pyipmeta_spatial_t *sp,
+                             const pyipmeta_index_t *idx, double lat,
+                             double lon, double radius_km, uint32_t provmask,
+                             pyipmeta_spatial_hits_t *hits)
+{
+  double ang = radius_km / EARTH_RADIUS_KM, dlon;
+  query_t q;
+
+  memset(&q, 0, sizeof(q));
+  q.lat = lat;
+  q.lon = lon;
+  q.radius_km = radius_km;
+  q.match = match_radius;
+  if (radius_km < 0) {
+    return 0;
+  }
+
+  /* the circle's bounding box, which takes in every longitude when the
+   * circle reaches a pole */
+  q.min_lat = lat - RAD2DEG(ang);
+  q.max_lat = lat + RAD2DEG(ang);
+  q.min_lon = -180;
+  q.max_lon = 180;
+  if (q.min_lat > -90 && q.max_lat < 90 &&
+      sin(ang) < cos(DEG2RAD(lat))) {
+    dlon = RAD2DEG(asin(sin(ang) / cos(DEG2RAD(lat))));
+    q.min_lon = lon - dlon;
+    q.max_lon = lon + dlon;
+    if (q.min_lon < -180) {
+      q.min_lon += 360;
+    }
+    if (q.max_lon > 180) {
+      q.max_lon -= 360;
+    }
+  }
+  return scan(sp, idx, &q, provmask, hits);
+}
+
+int _pyipmeta_spatial_polygon(const pyipmeta_spatial_t *sp,
+                              const pyipmeta_index_t *idx,
+                              uint32_t polygon_id, uint32_t provmask,
+                              pyipmeta_spatial_hits_t *hits)
+{
+  uint32_t lo = 0, hi = sp->poly_cnt, mid;
+  size_t first = hits->cnt;
+
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (sp->poly_ids[mid] < polygon_id) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  for (; lo < sp->poly_cnt && sp->poly_ids[lo] == polygon_id; lo++) {
+    if (provider_ok(idx->recs[sp->poly_recs[lo]], provmask) &&
+        hits_add(hits, sp->poly_recs[lo]) != 0) {
+      return -1;
+    }
+  }
+  return hits_sort(idx, hits, first);
+}
+
+void _pyipmeta_spatial_hits_free(pyipmeta_spatial_hits_t *hits)
+{
+  free(hits->recs);
+  hits->recs = NULL;
+  hits->cnt = hits->alloc = 0;
+}
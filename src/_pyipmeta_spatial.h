@@ -0,0 +1,143 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_spatial_H
+#define ___pyipmeta_spatial_H
+
+#include "_pyipmeta_index.h"
+#include <libipmeta.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/** Size of the grid cells in degrees of latitude and longitude */
+#define PYIPMETA_SPATIAL_CELL_DEG 1
+
+/** Spatial index over the records of a range index
+ *
+ * Records are placed in a grid of PYIPMETA_SPATIAL_CELL_DEG degree cells by
+ * their latitude/longitude (records at 0,0 are taken to have no location),
+ * and listed under each of their polygon ids. The ranges of addresses that
+ * map to each record are kept alongside so that queries can return them.
+ * Records are referred to by their index in the range index.
+ */
+typedef struct pyipmeta_spatial {
+  /* providers the index covers */
+  uint32_t provmask;
+
+  /* number of range index records when the index was built */
+  uint32_t recs_cnt;
+
+  /* IPv4 ranges of record r are rng4[rng4_offs[r]] to
+   * rng4[rng4_offs[r + 1] - 1], as pairs of first and last address */
+  uint32_t *rng4_offs;
+  uint32_t *rng4;
+
+  /* IPv6 ranges of each record, as pairs of first and last /64 */
+  uint32_t *rng6_offs;
+  uint64_t *rng6;
+
+  /* records in grid cell c are cell_recs[cell_offs[c]] to
+   * cell_recs[cell_offs[c + 1] - 1] */
+  uint32_t *cell_offs;
+  uint32_t *cell_recs;
+
+  /* (polygon id, record) pairs sorted by polygon id */
+  uint32_t *poly_ids;
+  uint32_t *poly_recs;
+  uint32_t poly_cnt;
+
+  /* memory used by the index */
+  size_t bytes;
+} pyipmeta_spatial_t;
+
+/** Growable array of range index records matched by a spatial query */
+typedef struct pyipmeta_spatial_hits {
+  uint32_t *recs;
+  size_t cnt;
+  size_t alloc;
+} pyipmeta_spatial_hits_t;
+
+/** Build a spatial index over the records of the given providers
+ *
+ * The range index tables of the providers must have been built.
+ *
+ * @return the spatial index, or NULL if out of memory
+ */
+pyipmeta_spatial_t *_pyipmeta_spatial_build(const pyipmeta_index_t *idx,
+                                            uint32_t provmask);
+
+/** Free a spatial index */
+void _pyipmeta_spatial_free(pyipmeta_spatial_t *sp);
+
+/** Find the records located within a bounding box
+ *
+ * A box with min_lon > max_lon crosses the antimeridian.
+ *
+ * @param sp            spatial index
+ * @param idx           range index it was built from
+ * @param min_lat       southern edge, in degrees
+ * @param min_lon       western edge, in degrees
+ * @param max_lat       northern edge, in degrees
+ * @param max_lon       eastern edge, in degrees
+ * @param provmask      providers to return records of (0 for all)
+ * @param hits          matching records are appended here, ordered by
+ *                      provider and record id
+ * @return 0 if successful, -1 if out of memory
+ */
+int _pyipmeta_spatial_bbox(const pyipmeta_spatial_t *sp,
+                           const pyipmeta_index_t *idx, double min_lat,
+                           double min_lon, double max_lat, double max_lon,
+                           uint32_t provmask, pyipmeta_spatial_hits_t *hits);
+
+/** Find the records located within a great-circle distance of a point
+ *
+ * Same as _pyipmeta_spatial_bbox, with the point in degrees and the radius
+ * in km.
+ */
+int _pyipmeta_spatial_radius(const pyipmeta_spatial_t *sp,
+                             const pyipmeta_index_t *idx, double lat,
+                             double lon, double radius_km, uint32_t provmask,
+                             pyipmeta_spatial_hits_t *hits);
+
+/** Find the records that have the given polygon id
+ *
+ * Same as _pyipmeta_spatial_bbox.
+ */
+int _pyipmeta_spatial_polygon(const pyipmeta_spatial_t *sp,
+                              const pyipmeta_index_t *idx,
+                              uint32_t polygon_id, uint32_t provmask,
+                              pyipmeta_spatial_hits_t *hits);
+
+/** Free the memory used by the hits (the array itself is reusable) */
+void _pyipmeta_spatial_hits_free(pyipmeta_spatial_hits_t *hits);
+
+#endif /* ___pyipmeta_spatial_H */
@@ -0,0 +1,81 @@
+/*
+ * This file is part of pyipmeta
+ *
+ * CAIDA, UC San Diego
+ * corsaro-info@caida.org
+ *
+ * Copyright (C) 2017-2020 The Regents of the University of California.
+ * Authors: Alistair King
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef ___pyipmeta_util_H
+#define ___pyipmeta_util_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/** Unset record string fields read as empty strings */
+#define STR_SAFE(cstr) ((cstr) ? (cstr) : "")
+
+/** Initial value of a 64-bit FNV-1a hash */
+#define PYIPMETA_FNV_OFFSET 0xcbf29ce484222325ULL
+
+/** Add bytes to a 64-bit FNV-1a hash */
+static inline uint64_t _pyipmeta_hash_bytes(uint64_t h, const void *data,
+                                            size_t len)
+{
+  const unsigned char *p = data;
+  size_t i;
+  for (i = 0; i < len; i++) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+/** Hash a string for a hash table (FNV-1a, with the upper half folded into
+ * the lower bits that tables are indexed by) */
+static inline uint64_t _pyipmeta_hash_str(const char *str, size_t len)
+{
+  uint64_t h = _pyipmeta_hash_bytes(PYIPMETA_FNV_OFFSET, str, len);
+  return h ^ (h >> 32);
+}
+
+/** Index of the last of the sorted keys that is <= key, or -1 */
+static inline int64_t _pyipmeta_pred(const uint64_t *keys, size_t cnt,
+                                     uint64_t key)
+{
+  size_t lo = 0, hi = cnt, mid;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if (keys[mid] <= key) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return (int64_t)lo - 1;
+}
+
+#endif /* ___pyipmeta_util_H */
@@ -60,6 +60,16 @@
 #define PYNUM_FROMLONG(num) PyInt_FromLong(num)
 #endif
 
+/* Lock an object against other threads in free-threaded builds (the GIL does
+ * it otherwise) */
+#if PY_VERSION_HEX >= 0x030D0000
+#define PYLOCK_BEGIN(op) Py_BEGIN_CRITICAL_SECTION(op)
+#define PYLOCK_END() Py_END_CRITICAL_SECTION()
+#else
+#define PYLOCK_BEGIN(op) {
+#define PYLOCK_END() }
+#endif
+
 static inline int add_to_dict(PyObject *dict, const char *key_str,
                               PyObject *value)
 {
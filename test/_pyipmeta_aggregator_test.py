@@ -0,0 +1,223 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Aggregates a seeded stream of events (with late ones) through a
+# FileTransport and checks the line protocol against counts made with
+# collections.Counter over IpMeta.lookup, using the included pfx2as data and
+# a made-up maxmind database with city names that need escaping. The stream
+# is aggregated with weights and the default unknown value, and again
+# without weights and with unknown=None; halfway through, the first run
+# switches to a second database with set_ipm.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import array
+import collections
+import gzip
+import ipaddress
+import os
+import random
+import shutil
+import tempfile
+from pyipmeta.aggregate import FileTransport
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+EVENTS = 50000
+BLOCKS = 200
+INTERVAL = 60
+FIELDS = ["city", "country_code", "asns"]
+MEASUREMENT = "pkts x,y"
+TAGS = {"src": "tel,1 a=b"}
+
+random.seed(1)
+
+CITIES = ["", "San Diego", "a=b", "Ciudad Juárez"]
+COUNTRIES = ["", "US", "MX", "NZ"]
+
+
+def load_maxmind(tmp, name, blocks):
+    """Load a maxmind database mapping each of the given /16s to a random
+    location"""
+    blocks_path = os.path.join(tmp, name + "-Blocks.csv.gz")
+    locations_path = os.path.join(tmp, name + "-Location.csv.gz")
+    with gzip.open(locations_path, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("locId,country,region,city,postalCode,latitude,longitude,"
+                 "metroCode,areaCode\n")
+        for i in range(len(blocks)):
+            fh.write('%d,"%s","","%s %s","",1.0,1.0,,\n' %
+                     (i + 1, random.choice(COUNTRIES), random.choice(CITIES),
+                      random.choice(["", str(i % 7)])))
+    with gzip.open(blocks_path, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("startIpNum,endIpNum,locId\n")
+        for i, block in enumerate(blocks):
+            fh.write('"%d","%d","%d"\n' %
+                     (block << 16, (block << 16) + 0xffff, i + 1))
+    ipm = _pyipmeta.IpMeta()
+    ipm.enable_provider(ipm.get_provider_by_name("maxmind"),
+                        "-b %s -l %s" % (blocks_path, locations_path))
+    return ipm
+
+
+def escape(val):
+    val = val.replace("\n", " ").replace("\r", " ")
+    for c in ",= ":
+        val = val.replace(c, "\\" + c)
+    return val
+
+
+def tag_value(recs, field):
+    """The value of a field in the first record (by provider) that has one"""
+    for rec in sorted(recs, key=lambda r: r["source"]):
+        val = rec[field]
+        if isinstance(val, list):
+            val = "_".join(str(v) for v in val)
+        elif isinstance(val, int):
+            val = str(val) if val else ""
+        if val:
+            return escape(val)
+    return None
+
+
+def expected_lines(ipms, events, switch, unknown, weights):
+    """Count the events per interval and tag set the way the aggregator
+    should, returning (a Counter of lines, number of late events)"""
+    counts = collections.Counter()
+    sums = collections.Counter()
+    start = None
+    late = 0
+    for i, (ts, addr, weight) in enumerate(events):
+        ipm = ipms[1] if switch is not None and i >= switch else ipms[0]
+        ts -= ts % INTERVAL
+        if start is not None and ts < start:
+            late += 1
+            continue
+        start = ts
+        recs = ipm.lookup(str(ipaddress.IPv4Address(addr)))
+        tags = dict((k, escape(v)) for k, v in TAGS.items())
+        for field in FIELDS:
+            val = tag_value(recs, field)
+            if val is None:
+                val = unknown and escape(unknown)
+            if val:
+                tags[field] = val
+        key = (ts, "".join(",%s=%s" % kv for kv in sorted(tags.items())))
+        counts[key] += 1
+        sums[key] += weight
+    lines = collections.Counter()
+    for (ts, tags), count in counts.items():
+        fields = "count=%di" % count
+        if weights:
+            fields += ",weight=%di" % sums[(ts, tags)]
+        lines["%s%s %s %d" % (MEASUREMENT.replace(",", "\\,")
+                               .replace(" ", "\\ "), tags, fields,
+                               ts * 1000000000)] += 1
+    return lines, late
+
+
+def aggregate(ipms, events, switch, path, **kwargs):
+    """Aggregate the events into a file, returning the aggregator stats and
+    the Counter of lines written"""
+    agg = _pyipmeta.Aggregator(ipms[0], FIELDS, INTERVAL, MEASUREMENT,
+                               tags=TAGS, **kwargs)
+    transport = FileTransport(path)
+    closed = 0
+    pos = 0
+    while pos < len(events):
+        end = min(len(events), pos + random.randrange(1, 5000))
+        if switch is not None and pos < switch:
+            end = min(end, switch)
+        ts, addrs, weights = zip(*events[pos:end])
+        closed += agg.add(array.array("Q", ts), array.array("I", addrs),
+                          array.array("Q", weights))
+        data = agg.take()
+        if data:
+            transport.send(data)
+        pos = end
+        if pos == switch:
+            agg.set_ipm(ipms[1])
+    closed += agg.flush()
+    transport.send(agg.take())
+    transport.close()
+    stats = agg.stats()
+    assert stats["intervals"] == closed
+    with open(path) as fh:
+        return stats, collections.Counter(fh.read().splitlines())
+
+
+def check(name, ipms, events, switch, path, **kwargs):
+    exp, late = expected_lines(ipms, events, switch,
+                               kwargs.get("unknown", "??"),
+                               kwargs.get("weight_field", "weight"))
+    stats, got = aggregate(ipms, events, switch, path, **kwargs)
+    print("%s: %d lines, %d late events, %s" % (name, sum(exp.values()), late,
+                                                stats))
+    for line in list((exp - got).keys())[:3]:
+        print("  missing    %s" % line)
+    for line in list((got - exp).keys())[:3]:
+        print("  unexpected %s" % line)
+    assert got == exp
+    assert any("city=San\\ Diego" in line for line in got)
+    assert any("city=a\\=b" in line for line in got)
+    assert stats["events"] == len(events) - late and stats["late"] == late
+    assert stats["lines"] == sum(exp.values())
+    assert stats["intervals"] == len(set(line.rsplit(" ", 1)[1]
+                                         for line in exp))
+    assert late > 0 and stats["intervals"] > 2
+
+
+blocks = random.sample(range(1 << 16), BLOCKS)
+tmp = tempfile.mkdtemp()
+try:
+    ipm = load_maxmind(tmp, "first", blocks)
+    ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + PFX2AS)
+    ipm2 = load_maxmind(tmp, "second", random.sample(blocks, BLOCKS // 2))
+
+    # events in mostly increasing time order, some of them for an interval
+    # that has already been written
+    events = []
+    now = 1600000000
+    for _ in range(EVENTS):
+        now += random.randrange(3) * random.randrange(2)
+        ts = now - INTERVAL * random.randrange(1, 3) \
+            if random.random() < 0.01 else now
+        if random.random() < 0.5:
+            addr = random.choice(blocks) << 16 | random.getrandbits(16)
+        else:
+            addr = random.getrandbits(32)
+        events.append((ts, addr, random.randrange(1, 1500)))
+
+    path = os.path.join(tmp, "points.lp")
+    check("weights, set_ipm", (ipm, ipm2), events, EVENTS // 2 + 17, path)
+    os.unlink(path)
+    check("no weights, unknown=None", (ipm, ipm), events, None, path,
+          weight_field=None, unknown=None)
+finally:
+    shutil.rmtree(tmp)
+
+print("OK")
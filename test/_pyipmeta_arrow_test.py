@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks that the rows exported by lookup_arrow match the records found by
+# lookup_batch, using the included pfx2as data and a made-up maxmind
+# database whose names include invalid UTF-8 (which, as in lookup(), must
+# come out as U+FFFD). The batch is imported with pyarrow if it is
+# installed, and otherwise read straight from the exported C structures.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import array
+import ctypes
+import gzip
+import os
+import random
+import shutil
+import tempfile
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+BLOCKS = 500
+QUERIES = 20000
+
+random.seed(1)
+
+NAMES = [b"", b"San Diego", "Ciudad Juárez".encode(), b"Bad \xff byte",
+         b"Cut \xc3", b"Surrogate \xed\xa0\x80", b"Overlong \xc0\xaf",
+         "東京".encode()]
+
+
+def load_maxmind(tmp, blocks):
+    """Load a maxmind database mapping each of the given /16s to a random
+    location"""
+    blocks_path = os.path.join(tmp, "GeoLiteCity-Blocks.csv.gz")
+    locations_path = os.path.join(tmp, "GeoLiteCity-Location.csv.gz")
+    with gzip.open(locations_path, "wb") as fh:
+        fh.write(b"Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write(b"locId,country,region,city,postalCode,latitude,longitude,"
+                 b"metroCode,areaCode\n")
+        for i in range(len(blocks)):
+            fh.write(b'%d,"US","%s","%s","",%r,%r,,\n' %
+                     (i + 1, random.choice(NAMES), random.choice(NAMES),
+                      random.uniform(-90, 90), random.uniform(-180, 180)))
+    with gzip.open(blocks_path, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("startIpNum,endIpNum,locId\n")
+        for i, block in enumerate(blocks):
+            fh.write('"%d","%d","%d"\n' %
+                     (block << 16, (block << 16) + 0xffff, i + 1))
+    ipm = _pyipmeta.IpMeta()
+    ipm.enable_provider(ipm.get_provider_by_name("maxmind"),
+                        "-b %s -l %s" % (blocks_path, locations_path))
+    return ipm
+
+
+# ---- reading the exported C structures, if pyarrow is not installed ----
+
+class ArrowSchema(ctypes.Structure):
+    pass
+
+
+ArrowSchema._fields_ = [
+    ("format", ctypes.c_char_p), ("name", ctypes.c_char_p),
+    ("metadata", ctypes.c_char_p), ("flags", ctypes.c_int64),
+    ("n_children", ctypes.c_int64),
+    ("children", ctypes.POINTER(ctypes.POINTER(ArrowSchema))),
+    ("dictionary", ctypes.POINTER(ArrowSchema)),
+    ("release", ctypes.c_void_p), ("private_data", ctypes.c_void_p)]
+
+
+class ArrowArray(ctypes.Structure):
+    pass
+
+
+ArrowArray._fields_ = [
+    ("length", ctypes.c_int64), ("null_count", ctypes.c_int64),
+    ("offset", ctypes.c_int64), ("n_buffers", ctypes.c_int64),
+    ("n_children", ctypes.c_int64),
+    ("buffers", ctypes.POINTER(ctypes.c_void_p)),
+    ("children", ctypes.POINTER(ctypes.POINTER(ArrowArray))),
+    ("dictionary", ctypes.POINTER(ArrowArray)),
+    ("release", ctypes.c_void_p), ("private_data", ctypes.c_void_p)]
+
+CTYPES = {b"I": ctypes.c_uint32, b"C": ctypes.c_uint8, b"i": ctypes.c_int32,
+          b"g": ctypes.c_double, b"L": ctypes.c_uint64}
+
+capsule_pointer = ctypes.pythonapi.PyCapsule_GetPointer
+capsule_pointer.restype = ctypes.c_void_p
+capsule_pointer.argtypes = [ctypes.py_object, ctypes.c_char_p]
+
+
+def read_values(arr, ctype, start=0, length=None):
+    if length is None:
+        length = arr.length
+    values = (ctype * (arr.offset + start + length)).from_address(
+        arr.buffers[1])
+    return values[arr.offset + start:arr.offset + start + length]
+
+
+def read_column(schema, arr):
+    assert arr.null_count == 0
+    if schema.dictionary:
+        assert schema.dictionary.contents.format == b"u"
+        d = arr.dictionary.contents
+        offs = read_values(d, ctypes.c_int32, 0, d.length + 1)
+        data = ctypes.string_at(d.buffers[2], offs[-1]) if offs[-1] else b""
+        # strict decoding: invalid UTF-8 raises UnicodeDecodeError
+        strs = [data[offs[k]:offs[k + 1]].decode() for k in range(d.length)]
+        return [strs[code] for code in read_values(arr, ctypes.c_int32)]
+    if schema.format == b"+l":
+        offs = read_values(arr, ctypes.c_int32, 0, arr.length + 1)
+        items = read_values(arr.children[0].contents, ctypes.c_uint32, 0,
+                            offs[-1])
+        return [items[offs[k]:offs[k + 1]] for k in range(arr.length)]
+    return read_values(arr, CTYPES[schema.format])
+
+
+def read_batch(batch):
+    schema_capsule, array_capsule = batch.__arrow_c_array__()
+    schema = ArrowSchema.from_address(
+        capsule_pointer(schema_capsule, b"arrow_schema"))
+    arr = ArrowArray.from_address(
+        capsule_pointer(array_capsule, b"arrow_array"))
+    assert schema.format == b"+s" and arr.length == len(batch)
+    cols = {}
+    for c in range(schema.n_children):
+        child = schema.children[c].contents
+        cols[child.name.decode()] = read_column(child,
+                                                arr.children[c].contents)
+    return [dict((name, col[r]) for name, col in cols.items())
+            for r in range(arr.length)]
+
+
+def arrow_rows(batch):
+    try:
+        import pyarrow
+    except ImportError:
+        print("reading the exported C structures (no pyarrow)")
+        return read_batch(batch)
+    print("importing with pyarrow %s" % pyarrow.__version__)
+    rb = pyarrow.record_batch(batch)
+    # checks, among other things, that strings are valid UTF-8
+    rb.validate(full=True)
+    return rb.to_pylist()
+
+
+def row_key(row):
+    return (row["index"], row["source"], row["id"], row["country_code"],
+            row["continent_code"], row["region"], row["city"],
+            row["latitude"], row["longitude"], list(row["asns"]),
+            list(row["polygon_ids"]))
+
+
+blocks = random.sample(range(1 << 16), BLOCKS)
+tmp = tempfile.mkdtemp()
+try:
+    ipm = load_maxmind(tmp, blocks)
+finally:
+    shutil.rmtree(tmp)
+ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + PFX2AS)
+provs = sorted(p.id for p in ipm.get_all_providers() if p.enabled)
+
+addrs = [random.choice(blocks) << 16 | random.getrandbits(16)
+         for _ in range(QUERIES // 2)]
+addrs += [random.getrandbits(32) for _ in range(QUERIES // 2)]
+addrs = array.array("I", addrs)
+
+# one row per address and provider that has a record for it
+res = memoryview(ipm.lookup_batch(addrs)).cast("I")
+exp = []
+for i in range(len(addrs)):
+    for j in range(len(provs)):
+        idx = res[i * len(provs) + j]
+        if idx == _pyipmeta.INDEX_NONE:
+            continue
+        rec = dict(ipm.get_record(idx), index=i)
+        rec["latitude"], rec["longitude"] = rec["lat_long"]
+        exp.append(row_key(rec))
+
+got = [row_key(row) for row in arrow_rows(ipm.lookup_arrow(addrs))]
+bad = [(g, e) for g, e in zip(got, exp) if g != e]
+print("%d rows (%d expected), %d mismatches" % (len(got), len(exp),
+                                                len(bad)))
+for g, e in bad[:3]:
+    print("  got %s\n  expected %s" % (g, e))
+assert len(got) == len(exp) and not bad
+cities = set(row[6] for row in got)
+assert "Bad � byte" in cities and "Cut �" in cities
+assert "Ciudad Juárez" in cities
+
+print("OK")
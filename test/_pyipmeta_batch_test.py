@@ -0,0 +1,146 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks that the lookups served by the range index (lookup_batch,
+# lookup_batch6 and lookup_fused) and by the DIR-24-8 tables agree with
+# lookup(), on random addresses and on the first and last addresses of (and
+# around) the prefixes of the included pfx2as data.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import array
+import gzip
+import ipaddress
+import os
+import random
+import socket
+import struct
+import tempfile
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+SAMPLE = 5000
+RANDOM = 20000
+
+random.seed(1)
+
+
+def load(path, **kwargs):
+    ipm = _pyipmeta.IpMeta(**kwargs)
+    ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + path)
+    return ipm
+
+
+def boundaries(prefixes, width):
+    """First and last address of each prefix, and the addresses on either
+    side of them"""
+    out = []
+    for net in prefixes:
+        first = int(net.network_address)
+        last = int(net.broadcast_address)
+        out += [a for a in (first - 1, first, last, last + 1)
+                if 0 <= a < (1 << width)]
+    return out
+
+
+def batch_records(ipm, res, i):
+    idx = res[i]
+    return [] if idx == _pyipmeta.INDEX_NONE else [ipm.get_record(idx)]
+
+
+def check(name, addrs, got, exp):
+    bad = [(a, g, e) for a, g, e in zip(addrs, got, exp) if g != e]
+    print("%s: %d addresses, %d mismatches" % (name, len(addrs), len(bad)))
+    for a, g, e in bad[:3]:
+        print("  %s: got %s, expected %s" % (a, g, e))
+    assert not bad
+
+
+def check4(ipm, ref, addrs, name):
+    strs = [socket.inet_ntoa(struct.pack("!I", a)) for a in addrs]
+    exp = [list(ref.lookup(s)) for s in strs]
+    res = memoryview(ipm.lookup_batch(array.array("I", addrs))).cast("I")
+    check(name + " lookup_batch", strs,
+          [batch_records(ipm, res, i) for i in range(len(addrs))], exp)
+    check(name + " lookup", strs, [list(ipm.lookup(s)) for s in strs], exp)
+
+
+def fused_ids(rows):
+    return [(row["record_ids"].get("pfx2as"), row["asns"]) for row in rows]
+
+
+# IPv4
+with gzip.open(PFX2AS, "rt") as fh:
+    prefixes = [ipaddress.ip_network("%s/%s" % tuple(line.split()[:2]))
+                for line in fh]
+addrs = boundaries(random.sample(prefixes, SAMPLE), 32)
+addrs += [random.getrandbits(32) for _ in range(RANDOM)]
+
+ref = load(PFX2AS)
+check4(ref, ref, addrs, "range index")
+check4(load(PFX2AS, datastructure="dir-24-8"), ref, addrs, "DIR-24-8")
+
+strs = [socket.inet_ntoa(struct.pack("!I", a)) for a in addrs]
+check("lookup_fused", strs, [fused_ids(ref.lookup_fused(s)) for s in strs],
+      [[(r["id"], r["asns"]) for r in ref.lookup(s)] for s in strs])
+del ref
+
+# IPv6: there is none in the included data, so make some up, with nested
+# prefixes down to /64 (the granularity of the range index)
+v6 = []
+for _ in range(500):
+    net = ipaddress.ip_network((2 << 124 | random.getrandbits(124),
+                                random.choice([29, 32, 40, 48])), strict=False)
+    v6.append(net)
+    for plen in (56, 64):
+        v6.append(ipaddress.ip_network(
+            (int(net.network_address) | random.getrandbits(128 - net.prefixlen),
+             plen), strict=False))
+v6 = sorted(set(v6))
+
+fd, path = tempfile.mkstemp(suffix=".pfx2as.gz")
+os.close(fd)
+try:
+    with gzip.open(path, "wt") as fh:
+        for i, net in enumerate(v6):
+            fh.write("%s\t%d\t%d\n" % (net.network_address, net.prefixlen,
+                                       64500 + i))
+    ipm = load(path)
+finally:
+    os.unlink(path)
+
+addrs = boundaries(v6, 128)
+addrs += [int(random.choice(v6).network_address) | random.getrandbits(64)
+          for _ in range(RANDOM)]
+addrs += [random.getrandbits(128) for _ in range(RANDOM)]
+strs = [str(ipaddress.IPv6Address(a)) for a in addrs]
+res = memoryview(ipm.lookup_batch6(
+    b"".join(a.to_bytes(16, "big") for a in addrs))).cast("I")
+check("range index lookup_batch6", strs,
+      [batch_records(ipm, res, i) for i in range(len(addrs))],
+      [list(ipm.lookup(s)) for s in strs])
+
+print("OK")
@@ -0,0 +1,565 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+"""
+Offline benchmark suite.
+
+Generates synthetic pfx2as and maxmind (GeoLiteCity CSV) databases at a
+configurable scale, seeded from the included pfx2as test data, and measures:
+
+  load      enable_provider() time and peak RSS for each database
+  latency   single lookup() latency percentiles for addresses and prefixes
+  batch     lookup_batch/lookup_batch6/lookup_json/annotate throughput
+  threads   multi-threaded throughput for 1..N threads
+  reload    cost of loading a second instance alongside the first (as the
+            IpMeta periodic reloader does) and rebuilding the batch index,
+            and of applying a small pfx2as change to a Pfx2asTable (as
+            reload_mode="delta" does)
+
+Load and reload are measured in fresh processes so that peak RSS is not
+polluted by the rest of the run. Results are written as JSON for comparison
+across commits; progress is printed to stderr.
+
+Run from the top of the source tree:
+    python3 test/_pyipmeta_bench.py [-s SCALE] [-o results.json]
+"""
+
+import _pyipmeta
+import argparse
+import array
+import concurrent.futures
+import datetime
+import gzip
+import ipaddress
+import json
+import multiprocessing
+import os
+import platform
+import random
+import resource
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+PFX2AS_V4 = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+
+# number of synthetic IPv6 prefixes at scale 1
+V6_BASE = 50000
+
+SECTIONS = ("load", "latency", "batch", "threads", "reload")
+
+# (country, continent, latitude, longitude) to scatter locations around
+COUNTRIES = [
+    ("US", "NA", 39.8, -98.6), ("CA", "NA", 56.1, -106.3),
+    ("BR", "SA", -14.2, -51.9), ("GB", "EU", 55.4, -3.4),
+    ("DE", "EU", 51.2, 10.5), ("FR", "EU", 46.2, 2.2),
+    ("RU", "EU", 61.5, 105.3), ("CN", "AS", 35.9, 104.2),
+    ("JP", "AS", 36.2, 138.3), ("IN", "AS", 20.6, 79.0),
+    ("AU", "OC", -25.3, 133.8), ("ZA", "AF", -30.6, 22.9),
+]
+
+
+def log(fmt, *args):
+    print(fmt % args, file=sys.stderr, flush=True)
+
+
+# ========== DATA GENERATION ==========
+
+def read_base_pfx2as():
+    """Read (net, len, asn) tuples for the prefixes in the included data"""
+    pfxs = []
+    with gzip.open(PFX2AS_V4, "rt") as fh:
+        for line in fh:
+            addr, plen, asn = line.rstrip("\n").split("\t")
+            pfxs.append((int(ipaddress.IPv4Address(addr)), int(plen), asn))
+    return pfxs
+
+
+def gen_v4_prefixes(rng, base, scale):
+    """Sample the base prefixes (scale < 1) or add more-specifics of them
+    (scale > 1), like the growth of a real table"""
+    count = int(len(base) * scale)
+    if count <= len(base):
+        return sorted(rng.sample(base, count))
+    pfxs = {(net, plen): asn for net, plen, asn in base}
+    asns = [asn for _, _, asn in base]
+    parents = [(net, plen) for net, plen, _ in base if plen < 24]
+    while len(pfxs) < count:
+        net, plen = rng.choice(parents)
+        sublen = rng.randint(plen + 1, 24)
+        sub = net | (rng.getrandbits(sublen - plen) << (32 - sublen))
+        pfxs.setdefault((sub, sublen), rng.choice(asns))
+    return sorted((net, plen, asn) for (net, plen), asn in pfxs.items())
+
+
+def gen_v6_prefixes(rng, count, asns):
+    """Generate sorted, non-overlapping pfx2as style IPv6 prefixes"""
+    pfxs = set()
+    while len(pfxs) < count:
+        # allocations are in 2000::/3, announced as a /32 or split up to /48
+        top = (0x2000 | rng.getrandbits(13)) << 16 | rng.getrandbits(16)
+        plen = rng.choice([32, 32, 36, 40, 44, 48, 48, 48])
+        net = (top << 96) | (rng.getrandbits(plen - 32) << (128 - plen))
+        pfxs.add((net, plen))
+    return [(net, plen, rng.choice(asns)) for net, plen in sorted(pfxs)]
+
+
+def write_pfx2as(path, v4_pfxs, v6_pfxs):
+    with gzip.open(path, "wt", compresslevel=1) as out:
+        for net, plen, asn in v4_pfxs:
+            out.write("%s\t%d\t%s\n" % (ipaddress.IPv4Address(net), plen, asn))
+        for net, plen, asn in v6_pfxs:
+            out.write("%s\t%d\t%s\n" % (ipaddress.IPv6Address(net), plen, asn))
+
+
+def write_maxmind(blocks_path, locs_path, rng, v4_pfxs):
+    """Write GeoLiteCity style blocks and locations files.
+
+    Blocks are the non-overlapping subset of the IPv4 prefixes, each assigned
+    to one of a pool of random locations.
+    """
+    blocks = []
+    next_start = 0
+    for net, plen, _ in v4_pfxs:
+        if net >= next_start:
+            end = net + (1 << (32 - plen)) - 1
+            blocks.append((net, end))
+            next_start = end + 1
+    locs_cnt = max(1000, len(blocks) // 20)
+
+    with gzip.open(locs_path, "wt", compresslevel=1) as out:
+        out.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        out.write("locId,country,region,city,postalCode,latitude,longitude,"
+                  "metroCode,areaCode\n")
+        for loc_id in range(1, locs_cnt + 1):
+            cc, _, lat, lon = rng.choice(COUNTRIES)
+            out.write('%d,"%s","%02d","City %d","%05d",%.4f,%.4f,,\n' %
+                      (loc_id, cc, rng.randint(1, 50), loc_id,
+                       rng.randint(0, 99999), lat + rng.uniform(-5, 5),
+                       lon + rng.uniform(-5, 5)))
+
+    with gzip.open(blocks_path, "wt", compresslevel=1) as out:
+        out.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        out.write("startIpNum,endIpNum,locId\n")
+        for start, end in blocks:
+            out.write('"%d","%d","%d"\n' %
+                      (start, end, rng.randint(1, locs_cnt)))
+
+    return len(blocks), locs_cnt
+
+
+def generate_data(data_dir, scale, seed):
+    rng = random.Random(seed)
+    base = read_base_pfx2as()
+    v4 = gen_v4_prefixes(rng, base, scale)
+    v6 = gen_v6_prefixes(rng, int(V6_BASE * scale),
+                         [asn for _, _, asn in base])
+
+    pfx2as_path = os.path.join(data_dir, "synthetic.pfx2as.gz")
+    blocks_path = os.path.join(data_dir, "synthetic.GeoLiteCity-Blocks.csv.gz")
+    locs_path = os.path.join(data_dir,
+                             "synthetic.GeoLiteCity-Location.csv.gz")
+    write_pfx2as(pfx2as_path, v4, v6)
+    blocks_cnt, locs_cnt = write_maxmind(blocks_path, locs_path, rng, v4)
+
+    info = {
+        "pfx2as": {
+            "config": "-f %s" % pfx2as_path,
+            "v4_prefixes": len(v4),
+            "v6_prefixes": len(v6),
+            "bytes": os.path.getsize(pfx2as_path),
+        },
+        "maxmind": {
+            "config": "-b %s -l %s" % (blocks_path, locs_path),
+            "blocks": blocks_cnt,
+            "locations": locs_cnt,
+            "bytes": (os.path.getsize(blocks_path) +
+                      os.path.getsize(locs_path)),
+        },
+    }
+    return info, v4, v6
+
+
+def gen_queries(rng, v4, v6, count, v6_share=0.3):
+    """Generate addresses that mostly land in (or next to) the prefixes"""
+    addrs4 = array.array("I")
+    addrs6 = bytearray()
+    strs = []
+    for _ in range(count):
+        if v6 and rng.random() < v6_share:
+            net, plen, _ = rng.choice(v6)
+            addr = net | rng.getrandbits(128 - plen + 1)
+            packed = (addr & ((1 << 128) - 1)).to_bytes(16, "big")
+            addrs6 += packed
+            strs.append(socket.inet_ntop(socket.AF_INET6, packed))
+        else:
+            if rng.random() < 0.8:
+                net, plen, _ = rng.choice(v4)
+                addr = net | rng.getrandbits(32 - plen + 1)
+                addr &= 0xffffffff
+            else:
+                addr = rng.getrandbits(32)
+            addrs4.append(addr)
+            strs.append(str(ipaddress.IPv4Address(addr)))
+    return addrs4, bytes(addrs6), strs
+
+
+def gen_prefix_queries(rng, v4, count):
+    """Generate IPv4 prefix queries between /16 and /28"""
+    queries = []
+    for _ in range(count):
+        net, plen, _ = rng.choice(v4)
+        qlen = rng.randint(max(16, plen - 4), 28)
+        addr = (net | rng.getrandbits(32)) & ~((1 << (32 - qlen)) - 1)
+        addr &= 0xffffffff
+        queries.append("%s/%d" % (ipaddress.IPv4Address(addr), qlen))
+    return queries
+
+
+# ========== MEASUREMENT ==========
+
+def peak_rss():
+    """Peak resident set size of this process in bytes"""
+    # on Linux ru_maxrss survives fork and exec, so a child would report its
+    # parent's peak; VmHWM is only for the current address space
+    try:
+        with open("/proc/self/status") as fh:
+            for line in fh:
+                if line.startswith("VmHWM:"):
+                    return int(line.split()[1]) * 1024
+    except OSError:
+        pass
+    # ru_maxrss is in kilobytes on Linux and bytes on macOS
+    rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+    return rss if sys.platform == "darwin" else rss * 1024
+
+
+def load_providers(configs):
+    ipm = _pyipmeta.IpMeta()
+    for name, config in configs:
+        prov = ipm.get_provider_by_name(name)
+        if not ipm.enable_provider(prov, config):
+            raise RuntimeError("Could not enable provider %s" % name)
+    return ipm
+
+
+def best_of(repeat, func):
+    best = None
+    for _ in range(repeat):
+        start = time.perf_counter()
+        func()
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+
+def rate(count, seconds):
+    return {"count": count, "seconds": seconds,
+            "per_second": count / seconds if seconds else None}
+
+
+def percentiles(samples_ns):
+    samples_ns.sort()
+    cnt = len(samples_ns)
+
+    def pct(p):
+        return samples_ns[min(cnt - 1, int(cnt * p))] / 1000.0
+
+    return {
+        "count": cnt,
+        "mean_us": sum(samples_ns) / cnt / 1000.0,
+        "p50_us": pct(0.50),
+        "p90_us": pct(0.90),
+        "p99_us": pct(0.99),
+        "p999_us": pct(0.999),
+        "max_us": samples_ns[-1] / 1000.0,
+    }
+
+
+def child_load(configs):
+    """Load the given providers (in a fresh process)"""
+    rss_before = peak_rss()
+    start = time.perf_counter()
+    load_providers(configs)
+    return {
+        "seconds": time.perf_counter() - start,
+        "peak_rss_bytes": peak_rss(),
+        "rss_growth_bytes": peak_rss() - rss_before,
+    }
+
+
+def child_reload(configs):
+    """Load the given providers twice, keeping the first instance alive and
+    in use, as IpMeta._load does (in a fresh process)"""
+    ipm = load_providers(configs)
+    ipm.lookup_batch(array.array("I", [0]))
+    rss_before = peak_rss()
+    start = time.perf_counter()
+    new_ipm = load_providers(configs)
+    load_secs = time.perf_counter() - start
+    start = time.perf_counter()
+    new_ipm.lookup_batch(array.array("I", [0]))
+    index_secs = time.perf_counter() - start
+    return {
+        "seconds": load_secs,
+        "index_build_seconds": index_secs,
+        "peak_rss_bytes": peak_rss(),
+        "rss_growth_bytes": peak_rss() - rss_before,
+    }
+
+
+def child_delta_reload(path, share, seed):
+    """Load a pfx2as file into a Pfx2asTable, then apply a copy with a share
+    of the prefixes moved to other ASes (in a fresh process)"""
+    with gzip.open(path, "rb") as fh:
+        data = fh.read()
+    lines = data.rstrip(b"\n").split(b"\n")
+    table = _pyipmeta.Pfx2asTable()
+    start = time.perf_counter()
+    table.update(data)
+    full_secs = time.perf_counter() - start
+
+    rng = random.Random(seed)
+    changes = max(1, int(len(lines) * share))
+    for i in rng.sample(range(len(lines)), changes):
+        addr, plen, _ = lines[i].split(b"\t")
+        lines[i] = b"%s\t%s\t%d" % (addr, plen, rng.randrange(1, 65536))
+    data = b"\n".join(lines) + b"\n"
+    rss_before = peak_rss()
+    start = time.perf_counter()
+    counts = table.update(data)
+    return {
+        "full_seconds": full_secs,
+        "seconds": time.perf_counter() - start,
+        "changes": changes,
+        "rss_growth_bytes": peak_rss() - rss_before,
+        "update": counts,
+    }
+
+
+def in_child(func, *args):
+    """Run func in a fresh interpreter and return its result"""
+    ctx = multiprocessing.get_context("spawn")
+    with concurrent.futures.ProcessPoolExecutor(1, mp_context=ctx) as pool:
+        return pool.submit(func, *args).result()
+
+
+def bench_load(data):
+    res = {}
+    for name in ("pfx2as", "maxmind"):
+        log("load: %s", name)
+        res[name] = in_child(child_load, [(name, data[name]["config"])])
+    log("load: both")
+    res["all"] = in_child(child_load, [(name, data[name]["config"])
+                                       for name in ("pfx2as", "maxmind")])
+    return res
+
+
+def bench_latency(ipm, addrs, prefixes):
+    res = {}
+    for label, queries in (("address", addrs), ("prefix", prefixes)):
+        log("latency: %s (%d queries)", label, len(queries))
+        samples = []
+        clock = time.perf_counter_ns
+        lookup = ipm.lookup
+        for query in queries:
+            start = clock()
+            lookup(query)
+            samples.append(clock() - start)
+        res[label] = percentiles(samples)
+    return res
+
+
+def bench_batch(ipm, addrs4, addrs6, strs, repeat):
+    res = {}
+    log("batch: index build")
+    start = time.perf_counter()
+    ipm.lookup_batch(array.array("I"))
+    res["index_build_seconds"] = time.perf_counter() - start
+    res["search_kernel"] = _pyipmeta.SEARCH_KERNEL
+
+    chunk = ("\n".join(strs) + "\n").encode()
+    out = bytearray()
+    cases = (
+        ("lookup_batch", len(addrs4), lambda: ipm.lookup_batch(addrs4)),
+        ("lookup_batch6", len(addrs6) // 16,
+         lambda: ipm.lookup_batch6(addrs6)),
+        ("lookup_json", len(strs), lambda: ipm.lookup_json(strs, out=out)),
+        ("annotate", len(strs), lambda: ipm.annotate(chunk)),
+    )
+    for label, count, func in cases:
+        log("batch: %s (%d queries)", label, count)
+        res[label] = rate(count, best_of(repeat, func))
+    return res
+
+
+def bench_threads(ipm, addrs4, strs, max_threads, repeat):
+    # make sure the batch index is built before timing anything
+    ipm.lookup_batch(array.array("I"))
+
+    # split the work into many pieces so that every thread stays busy
+    pieces = max(64, max_threads * 8)
+    step = (len(strs) + pieces - 1) // pieces
+    chunks = [("\n".join(strs[i:i + step]) + "\n").encode()
+              for i in range(0, len(strs), step)]
+    step = (len(addrs4) + pieces - 1) // pieces
+    arrays = [addrs4[i:i + step] for i in range(0, len(addrs4), step)]
+
+    counts = sorted({1, max_threads} |
+                    {1 << i for i in range(8) if 1 << i <= max_threads})
+    res = {"annotate": [], "lookup_batch": []}
+    for threads in counts:
+        log("threads: %d", threads)
+        with concurrent.futures.ThreadPoolExecutor(threads) as pool:
+            for label, func, work, count in (
+                    ("annotate", ipm.annotate, chunks, len(strs)),
+                    ("lookup_batch", ipm.lookup_batch, arrays, len(addrs4))):
+                secs = best_of(repeat, lambda: list(pool.map(func, work)))
+                entry = rate(count, secs)
+                entry["threads"] = threads
+                base = res[label][0]["per_second"] if res[label] else None
+                entry["speedup"] = (entry["per_second"] / base
+                                    if base else 1.0)
+                res[label].append(entry)
+    return res
+
+
+def bench_reload(data, seed):
+    log("reload")
+    res = in_child(child_reload, [(name, data[name]["config"])
+                                  for name in ("pfx2as", "maxmind")])
+    log("reload (delta)")
+    res["delta"] = in_child(child_delta_reload,
+                            data["pfx2as"]["config"].split()[1], 0.001, seed)
+    return res
+
+
+def git_commit():
+    try:
+        return subprocess.run(["git", "rev-parse", "HEAD"],
+                              capture_output=True, text=True,
+                              check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split("\n")[0])
+    parser.add_argument("-s", "--scale", type=float, default=1.0,
+                        help="size of the databases relative to the "
+                             "included pfx2as data (default: 1)")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("-n", "--queries", type=int, default=1000000,
+                        help="number of queries for batch and thread "
+                             "benchmarks")
+    parser.add_argument("-l", "--latency-queries", type=int, default=20000,
+                        help="number of queries for latency benchmarks")
+    parser.add_argument("-t", "--max-threads", type=int,
+                        default=os.cpu_count() or 1)
+    parser.add_argument("-r", "--repeat", type=int, default=3,
+                        help="throughput runs to take the best of")
+    parser.add_argument("--only", default=",".join(SECTIONS),
+                        help="comma-separated benchmarks to run (default: "
+                             "%(default)s)")
+    parser.add_argument("-d", "--data-dir",
+                        help="directory to generate the databases in "
+                             "(default: a temporary directory)")
+    parser.add_argument("-o", "--output",
+                        help="file to write JSON results to (default: "
+                             "stdout)")
+    opts = parser.parse_args()
+
+    sections = opts.only.split(",")
+    for section in sections:
+        if section not in SECTIONS:
+            parser.error("unknown benchmark '%s'" % section)
+
+    with tempfile.TemporaryDirectory() as tmpdir:
+        data_dir = opts.data_dir or tmpdir
+        os.makedirs(data_dir, exist_ok=True)
+        log("generating data (scale %g) in %s", opts.scale, data_dir)
+        start = time.perf_counter()
+        data, v4, v6 = generate_data(data_dir, opts.scale, opts.seed)
+        data["generate_seconds"] = time.perf_counter() - start
+
+        rng = random.Random(opts.seed + 1)
+        addrs4, addrs6, strs = gen_queries(rng, v4, v6, opts.queries)
+        lat_addrs = strs[:opts.latency_queries]
+        lat_prefixes = gen_prefix_queries(rng, v4, opts.latency_queries)
+
+        results = {}
+        if "load" in sections:
+            results["load"] = bench_load(data)
+        if {"latency", "batch", "threads"} & set(sections):
+            log("loading databases")
+            ipm = load_providers([(name, data[name]["config"])
+                                  for name in ("pfx2as", "maxmind")])
+            if "latency" in sections:
+                results["latency"] = bench_latency(ipm, lat_addrs,
+                                                   lat_prefixes)
+            if "batch" in sections:
+                results["batch"] = bench_batch(ipm, addrs4, addrs6, strs,
+                                               opts.repeat)
+            if "threads" in sections:
+                results["threads"] = bench_threads(ipm, addrs4, strs,
+                                                   opts.max_threads,
+                                                   opts.repeat)
+            del ipm
+        if "reload" in sections:
+            results["reload"] = bench_reload(data, opts.seed)
+
+    for info in (data["pfx2as"], data["maxmind"]):
+        del info["config"]
+    report = {
+        "meta": {
+            "timestamp": datetime.datetime.now(
+                datetime.timezone.utc).isoformat(),
+            "git_commit": git_commit(),
+            "python": platform.python_version(),
+            "platform": platform.platform(),
+            "cpus": os.cpu_count(),
+            "scale": opts.scale,
+            "seed": opts.seed,
+            "queries": opts.queries,
+            "latency_queries": opts.latency_queries,
+        },
+        "data": data,
+        "results": results,
+    }
+    if opts.output:
+        with open(opts.output, "w") as fh:
+            json.dump(report, fh, indent=2)
+            fh.write("\n")
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks that a History holding modified copies of the included pfx2as data
+# answers lookups at any time like a fresh IpMeta that loaded the copy in
+# effect then, including at /16 block and /8 page boundaries, and that
+# snapshots share the blocks that did not change.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import gzip
+import os
+import random
+import socket
+import struct
+import tempfile
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+SNAPSHOTS = 4
+CHANGES = 1000
+QUERIES = 20000
+DAY = 86400
+T0 = 1490745600
+
+random.seed(1)
+
+
+def load(lines):
+    fd, path = tempfile.mkstemp(suffix=".pfx2as.gz")
+    os.close(fd)
+    try:
+        with gzip.open(path, "wt") as fh:
+            fh.writelines(line + "\n" for line in lines)
+        ipm = _pyipmeta.IpMeta()
+        ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + path)
+    finally:
+        os.unlink(path)
+    return ipm
+
+
+def ntoa(addr):
+    return socket.inet_ntoa(struct.pack("!I", addr & 0xffffffff))
+
+
+def strip(recs):
+    # record ids are assigned differently
+    return sorted((r["asns"], r["asn_ip_count"], r["matched_ip_count"])
+                  for r in recs)
+
+
+def modify(lines):
+    """Change the origin of some prefixes, delete others, and add prefixes
+    that start or end at /16 and /8 boundaries"""
+    lines = list(lines)
+    for i in random.sample(range(len(lines)), CHANGES):
+        addr, plen, asns = lines[i].split("\t")
+        if random.random() < 0.5:
+            lines[i] = "%s\t%s\t%d" % (addr, plen, random.randrange(1, 65000))
+        else:
+            lines[i] = None
+    lines = [line for line in lines if line is not None]
+    keys = set(tuple(line.split("\t")[:2]) for line in lines)
+    for _ in range(CHANGES // 10):
+        block = random.randrange(1, 1 << 16)
+        if random.random() < 0.25:
+            block &= ~0xff
+        for addr, plen in ((block << 16, random.randrange(16, 25)),
+                           ((block << 16) - 256, 24)):
+            if (ntoa(addr), str(plen)) not in keys:
+                keys.add((ntoa(addr), str(plen)))
+                lines.append("%s\t%d\t%d" % (ntoa(addr), plen,
+                                             random.randrange(1, 65000)))
+    random.shuffle(lines)
+    return lines
+
+
+with gzip.open(PFX2AS, "rt") as fh:
+    snaps = [fh.read().splitlines()]
+for _ in range(SNAPSHOTS - 2):
+    snaps.append(modify(snaps[-1]))
+# a day without changes
+snaps.append(snaps[-1])
+
+hist = _pyipmeta.History()
+ipms = []
+blocks = []
+for i, lines in enumerate(snaps):
+    ipms.append(load(lines))
+    hist.add_snapshot(T0 + i * DAY, ipms[-1])
+    stats = hist.stats()
+    blocks.append(stats["blocks"])
+    print("snapshot %d: %s" % (i, stats))
+assert hist.snapshot_times() == [T0 + i * DAY for i in range(SNAPSHOTS)]
+
+# Moving a prefix to another AS changes the asn_ip_count of both ASes, and so
+# every block with a prefix of either, but most blocks are still shared. A
+# snapshot without changes shares all of them.
+for i in range(1, SNAPSHOTS - 1):
+    assert blocks[i] - blocks[i - 1] < blocks[0] / 2, blocks
+assert blocks[-1] == blocks[-2], blocks
+
+# both sides of every /8 boundary, of random /16 boundaries, and of the
+# prefixes of all snapshots, plus random addresses
+addrs = set()
+for page in range(256):
+    addrs.update((page << 24, (page << 24) - 1, (page << 24) + 0xffff))
+for block in random.sample(range(1 << 16), QUERIES // 8):
+    addrs.update((block << 16, (block << 16) - 1))
+for lines in snaps:
+    for line in random.sample(lines, QUERIES // 8):
+        addr, plen, _ = line.split("\t")
+        addr = struct.unpack("!I", socket.inet_aton(addr))[0]
+        addrs.update((addr - 1, addr, addr + (1 << (32 - int(plen))) - 1))
+addrs.update(random.getrandbits(32) for _ in range(QUERIES))
+addrs = [ntoa(addr) for addr in sorted(addrs)]
+
+bad = []
+for addr in addrs:
+    i = random.randrange(SNAPSHOTS)
+    for t in (T0 + i * DAY, T0 + i * DAY + random.randrange(DAY),
+              T0 + (i + 1) * DAY - 1):
+        got = strip(hist.lookup(addr, t))
+        exp = strip(ipms[i].lookup(addr))
+        if got != exp:
+            bad.append((addr, t, got, exp))
+print("%d addresses, %d mismatches" % (len(addrs), len(bad)))
+for addr, t, got, exp in bad[:3]:
+    print("  %s at %d: got %s, expected %s" % (addr, t, got, exp))
+assert not bad
+
+try:
+    hist.lookup("1.2.3.4", T0 - 1)
+    assert False, "lookup before the first snapshot did not raise"
+except ValueError:
+    pass
+
+print("OK")
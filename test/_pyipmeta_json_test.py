@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks that lookup_json and the CSV annotator write record coordinates
+# exactly as Python's json module and repr() do (whole numbers, tiny and huge
+# values, negative zero and random ones), using a made-up maxmind database.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import gzip
+import json
+import os
+import random
+import shutil
+import tempfile
+
+RANDOM = 2000
+
+random.seed(1)
+
+values = [0.0, -0.0, 1.0, 40.0, -40.0, 100.0, 180.0, 0.1, -0.5, 1.5,
+          33.333333333333336, 89.99999999999999, 1e-4, 1.5e-4, 1e-5, 1.5e-5,
+          123456789.0, 1e15, 9999999999999998.0, 1e16, 1.2345e17, 1e22,
+          5e-324, 1.7976931348623157e308, 2.0 ** 53, 0.30000000000000004]
+values += [random.uniform(-180, 180) for _ in range(RANDOM)]
+values += [round(random.uniform(-90, 90), random.randrange(5))
+           for _ in range(RANDOM)]
+values += [random.uniform(-1, 1) * 10 ** random.randrange(-30, 30)
+           for _ in range(RANDOM)]
+# one location (and one /24 block) per pair of coordinates
+locs = list(zip(values, values[1:] + values[:1]))
+
+tmp = tempfile.mkdtemp()
+try:
+    blocks = os.path.join(tmp, "GeoLiteCity-Blocks.csv.gz")
+    locations = os.path.join(tmp, "GeoLiteCity-Location.csv.gz")
+    with gzip.open(locations, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("locId,country,region,city,postalCode,latitude,longitude,"
+                 "metroCode,areaCode\n")
+        for i, (lat, lon) in enumerate(locs):
+            fh.write('%d,"US","CA","City %d","",%r,%r,,\n' %
+                     (i + 1, i + 1, lat, lon))
+    with gzip.open(blocks, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("startIpNum,endIpNum,locId\n")
+        for i in range(len(locs)):
+            start = (10 << 24) + (i << 8)
+            fh.write('"%d","%d","%d"\n' % (start, start + 255, i + 1))
+    ipm = _pyipmeta.IpMeta()
+    ipm.enable_provider(ipm.get_provider_by_name("maxmind"),
+                        "-b %s -l %s" % (blocks, locations))
+finally:
+    shutil.rmtree(tmp)
+
+bad = 0
+for i in range(len(locs)):
+    addr = "10.%d.%d.1" % (i >> 8, i & 255)
+    recs = [dict(r) for r in ipm.lookup(addr)]
+    assert len(recs) == 1 and recs[0]["lat_long"] == locs[i]
+    for r in recs:
+        r["lat_long"] = list(r["lat_long"])
+    exp = json.dumps({"query": addr, "result": recs})
+    got = ipm.lookup_json(addr).decode()
+    csv = ipm.annotate((addr + "\n").encode(), format="csv",
+                       fields=["lat_long"])[0].decode()
+    exp_csv = "%s,%r,%r\n" % (addr, locs[i][0], locs[i][1])
+    if got != exp or csv != exp_csv:
+        bad += 1
+        if bad <= 3:
+            print("%s:\n  got      %s %s\n  expected %s %s" %
+                  (addr, got, csv, exp, exp_csv))
+print("%d coordinates, %d mismatches" % (len(locs), bad))
+assert not bad
+
+print("OK")
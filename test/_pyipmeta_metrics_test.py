@@ -0,0 +1,161 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Runs a known mix of lookups (hits, misses that libipmeta answers, misses
+# that the presence filter answers, invalid queries and a batch) against a
+# small pfx2as file and checks the exact counts in stats(), that the latency
+# histograms count every timed lookup, and that prometheus_text() output
+# parses line by line.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import array
+import gzip
+import math
+import os
+import re
+import tempfile
+from pyipmeta import metrics
+
+PFX2AS = ["10.0.0.0\t25\t1", "10.1.0.0\t16\t2", "10.2.0.0\t24\t3_4"]
+HITS = ["10.0.0.1", "10.0.0.127", "10.1.2.3", "10.1.255.255", "10.2.0.9",
+        "10.0.0.0/26"]
+# in a /24 that has records, or prefixes, so libipmeta is asked
+MISSES = ["10.0.0.128", "10.0.0.255", "10.3.0.0/24"]
+# in a /24 that has no records, so the presence filter answers
+FILTERED = ["11.0.0.1", "10.3.0.1", "2001:db8::1"]
+INVALID = ["bogus", "10.0.0.1/33", ""]
+BATCH = 1000
+ROUNDS = 7
+
+LABEL = re.compile(r'([a-zA-Z_][a-zA-Z0-9_]*)="((?:[^"\\]|\\.)*)"')
+SAMPLE = re.compile(r'^([a-zA-Z_:][a-zA-Z0-9_:]*)'
+                    r'(?:\{((?:[a-zA-Z_][a-zA-Z0-9_]*="(?:[^"\\]|\\.)*",?)*)'
+                    r'\})? (\S+)$')
+
+
+def parse_prometheus(text):
+    """Parse the text format, returning {(name, labels): value} and
+    {family: type}"""
+    samples = {}
+    types = {}
+    assert text.endswith("\n")
+    for line in text[:-1].split("\n"):
+        if line.startswith("# HELP "):
+            assert len(line.split(" ", 3)) == 4, line
+            continue
+        if line.startswith("# TYPE "):
+            _, _, name, mtype = line.split(" ")
+            assert mtype in ("counter", "gauge", "histogram"), line
+            assert name not in types, "duplicate family %s" % name
+            types[name] = mtype
+            continue
+        m = SAMPLE.match(line)
+        assert m, "cannot parse %r" % line
+        name, labels, value = m.groups()
+        family = re.sub("_(bucket|sum|count)$", "", name) \
+            if name not in types else name
+        assert family in types, "sample %s before its TYPE" % name
+        labels = tuple(LABEL.findall(labels or ""))
+        assert (name, labels) not in samples, "duplicate sample %s" % line
+        samples[(name, labels)] = float(value)
+    return samples, types
+
+
+fd, path = tempfile.mkstemp(suffix=".pfx2as.gz")
+os.close(fd)
+try:
+    with gzip.open(path, "wt") as fh:
+        fh.writelines(line + "\n" for line in PFX2AS)
+    ipm = _pyipmeta.IpMeta()
+    ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + path)
+finally:
+    os.unlink(path)
+ipm.set_timing(True)
+
+records = 0
+for _ in range(ROUNDS):
+    for query in HITS:
+        res = ipm.lookup(query)
+        assert len(res) == 1, (query, res)
+        records += len(res)
+    for query in MISSES + FILTERED:
+        assert ipm.lookup(query) == (), query
+    for query in INVALID:
+        try:
+            ipm.lookup(query)
+            assert False, "%r did not raise" % query
+        except ValueError:
+            pass
+ipm.lookup_batch(array.array("I", range(0x0a000000, 0x0a000000 + BATCH)))
+
+stats = ipm.stats()
+print(dict((k, v) for k, v in stats.items() if k != "latency"))
+lookups = ROUNDS * (len(HITS) + len(MISSES) + len(FILTERED) + len(INVALID))
+assert stats["timing"] is True
+assert stats["lookups"] == lookups
+assert stats["misses"] == ROUNDS * (len(MISSES) + len(FILTERED))
+assert stats["filtered"] == ROUNDS * len(FILTERED)
+assert stats["errors_input"] == ROUNDS * len(INVALID)
+assert stats["errors_internal"] == 0
+assert stats["batch_lookups"] == BATCH
+assert stats["records"]["pfx2as"] == records == ROUNDS * len(HITS)
+assert sum(stats["records"].values()) == records
+
+# every lookup that went to libipmeta is timed (filtered ones are not), and
+# those that succeeded are timed again while converting their records
+hists = stats["latency"]
+for stage, hist in hists.items():
+    assert sum(cnt for _, cnt in hist["buckets"]) == hist["count"], stage
+    assert math.isinf(hist["buckets"][-1][0]), stage
+    assert hist["sum_seconds"] > 0, stage
+print(dict((stage, hist["count"]) for stage, hist in hists.items()))
+assert hists["lookup"]["count"] == stats["lookups"] - stats["filtered"]
+assert hists["convert"]["count"] == ROUNDS * (len(HITS) + len(MISSES))
+
+text = metrics.prometheus_text(stats)
+samples, types = parse_prometheus(text)
+print("%d lines, %d samples" % (text.count("\n"), len(samples)))
+assert samples[("pyipmeta_lookups_total", ())] == stats["lookups"]
+assert samples[("pyipmeta_lookup_errors_total",
+                (("reason", "input"),))] == stats["errors_input"]
+assert samples[("pyipmeta_lookups_filtered_total", ())] == stats["filtered"]
+assert samples[("pyipmeta_records_total",
+                (("provider", "pfx2as"),))] == records
+assert types["pyipmeta_lookup_duration_seconds"] == "histogram"
+for stage, hist in hists.items():
+    buckets = [(labels, value) for (name, labels), value in samples.items()
+               if name == "pyipmeta_lookup_duration_seconds_bucket" and
+               labels[0] == ("stage", stage)]
+    assert len(buckets) == len(hist["buckets"])
+    values = [value for _, value in buckets]
+    assert values == sorted(values), "buckets of %s not cumulative" % stage
+    assert buckets[-1][0][1] == ("le", "+Inf")
+    assert values[-1] == samples[("pyipmeta_lookup_duration_seconds_count",
+                                  (("stage", stage),))] == hist["count"]
+
+print("OK")
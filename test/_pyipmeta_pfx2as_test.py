@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks that a Pfx2asTable that has applied a modified copy of the included
+# pfx2as data (with prefixes changed, deleted and added, including IPv6 ones)
+# answers lookups like libipmeta does after loading that copy from scratch,
+# and again after going back to the original data.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import gzip
+import ipaddress
+import os
+import random
+import tempfile
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+CHANGES = 5000
+QUERIES = 20000
+
+random.seed(1)
+
+
+def load(lines):
+    fd, path = tempfile.mkstemp(suffix=".pfx2as.gz")
+    os.close(fd)
+    try:
+        with gzip.open(path, "wt") as fh:
+            fh.writelines(line + "\n" for line in lines)
+        ipm = _pyipmeta.IpMeta()
+        ipm.enable_provider(ipm.get_provider_by_name("pfx2as"), "-f " + path)
+    finally:
+        os.unlink(path)
+    return ipm
+
+
+def strip(recs):
+    # record ids are assigned differently
+    return sorted((r["asns"], r["asn_ip_count"], r["matched_ip_count"])
+                  for r in recs)
+
+
+def check(name, table, lines, queries):
+    ipm = load(lines)
+    bad = [(q, g, e) for q, g, e in
+           ((q, strip(table.lookup(q)), strip(ipm.lookup(q))) for q in queries)
+           if g != e]
+    print("%s: %d queries, %d mismatches" % (name, len(queries), len(bad)))
+    for q, g, e in bad[:3]:
+        print("  %s: got %s, expected %s" % (q, g, e))
+    assert not bad
+
+
+with gzip.open(PFX2AS, "rt") as fh:
+    orig = fh.read().splitlines()
+keys = set(tuple(line.split("\t")[:2]) for line in orig)
+
+# change the origin of some prefixes and delete others
+mod = list(orig)
+for i in random.sample(range(len(mod)), CHANGES):
+    addr, plen, asns = mod[i].split("\t")
+    if random.random() < 0.5:
+        mod[i] = "%s\t%s\t%d" % (addr, plen, random.randrange(1, 65000))
+    else:
+        mod[i] = None
+mod = [line for line in mod if line is not None]
+
+# add more-specifics of existing prefixes, and some IPv6 prefixes
+for line in random.sample(orig, CHANGES):
+    net = ipaddress.ip_network("%s/%s" % tuple(line.split("\t")[:2]))
+    if net.prefixlen == 32:
+        continue
+    sub = ipaddress.ip_network(
+        (int(net.network_address) | random.getrandbits(32 - net.prefixlen),
+         random.randrange(net.prefixlen + 1, 33)), strict=False)
+    if (str(sub.network_address), str(sub.prefixlen)) not in keys:
+        keys.add((str(sub.network_address), str(sub.prefixlen)))
+        mod.append("%s\t%d\t%d" % (sub.network_address, sub.prefixlen,
+                                   random.randrange(1, 65000)))
+v6 = set()
+for _ in range(500):
+    net = ipaddress.ip_network((2 << 124 | random.getrandbits(124),
+                                random.choice([32, 40, 48, 64])), strict=False)
+    v6.add(net)
+mod += ["%s\t%d\t%d" % (net.network_address, net.prefixlen,
+                        random.randrange(1, 65000)) for net in sorted(v6)]
+random.shuffle(mod)
+
+# addresses and prefixes in and around the prefixes of both versions
+queries = []
+for line in (random.sample(orig, QUERIES // 4) +
+             random.sample(mod, QUERIES // 4)):
+    net = ipaddress.ip_network("%s/%s" % tuple(line.split("\t")[:2]))
+    queries.append(str(net.network_address))
+    queries.append(str(net.broadcast_address if net.version == 4
+                       else net.network_address + random.getrandbits(64)))
+    if net.version == 4:
+        queries.append("%s/%d" % (net.supernet(
+            prefixlen_diff=min(4, net.prefixlen)).network_address,
+            max(0, net.prefixlen - 4)))
+queries += [str(ipaddress.IPv4Address(random.getrandbits(32)))
+            for _ in range(QUERIES)]
+
+table = _pyipmeta.Pfx2asTable()
+table.update(("\n".join(orig) + "\n").encode())
+check("original", table, orig, queries)
+stats = table.update(("\n".join(mod) + "\n").encode())
+print(stats)
+assert stats["changed"] > 0 and stats["deleted"] > 0
+assert stats["inserted"] > 0
+check("modified", table, mod, queries)
+table.update(("\n".join(orig) + "\n").encode())
+check("original again", table, orig, queries)
+
+print("OK")
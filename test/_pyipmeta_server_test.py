@@ -0,0 +1,240 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Feeds requests to the HTTP and line front ends of the native lookup server
+# (through Server.feed, which runs the same code as network connections) and
+# checks the responses against IpMeta.lookup_json. Then checks over real
+# connections that a client cannot make the server buffer without bound.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import socket
+
+PFX2AS = "./test/pfx2as/routeviews-rv2-20170329-0200.pfx2as.gz"
+MAX_BODY_LEN = 16 * 1024 * 1024
+
+ipm = _pyipmeta.IpMeta()
+prov = ipm.get_provider_by_name("pfx2as")
+ipm.enable_provider(prov, "-f " + PFX2AS)
+srv = _pyipmeta.Server(ipm)
+
+QUERIES = ["192.172.226.97", "1.0.4.1", "8.8.8.8", "0.0.0.1",
+           "192.172.226.0/24", "bogus"]
+
+
+def parse_http(data):
+    """Split response bytes into (status, headers, body) tuples"""
+    responses = []
+    while data:
+        head, sep, data = data.partition(b"\r\n\r\n")
+        assert sep, "truncated response headers"
+        lines = head.decode().split("\r\n")
+        headers = dict(line.split(": ", 1) for line in lines[1:])
+        length = int(headers["Content-Length"])
+        assert len(data) >= length, "truncated response body"
+        responses.append((lines[0].split(" ", 1)[1], headers, data[:length]))
+        data = data[length:]
+    return responses
+
+
+def get(path, version="1.1", headers=""):
+    return ("GET %s HTTP/%s\r\n%s\r\n" % (path, version, headers)).encode()
+
+
+def post(body, path="/lookup"):
+    return ("POST %s HTTP/1.1\r\nContent-Length: %d\r\n\r\n" %
+            (path, len(body))).encode() + body
+
+
+def check(name, got, exp):
+    print("%s: %s" % (name, "ok" if got == exp else "MISMATCH"))
+    if got != exp:
+        print("  got:      %r" % got[:200])
+        print("  expected: %r" % exp[:200])
+    assert got == exp
+
+
+def check_http(name, data, exp):
+    check(name, [(status, body) for status, _, body in
+                 parse_http(srv.feed("http", data))], exp)
+
+
+def get_exp(query, provmask=0):
+    return ("400 Bad Request" if query == "bogus" else "200 OK",
+            ipm.lookup_json(query, provmask))
+
+
+def post_exp(queries, provmask=0):
+    return ("200 OK", b"[" + b", ".join(ipm.lookup_json(q, provmask)
+                                       for q in queries) + b"]")
+
+
+# HTTP
+check_http("single request", get("/lookup/" + QUERIES[0]),
+           [get_exp(QUERIES[0])])
+check_http("pipelined requests",
+           b"".join(get("/lookup/" + q) for q in QUERIES),
+           [get_exp(q) for q in QUERIES])
+check_http("prefix request", get("/lookup/192.172.226.0/24"),
+           [get_exp("192.172.226.0/24")])
+check_http("url-encoded request", get("/lookup/192.172.226.0%2F24"),
+           [get_exp("192.172.226.0/24")])
+
+req = get("/lookup/" + QUERIES[0]) + post("\n".join(QUERIES).encode())
+check_http("request split across reads",
+           [req[i:i + 7] for i in range(0, len(req), 7)],
+           [get_exp(QUERIES[0]), post_exp(QUERIES)])
+
+# HTTP/1.0 closes the connection after each request unless asked not to
+check_http("HTTP/1.0 keep-alive request",
+           get("/lookup/1.0.4.1", "1.0", "Connection: keep-alive\r\n") +
+           get("/lookup/8.8.8.8", "1.0"),
+           [get_exp("1.0.4.1"), get_exp("8.8.8.8")])
+check_http("HTTP/1.0 request",
+           get("/lookup/1.0.4.1", "1.0") + get("/lookup/8.8.8.8", "1.0"),
+           [get_exp("1.0.4.1")])
+check_http("HTTP/1.1 close request",
+           get("/lookup/1.0.4.1", "1.1", "Connection: close\r\n") +
+           get("/lookup/8.8.8.8"),
+           [get_exp("1.0.4.1")])
+(status, headers, _), = parse_http(srv.feed("http", get("/lookup/1.0.4.1")))
+assert "Connection" not in headers
+(status, headers, _), = parse_http(srv.feed("http",
+                                            get("/lookup/1.0.4.1", "1.0")))
+assert headers["Connection"] == "close"
+
+# provmask must only be taken from the query string
+other = ipm.get_provider_by_name("maxmind").mask
+check_http("provmask request",
+           get("/lookup/1.0.4.1?provmask=%d" % prov.mask) +
+           get("/lookup/1.0.4.1?provmask=%d" % other) +
+           get("/lookup/1.0.4.1?xprovmask=%d" % other) +
+           get("/lookup/1.0.4.1", headers="X-provmask=%d: 1\r\n" % other) +
+           post(("1.0.4.1\nprovmask=%d\n" % other).encode(),
+                "/lookup?provmask=%d" % prov.mask),
+           [get_exp("1.0.4.1", prov.mask), get_exp("1.0.4.1", other),
+            get_exp("1.0.4.1"), get_exp("1.0.4.1"),
+            post_exp(["1.0.4.1", "provmask=%d" % other], prov.mask)])
+
+check_http("request with body", post("\r\n".join(QUERIES).encode()),
+           [post_exp(QUERIES)])
+check_http("request with empty body", post(b""), [("200 OK", b"[]")])
+check_http("unknown target", get("/nowhere"),
+           [("404 Not Found", b'{"error": "Not found"}')])
+check_http("malformed request", b"GARBAGE\r\n\r\n" + get("/lookup/1.0.4.1"),
+           [("400 Bad Request", b"")])
+
+# the body is never read, so only the headers need to be sent
+check_http("request over MAX_BODY_LEN",
+           b"POST /lookup HTTP/1.1\r\nContent-Length: %d\r\n\r\n1.0.4.1\n" %
+           (MAX_BODY_LEN + 1), [("413 Payload Too Large", b"")])
+check_http("request at MAX_BODY_LEN (incomplete)",
+           b"POST /lookup HTTP/1.1\r\nContent-Length: %d\r\n\r\n1.0.4.1\n" %
+           MAX_BODY_LEN, [])
+
+# line protocol
+exp = b"".join(ipm.lookup_json(q) + b"\n" for q in QUERIES)
+data = "\r\n".join(QUERIES).encode() + b"\r\n"
+check("line queries", srv.feed("line", data), exp)
+check("line queries split across reads",
+      srv.feed("line", [data[i:i + 5] for i in range(0, len(data), 5)]), exp)
+check("line blank and incomplete lines", srv.feed("line", b"\n\n1.0.4.1"),
+      b"")
+
+# over real connections
+srv = _pyipmeta.Server(ipm)
+line_port = srv.listen("127.0.0.1", "0", "line")
+http_port = srv.listen("127.0.0.1", "0", "http")
+srv.start(1)
+
+
+def connect(port):
+    return socket.create_connection(("127.0.0.1", port), timeout=30)
+
+
+def recv_all(sock):
+    out = b""
+    try:
+        while True:
+            data = sock.recv(65536)
+            if not data:
+                break
+            out += data
+    except ConnectionResetError:
+        pass
+    return out
+
+
+# a line that never ends is dropped once it is too long, without keeping
+# the (only) worker from serving another client
+flood = connect(line_port)
+other = connect(line_port)
+closed = False
+try:
+    for _ in range(4096):
+        flood.sendall(b"x" * 65536)
+        other.sendall(b"1.0.4.1\n")
+        check("line query during a flood", other.recv(65536),
+              ipm.lookup_json("1.0.4.1") + b"\n")
+except (BrokenPipeError, ConnectionResetError):
+    closed = True
+print("line flood closed: %s" % ("ok" if closed else "MISMATCH"))
+assert closed
+flood.close()
+other.close()
+
+# a request of the largest acceptable size still goes through
+sock = connect(http_port)
+body = b"\n" * (MAX_BODY_LEN - 8) + b"1.0.4.1\n"
+sock.sendall(b"POST /lookup HTTP/1.1\r\nConnection: close\r\n"
+             b"Content-Length: %d\r\n\r\n" % len(body) + body)
+check("request at MAX_BODY_LEN",
+      [(status, body) for status, _, body in parse_http(recv_all(sock))],
+      [post_exp(["1.0.4.1"])])
+sock.close()
+
+
+def can_change(i):
+    """Whether enable_provider may change i (it refuses while i is read)"""
+    try:
+        i.enable_provider(i.get_provider_by_name("maxmind"), "invalid options")
+    except RuntimeError:
+        return False
+    return True
+
+
+# the running server keeps its IpMeta from being changed, and moves on to
+# another one with set_ipm
+ipm2 = _pyipmeta.IpMeta()
+check("running server's IpMeta can change", can_change(ipm), False)
+srv.set_ipm(ipm2)
+check("previous IpMeta can change", can_change(ipm), True)
+check("new IpMeta can change", can_change(ipm2), False)
+srv.stop()
+check("IpMeta can change once stopped", can_change(ipm2), True)
+
+print("OK")
@@ -0,0 +1,244 @@
+#!/usr/bin/env python3
+
+# This file is part of pyipmeta.
+#
+# Copyright (C) 2017-2020 The Regents of the University of California.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are met:
+#
+# 1. Redistributions of source code must retain the above copyright notice, this
+#   list of conditions and the following disclaimer.
+#
+# 2. Redistributions in binary form must reproduce the above copyright notice,
+#   this list of conditions and the following disclaimer in the documentation
+#   and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+# AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+# DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+# SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+# CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+# OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+# OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Checks lookup_bbox, lookup_radius and lookup_polygon against a brute-force
+# scan of every record that has prefixes (as listed by lookup_fused over the
+# whole address space), using a made-up maxmind database with locations on
+# cell boundaries, next to the antimeridian and near the poles. Boxes that
+# cross the antimeridian and circles that reach a pole are included.
+# Provider configs given as arguments (e.g., a netacq-edge config with
+# polygons) are loaded as well.
+# Run from the top of the source tree.
+
+import _pyipmeta
+import gzip
+import math
+import os
+import random
+import shutil
+import sys
+import tempfile
+
+LOCATIONS = 3000
+QUERIES = 300
+EARTH_RADIUS_KM = 6371.0088
+
+random.seed(1)
+
+
+def random_location():
+    kind = random.random()
+    if kind < 0.2:
+        # next to the antimeridian
+        return (random.uniform(-60, 60),
+                random.choice([-1, 1]) * random.uniform(178, 180))
+    if kind < 0.4:
+        # near a pole
+        return (random.choice([-1, 1]) * random.uniform(85, 90),
+                random.uniform(-180, 180))
+    if kind < 0.6:
+        # on cell boundaries
+        return (float(random.randrange(-90, 91)),
+                float(random.randrange(-180, 181)))
+    if kind < 0.62:
+        # no location
+        return (0.0, 0.0)
+    return (random.uniform(-90, 90), random.uniform(-180, 180))
+
+
+def load_maxmind(tmp, locs):
+    """Load a maxmind database with one /24 per location, except for a few
+    locations that have no prefixes"""
+    blocks_path = os.path.join(tmp, "GeoLiteCity-Blocks.csv.gz")
+    locations_path = os.path.join(tmp, "GeoLiteCity-Location.csv.gz")
+    with gzip.open(locations_path, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("locId,country,region,city,postalCode,latitude,longitude,"
+                 "metroCode,areaCode\n")
+        for i, (lat, lon) in enumerate(locs):
+            fh.write('%d,"US","","City %d","",%r,%r,,\n' %
+                     (i + 1, i + 1, lat, lon))
+    with gzip.open(blocks_path, "wt") as fh:
+        fh.write("Copyright (c) 2012 MaxMind LLC.  All Rights Reserved.\n")
+        fh.write("startIpNum,endIpNum,locId\n")
+        for i in range(len(locs)):
+            if i % 50 == 7:
+                continue
+            start = (10 << 24) + (i << 8)
+            fh.write('"%d","%d","%d"\n' % (start, start + 255, i + 1))
+    ipm = _pyipmeta.IpMeta()
+    ipm.enable_provider(ipm.get_provider_by_name("maxmind"),
+                        "-b %s -l %s" % (blocks_path, locations_path))
+    return ipm
+
+
+def all_records(ipm):
+    """{(source, id): record} for every record that has prefixes, with the
+    IPv4 addresses of all its prefixes in matched_ip_count"""
+    recs = {}
+    for prov in ipm.get_all_providers():
+        if not prov.enabled:
+            continue
+        for query in ("0.0.0.0/0", "::/0"):
+            for row in ipm.lookup_fused(query, prov.mask):
+                key = (prov.id, row["record_ids"][prov.name])
+                rec = recs.setdefault(key, {
+                    "lat_long": row["lat_long"],
+                    "polygon_ids": sorted(set(row["polygon_ids"])),
+                    "matched_ip_count": 0})
+                if query == "0.0.0.0/0":
+                    rec["matched_ip_count"] += row["matched_ip_count"]
+    return recs
+
+
+def summary(result):
+    return sorted(((r["source"], r["id"]), r["lat_long"],
+                   sorted(set(r["polygon_ids"])), r["matched_ip_count"])
+                  for r in result)
+
+
+def expected(recs, match):
+    return sorted((key, r["lat_long"], r["polygon_ids"],
+                   r["matched_ip_count"])
+                  for key, r in recs.items()
+                  if r["lat_long"] != (0.0, 0.0) and match(r))
+
+
+def in_bbox(min_lat, min_lon, max_lat, max_lon):
+    def match(rec):
+        lat, lon = rec["lat_long"]
+        if not min_lat <= lat <= max_lat:
+            return False
+        if min_lon <= max_lon:
+            return min_lon <= lon <= max_lon
+        return lon >= min_lon or lon <= max_lon
+    return match
+
+
+def distance_km(lat1, lon1, lat2, lon2):
+    # the same haversine formula, evaluated in the same order, as the
+    # spatial index, so that points on the circle agree
+    dlat = (lat2 - lat1) * math.pi / 180.0 / 2
+    dlon = (lon2 - lon1) * math.pi / 180.0 / 2
+    a = math.sin(dlat) * math.sin(dlat) + \
+        math.cos(lat1 * math.pi / 180.0) * math.cos(lat2 * math.pi / 180.0) * \
+        math.sin(dlon) * math.sin(dlon)
+    return 2 * EARTH_RADIUS_KM * math.asin(math.sqrt(a if a < 1 else 1))
+
+
+def in_radius(lat, lon, radius_km):
+    def match(rec):
+        return distance_km(lat, lon, *rec["lat_long"]) <= radius_km
+    return match
+
+
+def check(name, queries, got, exp):
+    bad = [(q, g, e) for q, g, e in zip(queries, got, exp) if g != e]
+    print("%s: %d queries, %d records found, %d mismatches" %
+          (name, len(queries), sum(len(e) for e in exp), len(bad)))
+    for q, g, e in bad[:3]:
+        print("  %s: got %s\n    expected %s" % (q, g, e))
+    assert not bad
+
+
+locs = [random_location() for _ in range(LOCATIONS)]
+tmp = tempfile.mkdtemp()
+try:
+    ipm = load_maxmind(tmp, locs)
+finally:
+    shutil.rmtree(tmp)
+for arg in sys.argv[1:]:
+    name, cmd = arg.split(None, 1)
+    ipm.enable_provider(ipm.get_provider_by_name(name), cmd)
+recs = all_records(ipm)
+points = [r["lat_long"] for r in recs.values()]
+
+# random boxes, boxes across the antimeridian, boxes with a record on their
+# edges, and empty ones
+boxes = []
+for _ in range(QUERIES):
+    lat1, lat2 = sorted(random.uniform(-90, 90) for _ in range(2))
+    boxes.append((lat1, random.uniform(-180, 180), lat2,
+                  random.uniform(-180, 180)))
+    lat, lon = random.choice(points)
+    boxes.append((lat, lon, lat + random.uniform(0, 5),
+                  lon + random.uniform(0, 5)))
+    boxes.append((lat - random.uniform(0, 5), random.uniform(170, 180), lat,
+                  random.uniform(-180, -170)))
+boxes += [(-90, -180, 90, 180), (-90, 180, 90, -180), (10, 0, -10, 10),
+          (-90, 179, 90, -179), (89, -180, 90, 180),
+          (-1e300, -1e300, 1e300, 1e300)]
+check("lookup_bbox", boxes, [summary(ipm.lookup_bbox(*b)) for b in boxes],
+      [expected(recs, in_bbox(*b)) for b in boxes])
+
+# random circles, circles around records and across the antimeridian, and
+# circles that reach or contain a pole
+circles = []
+for _ in range(QUERIES):
+    circles.append((random.uniform(-90, 90), random.uniform(-180, 180),
+                    random.uniform(0, 3000)))
+    lat, lon = random.choice(points)
+    circles.append((lat, lon, random.choice([0, random.uniform(0, 500)])))
+    circles.append((random.uniform(-60, 60),
+                    random.choice([-1, 1]) * random.uniform(175, 180),
+                    random.uniform(0, 1000)))
+    circles.append((random.choice([-1, 1]) * random.uniform(80, 90),
+                    random.uniform(-180, 180), random.uniform(0, 2000)))
+circles += [(90, 0, 600), (-90, 0, 600), (0, 0, 20100), (0, 180, 111),
+            (45, 0, -1)]
+check("lookup_radius", circles,
+      [summary(ipm.lookup_radius(*c)) for c in circles],
+      [expected(recs, in_radius(*c)) for c in circles])
+
+# every polygon id that a record has, plus some that none has
+ids = sorted(set(i for r in recs.values() for i in r["polygon_ids"]))
+ids += [max(ids + [0]) + 1, 0xffffffff]
+check("lookup_polygon", ids, [summary(ipm.lookup_polygon(i)) for i in ids],
+      [sorted((key, r["lat_long"], r["polygon_ids"], r["matched_ip_count"])
+              for key, r in recs.items() if i in r["polygon_ids"])
+       for i in ids])
+
+for args in ((float("nan"), 0, 1, 1), (0, 0, 1, float("inf"))):
+    try:
+        ipm.lookup_bbox(*args)
+        assert False, "lookup_bbox%r did not raise" % (args,)
+    except ValueError:
+        pass
+for args in ((float("nan"), 0, 1), (0, 0, float("inf")), (0, 0, float("nan"))):
+    try:
+        ipm.lookup_radius(*args)
+        assert False, "lookup_radius%r did not raise" % (args,)
+    except ValueError:
+        pass
+for arg in (-1, 1 << 32):
+    try:
+        ipm.lookup_polygon(arg)
+        assert False, "lookup_polygon(%r) did not raise" % arg
+    except ValueError:
+        pass
+
+print("OK")